@@ -0,0 +1,309 @@
+#!/usr/bin/env python3
+#
+# /benchmarks/pipevec-benchmark-compare.py
+#
+# Compare benchmark results against a stored baseline.
+#
+# Copyright (C) 2019 Sam Spilsbury.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+"""Run pipevec_benchmark and compare it against a JSON baseline.
+
+Every benchmark is repeated a number of times and summarised by the
+median of its per-repetition real times, with a distribution-free
+confidence interval for the median taken from the order statistics.
+A benchmark regresses when its median is slower than the baseline
+median by more than the threshold and the two confidence intervals
+do not overlap, so that noise on a busy machine is not reported as a
+regression. The exit status is 1 if anything regressed.
+
+With --update the results are written to the baseline instead,
+along with the CPU model, the number of CPUs, the frequency governor
+and the compiler of the machine they were recorded on. The baseline
+only means something on that machine, so the comparison is skipped
+with a warning on any other, unless --ignore-host is given. Record a
+baseline locally with --update, with nothing else running, to compare
+against on a new machine."""
+
+import argparse
+import json
+import math
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+
+TIME_UNITS_NS = {
+    'ns': 1.0,
+    'us': 1e3,
+    'ms': 1e6,
+    's': 1e9
+}
+
+
+def median(samples):
+    ordered = sorted(samples)
+    middle = len(ordered) // 2
+
+    if len(ordered) % 2:
+        return ordered[middle]
+
+    return (ordered[middle - 1] + ordered[middle]) / 2.0
+
+
+def median_confidence_interval(samples, confidence):
+    """Interval between two order statistics that contains the median
+    with at least the given probability, whatever the distribution."""
+    ordered = sorted(samples)
+    n = len(ordered)
+    alpha = 1.0 - confidence
+
+    # The number of samples below the median is Binomial(n, 1/2), so
+    # find the largest k with P(X < k) <= alpha / 2
+    cumulative = 0.0
+    k = 0
+
+    while k < n:
+        probability = math.comb(n, k) / 2.0 ** n
+
+        if cumulative + probability > alpha / 2.0:
+            break
+
+        cumulative += probability
+        k += 1
+
+    # Too few samples for the requested confidence
+    if k == 0:
+        return ordered[0], ordered[-1]
+
+    return ordered[k - 1], ordered[n - k]
+
+
+def read_first_line(path):
+    try:
+        with open(path) as file:
+            return file.readline().strip()
+    except OSError:
+        return None
+
+
+def cpu_model():
+    try:
+        with open('/proc/cpuinfo') as cpuinfo:
+            for line in cpuinfo:
+                key, _, value = line.partition(':')
+
+                if key.strip() == 'model name':
+                    return value.strip()
+    except OSError:
+        pass
+
+    return platform.processor() or None
+
+
+def host_description(compiler):
+    """What the results depend on besides the code, None where it
+    cannot be found out."""
+    return {
+        'cpu_model': cpu_model(),
+        'num_cpus': os.cpu_count(),
+        'governor': read_first_line('/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor'),
+        'compiler': compiler or None
+    }
+
+
+def host_mismatches(recorded, current):
+    """Describe each way the host differs from the recorded one."""
+    def describe(value):
+        return 'unknown' if value is None else value
+
+    return [
+        '{} was {}, is now {}'.format(key, describe(recorded.get(key)), describe(current[key]))
+        for key in sorted(current)
+        if recorded.get(key) != current[key]
+    ]
+
+
+def run_benchmarks(executable, repetitions, benchmark_filter, min_time):
+    """Run the benchmarks and return the samples of each, in ns,
+    along with the context Google Benchmark reports."""
+    with tempfile.TemporaryDirectory() as directory:
+        output = os.path.join(directory, 'results.json')
+        command = [
+            executable,
+            '--benchmark_repetitions={}'.format(repetitions),
+            '--benchmark_out={}'.format(output),
+            '--benchmark_out_format=json'
+        ]
+
+        if benchmark_filter:
+            command.append('--benchmark_filter={}'.format(benchmark_filter))
+
+        if min_time:
+            command.append('--benchmark_min_time={}'.format(min_time))
+
+        subprocess.run(command, check=True, stdout=subprocess.DEVNULL)
+
+        with open(output) as results_file:
+            results = json.load(results_file)
+
+    samples = {}
+
+    for result in results['benchmarks']:
+        if result.get('run_type', 'iteration') != 'iteration' or result.get('error_occurred'):
+            continue
+
+        name = result.get('run_name', result['name'])
+        time_ns = result['real_time'] * TIME_UNITS_NS[result.get('time_unit', 'ns')]
+        samples.setdefault(name, []).append(time_ns)
+
+    return samples, results.get('context', {})
+
+
+def summarise(samples, confidence):
+    summaries = {}
+
+    for name, times in samples.items():
+        low, high = median_confidence_interval(times, confidence)
+        summaries[name] = {
+            'median_ns': median(times),
+            'ci_low_ns': low,
+            'ci_high_ns': high,
+            'samples_ns': sorted(times)
+        }
+
+    return summaries
+
+
+def compare(baseline, current, threshold):
+    """Print a comparison table and return the names that regressed."""
+    regressions = []
+
+    print('{:<36} {:>14} {:>14} {:>9}  {}'.format('benchmark', 'baseline ns', 'current ns', 'change', 'verdict'))
+
+    for name in sorted(current):
+        result = current[name]
+        reference = baseline.get(name)
+
+        if reference is None:
+            print('{:<36} {:>14} {:>14.1f} {:>9}  {}'.format(name, '-', result['median_ns'], '-', 'new'))
+            continue
+
+        change = result['median_ns'] / reference['median_ns'] - 1.0
+        separated_slower = result['ci_low_ns'] > reference['ci_high_ns']
+        separated_faster = result['ci_high_ns'] < reference['ci_low_ns']
+
+        if change > threshold and separated_slower:
+            verdict = 'REGRESSED'
+            regressions.append(name)
+        elif change < -threshold and separated_faster:
+            verdict = 'improved'
+        else:
+            verdict = 'ok'
+
+        print('{:<36} {:>14.1f} {:>14.1f} {:>+8.1f}%  {}'.format(name,
+                                                                 reference['median_ns'],
+                                                                 result['median_ns'],
+                                                                 100.0 * change,
+                                                                 verdict))
+
+    for name in sorted(set(baseline) - set(current)):
+        print('{:<36} {:>14.1f} {:>14} {:>9}  {}'.format(name, baseline[name]['median_ns'], '-', '-', 'not run'))
+
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--benchmark', required=True,
+                        help='Path to the pipevec_benchmark executable')
+    parser.add_argument('--baseline', required=True,
+                        help='Path to the JSON baseline')
+    parser.add_argument('--update', action='store_true',
+                        help='Write the results to the baseline instead of comparing')
+    parser.add_argument('--repetitions', type=int, default=10,
+                        help='Number of times to run each benchmark')
+    parser.add_argument('--threshold', type=float, default=0.05,
+                        help='Slowdown of the median that counts as a regression')
+    parser.add_argument('--confidence', type=float, default=0.95,
+                        help='Confidence level of the intervals for the medians')
+    parser.add_argument('--filter', default=os.environ.get('PIPEVEC_BENCHMARK_FILTER', ''),
+                        help='Only run benchmarks matching this regular expression')
+    parser.add_argument('--min-time', default='',
+                        help='Passed on as --benchmark_min_time')
+    parser.add_argument('--compiler', default='',
+                        help='Compiler the benchmarks were built with, recorded with the baseline')
+    parser.add_argument('--ignore-host', action='store_true',
+                        help='Compare even if the baseline was recorded on a different host')
+    arguments = parser.parse_args()
+
+    host = host_description(arguments.compiler)
+
+    if not arguments.update:
+        with open(arguments.baseline) as baseline_file:
+            baseline = json.load(baseline_file)
+
+        mismatches = host_mismatches(baseline.get('host', {}), host)
+
+        for mismatch in mismatches:
+            print('Warning: the baseline was recorded on a different host, {}'.format(mismatch))
+
+        if mismatches and not arguments.ignore_host:
+            print('Skipping the comparison, record a baseline on this host with --update '
+                  'or compare anyway with --ignore-host')
+            return 0
+
+    samples, context = run_benchmarks(arguments.benchmark,
+                                      arguments.repetitions,
+                                      arguments.filter,
+                                      arguments.min_time)
+    current = summarise(samples, arguments.confidence)
+
+    if arguments.update:
+        baseline = {
+            'context': {
+                key: context[key]
+                for key in ('host_name', 'num_cpus', 'mhz_per_cpu', 'library_build_type')
+                if key in context
+            },
+            'host': host,
+            'repetitions': arguments.repetitions,
+            'confidence': arguments.confidence,
+            'benchmarks': current
+        }
+
+        with open(arguments.baseline, 'w') as baseline_file:
+            json.dump(baseline, baseline_file, indent=2, sort_keys=True)
+            baseline_file.write('\n')
+
+        print('Wrote {} benchmarks to {}'.format(len(current), arguments.baseline))
+        return 0
+
+    if not baseline.get('benchmarks'):
+        print('The baseline {} has no results yet, record one with --update'.format(arguments.baseline))
+
+    regressions = compare(baseline.get('benchmarks', {}), current, arguments.threshold)
+
+    if regressions:
+        print('{} benchmarks regressed by more than {:.0f}%'.format(len(regressions), 100.0 * arguments.threshold))
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,514 @@
+/*
+ * /benchmarks/pipevec-pipeline-benchmark.cpp
+ *
+ * End-to-end benchmarks of pipelines built on PipevecTensor.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <benchmark/benchmark.h>
+
+#include <pipevec/pipevec-memory.h>
+#include <pipevec/pipevec-packed-tensor.h>
+#include <pipevec/pipevec-tensor.h>
+
+/* Each benchmark runs a whole pipeline on one batch of rows per
+ * iteration, starting from data in host memory and ending with the
+ * results copied back out, so that allocation, copies and cache
+ * traffic between the operations are part of the measurement.
+ *
+ * The datasets are generated from fixed seeds with std::mt19937,
+ * whose output is specified by the standard, and mapped to floats
+ * by hand rather than with the <random> distributions, which differ
+ * between standard libraries. Every run on every platform sees the
+ * same data.
+ *
+ * Besides the time per batch, each benchmark reports:
+ *
+ *  - rows_per_second: rows of input pushed through the pipeline.
+ *  - p50_us and p99_us: percentiles of the latency of one batch.
+ *  - peak_rss_MB: the peak resident set size of the process so far,
+ *    which only ever goes up, so run one benchmark at a time with
+ *    --benchmark_filter to attribute it.
+ *  - peak_tensor_MB: the peak tensor storage during the benchmark. */
+namespace {
+  std::uint32_t const dataset_seed = 20190601;
+
+  /* Uniform in [-1, 1) from the top 24 bits of the generator */
+  float
+  uniform (std::mt19937 &generator)
+  {
+    return static_cast <float> (generator () >> 8) / 8388608.0f - 1.0f;
+  }
+
+  std::vector <float>
+  uniform_matrix (size_t        rows,
+                  size_t        columns,
+                  std::uint32_t seed)
+  {
+    std::mt19937 generator (seed);
+    std::vector <float> values (rows * columns);
+
+    for (float &value : values)
+      value = uniform (generator);
+
+    return values;
+  }
+
+  PipevecTensor *
+  make_tensor (std::vector <size_t> const &shape,
+               float const                *values)
+  {
+    g_autoptr(GArray) shape_array = g_array_sized_new (FALSE, FALSE, sizeof (size_t), shape.size ());
+    size_t n = 1;
+
+    for (size_t dimension : shape)
+      n *= dimension;
+
+    g_autoptr(GArray) contents_array = g_array_sized_new (FALSE, FALSE, sizeof (float), n);
+
+    g_array_append_vals (shape_array, shape.data (), shape.size ());
+    g_array_append_vals (contents_array, values, n);
+
+    return pipevec_tensor_new (shape_array, contents_array, NULL);
+  }
+
+  PipevecTensor *
+  make_filled_tensor (std::vector <size_t> const &shape,
+                      float                       value)
+  {
+    size_t n = 1;
+
+    for (size_t dimension : shape)
+      n *= dimension;
+
+    std::vector <float> values (n, value);
+
+    return make_tensor (shape, values.data ());
+  }
+
+  /* Times each batch and reports the pipeline counters when done */
+  class BatchTimer
+  {
+    public:
+      explicit BatchTimer (size_t rows_per_batch) :
+        rows_per_batch (rows_per_batch)
+      {
+        pipevec_memory_reset_peak ();
+      }
+
+      void start ()
+      {
+        batch_start = std::chrono::steady_clock::now ();
+      }
+
+      void stop ()
+      {
+        std::chrono::duration <double, std::micro> elapsed = std::chrono::steady_clock::now () - batch_start;
+        latencies_us.push_back (elapsed.count ());
+      }
+
+      void report (benchmark::State &state)
+      {
+        g_autoptr(PipevecMemorySnapshot) snapshot = pipevec_memory_get_snapshot ();
+        struct rusage usage;
+
+        getrusage (RUSAGE_SELF, &usage);
+
+        state.counters["rows_per_second"] = benchmark::Counter (static_cast <double> (rows_per_batch),
+                                                                benchmark::Counter::kIsIterationInvariantRate);
+        state.counters["p50_us"] = percentile (0.50);
+        state.counters["p99_us"] = percentile (0.99);
+
+        /* ru_maxrss is in kilobytes on Linux */
+        state.counters["peak_rss_MB"] = usage.ru_maxrss / 1024.0;
+        state.counters["peak_tensor_MB"] = pipevec_memory_snapshot_get_stats (snapshot)->peak_bytes / 1e6;
+      }
+
+    private:
+      double percentile (double fraction)
+      {
+        if (latencies_us.empty ())
+          return 0.0;
+
+        size_t index = std::min (latencies_us.size () - 1,
+                                 static_cast <size_t> (fraction * latencies_us.size ()));
+
+        std::nth_element (latencies_us.begin (), latencies_us.begin () + index, latencies_us.end ());
+        return latencies_us[index];
+      }
+
+      size_t rows_per_batch;
+      std::chrono::steady_clock::time_point batch_start;
+      std::vector <double> latencies_us;
+  };
+
+  bool
+  check_result (benchmark::State &state,
+                void             *result,
+                GError           *error)
+  {
+    if (result != NULL)
+      return true;
+
+    state.SkipWithError (error != NULL ? error->message : "operation failed");
+    return false;
+  }
+
+  float
+  inverse_standard_deviation (float     variance,
+                              GArray   *indices,
+                              gpointer  user_data)
+  {
+    return 1.0f / std::sqrt (variance + 1e-6f);
+  }
+
+  /* Standardize every feature of a batch to zero mean and unit
+   * variance. Column statistics are products with a row of 1/N and
+   * broadcasting back over the rows is a product with a column of
+   * ones, since elementwise operations need matching shapes. */
+  void
+  benchmark_feature_normalization (benchmark::State &state)
+  {
+    size_t const batch = 4096;
+    size_t const features = 64;
+    size_t const n_batches = 16;
+    std::vector <float> dataset = uniform_matrix (batch * n_batches, features, dataset_seed);
+    g_autoptr(PipevecTensor) mean_weights = make_filled_tensor ({ 1, batch }, 1.0f / batch);
+    g_autoptr(PipevecTensor) ones = make_filled_tensor ({ batch, 1 }, 1.0f);
+    BatchTimer timer (batch);
+    size_t batch_index = 0;
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+
+        timer.start ();
+
+        g_autoptr(PipevecTensor) rows = make_tensor ({ batch, features },
+                                                     &dataset[batch_index * batch * features]);
+        g_autoptr(PipevecTensor) mean = pipevec_tensor_inner_product_tensor (mean_weights, rows, &error);
+
+        if (!check_result (state, mean, error))
+          break;
+
+        /* rows - ones * mean */
+        g_autoptr(PipevecTensor) centered = pipevec_tensor_inner_product_tensor_fused (ones, mean,
+                                                                                       -1.0f,
+                                                                                       NULL,
+                                                                                       PIPEVEC_ACTIVATION_NONE,
+                                                                                       rows,
+                                                                                       1.0f,
+                                                                                       &error);
+
+        if (!check_result (state, centered, error))
+          break;
+
+        g_autoptr(PipevecTensor) squared = pipevec_tensor_multiply_tensor (centered, centered, &error);
+
+        if (!check_result (state, squared, error))
+          break;
+
+        g_autoptr(PipevecTensor) variance = pipevec_tensor_inner_product_tensor (mean_weights, squared, &error);
+
+        if (!check_result (state, variance, error))
+          break;
+
+        g_autoptr(PipevecTensor) scale = pipevec_tensor_map (variance, inverse_standard_deviation, NULL, &error);
+
+        if (!check_result (state, scale, error))
+          break;
+
+        g_autoptr(PipevecTensor) row_scale = pipevec_tensor_inner_product_tensor (ones, scale, &error);
+
+        if (!check_result (state, row_scale, error))
+          break;
+
+        g_autoptr(PipevecTensor) normalized = pipevec_tensor_multiply_tensor (centered, row_scale, &error);
+
+        if (!check_result (state, normalized, error))
+          break;
+
+        g_autoptr(GArray) output = pipevec_tensor_get_data (normalized);
+        benchmark::DoNotOptimize (output->data);
+
+        timer.stop ();
+        batch_index = (batch_index + 1) % n_batches;
+      }
+
+    timer.report (state);
+  }
+
+  /* Inference of a small classifier with two hidden layers, with the
+   * weights packed once up front as a deployed model would have them,
+   * then the predicted class of every row picked on the host. */
+  void
+  benchmark_mlp_inference (benchmark::State &state)
+  {
+    size_t const batch = 256;
+    std::vector <size_t> const widths = { 64, 256, 256, 10 };
+    size_t const n_batches = 16;
+    std::vector <float> dataset = uniform_matrix (batch * n_batches, widths[0], dataset_seed);
+    std::vector <PipevecPackedTensor *> weights;
+    std::vector <PipevecTensor *> biases;
+    BatchTimer timer (batch);
+    size_t batch_index = 0;
+
+    for (size_t layer = 0; layer + 1 < widths.size (); ++layer)
+      {
+        /* Scaled so that activations stay in range through the layers */
+        std::vector <float> weight_values = uniform_matrix (widths[layer], widths[layer + 1], dataset_seed + 1 + layer);
+        std::vector <float> bias_values = uniform_matrix (1, widths[layer + 1], dataset_seed + 101 + layer);
+
+        for (float &value : weight_values)
+          value /= std::sqrt (static_cast <float> (widths[layer]));
+
+        g_autoptr(PipevecTensor) weight = make_tensor ({ widths[layer], widths[layer + 1] }, weight_values.data ());
+
+        weights.push_back (pipevec_tensor_pack_for_matmul (weight, NULL));
+        biases.push_back (make_tensor ({ widths[layer + 1] }, bias_values.data ()));
+      }
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+
+        timer.start ();
+
+        g_autoptr(PipevecTensor) activations = make_tensor ({ batch, widths[0] },
+                                                            &dataset[batch_index * batch * widths[0]]);
+
+        bool failed = false;
+
+        for (size_t layer = 0; layer < weights.size () && !failed; ++layer)
+          {
+            bool last = layer + 1 == weights.size ();
+            PipevecTensor *next = pipevec_tensor_inner_product_packed_fused (activations,
+                                                                             weights[layer],
+                                                                             1.0f,
+                                                                             biases[layer],
+                                                                             last ? PIPEVEC_ACTIVATION_NONE : PIPEVEC_ACTIVATION_RELU,
+                                                                             NULL,
+                                                                             0.0f,
+                                                                             &error);
+
+            failed = !check_result (state, next, error);
+
+            if (!failed)
+              {
+                g_object_unref (activations);
+                activations = next;
+              }
+          }
+
+        if (failed)
+          break;
+
+        g_autoptr(GArray) logits = pipevec_tensor_get_data (activations);
+        float const *logit_data = reinterpret_cast <float const *> (logits->data);
+        size_t n_classes = widths.back ();
+        size_t predicted = 0;
+
+        for (size_t row = 0; row < batch; ++row)
+          predicted += std::max_element (logit_data + row * n_classes,
+                                         logit_data + (row + 1) * n_classes) - (logit_data + row * n_classes);
+
+        benchmark::DoNotOptimize (predicted);
+
+        timer.stop ();
+        batch_index = (batch_index + 1) % n_batches;
+      }
+
+    timer.report (state);
+
+    for (PipevecPackedTensor *weight : weights)
+      g_object_unref (weight);
+
+    for (PipevecTensor *bias : biases)
+      g_object_unref (bias);
+  }
+
+  /* Nearest neighbours of a batch of queries in a database of
+   * embeddings. ||q - d||^2 ranks the same as ||d||^2 - 2 q.d, which
+   * is a single fused product against the packed, transposed database
+   * with the squared norms as the bias. The top k of each row are
+   * then selected on the host. */
+  void
+  benchmark_knn_retrieval (benchmark::State &state)
+  {
+    size_t const batch = 64;
+    size_t const dimensions = 32;
+    size_t const database_size = 16384;
+    size_t const k = 10;
+    size_t const n_batches = 16;
+    std::vector <float> database = uniform_matrix (database_size, dimensions, dataset_seed);
+    std::vector <float> queries = uniform_matrix (batch * n_batches, dimensions, dataset_seed + 1);
+    std::vector <float> transposed (dimensions * database_size);
+    std::vector <float> norms (database_size, 0.0f);
+    BatchTimer timer (batch);
+    size_t batch_index = 0;
+
+    for (size_t i = 0; i < database_size; ++i)
+      for (size_t j = 0; j < dimensions; ++j)
+        {
+          float value = database[i * dimensions + j];
+
+          transposed[j * database_size + i] = value;
+          norms[i] += value * value;
+        }
+
+    g_autoptr(PipevecTensor) database_tensor = make_tensor ({ dimensions, database_size }, transposed.data ());
+    g_autoptr(PipevecPackedTensor) packed_database = pipevec_tensor_pack_for_matmul (database_tensor, NULL);
+    g_autoptr(PipevecTensor) norms_tensor = make_tensor ({ database_size }, norms.data ());
+    std::vector <size_t> candidates (database_size);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+
+        timer.start ();
+
+        g_autoptr(PipevecTensor) query_tensor = make_tensor ({ batch, dimensions },
+                                                             &queries[batch_index * batch * dimensions]);
+        g_autoptr(PipevecTensor) distances = pipevec_tensor_inner_product_packed_fused (query_tensor,
+                                                                                        packed_database,
+                                                                                        -2.0f,
+                                                                                        norms_tensor,
+                                                                                        PIPEVEC_ACTIVATION_NONE,
+                                                                                        NULL,
+                                                                                        0.0f,
+                                                                                        &error);
+
+        if (!check_result (state, distances, error))
+          break;
+
+        g_autoptr(GArray) distance_data = pipevec_tensor_get_data (distances);
+        float const *rows = reinterpret_cast <float const *> (distance_data->data);
+
+        for (size_t query = 0; query < batch; ++query)
+          {
+            float const *row = rows + query * database_size;
+
+            for (size_t i = 0; i < database_size; ++i)
+              candidates[i] = i;
+
+            std::partial_sort (candidates.begin (),
+                               candidates.begin () + k,
+                               candidates.end (),
+                               [row] (size_t lhs, size_t rhs) { return row[lhs] < row[rhs]; });
+            benchmark::DoNotOptimize (candidates[0]);
+          }
+
+        timer.stop ();
+        batch_index = (batch_index + 1) % n_batches;
+      }
+
+    timer.report (state);
+  }
+
+  /* Parse CSV records of "id,category,a,b,c" and compute the count
+   * and the sum of each column per category. The grouping is a
+   * product of the transposed one-hot encoding of the categories
+   * with the values and a column of ones. */
+  void
+  benchmark_csv_aggregate (benchmark::State &state)
+  {
+    size_t const batch = 8192;
+    size_t const n_categories = 16;
+    size_t const n_values = 3;
+    size_t const n_batches = 8;
+    std::mt19937 generator (dataset_seed);
+    std::string csv;
+    std::vector <size_t> batch_offsets;
+
+    for (size_t row = 0; row < batch * n_batches; ++row)
+      {
+        if (row % batch == 0)
+          batch_offsets.push_back (csv.size ());
+
+        csv += std::to_string (row) + "," + std::to_string (generator () % n_categories);
+
+        for (size_t column = 0; column < n_values; ++column)
+          csv += "," + std::to_string (100.0f * uniform (generator));
+
+        csv += "\n";
+      }
+
+    std::vector <float> one_hot (n_categories * batch);
+    std::vector <float> values (batch * (n_values + 1));
+    BatchTimer timer (batch);
+    size_t batch_index = 0;
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+        char const *cursor = csv.c_str () + batch_offsets[batch_index];
+
+        timer.start ();
+
+        std::fill (one_hot.begin (), one_hot.end (), 0.0f);
+
+        for (size_t row = 0; row < batch; ++row)
+          {
+            char *end;
+
+            g_ascii_strtoull (cursor, &end, 10);
+            size_t category = g_ascii_strtoull (end + 1, &end, 10);
+
+            one_hot[category * batch + row] = 1.0f;
+
+            for (size_t column = 0; column < n_values; ++column)
+              values[row * (n_values + 1) + column] = static_cast <float> (g_ascii_strtod (end + 1, &end));
+
+            values[row * (n_values + 1) + n_values] = 1.0f;
+            cursor = end + 1;
+          }
+
+        g_autoptr(PipevecTensor) one_hot_tensor = make_tensor ({ n_categories, batch }, one_hot.data ());
+        g_autoptr(PipevecTensor) values_tensor = make_tensor ({ batch, n_values + 1 }, values.data ());
+        g_autoptr(PipevecTensor) sums = pipevec_tensor_inner_product_tensor (one_hot_tensor, values_tensor, &error);
+
+        if (!check_result (state, sums, error))
+          break;
+
+        g_autoptr(GArray) aggregate = pipevec_tensor_get_data (sums);
+        benchmark::DoNotOptimize (aggregate->data);
+
+        timer.stop ();
+        batch_index = (batch_index + 1) % n_batches;
+      }
+
+    timer.report (state);
+  }
+}
+
+BENCHMARK (benchmark_feature_normalization)->Name ("pipeline/feature_normalization");
+BENCHMARK (benchmark_mlp_inference)->Name ("pipeline/mlp_inference");
+BENCHMARK (benchmark_knn_retrieval)->Name ("pipeline/knn_retrieval");
+BENCHMARK (benchmark_csv_aggregate)->Name ("pipeline/csv_aggregate");
+
+BENCHMARK_MAIN ();
@@ -0,0 +1,423 @@
+/*
+ * /benchmarks/pipevec-tensor-benchmark.cpp
+ *
+ * Benchmarks for the public PipevecTensor operations.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <pipevec/pipevec-tensor.h>
+
+/* Each operation is run over the same set of shapes so that the
+ * numbers can be compared between operations and between builds:
+ *
+ *  - tiny: dominated by call and allocation overhead.
+ *  - padded-tail: the last dimension is not a multiple of the
+ *    vector width, so every row has a padded tail.
+ *  - wide and tall: the same number of elements laid out as a
+ *    few long rows or many short ones.
+ *  - batched: a leading batch dimension over square matrices.
+ *
+ * Throughput is reported as FLOPS (floating point operations per
+ * second) and bytes_per_second. Bytes count the logical, unpadded
+ * elements each operation has to read and write at least once, so
+ * any extra copies made along the way show up as lower throughput. */
+namespace {
+  struct ElementwiseShape {
+    std::string name;
+    std::vector <size_t> shape;
+  };
+
+  struct ProductShape {
+    std::string name;
+    size_t batch;
+    size_t m;
+    size_t k;
+    size_t n;
+  };
+
+  std::vector <ElementwiseShape> const elementwise_shapes = {
+    { "tiny", { 3, 3 } },
+    { "padded-tail", { 509, 509 } },
+    { "wide", { 16, 16384 } },
+    { "tall", { 16384, 16 } },
+    { "batched", { 64, 64, 64 } }
+  };
+
+  std::vector <ProductShape> const product_shapes = {
+    { "tiny", 1, 4, 4, 4 },
+    { "padded-tail", 1, 253, 253, 253 },
+    { "wide", 1, 32, 1024, 1024 },
+    { "tall", 1, 2048, 256, 16 },
+    { "batched", 64, 64, 64, 64 }
+  };
+
+  size_t
+  n_elements (std::vector <size_t> const &shape)
+  {
+    size_t n = 1;
+
+    for (size_t dimension : shape)
+      n *= dimension;
+
+    return n;
+  }
+
+  GArray *
+  make_shape_array (std::vector <size_t> const &shape)
+  {
+    GArray *array = g_array_sized_new (FALSE, FALSE, sizeof (size_t), shape.size ());
+
+    g_array_append_vals (array, shape.data (), shape.size ());
+
+    return array;
+  }
+
+  /* Values in [0.5, 1.5), so that division never hits zero */
+  GArray *
+  make_contents_array (size_t n)
+  {
+    GArray *array = g_array_sized_new (FALSE, FALSE, sizeof (float), n);
+
+    for (size_t i = 0; i < n; ++i)
+      {
+        float value = static_cast <float> ((i * 7) % 11) / 11.0f + 0.5f;
+        g_array_append_val (array, value);
+      }
+
+    return array;
+  }
+
+  PipevecTensor *
+  make_tensor (std::vector <size_t> const &shape)
+  {
+    g_autoptr(GArray) shape_array = make_shape_array (shape);
+    g_autoptr(GArray) contents_array = make_contents_array (n_elements (shape));
+
+    return pipevec_tensor_new (shape_array, contents_array, NULL);
+  }
+
+  void
+  report_throughput (benchmark::State &state,
+                     double            flops_per_iteration,
+                     double            bytes_per_iteration)
+  {
+    state.SetBytesProcessed (static_cast <int64_t> (state.iterations () *
+                                                    bytes_per_iteration));
+
+    /* Pure data movement has no arithmetic to report */
+    if (flops_per_iteration > 0.0)
+      state.counters["FLOPS"] = benchmark::Counter (flops_per_iteration,
+                                                    benchmark::Counter::kIsIterationInvariantRate);
+  }
+
+  /* Returns TRUE if the operation produced a result, otherwise
+   * marks the benchmark as failed so that a broken operation
+   * is not reported as an impossibly fast one. */
+  bool
+  check_result (benchmark::State &state,
+                PipevecTensor    *result,
+                GError           *error)
+  {
+    if (result != NULL)
+      return true;
+
+    state.SkipWithError (error != NULL ? error->message : "operation failed");
+    return false;
+  }
+
+  void
+  benchmark_set_data (benchmark::State           &state,
+                      std::vector <size_t> const &shape)
+  {
+    size_t n = n_elements (shape);
+    g_autoptr(PipevecTensor) tensor = make_tensor (shape);
+    g_autoptr(GArray) shape_array = make_shape_array (shape);
+    g_autoptr(GArray) contents_array = make_contents_array (n);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+
+        if (!pipevec_tensor_set_data (tensor, contents_array, shape_array, &error))
+          {
+            state.SkipWithError (error->message);
+            break;
+          }
+      }
+
+    report_throughput (state, 0.0, 2.0 * n * sizeof (float));
+  }
+
+  void
+  benchmark_get_data (benchmark::State           &state,
+                      std::vector <size_t> const &shape)
+  {
+    size_t n = n_elements (shape);
+    g_autoptr(PipevecTensor) tensor = make_tensor (shape);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GArray) data = pipevec_tensor_get_data (tensor);
+        benchmark::DoNotOptimize (data->data);
+      }
+
+    report_throughput (state, 0.0, 2.0 * n * sizeof (float));
+  }
+
+  /* Alternates between the original shape and a flat one, which
+   * changes the padding of the last dimension on every call. */
+  void
+  benchmark_reshape (benchmark::State           &state,
+                     std::vector <size_t> const &shape)
+  {
+    size_t n = n_elements (shape);
+    g_autoptr(PipevecTensor) tensor = make_tensor (shape);
+    g_autoptr(GArray) shape_array = make_shape_array (shape);
+    g_autoptr(GArray) flat_shape_array = make_shape_array ({ n });
+    bool flat = false;
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+
+        flat = !flat;
+        if (!pipevec_tensor_reshape (tensor,
+                                     flat ? flat_shape_array : shape_array,
+                                     &error))
+          {
+            state.SkipWithError (error->message);
+            break;
+          }
+      }
+
+    report_throughput (state, 0.0, 2.0 * n * sizeof (float));
+  }
+
+  void
+  benchmark_copy (benchmark::State           &state,
+                  std::vector <size_t> const &shape)
+  {
+    size_t n = n_elements (shape);
+    g_autoptr(PipevecTensor) tensor = make_tensor (shape);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) result = pipevec_tensor_copy (tensor, &error);
+
+        if (!check_result (state, result, error))
+          break;
+      }
+
+    report_throughput (state, 0.0, 2.0 * n * sizeof (float));
+  }
+
+  float
+  double_element (float     element,
+                  GArray   *indices G_GNUC_UNUSED,
+                  gpointer  user_data G_GNUC_UNUSED)
+  {
+    return element * 2.0f;
+  }
+
+  void
+  benchmark_map (benchmark::State           &state,
+                 std::vector <size_t> const &shape)
+  {
+    size_t n = n_elements (shape);
+    g_autoptr(PipevecTensor) tensor = make_tensor (shape);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) result = pipevec_tensor_map (tensor,
+                                                              double_element,
+                                                              NULL,
+                                                              &error);
+
+        if (!check_result (state, result, error))
+          break;
+      }
+
+    report_throughput (state, n, 2.0 * n * sizeof (float));
+  }
+
+  typedef PipevecTensor * (*TensorOperation) (PipevecTensor  *lhs,
+                                               PipevecTensor  *rhs,
+                                               GError        **error);
+
+  typedef PipevecTensor * (*ScalarOperation) (PipevecTensor  *lhs,
+                                               float           rhs,
+                                               GError        **error);
+
+  void
+  benchmark_elementwise (benchmark::State           &state,
+                         TensorOperation             operation,
+                         std::vector <size_t> const &shape)
+  {
+    size_t n = n_elements (shape);
+    g_autoptr(PipevecTensor) lhs = make_tensor (shape);
+    g_autoptr(PipevecTensor) rhs = make_tensor (shape);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) result = operation (lhs, rhs, &error);
+
+        if (!check_result (state, result, error))
+          break;
+      }
+
+    report_throughput (state, n, 3.0 * n * sizeof (float));
+  }
+
+  void
+  benchmark_scalar (benchmark::State           &state,
+                    ScalarOperation             operation,
+                    std::vector <size_t> const &shape)
+  {
+    size_t n = n_elements (shape);
+    g_autoptr(PipevecTensor) lhs = make_tensor (shape);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) result = operation (lhs, 1.5f, &error);
+
+        if (!check_result (state, result, error))
+          break;
+      }
+
+    report_throughput (state, n, 2.0 * n * sizeof (float));
+  }
+
+  std::vector <size_t>
+  matrix_shape (size_t batch,
+                size_t rows,
+                size_t columns)
+  {
+    if (batch == 1)
+      return { rows, columns };
+
+    return { batch, rows, columns };
+  }
+
+  void
+  benchmark_inner_product (benchmark::State   &state,
+                           ProductShape const &shape)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor (matrix_shape (shape.batch, shape.m, shape.k));
+    g_autoptr(PipevecTensor) rhs = make_tensor (matrix_shape (shape.batch, shape.k, shape.n));
+    double flops = 2.0 * shape.batch * shape.m * shape.k * shape.n;
+    double elements = static_cast <double> (shape.batch) *
+                      (shape.m * shape.k + shape.k * shape.n + shape.m * shape.n);
+
+    for (auto _ : state)
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) result = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+        if (!check_result (state, result, error))
+          break;
+      }
+
+    report_throughput (state, flops, elements * sizeof (float));
+  }
+
+  struct NamedTensorOperation {
+    char const *name;
+    TensorOperation operation;
+  };
+
+  struct NamedScalarOperation {
+    char const *name;
+    ScalarOperation operation;
+  };
+
+  void
+  register_benchmarks ()
+  {
+    NamedTensorOperation const elementwise_operations[] = {
+      { "add_tensor", pipevec_tensor_add_tensor },
+      { "sub_tensor", pipevec_tensor_sub_tensor },
+      { "multiply_tensor", pipevec_tensor_multiply_tensor },
+      { "divide_tensor", pipevec_tensor_divide_tensor }
+    };
+    NamedScalarOperation const scalar_operations[] = {
+      { "add_scalar", pipevec_tensor_add_scalar },
+      { "sub_scalar", pipevec_tensor_sub_scalar },
+      { "multiply_scalar", pipevec_tensor_multiply_scalar },
+      { "divide_scalar", pipevec_tensor_divide_scalar }
+    };
+
+    for (auto const &shape : elementwise_shapes)
+      {
+        benchmark::RegisterBenchmark (("set_data/" + shape.name).c_str (),
+                                      benchmark_set_data,
+                                      shape.shape);
+        benchmark::RegisterBenchmark (("get_data/" + shape.name).c_str (),
+                                      benchmark_get_data,
+                                      shape.shape);
+        benchmark::RegisterBenchmark (("reshape/" + shape.name).c_str (),
+                                      benchmark_reshape,
+                                      shape.shape);
+        benchmark::RegisterBenchmark (("copy/" + shape.name).c_str (),
+                                      benchmark_copy,
+                                      shape.shape);
+        benchmark::RegisterBenchmark (("map/" + shape.name).c_str (),
+                                      benchmark_map,
+                                      shape.shape);
+
+        for (auto const &operation : elementwise_operations)
+          benchmark::RegisterBenchmark ((std::string (operation.name) + "/" + shape.name).c_str (),
+                                        benchmark_elementwise,
+                                        operation.operation,
+                                        shape.shape);
+
+        for (auto const &operation : scalar_operations)
+          benchmark::RegisterBenchmark ((std::string (operation.name) + "/" + shape.name).c_str (),
+                                        benchmark_scalar,
+                                        operation.operation,
+                                        shape.shape);
+      }
+
+    for (auto const &shape : product_shapes)
+      benchmark::RegisterBenchmark (("inner_product_tensor/" + shape.name).c_str (),
+                                    benchmark_inner_product,
+                                    shape);
+  }
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  register_benchmarks ();
+
+  benchmark::Initialize (&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments (argc, argv))
+    return 1;
+
+  benchmark::RunSpecifiedBenchmarks ();
+  return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * /pipevec/pipevec-allocator-private.h
+ *
+ * Allocation of tensor storage through the installed allocator.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include <pipevec/pipevec-allocator.h>
+
+G_BEGIN_DECLS
+
+/* An installed allocator. Storage holds a reference to the allocator
+ * that made it, so it is always freed by the same one even if another
+ * is installed in the meantime. */
+typedef struct _PipevecAllocator PipevecAllocator;
+
+gpointer pipevec_allocator_alloc (size_t              size,
+                                  PipevecAllocator  **allocator,
+                                  GError            **error);
+
+void pipevec_allocator_free (PipevecAllocator *allocator,
+                             gpointer          memory,
+                             size_t            size);
+
+void pipevec_allocator_get_cache_counts (guint64 *n_reused,
+                                         guint64 *n_allocated);
+
+G_END_DECLS
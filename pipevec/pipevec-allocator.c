@@ -0,0 +1,339 @@
+/*
+ * /pipevec/pipevec-allocator.c
+ *
+ * Pluggable allocator for tensor storage.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-allocator.h>
+#include <pipevec/pipevec-allocator-private.h>
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-tensor-private.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+struct _PipevecAllocator {
+  gint ref_count;
+  PipevecAllocatorFuncs funcs;
+  gpointer user_data;
+  GDestroyNotify user_data_destroy;
+};
+
+static gpointer
+default_alloc (gsize    size,
+               gsize    alignment,
+               gpointer user_data G_GNUC_UNUSED)
+{
+  gpointer memory = NULL;
+
+  if (posix_memalign (&memory, alignment, size) != 0)
+    return NULL;
+
+  return memory;
+}
+
+static void
+default_free (gpointer memory,
+              gsize    size G_GNUC_UNUSED,
+              gpointer user_data G_GNUC_UNUSED)
+{
+  free (memory);
+}
+
+/* Static, so it is not reference counted */
+static PipevecAllocator default_allocator = {
+  .funcs = { default_alloc, default_free }
+};
+
+static GMutex current_allocator_lock;
+static PipevecAllocator *current_allocator = &default_allocator;
+
+/* Blocks freed to the default allocator are kept on a small free list
+ * on the thread that freed them and handed out again for the next
+ * allocation of the same size, so that short-lived results and
+ * packing buffers do not go through posix_memalign() and free() every
+ * time. Installed allocators see every allocation and free, since
+ * they may be pooling or counting already. Cached blocks are no
+ * longer counted against the memory limit. */
+#define PIPEVEC_ALLOCATOR_CACHE_SIZE 8
+#define PIPEVEC_ALLOCATOR_CACHE_BYTES (16 << 20)
+
+typedef struct {
+  gpointer memory;
+  size_t   size;
+} PipevecAllocatorCachedBlock;
+
+typedef struct {
+  size_t                      n_blocks;
+  size_t                      bytes;
+  guint64                     n_reused;
+  guint64                     n_allocated;
+  PipevecAllocatorCachedBlock blocks[PIPEVEC_ALLOCATOR_CACHE_SIZE];
+} PipevecAllocatorCache;
+
+static void
+cache_free (gpointer data)
+{
+  PipevecAllocatorCache *cache = data;
+
+  for (size_t i = 0; i < cache->n_blocks; ++i)
+    free (cache->blocks[i].memory);
+
+  g_free (cache);
+}
+
+static GPrivate allocator_cache = G_PRIVATE_INIT (cache_free);
+
+static PipevecAllocatorCache *
+get_cache (void)
+{
+  PipevecAllocatorCache *cache = g_private_get (&allocator_cache);
+
+  if (cache == NULL)
+    {
+      cache = g_new0 (PipevecAllocatorCache, 1);
+      g_private_set (&allocator_cache, cache);
+    }
+
+  return cache;
+}
+
+static void
+cache_remove (PipevecAllocatorCache *cache,
+              size_t                 index)
+{
+  cache->bytes -= cache->blocks[index].size;
+  memmove (&cache->blocks[index],
+           &cache->blocks[index + 1],
+           sizeof (PipevecAllocatorCachedBlock) * (cache->n_blocks - index - 1));
+  --cache->n_blocks;
+}
+
+/* Take the most recently freed block of exactly size bytes */
+static gpointer
+cache_take (PipevecAllocatorCache *cache,
+            size_t                 size)
+{
+  for (size_t i = cache->n_blocks; i-- > 0;)
+    {
+      if (cache->blocks[i].size == size)
+        {
+          gpointer memory = cache->blocks[i].memory;
+
+          cache_remove (cache, i);
+          ++cache->n_reused;
+          return memory;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+cache_put (PipevecAllocatorCache *cache,
+           gpointer               memory,
+           size_t                 size)
+{
+  if (size > PIPEVEC_ALLOCATOR_CACHE_BYTES)
+    {
+      free (memory);
+      return;
+    }
+
+  /* Make room by dropping the blocks that were freed longest ago */
+  while (cache->n_blocks == PIPEVEC_ALLOCATOR_CACHE_SIZE ||
+         cache->bytes + size > PIPEVEC_ALLOCATOR_CACHE_BYTES)
+    {
+      free (cache->blocks[0].memory);
+      cache_remove (cache, 0);
+    }
+
+  cache->blocks[cache->n_blocks].memory = memory;
+  cache->blocks[cache->n_blocks].size = size;
+  cache->bytes += size;
+  ++cache->n_blocks;
+}
+
+static PipevecAllocator *
+allocator_ref (PipevecAllocator *allocator)
+{
+  if (allocator != &default_allocator)
+    g_atomic_int_inc (&allocator->ref_count);
+
+  return allocator;
+}
+
+static void
+allocator_unref (PipevecAllocator *allocator)
+{
+  if (allocator == &default_allocator ||
+      !g_atomic_int_dec_and_test (&allocator->ref_count))
+    return;
+
+  if (allocator->user_data_destroy != NULL)
+    allocator->user_data_destroy (allocator->user_data);
+
+  g_free (allocator);
+}
+
+/**
+ * pipevec_allocator_set:
+ * @funcs: (nullable): The #PipevecAllocatorFuncs to use, or %NULL to
+ *         go back to posix_memalign() and free().
+ * @user_data: (closure): Data passed to the functions in @funcs.
+ * @user_data_destroy: (nullable): Called on @user_data once no storage
+ *                     allocated by @funcs is left.
+ *
+ * Install the functions that allocate and free the storage of tensors
+ * and packed tensors, for example to put it in an arena or a pool of
+ * huge pages. Storage is always freed by the functions that allocated
+ * it, so tensors that already exist keep using the old allocator and
+ * the new one only applies to storage allocated from now on. The
+ * buffers that matrix products pack their operands into go through
+ * the allocator too, since they grow with the operands, and a product
+ * fails with %PIPEVEC_ERROR_OUT_OF_MEMORY if they cannot be
+ * allocated. Other temporary buffers that operations use internally
+ * do not. An installed allocator sees every allocation and free, while
+ * the default one keeps a few recently freed blocks on each thread to
+ * hand out again.
+ */
+void
+pipevec_allocator_set (const PipevecAllocatorFuncs *funcs,
+                       gpointer                     user_data,
+                       GDestroyNotify               user_data_destroy)
+{
+  PipevecAllocator *allocator = &default_allocator;
+
+  g_return_if_fail (funcs == NULL || (funcs->alloc != NULL && funcs->free != NULL));
+
+  if (funcs != NULL)
+    {
+      allocator = g_new0 (PipevecAllocator, 1);
+      allocator->ref_count = 1;
+      allocator->funcs = *funcs;
+      allocator->user_data = user_data;
+      allocator->user_data_destroy = user_data_destroy;
+    }
+
+  g_mutex_lock (&current_allocator_lock);
+  PipevecAllocator *previous = current_allocator;
+  current_allocator = allocator;
+  g_mutex_unlock (&current_allocator_lock);
+
+  allocator_unref (previous);
+}
+
+/**
+ * pipevec_allocator_alloc:
+ * @size: Number of bytes to allocate.
+ * @allocator: (out) (transfer full): Return location for the allocator
+ *             that made the allocation, to pass to pipevec_allocator_free().
+ * @error: A #GError return location.
+ *
+ * Allocate tensor storage or a packing buffer aligned for float8_t
+ * with the installed allocator.
+ *
+ * Returns: The allocation, or %NULL with @error set.
+ */
+gpointer
+pipevec_allocator_alloc (size_t              size,
+                         PipevecAllocator  **allocator,
+                         GError            **error)
+{
+  g_mutex_lock (&current_allocator_lock);
+  PipevecAllocator *used = allocator_ref (current_allocator);
+  g_mutex_unlock (&current_allocator_lock);
+
+  gpointer memory = NULL;
+
+  if (used == &default_allocator)
+    {
+      PipevecAllocatorCache *cache = get_cache ();
+
+      memory = cache_take (cache, size);
+
+      if (memory == NULL)
+        {
+          memory = default_alloc (size, sizeof (float8_t), NULL);
+          ++cache->n_allocated;
+        }
+    }
+  else
+    {
+      memory = used->funcs.alloc (size, sizeof (float8_t), used->user_data);
+    }
+
+  if (memory == NULL)
+    {
+      allocator_unref (used);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_OUT_OF_MEMORY,
+                   "Unable to allocate %" G_GSIZE_FORMAT " bytes",
+                   size);
+      return NULL;
+    }
+
+  *allocator = used;
+
+  return memory;
+}
+
+/**
+ * pipevec_allocator_free:
+ * @allocator: (transfer full): The allocator returned with @memory.
+ * @memory: Storage from pipevec_allocator_alloc().
+ * @size: The size it was allocated with.
+ *
+ * Free tensor storage and drop the reference to its allocator.
+ */
+void
+pipevec_allocator_free (PipevecAllocator *allocator,
+                        gpointer          memory,
+                        size_t            size)
+{
+  if (allocator == &default_allocator)
+    {
+      cache_put (get_cache (), memory, size);
+      return;
+    }
+
+  allocator->funcs.free (memory, size, allocator->user_data);
+  allocator_unref (allocator);
+}
+
+/**
+ * pipevec_allocator_get_cache_counts:
+ * @n_reused: (out): Return location for the number of allocations
+ *            that reused a cached block.
+ * @n_allocated: (out): Return location for the number of allocations
+ *               that went to posix_memalign().
+ *
+ * Count the allocations made by the default allocator on the calling
+ * thread so far.
+ */
+void
+pipevec_allocator_get_cache_counts (guint64 *n_reused,
+                                    guint64 *n_allocated)
+{
+  PipevecAllocatorCache *cache = get_cache ();
+
+  *n_reused = cache->n_reused;
+  *n_allocated = cache->n_allocated;
+}
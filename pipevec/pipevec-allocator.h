@@ -0,0 +1,72 @@
+/*
+ * /pipevec/pipevec-allocator.h
+ *
+ * Pluggable allocator for tensor storage.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PipevecAlignedAllocFunc:
+ * @size: Number of bytes to allocate.
+ * @alignment: Required alignment of the allocation, a power of two.
+ * @user_data: The user data the allocator was installed with.
+ *
+ * Allocate @size bytes aligned to @alignment.
+ *
+ * Returns: The allocation, or %NULL if it could not be made.
+ */
+typedef gpointer (*PipevecAlignedAllocFunc) (gsize    size,
+                                             gsize    alignment,
+                                             gpointer user_data);
+
+/**
+ * PipevecAlignedFreeFunc:
+ * @memory: An allocation made by the matching #PipevecAlignedAllocFunc.
+ * @size: The size it was allocated with.
+ * @user_data: The user data the allocator was installed with.
+ *
+ * Free an allocation.
+ */
+typedef void (*PipevecAlignedFreeFunc) (gpointer memory,
+                                        gsize    size,
+                                        gpointer user_data);
+
+/**
+ * PipevecAllocatorFuncs:
+ * @alloc: Allocates aligned memory.
+ * @free: Frees memory from @alloc.
+ *
+ * The functions used to allocate and free the storage of tensors
+ * and packed tensors.
+ */
+typedef struct {
+  PipevecAlignedAllocFunc alloc;
+  PipevecAlignedFreeFunc  free;
+} PipevecAllocatorFuncs;
+
+void pipevec_allocator_set (const PipevecAllocatorFuncs *funcs,
+                            gpointer                     user_data,
+                            GDestroyNotify               user_data_destroy);
+
+G_END_DECLS
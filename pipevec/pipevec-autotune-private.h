@@ -0,0 +1,39 @@
+/*
+ * /pipevec/pipevec-autotune-private.h
+ *
+ * Internal access to the tuned parameters of the matrix product engine.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include <pipevec/pipevec-autotune.h>
+#include <pipevec/pipevec-dispatch-private.h>
+#include <pipevec/pipevec-gemm-private.h>
+
+G_BEGIN_DECLS
+
+void pipevec_autotune_current_gemm_blocking (PipevecGemmBlocking *blocking);
+
+void pipevec_autotune_current_dispatch_costs (PipevecDispatchCosts *costs);
+
+void pipevec_autotune_set_dispatch_costs (const PipevecDispatchCosts *costs);
+
+G_END_DECLS
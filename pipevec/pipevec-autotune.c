@@ -0,0 +1,903 @@
+/*
+ * /pipevec/pipevec-autotune.c
+ *
+ * Tuning of the matrix product engine for the machine it runs on.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-autotune.h>
+#include <pipevec/pipevec-autotune-private.h>
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-parallel-private.h>
+
+#include <errno.h>
+#include <string.h>
+
+/* The packed product keeps an mc x kc block of A in L2 and a kc x nc
+ * block of B in L3, while the microkernel streams a kc x NR panel of
+ * B from L1. Good block sizes therefore follow from the cache sizes,
+ * which are read from sysfs. The best sizes also depend on details
+ * like associativity and prefetching, so they can be refined by
+ * timing candidates on the machine itself. The results are cached
+ * per CPU model under the user cache directory and loaded on first
+ * use. Setting PIPEVEC_AUTOTUNE=1 tunes on first use if there is no
+ * cached result for this CPU yet. */
+
+/* Cache sizes to assume when sysfs does not have them */
+#define PIPEVEC_AUTOTUNE_DEFAULT_L1 (32 * 1024)
+#define PIPEVEC_AUTOTUNE_DEFAULT_L2 (256 * 1024)
+
+/* Bounds for blockings computed from cache sizes or loaded
+ * from the cache file */
+#define PIPEVEC_AUTOTUNE_MIN_KC 64
+#define PIPEVEC_AUTOTUNE_MAX_KC 1024
+#define PIPEVEC_AUTOTUNE_MAX_MC 4096
+#define PIPEVEC_AUTOTUNE_MAX_NC 16384
+
+/* Shape of the product that candidate blockings are timed on. It
+ * spans several blocks of k and n for the candidates to differ. */
+#define PIPEVEC_AUTOTUNE_M 192
+#define PIPEVEC_AUTOTUNE_N 1024
+#define PIPEVEC_AUTOTUNE_K 512
+
+/* Each candidate is timed this many times and the fastest run kept */
+#define PIPEVEC_AUTOTUNE_REPEATS 3
+
+/* The dispatcher's cost model is calibrated the same way. Until it
+ * is, it assumes rates typical of a desktop core that put the switch
+ * from direct to blocked products at about 32 x 32 x 32 and keep
+ * loops under about 100 microseconds on one thread. */
+#define PIPEVEC_AUTOTUNE_DEFAULT_FLOPS_PER_NS 8.0
+#define PIPEVEC_AUTOTUNE_DEFAULT_BLOCKED_FLOPS_PER_NS 16.0
+#define PIPEVEC_AUTOTUNE_DEFAULT_BLOCKED_SETUP_NS 4000.0
+#define PIPEVEC_AUTOTUNE_DEFAULT_CACHE_BYTES_PER_NS 32.0
+#define PIPEVEC_AUTOTUNE_DEFAULT_MEMORY_BYTES_PER_NS 8.0
+#define PIPEVEC_AUTOTUNE_DEFAULT_MEMORY_BYTES_PER_NS_ALL 16.0
+#define PIPEVEC_AUTOTUNE_DEFAULT_DISPATCH_NS 20000.0
+#define PIPEVEC_AUTOTUNE_DEFAULT_DISPATCH_THREAD_NS 5000.0
+
+/* Streaming from memory is timed over at least this many bytes, or
+ * four times the last level cache if that is larger */
+#define PIPEVEC_AUTOTUNE_MIN_MEMORY_BYTES (32 * 1024 * 1024)
+#define PIPEVEC_AUTOTUNE_MAX_MEMORY_BYTES (256 * 1024 * 1024)
+
+/* Calls timed together, so that short ones are above the resolution
+ * of the monotonic clock */
+#define PIPEVEC_AUTOTUNE_DISPATCH_CALLS 200
+
+static GMutex blocking_lock;
+static PipevecGemmBlocking current_blocking;
+
+static GMutex dispatch_costs_lock;
+static PipevecDispatchCosts current_dispatch_costs;
+
+static size_t
+round_down_to_multiple (size_t value,
+                        size_t multiple,
+                        size_t minimum,
+                        size_t maximum)
+{
+  value = CLAMP (value, minimum, maximum);
+
+  return MAX (value - value % multiple, multiple);
+}
+
+/* Parse sysfs cache sizes such as "32K" or "8M" */
+static size_t
+parse_cache_size (const char *text)
+{
+  char *end = NULL;
+  guint64 size = g_ascii_strtoull (text, &end, 10);
+
+  if (end == text)
+    return 0;
+
+  switch (*end)
+    {
+    case 'K':
+      return size * 1024;
+    case 'M':
+      return size * 1024 * 1024;
+    case 'G':
+      return size * 1024 * 1024 * 1024;
+    default:
+      return size;
+    }
+}
+
+/* Size in bytes of the data or unified cache at the given level
+ * seen by the first CPU, or 0 if sysfs does not say */
+static size_t
+read_cache_size (unsigned int level)
+{
+  for (unsigned int index = 0; ; ++index)
+    {
+      g_autofree char *directory = g_strdup_printf ("/sys/devices/system/cpu/cpu0/cache/index%u", index);
+      g_autofree char *level_path = g_build_filename (directory, "level", NULL);
+      g_autofree char *type_path = g_build_filename (directory, "type", NULL);
+      g_autofree char *size_path = g_build_filename (directory, "size", NULL);
+      g_autofree char *level_text = NULL;
+      g_autofree char *type_text = NULL;
+      g_autofree char *size_text = NULL;
+
+      if (!g_file_get_contents (level_path, &level_text, NULL, NULL))
+        return 0;
+
+      if (g_ascii_strtoull (level_text, NULL, 10) != level ||
+          !g_file_get_contents (type_path, &type_text, NULL, NULL) ||
+          g_str_has_prefix (type_text, "Instruction") ||
+          !g_file_get_contents (size_path, &size_text, NULL, NULL))
+        continue;
+
+      return parse_cache_size (g_strstrip (size_text));
+    }
+}
+
+static void
+default_blocking (PipevecGemmBlocking *blocking)
+{
+  size_t mr, nr;
+  size_t l1 = read_cache_size (1);
+  size_t l2 = read_cache_size (2);
+  size_t l3 = read_cache_size (3);
+
+  pipevec_gemm_get_microkernel_shape (&mr, &nr);
+
+  if (l1 == 0)
+    l1 = PIPEVEC_AUTOTUNE_DEFAULT_L1;
+
+  if (l2 == 0)
+    l2 = PIPEVEC_AUTOTUNE_DEFAULT_L2;
+
+  if (l3 == 0)
+    l3 = 4 * l2;
+
+  /* Use about half of each level, leaving the rest for the
+   * other operands passing through it */
+  blocking->kc = round_down_to_multiple (l1 / 2 / (sizeof (float) * nr),
+                                         8,
+                                         PIPEVEC_AUTOTUNE_MIN_KC,
+                                         PIPEVEC_AUTOTUNE_MAX_KC);
+  blocking->mc = round_down_to_multiple (l2 / 2 / (sizeof (float) * blocking->kc),
+                                         mr,
+                                         mr,
+                                         PIPEVEC_AUTOTUNE_MAX_MC);
+  blocking->nc = round_down_to_multiple (l3 / 2 / (sizeof (float) * blocking->kc),
+                                         nr,
+                                         nr,
+                                         PIPEVEC_AUTOTUNE_MAX_NC);
+}
+
+static gboolean
+blocking_is_valid (const PipevecGemmBlocking *blocking)
+{
+  size_t mr, nr;
+
+  pipevec_gemm_get_microkernel_shape (&mr, &nr);
+
+  return (blocking->mc > 0 && blocking->mc <= PIPEVEC_AUTOTUNE_MAX_MC && blocking->mc % mr == 0 &&
+          blocking->kc > 0 && blocking->kc <= PIPEVEC_AUTOTUNE_MAX_KC &&
+          blocking->nc > 0 && blocking->nc <= PIPEVEC_AUTOTUNE_MAX_NC && blocking->nc % nr == 0);
+}
+
+static char *
+cache_file_path (const char *basename)
+{
+  return g_build_filename (g_get_user_cache_dir (), "pipevec", basename, NULL);
+}
+
+/* Results are only valid for the same CPU and microkernel, so the
+ * group they are stored under names both */
+static char *
+cache_group_name (void)
+{
+  g_autofree char *cpuinfo = NULL;
+  g_autofree char *model = NULL;
+  size_t mr, nr;
+
+  pipevec_gemm_get_microkernel_shape (&mr, &nr);
+
+  if (g_file_get_contents ("/proc/cpuinfo", &cpuinfo, NULL, NULL))
+    {
+      g_auto(GStrv) lines = g_strsplit (cpuinfo, "\n", -1);
+
+      for (char **line = lines; *line != NULL && model == NULL; ++line)
+        {
+          char *colon = strchr (*line, ':');
+
+          if (g_str_has_prefix (*line, "model name") && colon != NULL)
+            model = g_strdup (colon + 1);
+        }
+    }
+
+  if (model == NULL)
+    model = g_strdup ("unknown");
+
+  /* Square brackets would end the group name */
+  g_strdelimit (g_strstrip (model), "[]", ' ');
+
+  return g_strdup_printf ("%s %zux%zu", model, mr, nr);
+}
+
+static gboolean
+load_cached_blocking (PipevecGemmBlocking *blocking)
+{
+  g_autofree char *path = cache_file_path ("gemm-blocking.ini");
+  g_autofree char *group = cache_group_name ();
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autoptr(GError) error = NULL;
+  PipevecGemmBlocking loaded;
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL) ||
+      !g_key_file_has_group (key_file, group))
+    return FALSE;
+
+  loaded.mc = g_key_file_get_uint64 (key_file, group, "mc", &error);
+  if (error == NULL)
+    loaded.kc = g_key_file_get_uint64 (key_file, group, "kc", &error);
+  if (error == NULL)
+    loaded.nc = g_key_file_get_uint64 (key_file, group, "nc", &error);
+
+  /* A stale or hand edited file is ignored rather than trusted */
+  if (error != NULL || !blocking_is_valid (&loaded))
+    return FALSE;
+
+  *blocking = loaded;
+
+  return TRUE;
+}
+
+/* Open the cache file at path for adding the results for this CPU,
+ * creating its directory if needed */
+static GKeyFile *
+open_cache_file (const char  *path,
+                 GError     **error)
+{
+  g_autofree char *directory = g_path_get_dirname (path);
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+
+  if (g_mkdir_with_parents (directory, 0755) != 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (saved_errno),
+                   "Could not create %s: %s",
+                   directory,
+                   g_strerror (saved_errno));
+      return NULL;
+    }
+
+  /* Keep the results for other CPUs that share the home directory */
+  g_key_file_load_from_file (key_file, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+
+  return g_steal_pointer (&key_file);
+}
+
+static gboolean
+save_cached_blocking (const PipevecGemmBlocking  *blocking,
+                      GError                    **error)
+{
+  g_autofree char *path = cache_file_path ("gemm-blocking.ini");
+  g_autofree char *group = cache_group_name ();
+  g_autoptr(GKeyFile) key_file = open_cache_file (path, error);
+
+  if (key_file == NULL)
+    return FALSE;
+
+  g_key_file_set_uint64 (key_file, group, "mc", blocking->mc);
+  g_key_file_set_uint64 (key_file, group, "kc", blocking->kc);
+  g_key_file_set_uint64 (key_file, group, "nc", blocking->nc);
+
+  return g_key_file_save_to_file (key_file, path, error);
+}
+
+/* Fastest of a few runs of the benchmark product, in microseconds */
+static gint64
+time_blocking (const PipevecGemmBlocking *blocking,
+               const float               *a,
+               const float               *b,
+               float                     *c)
+{
+  gint64 best = G_MAXINT64;
+
+  for (size_t repeat = 0; repeat < PIPEVEC_AUTOTUNE_REPEATS; ++repeat)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      if (!pipevec_gemm_with_blocking (blocking,
+                                       PIPEVEC_AUTOTUNE_M,
+                                       PIPEVEC_AUTOTUNE_N,
+                                       PIPEVEC_AUTOTUNE_K,
+                                       a, b, c))
+        return G_MAXINT64;
+
+      best = MIN (best, g_get_monotonic_time () - start);
+    }
+
+  return best;
+}
+
+/* Try each value of one block size in turn, keeping the others
+ * fixed, and keep the fastest */
+static void
+tune_block_size (PipevecGemmBlocking *blocking,
+                 size_t              *block_size,
+                 const size_t        *candidates,
+                 size_t               n_candidates,
+                 const float         *a,
+                 const float         *b,
+                 float               *c)
+{
+  size_t best_size = *block_size;
+  gint64 best_time = time_blocking (blocking, a, b, c);
+
+  for (size_t i = 0; i < n_candidates; ++i)
+    {
+      gint64 time;
+
+      *block_size = candidates[i];
+
+      if (!blocking_is_valid (blocking))
+        continue;
+
+      time = time_blocking (blocking, a, b, c);
+
+      if (time < best_time)
+        {
+          best_time = time;
+          best_size = candidates[i];
+        }
+    }
+
+  *block_size = best_size;
+}
+
+static gboolean
+tune_blocking (PipevecGemmBlocking  *blocking,
+               GError              **error)
+{
+  size_t mr, nr;
+  g_autofree float *a = g_try_new (float, PIPEVEC_AUTOTUNE_M * PIPEVEC_AUTOTUNE_K);
+  g_autofree float *b = g_try_new (float, PIPEVEC_AUTOTUNE_K * PIPEVEC_AUTOTUNE_N);
+  g_autofree float *c = g_try_new (float, PIPEVEC_AUTOTUNE_M * PIPEVEC_AUTOTUNE_N);
+
+  if (a == NULL || b == NULL || c == NULL)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INTERNAL,
+                   "Unable to allocate memory for tuning");
+      return FALSE;
+    }
+
+  for (size_t i = 0; i < PIPEVEC_AUTOTUNE_M * PIPEVEC_AUTOTUNE_K; ++i)
+    a[i] = (float) (i % 13) / 13.0f;
+
+  for (size_t i = 0; i < PIPEVEC_AUTOTUNE_K * PIPEVEC_AUTOTUNE_N; ++i)
+    b[i] = (float) (i % 7) / 7.0f;
+
+  pipevec_gemm_get_microkernel_shape (&mr, &nr);
+
+  /* Coordinate descent from the sysfs defaults: k first, since it
+   * sizes the panels that the other two blocks are made of */
+  const size_t kc_candidates[] = { 128, 192, 256, 384, 512 };
+  const size_t mc_candidates[] = { 4 * mr, 8 * mr, 16 * mr, 32 * mr, 64 * mr };
+  const size_t nc_candidates[] = { 32 * nr, 64 * nr, 128 * nr, 256 * nr, 512 * nr };
+
+  tune_block_size (blocking, &blocking->kc, kc_candidates, G_N_ELEMENTS (kc_candidates), a, b, c);
+  tune_block_size (blocking, &blocking->mc, mc_candidates, G_N_ELEMENTS (mc_candidates), a, b, c);
+  tune_block_size (blocking, &blocking->nc, nc_candidates, G_N_ELEMENTS (nc_candidates), a, b, c);
+
+  return TRUE;
+}
+
+static void
+ensure_blocking (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      PipevecGemmBlocking blocking;
+
+      default_blocking (&blocking);
+
+      if (!load_cached_blocking (&blocking) &&
+          g_strcmp0 (g_getenv ("PIPEVEC_AUTOTUNE"), "1") == 0)
+        {
+          g_autoptr(GError) error = NULL;
+
+          if (!tune_blocking (&blocking, &error) ||
+              !save_cached_blocking (&blocking, &error))
+            g_warning ("Could not tune the matrix product engine: %s", error->message);
+        }
+
+      current_blocking = blocking;
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/**
+ * pipevec_autotune_current_gemm_blocking:
+ * @blocking: (out caller-allocates): The cache blocking to use.
+ *
+ * Get the cache blocking that the packed matrix product should use,
+ * loading it or computing the defaults on first use.
+ */
+void
+pipevec_autotune_current_gemm_blocking (PipevecGemmBlocking *blocking)
+{
+  ensure_blocking ();
+
+  g_mutex_lock (&blocking_lock);
+  *blocking = current_blocking;
+  g_mutex_unlock (&blocking_lock);
+}
+
+/**
+ * pipevec_autotune_get_gemm_blocking:
+ * @mc: (out): Rows of A packed at once.
+ * @kc: (out): Depth of the packed blocks of A and B.
+ * @nc: (out): Columns of B packed at once.
+ *
+ * Get the cache blocking that matrix products currently use. It is
+ * the result of pipevec_autotune_gemm() cached for this CPU if there
+ * is one, and otherwise computed from the cache sizes in sysfs.
+ */
+void
+pipevec_autotune_get_gemm_blocking (size_t *mc,
+                                    size_t *kc,
+                                    size_t *nc)
+{
+  PipevecGemmBlocking blocking;
+
+  pipevec_autotune_current_gemm_blocking (&blocking);
+
+  *mc = blocking.mc;
+  *kc = blocking.kc;
+  *nc = blocking.nc;
+}
+
+/**
+ * pipevec_autotune_gemm:
+ * @error: A #GError out pointer.
+ *
+ * Time candidate cache blockings for the matrix product engine on
+ * this machine, starting from the defaults computed from the cache
+ * sizes, and use the fastest from now on. The result is saved to
+ * `pipevec/gemm-blocking.ini` under the user cache directory
+ * (`XDG_CACHE_HOME`), keyed by CPU model, and loaded by later
+ * processes on the same CPU. Tuning takes a few seconds, so it is
+ * meant to be run once after installation, for instance with the
+ * pipevec-autotune tool, or on first use by setting
+ * `PIPEVEC_AUTOTUNE=1`.
+ *
+ * Packed tensors remember the blocking they were packed with, so
+ * they stay valid when it changes.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set on failure. The
+ *          tuned blocking is used even if it could not be saved.
+ */
+gboolean
+pipevec_autotune_gemm (GError **error)
+{
+  PipevecGemmBlocking blocking;
+
+  ensure_blocking ();
+  default_blocking (&blocking);
+
+  if (!tune_blocking (&blocking, error))
+    return FALSE;
+
+  g_mutex_lock (&blocking_lock);
+  current_blocking = blocking;
+  g_mutex_unlock (&blocking_lock);
+
+  return save_cached_blocking (&blocking, error);
+}
+
+static size_t
+last_level_cache_size (void)
+{
+  size_t l2 = read_cache_size (2);
+  size_t l3 = read_cache_size (3);
+
+  if (l2 == 0)
+    l2 = PIPEVEC_AUTOTUNE_DEFAULT_L2;
+
+  return l3 != 0 ? l3 : 4 * l2;
+}
+
+static void
+default_dispatch_costs (PipevecDispatchCosts *costs)
+{
+  *costs = (PipevecDispatchCosts) {
+    .flops_per_ns = PIPEVEC_AUTOTUNE_DEFAULT_FLOPS_PER_NS,
+    .blocked_flops_per_ns = PIPEVEC_AUTOTUNE_DEFAULT_BLOCKED_FLOPS_PER_NS,
+    .blocked_setup_ns = PIPEVEC_AUTOTUNE_DEFAULT_BLOCKED_SETUP_NS,
+    .cache_bytes_per_ns = PIPEVEC_AUTOTUNE_DEFAULT_CACHE_BYTES_PER_NS,
+    .memory_bytes_per_ns = PIPEVEC_AUTOTUNE_DEFAULT_MEMORY_BYTES_PER_NS,
+    .memory_bytes_per_ns_all = PIPEVEC_AUTOTUNE_DEFAULT_MEMORY_BYTES_PER_NS_ALL,
+    .dispatch_ns = PIPEVEC_AUTOTUNE_DEFAULT_DISPATCH_NS,
+    .dispatch_thread_ns = PIPEVEC_AUTOTUNE_DEFAULT_DISPATCH_THREAD_NS,
+    .cache_bytes = last_level_cache_size ()
+  };
+}
+
+/* The rates are divided by, so they must be positive. The setup and
+ * dispatch latencies may be measured as zero. */
+static gboolean
+dispatch_costs_are_valid (const PipevecDispatchCosts *costs)
+{
+  return (costs->flops_per_ns > 0.0 &&
+          costs->blocked_flops_per_ns > 0.0 &&
+          costs->blocked_setup_ns >= 0.0 &&
+          costs->cache_bytes_per_ns > 0.0 &&
+          costs->memory_bytes_per_ns > 0.0 &&
+          costs->memory_bytes_per_ns_all > 0.0 &&
+          costs->dispatch_ns >= 0.0 &&
+          costs->dispatch_thread_ns >= 0.0);
+}
+
+/* Keys in the cache file, and where each is kept */
+static const struct {
+  const char *key;
+  size_t      offset;
+} dispatch_cost_keys[] = {
+  { "flops-per-ns", G_STRUCT_OFFSET (PipevecDispatchCosts, flops_per_ns) },
+  { "blocked-flops-per-ns", G_STRUCT_OFFSET (PipevecDispatchCosts, blocked_flops_per_ns) },
+  { "blocked-setup-ns", G_STRUCT_OFFSET (PipevecDispatchCosts, blocked_setup_ns) },
+  { "cache-bytes-per-ns", G_STRUCT_OFFSET (PipevecDispatchCosts, cache_bytes_per_ns) },
+  { "memory-bytes-per-ns", G_STRUCT_OFFSET (PipevecDispatchCosts, memory_bytes_per_ns) },
+  { "memory-bytes-per-ns-all", G_STRUCT_OFFSET (PipevecDispatchCosts, memory_bytes_per_ns_all) },
+  { "dispatch-ns", G_STRUCT_OFFSET (PipevecDispatchCosts, dispatch_ns) },
+  { "dispatch-thread-ns", G_STRUCT_OFFSET (PipevecDispatchCosts, dispatch_thread_ns) }
+};
+
+static gboolean
+load_cached_dispatch_costs (PipevecDispatchCosts *costs)
+{
+  g_autofree char *path = cache_file_path ("dispatch-costs.ini");
+  g_autofree char *group = cache_group_name ();
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  PipevecDispatchCosts loaded = *costs;
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, NULL) ||
+      !g_key_file_has_group (key_file, group))
+    return FALSE;
+
+  for (size_t i = 0; i < G_N_ELEMENTS (dispatch_cost_keys); ++i)
+    {
+      g_autoptr(GError) error = NULL;
+      double value = g_key_file_get_double (key_file, group, dispatch_cost_keys[i].key, &error);
+
+      if (error != NULL)
+        return FALSE;
+
+      G_STRUCT_MEMBER (double, &loaded, dispatch_cost_keys[i].offset) = value;
+    }
+
+  if (!dispatch_costs_are_valid (&loaded))
+    return FALSE;
+
+  *costs = loaded;
+
+  return TRUE;
+}
+
+static gboolean
+save_cached_dispatch_costs (const PipevecDispatchCosts  *costs,
+                            GError                     **error)
+{
+  g_autofree char *path = cache_file_path ("dispatch-costs.ini");
+  g_autofree char *group = cache_group_name ();
+  g_autoptr(GKeyFile) key_file = open_cache_file (path, error);
+
+  if (key_file == NULL)
+    return FALSE;
+
+  for (size_t i = 0; i < G_N_ELEMENTS (dispatch_cost_keys); ++i)
+    g_key_file_set_double (key_file,
+                           group,
+                           dispatch_cost_keys[i].key,
+                           G_STRUCT_MEMBER (double, costs, dispatch_cost_keys[i].offset));
+
+  return g_key_file_save_to_file (key_file, path, error);
+}
+
+/* dst = 0.5 * src, split into n_tasks contiguous chunks */
+typedef struct {
+  const float *src;
+  float       *dst;
+  size_t       n_floats;
+  size_t       n_tasks;
+} StreamJob;
+
+static void
+stream_task (size_t   task,
+             gpointer user_data)
+{
+  StreamJob *job = user_data;
+  size_t chunk = (job->n_floats + job->n_tasks - 1) / job->n_tasks;
+  size_t first = task * chunk;
+  size_t last = MIN (first + chunk, job->n_floats);
+
+  for (size_t i = first; i < last; ++i)
+    job->dst[i] = 0.5f * job->src[i];
+}
+
+static void
+empty_task (size_t   task G_GNUC_UNUSED,
+            gpointer user_data G_GNUC_UNUSED)
+{
+}
+
+/* Bytes per nanosecond of the fastest of a few passes over the
+ * buffers, each repeated enough times to take a measurable time */
+static double
+time_stream (StreamJob *job,
+             size_t     n_passes)
+{
+  gint64 best = G_MAXINT64;
+
+  for (size_t repeat = 0; repeat < PIPEVEC_AUTOTUNE_REPEATS; ++repeat)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      for (size_t pass = 0; pass < n_passes; ++pass)
+        pipevec_parallel_for_n_threads (job->n_tasks, job->n_tasks, stream_task, job);
+
+      best = MIN (best, g_get_monotonic_time () - start);
+    }
+
+  return 2.0 * sizeof (float) * job->n_floats * n_passes / (MAX (best, 1) * 1e3);
+}
+
+/* Nanoseconds per call of a parallel loop with one empty task on
+ * each of n_threads threads */
+static double
+time_dispatch (size_t n_threads)
+{
+  gint64 best = G_MAXINT64;
+
+  for (size_t repeat = 0; repeat < PIPEVEC_AUTOTUNE_REPEATS; ++repeat)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      for (size_t call = 0; call < PIPEVEC_AUTOTUNE_DISPATCH_CALLS; ++call)
+        pipevec_parallel_for_n_threads (n_threads, n_threads, empty_task, NULL);
+
+      best = MIN (best, g_get_monotonic_time () - start);
+    }
+
+  return best * 1e3 / PIPEVEC_AUTOTUNE_DISPATCH_CALLS;
+}
+
+/* Nanoseconds for the fastest of a few runs of a contiguous m x k by
+ * k x n product, repeated n_calls times */
+static double
+time_product (const PipevecGemmBlocking *blocking,
+              size_t                     m,
+              size_t                     n,
+              size_t                     k,
+              size_t                     n_calls,
+              const float               *a,
+              const float               *b,
+              float                     *c)
+{
+  gint64 best = G_MAXINT64;
+
+  for (size_t repeat = 0; repeat < PIPEVEC_AUTOTUNE_REPEATS; ++repeat)
+    {
+      gint64 start = g_get_monotonic_time ();
+
+      for (size_t call = 0; call < n_calls; ++call)
+        {
+          if (blocking == NULL)
+            pipevec_gemm_unblocked (m, n, k, a, b, c);
+          else if (!pipevec_gemm_with_blocking (blocking, m, n, k, a, b, c))
+            return -1.0;
+        }
+
+      best = MIN (best, g_get_monotonic_time () - start);
+    }
+
+  return MAX (best, 1) * 1e3 / n_calls;
+}
+
+static gboolean
+calibrate_dispatch_costs (PipevecDispatchCosts  *costs,
+                          GError               **error)
+{
+  PipevecGemmBlocking blocking;
+  size_t n_threads = pipevec_parallel_get_n_threads ();
+  size_t cache_floats = costs->cache_bytes / 4 / sizeof (float);
+  size_t memory_floats = CLAMP (4 * costs->cache_bytes,
+                                PIPEVEC_AUTOTUNE_MIN_MEMORY_BYTES,
+                                PIPEVEC_AUTOTUNE_MAX_MEMORY_BYTES) / 2 / sizeof (float);
+  g_autofree float *src = g_try_new0 (float, memory_floats);
+  g_autofree float *dst = g_try_new0 (float, memory_floats);
+
+  if (src == NULL || dst == NULL)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INTERNAL,
+                   "Unable to allocate memory for calibration");
+      return FALSE;
+    }
+
+  /* Products reuse the streaming buffers, which are far larger */
+  const float *a = src;
+  const float *b = src + 256 * 256;
+  float *c = dst;
+
+  /* Direct products are timed where they are used, on operands that
+   * fit in L1, and blocked ones on operands large enough for the
+   * microkernel to dominate. What a tiny blocked product costs beyond
+   * its arithmetic is the setup. */
+  double direct_ns = time_product (NULL, 32, 32, 32, 64, a, b, c);
+
+  costs->flops_per_ns = 2.0 * 32 * 32 * 32 / direct_ns;
+
+  pipevec_autotune_current_gemm_blocking (&blocking);
+
+  double blocked_ns = time_product (&blocking, 256, 256, 256, 1, a, b, c);
+  double setup_ns = time_product (&blocking, 8, 8, 8, 64, a, b, c);
+
+  if (blocked_ns < 0.0 || setup_ns < 0.0)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INTERNAL,
+                   "Unable to allocate packing buffers for calibration");
+      return FALSE;
+    }
+
+  costs->blocked_flops_per_ns = 2.0 * 256 * 256 * 256 / blocked_ns;
+  costs->blocked_setup_ns = MAX (setup_ns - 2.0 * 8 * 8 * 8 / costs->blocked_flops_per_ns, 0.0);
+
+  StreamJob cached = { .src = src, .dst = dst, .n_floats = cache_floats, .n_tasks = 1 };
+  StreamJob memory = { .src = src, .dst = dst, .n_floats = memory_floats, .n_tasks = 1 };
+
+  /* Touch the buffers first so that page faults are not timed */
+  stream_task (0, &memory);
+
+  costs->cache_bytes_per_ns = time_stream (&cached, MAX (memory_floats / cache_floats, 1));
+  costs->memory_bytes_per_ns = time_stream (&memory, 1);
+  costs->memory_bytes_per_ns_all = costs->memory_bytes_per_ns;
+
+  if (n_threads > 1)
+    {
+      double two_ns = time_dispatch (2);
+      double all_ns = time_dispatch (n_threads);
+
+      memory.n_tasks = n_threads;
+      costs->memory_bytes_per_ns_all = MAX (time_stream (&memory, 1), costs->memory_bytes_per_ns);
+
+      /* Fit a fixed cost and a cost per worker woken */
+      costs->dispatch_thread_ns = n_threads > 2 ? MAX (all_ns - two_ns, 0.0) / (n_threads - 2) : 0.0;
+      costs->dispatch_ns = MAX (two_ns - costs->dispatch_thread_ns, 0.0);
+    }
+
+  return TRUE;
+}
+
+static void
+ensure_dispatch_costs (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      PipevecDispatchCosts costs;
+
+      default_dispatch_costs (&costs);
+
+      if (!load_cached_dispatch_costs (&costs) &&
+          g_strcmp0 (g_getenv ("PIPEVEC_AUTOTUNE"), "1") == 0)
+        {
+          g_autoptr(GError) error = NULL;
+
+          if (!calibrate_dispatch_costs (&costs, &error) ||
+              !save_cached_dispatch_costs (&costs, &error))
+            g_warning ("Could not calibrate the dispatcher: %s", error->message);
+        }
+
+      g_mutex_lock (&dispatch_costs_lock);
+      current_dispatch_costs = costs;
+      g_mutex_unlock (&dispatch_costs_lock);
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/**
+ * pipevec_autotune_current_dispatch_costs:
+ * @costs: (out caller-allocates): The costs to estimate with.
+ *
+ * Get the rates and latencies that the dispatcher estimates the time
+ * of each operation from, loading them or using the defaults on first
+ * use.
+ */
+void
+pipevec_autotune_current_dispatch_costs (PipevecDispatchCosts *costs)
+{
+  ensure_dispatch_costs ();
+
+  g_mutex_lock (&dispatch_costs_lock);
+  *costs = current_dispatch_costs;
+  g_mutex_unlock (&dispatch_costs_lock);
+}
+
+/**
+ * pipevec_autotune_set_dispatch_costs:
+ * @costs: The costs to estimate with.
+ *
+ * Make the dispatcher estimate with @costs from now on instead of the
+ * cached or measured ones, without saving them. This is meant for
+ * checking the choices the cost model makes for a known machine.
+ */
+void
+pipevec_autotune_set_dispatch_costs (const PipevecDispatchCosts *costs)
+{
+  g_return_if_fail (dispatch_costs_are_valid (costs));
+
+  ensure_dispatch_costs ();
+
+  g_mutex_lock (&dispatch_costs_lock);
+  current_dispatch_costs = *costs;
+  g_mutex_unlock (&dispatch_costs_lock);
+}
+
+/**
+ * pipevec_autotune_dispatch:
+ * @error: A #GError out pointer.
+ *
+ * Measure the arithmetic and memory throughput of this machine and
+ * the latency of waking worker threads, which the dispatcher uses to
+ * choose between implementations and thread counts for each call, and
+ * use them from now on. Like pipevec_autotune_gemm(), the result is
+ * saved under the user cache directory, in
+ * `pipevec/dispatch-costs.ini`, keyed by CPU model, and takes a
+ * second or so. Run pipevec_autotune_gemm() first, since the blocked
+ * product is timed with the current blocking.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set on failure. The
+ *          measured costs are used even if they could not be saved.
+ */
+gboolean
+pipevec_autotune_dispatch (GError **error)
+{
+  PipevecDispatchCosts costs;
+
+  ensure_dispatch_costs ();
+  default_dispatch_costs (&costs);
+
+  if (!calibrate_dispatch_costs (&costs, error))
+    return FALSE;
+
+  g_mutex_lock (&dispatch_costs_lock);
+  current_dispatch_costs = costs;
+  g_mutex_unlock (&dispatch_costs_lock);
+
+  return save_cached_dispatch_costs (&costs, error);
+}
@@ -0,0 +1,66 @@
+/*
+ * /pipevec/pipevec-dispatch-private.h
+ *
+ * Choosing how to run each operation from a cost model.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stddef.h>
+
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-parallel-private.h>
+
+G_BEGIN_DECLS
+
+/* Throughputs and latencies of this machine that the cost model is
+ * built from. Rates are per thread unless noted otherwise. */
+typedef struct {
+  double flops_per_ns;            /* Vector loops over operands in place */
+  double blocked_flops_per_ns;    /* The packed microkernel */
+  double blocked_setup_ns;        /* Fixed cost of a blocked product */
+  double cache_bytes_per_ns;      /* Streaming data that fits in cache */
+  double memory_bytes_per_ns;     /* Streaming from memory on one thread */
+  double memory_bytes_per_ns_all; /* Streaming from memory on all threads together */
+  double dispatch_ns;             /* Fixed cost of a parallel loop */
+  double dispatch_thread_ns;      /* Further cost of each worker woken */
+  size_t cache_bytes;             /* Size of the last level cache */
+} PipevecDispatchCosts;
+
+PipevecDispatchVariant pipevec_dispatch_gemm_variant (size_t   m,
+                                                      size_t   n,
+                                                      size_t   k,
+                                                      gboolean streamable);
+
+size_t pipevec_dispatch_blocked_gemm_threads (size_t m,
+                                              size_t n,
+                                              size_t k);
+
+size_t pipevec_dispatch_loop_threads (size_t n_items,
+                                      double flops_per_item,
+                                      double bytes_per_item);
+
+void pipevec_dispatch_parallel_for (size_t              n_items,
+                                    double              flops_per_item,
+                                    double              bytes_per_item,
+                                    PipevecParallelFunc func,
+                                    gpointer            user_data);
+
+G_END_DECLS
@@ -0,0 +1,600 @@
+/*
+ * /pipevec/pipevec-dispatch.c
+ *
+ * Choosing how to run each operation from a cost model.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-autotune-private.h>
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-dispatch-private.h>
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-parallel-private.h>
+
+#include <string.h>
+
+/* Each operation estimates its own time from the number of floating
+ * point operations it does and the bytes it moves, against rates
+ * measured on this machine (see pipevec_autotune_dispatch()). Data
+ * that fits in the last level cache streams at the cache rate, which
+ * every thread gets. Beyond that it streams at the memory rate, which
+ * threads share. Whichever of the arithmetic and the streaming takes
+ * longer is the estimate.
+ *
+ * A parallel loop only pays off once its work is split finely enough
+ * to make up for waking the workers, and the estimates are rough, so
+ * threads are only used when they win by at least the cost of waking
+ * them again. Operations on small tensors therefore never touch the
+ * pool. The blocked product is split between threads by rows of C in
+ * the same way, but wakes them once for every block of B, so it is
+ * charged for waking them that many times. The direct product always
+ * runs on the calling thread. */
+
+static gint override_variant = PIPEVEC_DISPATCH_VARIANT_AUTO;
+static gsize override_threads = 0;
+
+/* PIPEVEC_DISPATCH is a comma separated list of a variant name,
+ * "serial" or "threads=N", for instance "blocked,threads=2" */
+static void
+ensure_override (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *requested = g_getenv ("PIPEVEC_DISPATCH");
+      g_auto(GStrv) tokens = g_strsplit (requested != NULL ? requested : "", ",", -1);
+
+      for (char **token = tokens; *token != NULL; ++token)
+        {
+          const char *name = g_strstrip (*token);
+
+          if (g_str_equal (name, "streaming"))
+            override_variant = PIPEVEC_DISPATCH_VARIANT_STREAMING;
+          else if (g_str_equal (name, "direct"))
+            override_variant = PIPEVEC_DISPATCH_VARIANT_DIRECT;
+          else if (g_str_equal (name, "blocked"))
+            override_variant = PIPEVEC_DISPATCH_VARIANT_BLOCKED;
+          else if (g_str_equal (name, "serial"))
+            override_threads = 1;
+          else if (g_str_has_prefix (name, "threads="))
+            override_threads = (gsize) g_ascii_strtoull (name + strlen ("threads="), NULL, 10);
+          else if (*name != '\0')
+            g_warning ("Unknown PIPEVEC_DISPATCH setting %s", name);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+static double
+dispatch_cost (const PipevecDispatchCosts *costs,
+               size_t                      n_threads)
+{
+  if (n_threads < 2)
+    return 0.0;
+
+  return costs->dispatch_ns + (n_threads - 1) * costs->dispatch_thread_ns;
+}
+
+/* Time for one of n_threads threads to stream bytes, when all of
+ * them together touch total_bytes */
+static double
+stream_ns (const PipevecDispatchCosts *costs,
+           double                      bytes,
+           double                      total_bytes,
+           size_t                      n_threads)
+{
+  if (total_bytes <= costs->cache_bytes)
+    return bytes / costs->cache_bytes_per_ns;
+
+  return bytes / MIN (costs->memory_bytes_per_ns,
+                      costs->memory_bytes_per_ns_all / n_threads);
+}
+
+/* Time for a loop over n_items equal items split into contiguous
+ * runs between n_threads threads, not counting waking them */
+static double
+loop_ns (const PipevecDispatchCosts *costs,
+         size_t                      n_items,
+         double                      flops_per_item,
+         double                      bytes_per_item,
+         size_t                      n_threads)
+{
+  double items = (double) ((n_items + n_threads - 1) / n_threads);
+
+  return MAX (items * flops_per_item / costs->flops_per_ns,
+              stream_ns (costs, items * bytes_per_item, n_items * bytes_per_item, n_threads));
+}
+
+static void
+plan_loop (const PipevecDispatchCosts *costs,
+           size_t                      n_items,
+           double                      flops_per_item,
+           double                      bytes_per_item,
+           PipevecDispatchPlan        *plan)
+{
+  size_t forced_threads = g_atomic_pointer_get (&override_threads);
+  size_t max_threads = MIN (pipevec_parallel_get_n_threads (), MAX (n_items, 1));
+  double serial_ns = loop_ns (costs, n_items, flops_per_item, bytes_per_item, 1);
+  size_t best_threads = 1;
+  double best_ns = serial_ns;
+
+  if (forced_threads > 0)
+    {
+      best_threads = MIN (forced_threads, max_threads);
+      best_ns = (loop_ns (costs, n_items, flops_per_item, bytes_per_item, best_threads) +
+                 dispatch_cost (costs, best_threads));
+    }
+  else
+    {
+      for (size_t n_threads = 2; n_threads <= max_threads; ++n_threads)
+        {
+          double ns = (loop_ns (costs, n_items, flops_per_item, bytes_per_item, n_threads) +
+                       dispatch_cost (costs, n_threads));
+
+          if (ns + dispatch_cost (costs, n_threads) < serial_ns && ns < best_ns)
+            {
+              best_threads = n_threads;
+              best_ns = ns;
+            }
+        }
+    }
+
+  *plan = (PipevecDispatchPlan) {
+    .variant = PIPEVEC_DISPATCH_VARIANT_DIRECT,
+    .n_threads = best_threads,
+    .max_threads = pipevec_parallel_get_n_threads (),
+    .serial_ns = serial_ns,
+    .estimated_ns = best_ns,
+    .dispatch_ns = dispatch_cost (costs, best_threads),
+    .flops = n_items * flops_per_item,
+    .bytes = n_items * bytes_per_item,
+    .overridden = forced_threads > 0
+  };
+}
+
+/* A product streams its matrix operand one output row or column at a
+ * time, so it is split between threads like a loop over those */
+static void
+plan_streaming (const PipevecDispatchCosts *costs,
+                size_t                      m,
+                size_t                      n,
+                size_t                      k,
+                PipevecDispatchPlan        *plan)
+{
+  size_t n_items = n == 1 ? m : m == 1 ? n : m;
+  double macs_per_item = (double) m * n * k / n_items;
+
+  plan_loop (costs, n_items, 2.0 * macs_per_item, sizeof (float) * macs_per_item, plan);
+  plan->variant = PIPEVEC_DISPATCH_VARIANT_STREAMING;
+}
+
+/* The direct product runs on the calling thread */
+static void
+plan_direct (const PipevecDispatchCosts *costs,
+             size_t                      m,
+             size_t                      n,
+             size_t                      k,
+             PipevecDispatchPlan        *plan)
+{
+  double flops = 2.0 * m * n * k;
+  double bytes = sizeof (float) * ((double) m * k + (double) k * n + (double) m * n);
+  double ns = MAX (flops / costs->flops_per_ns, stream_ns (costs, bytes, bytes, 1));
+
+  *plan = (PipevecDispatchPlan) {
+    .variant = PIPEVEC_DISPATCH_VARIANT_DIRECT,
+    .n_threads = 1,
+    .max_threads = pipevec_parallel_get_n_threads (),
+    .serial_ns = ns,
+    .estimated_ns = ns,
+    .dispatch_ns = 0.0,
+    .flops = flops,
+    .bytes = bytes,
+    .overridden = FALSE
+  };
+}
+
+/* The blocked product wakes the workers once for every block of B */
+static double
+blocked_dispatch_cost (const PipevecDispatchCosts *costs,
+                       const PipevecGemmBlocking  *blocking,
+                       size_t                      n,
+                       size_t                      k,
+                       size_t                      n_threads)
+{
+  size_t n_blocks = ((n + blocking->nc - 1) / blocking->nc) * ((k + blocking->kc - 1) / blocking->kc);
+
+  return n_blocks * dispatch_cost (costs, n_threads);
+}
+
+/* Time for the blocked product with the rows of C split between
+ * n_threads threads, not counting waking them. Each thread packs the
+ * blocks of A for its own rows and runs the microkernel over them
+ * from cache, while the blocks of B are packed once and shared. */
+static double
+blocked_ns (const PipevecDispatchCosts *costs,
+            size_t                      m,
+            size_t                      n,
+            size_t                      k,
+            size_t                      n_threads)
+{
+  size_t mr, nr;
+  size_t rows;
+  double total_bytes = sizeof (float) * ((double) m * k + (double) k * n + (double) m * n);
+
+  pipevec_gemm_get_microkernel_shape (&mr, &nr);
+  rows = MIN (((m + n_threads - 1) / n_threads + mr - 1) / mr * mr, m);
+
+  return (MAX (2.0 * rows * n * k / costs->blocked_flops_per_ns,
+               stream_ns (costs,
+                          sizeof (float) * ((double) rows * k + (double) k * n + (double) rows * n),
+                          total_bytes,
+                          n_threads)) +
+          costs->blocked_setup_ns +
+          sizeof (float) * ((double) rows * k + (double) k * n) / costs->cache_bytes_per_ns);
+}
+
+/* Like a loop, the rows of a blocked product are only split between
+ * threads when that wins by at least the cost of waking them again */
+static void
+plan_blocked (const PipevecDispatchCosts *costs,
+              size_t                      m,
+              size_t                      n,
+              size_t                      k,
+              PipevecDispatchPlan        *plan)
+{
+  PipevecGemmBlocking blocking;
+  size_t mr, nr;
+  size_t forced_threads = g_atomic_pointer_get (&override_threads);
+  size_t max_threads;
+  double serial_ns = blocked_ns (costs, m, n, k, 1);
+  size_t best_threads = 1;
+  double best_ns = serial_ns;
+
+  pipevec_autotune_current_gemm_blocking (&blocking);
+  pipevec_gemm_get_microkernel_shape (&mr, &nr);
+
+  /* Every thread gets at least one row of tiles */
+  max_threads = MIN (pipevec_parallel_get_n_threads (), MAX ((m + mr - 1) / mr, 1));
+
+  if (forced_threads > 0)
+    {
+      best_threads = MIN (forced_threads, max_threads);
+      best_ns = (blocked_ns (costs, m, n, k, best_threads) +
+                 blocked_dispatch_cost (costs, &blocking, n, k, best_threads));
+    }
+  else
+    {
+      for (size_t n_threads = 2; n_threads <= max_threads; ++n_threads)
+        {
+          double wake_ns = blocked_dispatch_cost (costs, &blocking, n, k, n_threads);
+          double ns = blocked_ns (costs, m, n, k, n_threads) + wake_ns;
+
+          if (ns + wake_ns < serial_ns && ns < best_ns)
+            {
+              best_threads = n_threads;
+              best_ns = ns;
+            }
+        }
+    }
+
+  *plan = (PipevecDispatchPlan) {
+    .variant = PIPEVEC_DISPATCH_VARIANT_BLOCKED,
+    .n_threads = best_threads,
+    .max_threads = pipevec_parallel_get_n_threads (),
+    .serial_ns = serial_ns,
+    .estimated_ns = best_ns,
+    .dispatch_ns = blocked_dispatch_cost (costs, &blocking, n, k, best_threads),
+    .flops = 2.0 * m * n * k,
+    .bytes = sizeof (float) * ((double) m * k + (double) k * n + (double) m * n),
+    .overridden = forced_threads > 0
+  };
+}
+
+static void
+plan_gemm (size_t               m,
+           size_t               n,
+           size_t               k,
+           gboolean             streamable,
+           PipevecDispatchPlan *plan)
+{
+  PipevecDispatchCosts costs;
+  PipevecDispatchVariant forced_variant;
+
+  ensure_override ();
+  pipevec_autotune_current_dispatch_costs (&costs);
+
+  forced_variant = g_atomic_int_get (&override_variant);
+
+  /* Only thin products can be streamed */
+  if (forced_variant == PIPEVEC_DISPATCH_VARIANT_STREAMING && !streamable)
+    forced_variant = PIPEVEC_DISPATCH_VARIANT_AUTO;
+
+  if (forced_variant == PIPEVEC_DISPATCH_VARIANT_STREAMING ||
+      (forced_variant == PIPEVEC_DISPATCH_VARIANT_AUTO && streamable))
+    {
+      plan_streaming (&costs, m, n, k, plan);
+    }
+  else if (forced_variant == PIPEVEC_DISPATCH_VARIANT_DIRECT)
+    {
+      plan_direct (&costs, m, n, k, plan);
+    }
+  else if (forced_variant == PIPEVEC_DISPATCH_VARIANT_BLOCKED)
+    {
+      plan_blocked (&costs, m, n, k, plan);
+    }
+  else
+    {
+      PipevecDispatchPlan blocked;
+
+      plan_direct (&costs, m, n, k, plan);
+      plan_blocked (&costs, m, n, k, &blocked);
+
+      if (blocked.estimated_ns < plan->estimated_ns)
+        *plan = blocked;
+    }
+
+  plan->overridden = plan->overridden || forced_variant != PIPEVEC_DISPATCH_VARIANT_AUTO;
+}
+
+/**
+ * pipevec_dispatch_gemm_variant:
+ * @m: Rows of A and C.
+ * @n: Columns of B and C.
+ * @k: Columns of A and rows of B.
+ * @streamable: Whether the operands can be streamed, which needs @m,
+ *              @n or @k to be 1 and the matrix operand to have a unit
+ *              stride dimension.
+ *
+ * Choose how to compute a product of the given shape.
+ *
+ * Returns: The variant to use, never %PIPEVEC_DISPATCH_VARIANT_AUTO.
+ */
+PipevecDispatchVariant
+pipevec_dispatch_gemm_variant (size_t   m,
+                               size_t   n,
+                               size_t   k,
+                               gboolean streamable)
+{
+  PipevecDispatchPlan plan;
+
+  plan_gemm (m, n, k, streamable, &plan);
+
+  return plan.variant;
+}
+
+/**
+ * pipevec_dispatch_blocked_gemm_threads:
+ * @m: Rows of A and C.
+ * @n: Columns of B and C.
+ * @k: Columns of A and rows of B.
+ *
+ * Choose how many threads to split the rows of a blocked product of
+ * the given shape between. The answer holds even where
+ * pipevec_dispatch_gemm_variant() would not choose the blocked
+ * product, since products with packed operands are always blocked.
+ *
+ * Returns: The number of threads, at least 1.
+ */
+size_t
+pipevec_dispatch_blocked_gemm_threads (size_t m,
+                                       size_t n,
+                                       size_t k)
+{
+  PipevecDispatchCosts costs;
+  PipevecDispatchPlan plan;
+
+  ensure_override ();
+  pipevec_autotune_current_dispatch_costs (&costs);
+
+  plan_blocked (&costs, m, n, k, &plan);
+
+  return plan.n_threads;
+}
+
+/**
+ * pipevec_dispatch_loop_threads:
+ * @n_items: Number of independent items in the loop.
+ * @flops_per_item: Floating point operations in each item.
+ * @bytes_per_item: Bytes each item reads and writes.
+ *
+ * Choose how many threads to split a loop between.
+ *
+ * Returns: The number of threads, between 1 and @n_items.
+ */
+size_t
+pipevec_dispatch_loop_threads (size_t n_items,
+                               double flops_per_item,
+                               double bytes_per_item)
+{
+  PipevecDispatchPlan plan;
+
+  pipevec_dispatch_plan_loop (n_items, flops_per_item, bytes_per_item, &plan);
+
+  return plan.n_threads;
+}
+
+/**
+ * pipevec_dispatch_parallel_for:
+ * @n_items: Number of tasks to run.
+ * @flops_per_item: Floating point operations in each task.
+ * @bytes_per_item: Bytes each task reads and writes.
+ * @func: (scope call): Function called once with each index in [0, @n_items).
+ * @user_data: Data passed to @func.
+ *
+ * Like pipevec_parallel_for(), but only use as many threads as the
+ * cost model says pay off, which for small loops is none but the
+ * calling one.
+ */
+void
+pipevec_dispatch_parallel_for (size_t              n_items,
+                               double              flops_per_item,
+                               double              bytes_per_item,
+                               PipevecParallelFunc func,
+                               gpointer            user_data)
+{
+  pipevec_parallel_for_n_threads (n_items,
+                                  pipevec_dispatch_loop_threads (n_items, flops_per_item, bytes_per_item),
+                                  func,
+                                  user_data);
+}
+
+/**
+ * pipevec_dispatch_set_override:
+ * @variant: The variant that matrix products should use, or
+ *           %PIPEVEC_DISPATCH_VARIANT_AUTO to let the cost model
+ *           choose.
+ * @n_threads: The number of threads that parallel loops should use,
+ *             or 0 to let the cost model choose.
+ *
+ * Force the choices that the cost model would otherwise make, for
+ * every thread in the process. This is meant for benchmarking and for
+ * working around a bad estimate. A forced @n_threads is still limited
+ * by the size of the thread pool and the number of items in a loop,
+ * and %PIPEVEC_DISPATCH_VARIANT_STREAMING only applies to products
+ * that can be streamed. The initial override is read from the
+ * `PIPEVEC_DISPATCH` environment variable, a comma separated list of
+ * a variant name (`streaming`, `direct` or `blocked`), `serial` or
+ * `threads=N`.
+ */
+void
+pipevec_dispatch_set_override (PipevecDispatchVariant variant,
+                               size_t                 n_threads)
+{
+  ensure_override ();
+
+  g_atomic_int_set (&override_variant, variant);
+  g_atomic_pointer_set (&override_threads, n_threads);
+}
+
+/**
+ * pipevec_dispatch_get_override:
+ * @variant: (out): The forced variant, or %PIPEVEC_DISPATCH_VARIANT_AUTO.
+ * @n_threads: (out): The forced number of threads, or 0.
+ *
+ * Get the choices forced with pipevec_dispatch_set_override().
+ */
+void
+pipevec_dispatch_get_override (PipevecDispatchVariant *variant,
+                               size_t                 *n_threads)
+{
+  ensure_override ();
+
+  *variant = g_atomic_int_get (&override_variant);
+  *n_threads = g_atomic_pointer_get (&override_threads);
+}
+
+/**
+ * pipevec_dispatch_plan_gemm:
+ * @m: Rows of A and C.
+ * @n: Columns of B and C.
+ * @k: Columns of A and rows of B.
+ * @plan: (out caller-allocates): How the product would run.
+ *
+ * Work out how a product of an @m x @k matrix with a @k x @n matrix
+ * would be run, assuming contiguous operands. Streamed products are
+ * split between threads by output rows or columns, and blocked ones
+ * by rows of C, each with as many threads as the cost model says pay
+ * off. Direct products run on the calling thread, so their plan
+ * always has one thread.
+ */
+void
+pipevec_dispatch_plan_gemm (size_t               m,
+                            size_t               n,
+                            size_t               k,
+                            PipevecDispatchPlan *plan)
+{
+  plan_gemm (m, n, k, m == 1 || n == 1 || k == 1, plan);
+}
+
+/**
+ * pipevec_dispatch_plan_loop:
+ * @n_items: Number of independent items in the loop, such as rows of
+ *           a tensor or matrices in a batch.
+ * @flops_per_item: Floating point operations in each item.
+ * @bytes_per_item: Bytes each item reads and writes.
+ * @plan: (out caller-allocates): How the loop would run.
+ *
+ * Work out how many threads a loop with the given work would be
+ * split between.
+ */
+void
+pipevec_dispatch_plan_loop (size_t               n_items,
+                            double               flops_per_item,
+                            double               bytes_per_item,
+                            PipevecDispatchPlan *plan)
+{
+  PipevecDispatchCosts costs;
+
+  ensure_override ();
+  pipevec_autotune_current_dispatch_costs (&costs);
+
+  plan_loop (&costs, n_items, flops_per_item, bytes_per_item, plan);
+}
+
+static const char *
+variant_name (PipevecDispatchVariant variant)
+{
+  switch (variant)
+    {
+    case PIPEVEC_DISPATCH_VARIANT_STREAMING:
+      return "streaming";
+    case PIPEVEC_DISPATCH_VARIANT_DIRECT:
+      return "direct";
+    case PIPEVEC_DISPATCH_VARIANT_BLOCKED:
+      return "blocked";
+    case PIPEVEC_DISPATCH_VARIANT_AUTO:
+    default:
+      return "auto";
+    }
+}
+
+/**
+ * pipevec_dispatch_explain:
+ * @plan: A #PipevecDispatchPlan.
+ *
+ * Describe @plan and the estimates it was chosen from.
+ *
+ * Returns: (transfer full): The description.
+ */
+char *
+pipevec_dispatch_explain (const PipevecDispatchPlan *plan)
+{
+  GString *explanation = g_string_new (NULL);
+
+  g_string_append_printf (explanation,
+                          "%s on %zu of %zu threads%s: estimated %.3f us, %.3f us on one thread",
+                          variant_name (plan->variant),
+                          plan->n_threads,
+                          plan->max_threads,
+                          plan->overridden ? " (overridden)" : "",
+                          plan->estimated_ns / 1e3,
+                          plan->serial_ns / 1e3);
+
+  if (plan->n_threads > 1)
+    g_string_append_printf (explanation, ", %.3f us of it waking workers", plan->dispatch_ns / 1e3);
+
+  g_string_append_printf (explanation,
+                          "; %.0f flops over %.0f bytes (%.2f flops/byte)",
+                          plan->flops,
+                          plan->bytes,
+                          plan->bytes > 0.0 ? plan->flops / plan->bytes : 0.0);
+
+  return g_string_free (explanation, FALSE);
+}
@@ -0,0 +1,101 @@
+/*
+ * /pipevec/pipevec-dispatch.h
+ *
+ * Choosing how to run each operation from a cost model.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stddef.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PipevecDispatchVariant:
+ * @PIPEVEC_DISPATCH_VARIANT_AUTO: Let the cost model choose.
+ * @PIPEVEC_DISPATCH_VARIANT_STREAMING: Stream the matrix operand of a
+ *                                      product with a single row,
+ *                                      column or inner dimension
+ *                                      through vector loads.
+ * @PIPEVEC_DISPATCH_VARIANT_DIRECT: Loop over the operands in place.
+ * @PIPEVEC_DISPATCH_VARIANT_BLOCKED: Pack the operands into cache
+ *                                    sized blocks for the
+ *                                    microkernel first.
+ *
+ * The implementations that a matrix product can run with. Loops that
+ * are not matrix products only have the one implementation, and the
+ * choice there is only how many threads to use.
+ */
+typedef enum {
+  PIPEVEC_DISPATCH_VARIANT_AUTO,
+  PIPEVEC_DISPATCH_VARIANT_STREAMING,
+  PIPEVEC_DISPATCH_VARIANT_DIRECT,
+  PIPEVEC_DISPATCH_VARIANT_BLOCKED
+} PipevecDispatchVariant;
+
+/**
+ * PipevecDispatchPlan:
+ * @variant: The implementation chosen.
+ * @n_threads: The number of threads chosen, including the calling
+ *             thread.
+ * @max_threads: The number of threads that were available.
+ * @serial_ns: Estimated time of @variant on one thread.
+ * @estimated_ns: Estimated time of @variant on @n_threads threads,
+ *                including the cost of waking them.
+ * @dispatch_ns: Estimated cost of waking @n_threads - 1 workers, as
+ *               many times as the operation does.
+ * @flops: Floating point operations the estimate assumes.
+ * @bytes: Bytes read and written the estimate assumes.
+ * @overridden: Whether @variant or @n_threads was forced with
+ *              pipevec_dispatch_set_override().
+ *
+ * How an operation of a given size would be run, and why.
+ */
+typedef struct {
+  PipevecDispatchVariant variant;
+  size_t                 n_threads;
+  size_t                 max_threads;
+  double                 serial_ns;
+  double                 estimated_ns;
+  double                 dispatch_ns;
+  double                 flops;
+  double                 bytes;
+  gboolean               overridden;
+} PipevecDispatchPlan;
+
+void pipevec_dispatch_set_override (PipevecDispatchVariant variant,
+                                    size_t                 n_threads);
+
+void pipevec_dispatch_get_override (PipevecDispatchVariant *variant,
+                                    size_t                 *n_threads);
+
+void pipevec_dispatch_plan_gemm (size_t               m,
+                                 size_t               n,
+                                 size_t               k,
+                                 PipevecDispatchPlan *plan);
+
+void pipevec_dispatch_plan_loop (size_t               n_items,
+                                 double               flops_per_item,
+                                 double               bytes_per_item,
+                                 PipevecDispatchPlan *plan);
+
+char * pipevec_dispatch_explain (const PipevecDispatchPlan *plan);
+
+G_END_DECLS
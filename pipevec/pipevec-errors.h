@@ -31,13 +31,25 @@ G_BEGIN_DECLS
  * @PIPEVEC_ERROR_INTERNAL: Internal error occurred in pipevec or another library.
  * @PIPEVEC_ERROR_BAD_SHAPE: The data does not conform to the requested shape.
  * @PIPEVEC_ERROR_DIMENSION_MISMATCH: Dimensions mismatch such that the operation cannot be performed.
+ * @PIPEVEC_ERROR_NOT_POSITIVE_DEFINITE: The matrix is not symmetric positive definite.
+ * @PIPEVEC_ERROR_SINGULAR_MATRIX: The matrix is singular, so the system has no unique solution.
+ * @PIPEVEC_ERROR_NOT_CONVERGED: An iterative algorithm did not converge.
+ * @PIPEVEC_ERROR_INVALID_ARGUMENT: An argument was malformed.
+ * @PIPEVEC_ERROR_INVALID_DATA: Serialized data was malformed or written by an incompatible version.
+ * @PIPEVEC_ERROR_OUT_OF_MEMORY: Allocating the result would exceed the memory limit.
  *
  * Error enumeration for Scorch related errors.
  */
 typedef enum {
   PIPEVEC_ERROR_INTERNAL,
   PIPEVEC_ERROR_BAD_SHAPE,
-  PIPEVEC_ERROR_DIMENSION_MISMATCH
+  PIPEVEC_ERROR_DIMENSION_MISMATCH,
+  PIPEVEC_ERROR_NOT_POSITIVE_DEFINITE,
+  PIPEVEC_ERROR_SINGULAR_MATRIX,
+  PIPEVEC_ERROR_NOT_CONVERGED,
+  PIPEVEC_ERROR_INVALID_ARGUMENT,
+  PIPEVEC_ERROR_INVALID_DATA,
+  PIPEVEC_ERROR_OUT_OF_MEMORY
 } PipevecError;
 
 #define PIPEVEC_ERROR pipevec_error_quark ()
@@ -0,0 +1,189 @@
+/*
+ * /pipevec/pipevec-gemm-private.h
+ *
+ * Blocked matrix multiplication engine used by the tensor operations.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stddef.h>
+
+#include <pipevec/pipevec-tensor.h>
+
+G_BEGIN_DECLS
+
+/* Elementwise operations applied to each element of C once the
+ * product is complete:
+ *
+ *   C[i, j] = activation (C[i, j] + bias[j]) + residual_scale * residual[i, j]
+ *
+ * Either pointer may be NULL. The residual has the same strides as C. */
+typedef struct {
+  const float       *bias;
+  PipevecActivation  activation;
+  const float       *residual;
+  float              residual_scale;
+} PipevecGemmEpilogue;
+
+/* Cache blocking of the packed product: an mc x kc block of A is
+ * packed to stay in L2 and a kc x nc block of B to stay in L3. mc is
+ * a multiple of the microkernel's rows and nc of its columns. */
+typedef struct {
+  size_t mc;
+  size_t kc;
+  size_t nc;
+} PipevecGemmBlocking;
+
+/* How B is split into panels when it is packed: column panels of nr
+ * columns, in blocks of kc rows by nc columns. The values depend on
+ * the microkernel, and so on the instruction set the engine was
+ * built for. */
+typedef struct {
+  size_t nr;
+  size_t kc;
+  size_t nc;
+} PipevecGemmPackedLayout;
+
+void pipevec_gemm (size_t       m,
+                   size_t       n,
+                   size_t       k,
+                   float        alpha,
+                   const float *a,
+                   ptrdiff_t    a_row_stride,
+                   ptrdiff_t    a_col_stride,
+                   const float *b,
+                   ptrdiff_t    b_row_stride,
+                   ptrdiff_t    b_col_stride,
+                   float        beta,
+                   float       *c,
+                   size_t       c_row_stride);
+
+void pipevec_gemm_batched (size_t       n_batches,
+                           size_t       m,
+                           size_t       n,
+                           size_t       k,
+                           float        alpha,
+                           const float *a,
+                           ptrdiff_t    a_batch_stride,
+                           ptrdiff_t    a_row_stride,
+                           ptrdiff_t    a_col_stride,
+                           const float *b,
+                           ptrdiff_t    b_batch_stride,
+                           ptrdiff_t    b_row_stride,
+                           ptrdiff_t    b_col_stride,
+                           float        beta,
+                           float       *c,
+                           ptrdiff_t    c_batch_stride,
+                           size_t       c_row_stride);
+
+gboolean pipevec_gemm_batched_fused (size_t                     n_batches,
+                                     size_t                     m,
+                                     size_t                     n,
+                                     size_t                     k,
+                                     float                      alpha,
+                                     const float               *a,
+                                     ptrdiff_t                  a_batch_stride,
+                                     ptrdiff_t                  a_row_stride,
+                                     ptrdiff_t                  a_col_stride,
+                                     const float               *b,
+                                     ptrdiff_t                  b_batch_stride,
+                                     ptrdiff_t                  b_row_stride,
+                                     ptrdiff_t                  b_col_stride,
+                                     float                      beta,
+                                     float                     *c,
+                                     ptrdiff_t                  c_batch_stride,
+                                     size_t                     c_row_stride,
+                                     const PipevecGemmEpilogue *epilogue,
+                                     GError                   **error);
+
+void pipevec_gemm_get_packed_layout (PipevecGemmPackedLayout *layout);
+
+size_t pipevec_gemm_packed_b_size (const PipevecGemmPackedLayout *layout,
+                                   size_t                         k,
+                                   size_t                         n);
+
+void pipevec_gemm_pack_b (const PipevecGemmPackedLayout *layout,
+                          size_t                         k,
+                          size_t                         n,
+                          const float                   *b,
+                          ptrdiff_t                      b_row_stride,
+                          ptrdiff_t                      b_col_stride,
+                          float                         *packed);
+
+void pipevec_gemm_unpack_b (const PipevecGemmPackedLayout *layout,
+                            size_t                         k,
+                            size_t                         n,
+                            const float                   *packed,
+                            float                         *b,
+                            size_t                         b_row_stride);
+
+gboolean pipevec_gemm_batched_fused_packed (size_t                         n_batches,
+                                            size_t                         m,
+                                            size_t                         n,
+                                            size_t                         k,
+                                            float                          alpha,
+                                            const float                   *a,
+                                            ptrdiff_t                      a_batch_stride,
+                                            ptrdiff_t                      a_row_stride,
+                                            ptrdiff_t                      a_col_stride,
+                                            const PipevecGemmPackedLayout *layout,
+                                            const float                   *packed_b,
+                                            float                          beta,
+                                            float                         *c,
+                                            ptrdiff_t                      c_batch_stride,
+                                            size_t                         c_row_stride,
+                                            const PipevecGemmEpilogue     *epilogue,
+                                            GError                       **error);
+
+gboolean pipevec_gemm_small_batched (size_t                     n_batches,
+                                     size_t                     m,
+                                     size_t                     n,
+                                     size_t                     k,
+                                     float                      alpha,
+                                     const float               *a,
+                                     ptrdiff_t                  a_batch_stride,
+                                     size_t                     a_row_stride,
+                                     const float               *b,
+                                     ptrdiff_t                  b_batch_stride,
+                                     size_t                     b_row_stride,
+                                     float                     *c,
+                                     ptrdiff_t                  c_batch_stride,
+                                     size_t                     c_row_stride,
+                                     const PipevecGemmEpilogue *epilogue);
+
+void pipevec_gemm_get_microkernel_shape (size_t *mr,
+                                         size_t *nr);
+
+gboolean pipevec_gemm_with_blocking (const PipevecGemmBlocking *blocking,
+                                     size_t                     m,
+                                     size_t                     n,
+                                     size_t                     k,
+                                     const float               *a,
+                                     const float               *b,
+                                     float                     *c);
+
+void pipevec_gemm_unblocked (size_t       m,
+                             size_t       n,
+                             size_t       k,
+                             const float *a,
+                             const float *b,
+                             float       *c);
+
+G_END_DECLS
@@ -0,0 +1,1707 @@
+/*
+ * /pipevec/pipevec-gemm.c
+ *
+ * Blocked matrix multiplication engine used by the tensor operations.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-allocator-private.h>
+#include <pipevec/pipevec-autotune-private.h>
+#include <pipevec/pipevec-dispatch-private.h>
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-parallel-private.h>
+#include <pipevec/pipevec-tensor-private.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The engine follows the usual three level blocking scheme. The
+ * operands are copied ("packed") into contiguous panels sized to fit
+ * the caches: a KC x NC slice of B lives in L3, an MC x KC slice of A
+ * lives in L2 and the microkernel streams MR rows of A against NR
+ * columns of B from L1, keeping the whole MR x NR tile of C in
+ * registers.
+ *
+ * The microkernel shape depends on how many vector registers are
+ * available. With AVX there are sixteen 8-wide registers, so a
+ * 6 x 16 tile (twelve accumulators) fits. Without it each float8_t
+ * takes two SSE registers, so we use a 4 x 8 tile instead. */
+#if defined(__AVX__)
+#define PIPEVEC_GEMM_MR 6
+#define PIPEVEC_GEMM_NR 16
+#else
+#define PIPEVEC_GEMM_MR 4
+#define PIPEVEC_GEMM_NR 8
+#endif
+
+#define PIPEVEC_GEMM_NR_VECTORS (PIPEVEC_GEMM_NR / 8)
+
+/* The cache blocking sizes MC, KC and NC depend on the cache sizes
+ * of the machine, so they are chosen at runtime, see
+ * pipevec-autotune.c */
+
+/* Whether packing pays off for a product, and how many threads the
+ * streaming kernels use, is decided by the cost model in
+ * pipevec-dispatch.c.
+ *
+ * Products with a single row, column or inner dimension read each
+ * element of the matrix operand exactly once, so they are bound by
+ * memory bandwidth rather than arithmetic. They skip packing and
+ * stream the matrix with vector loads instead. */
+
+/* Columns of the output accumulated at once when streaming the rows
+ * of a matrix into a vector; enough to stay in L1 */
+#define PIPEVEC_GEMV_COLUMN_BLOCK 1024
+
+/* Largest dimension handled by the fixed-size kernels for batches
+ * of small matrices. Their rows fit in at most two float8_t. */
+#define PIPEVEC_GEMM_SMALL_MAX 16
+
+static inline float
+apply_activation (PipevecActivation activation,
+                  float             x)
+{
+  switch (activation)
+    {
+    case PIPEVEC_ACTIVATION_RELU:
+      return x > 0.0f ? x : 0.0f;
+    case PIPEVEC_ACTIVATION_SIGMOID:
+      return 1.0f / (1.0f + expf (-x));
+    case PIPEVEC_ACTIVATION_TANH:
+      return tanhf (x);
+    case PIPEVEC_ACTIVATION_GELU:
+      /* The tanh approximation */
+      return 0.5f * x * (1.0f + tanhf (0.7978845608f * (x + 0.044715f * x * x * x)));
+    case PIPEVEC_ACTIVATION_NONE:
+    default:
+      return x;
+    }
+}
+
+/* Finish a rows x columns block of C starting at row i, column j of
+ * the current product, while it is still in cache. The residual has
+ * the same strides as C. */
+static void
+apply_epilogue (const PipevecGemmEpilogue *epilogue,
+                float                     *c,
+                size_t                     c_row_stride,
+                size_t                     i,
+                size_t                     j,
+                size_t                     rows,
+                size_t                     columns)
+{
+  const float *bias = epilogue->bias != NULL ? epilogue->bias + j : NULL;
+
+  for (size_t r = 0; r < rows; ++r)
+    {
+      float *c_row = c + r * c_row_stride;
+
+      if (bias != NULL)
+        for (size_t q = 0; q < columns; ++q)
+          c_row[q] += bias[q];
+
+      /* Dispatch once per row so that each loop vectorizes */
+      switch (epilogue->activation)
+        {
+        case PIPEVEC_ACTIVATION_RELU:
+          for (size_t q = 0; q < columns; ++q)
+            c_row[q] = c_row[q] > 0.0f ? c_row[q] : 0.0f;
+          break;
+        case PIPEVEC_ACTIVATION_NONE:
+          break;
+        default:
+          for (size_t q = 0; q < columns; ++q)
+            c_row[q] = apply_activation (epilogue->activation, c_row[q]);
+          break;
+        }
+
+      if (epilogue->residual != NULL)
+        {
+          const float *residual_row = epilogue->residual + (i + r) * c_row_stride + j;
+
+          for (size_t q = 0; q < columns; ++q)
+            c_row[q] += epilogue->residual_scale * residual_row[q];
+        }
+    }
+}
+
+static void
+gemm_direct (size_t                     m,
+             size_t                     n,
+             size_t                     k,
+             float                      alpha,
+             const float               *a,
+             ptrdiff_t                  a_row_stride,
+             ptrdiff_t                  a_col_stride,
+             const float               *b,
+             ptrdiff_t                  b_row_stride,
+             ptrdiff_t                  b_col_stride,
+             float                      beta,
+             float                     *c,
+             size_t                     c_row_stride,
+             const PipevecGemmEpilogue *epilogue)
+{
+  for (size_t i = 0; i < m; ++i)
+    {
+      float *c_row = c + i * c_row_stride;
+
+      if (beta == 0.0f)
+        memset (c_row, 0, sizeof (float) * n);
+      else if (beta != 1.0f)
+        for (size_t j = 0; j < n; ++j)
+          c_row[j] *= beta;
+
+      for (size_t p = 0; p < k; ++p)
+        {
+          float a_ip = alpha * a[i * a_row_stride + p * a_col_stride];
+          const float *b_row = b + p * b_row_stride;
+
+          /* Written so that the common unit column stride case
+           * vectorizes over j */
+          if (b_col_stride == 1)
+            for (size_t j = 0; j < n; ++j)
+              c_row[j] += a_ip * b_row[j];
+          else
+            for (size_t j = 0; j < n; ++j)
+              c_row[j] += a_ip * b_row[j * b_col_stride];
+        }
+
+      if (epilogue != NULL)
+        apply_epilogue (epilogue, c_row, c_row_stride, i, 0, 1, n);
+    }
+}
+
+/* Pack an mc x kc block of A into row panels of MR rows each. Within a
+ * panel, element (i, p) lives at p * MR + i, so that the microkernel
+ * reads MR consecutive values per step of p. Rows past mc are zero. */
+static void
+pack_a (size_t       mc,
+        size_t       kc,
+        const float *a,
+        ptrdiff_t    a_row_stride,
+        ptrdiff_t    a_col_stride,
+        float       *packed)
+{
+  for (size_t ir = 0; ir < mc; ir += PIPEVEC_GEMM_MR)
+    {
+      size_t mr = MIN (PIPEVEC_GEMM_MR, mc - ir);
+
+      for (size_t p = 0; p < kc; ++p)
+        {
+          size_t i = 0;
+
+          for (; i < mr; ++i)
+            packed[p * PIPEVEC_GEMM_MR + i] = a[(ir + i) * a_row_stride + p * a_col_stride];
+
+          for (; i < PIPEVEC_GEMM_MR; ++i)
+            packed[p * PIPEVEC_GEMM_MR + i] = 0.0f;
+        }
+
+      packed += kc * PIPEVEC_GEMM_MR;
+    }
+}
+
+/* Pack a kc x nc block of B into column panels of NR columns each.
+ * Within a panel, element (p, j) lives at p * NR + j. Columns past
+ * nc are zero. */
+static void
+pack_b (size_t       kc,
+        size_t       nc,
+        const float *b,
+        ptrdiff_t    b_row_stride,
+        ptrdiff_t    b_col_stride,
+        float       *packed)
+{
+  for (size_t jr = 0; jr < nc; jr += PIPEVEC_GEMM_NR)
+    {
+      size_t nr = MIN (PIPEVEC_GEMM_NR, nc - jr);
+
+      for (size_t p = 0; p < kc; ++p)
+        {
+          const float *b_row = b + p * b_row_stride + jr * b_col_stride;
+          size_t j = 0;
+
+          if (b_col_stride == 1)
+            {
+              memcpy (packed + p * PIPEVEC_GEMM_NR, b_row, sizeof (float) * nr);
+              j = nr;
+            }
+
+          for (; j < nr; ++j)
+            packed[p * PIPEVEC_GEMM_NR + j] = b_row[j * b_col_stride];
+
+          for (; j < PIPEVEC_GEMM_NR; ++j)
+            packed[p * PIPEVEC_GEMM_NR + j] = 0.0f;
+        }
+
+      packed += kc * PIPEVEC_GEMM_NR;
+    }
+}
+
+/* Compute an MR x NR tile of C = alpha * A * B + beta * C from packed
+ * panels. Only the top-left mr x nr corner of the tile is written. If
+ * epilogue is set, it is applied to the tile, which starts at row i
+ * and column j of C, right after it is written. */
+static void
+microkernel (size_t                     kc,
+             const float               *packed_a,
+             const float               *packed_b,
+             float                      alpha,
+             float                      beta,
+             float                     *c,
+             size_t                     c_row_stride,
+             size_t                     mr,
+             size_t                     nr,
+             const PipevecGemmEpilogue *epilogue,
+             size_t                     i,
+             size_t                     j)
+{
+  float8_t acc[PIPEVEC_GEMM_MR][PIPEVEC_GEMM_NR_VECTORS];
+
+  memset (acc, 0, sizeof (acc));
+
+  for (size_t p = 0; p < kc; ++p)
+    {
+      float8_t b_vectors[PIPEVEC_GEMM_NR_VECTORS];
+
+      for (size_t v = 0; v < PIPEVEC_GEMM_NR_VECTORS; ++v)
+        b_vectors[v] = load_float8 (packed_b + p * PIPEVEC_GEMM_NR + v * 8);
+
+      for (size_t i = 0; i < PIPEVEC_GEMM_MR; ++i)
+        {
+          float a_ip = packed_a[p * PIPEVEC_GEMM_MR + i];
+
+          for (size_t v = 0; v < PIPEVEC_GEMM_NR_VECTORS; ++v)
+            acc[i][v] += a_ip * b_vectors[v];
+        }
+    }
+
+  if (mr == PIPEVEC_GEMM_MR && nr == PIPEVEC_GEMM_NR)
+    {
+      for (size_t r = 0; r < PIPEVEC_GEMM_MR; ++r)
+        {
+          float *c_row = c + r * c_row_stride;
+
+          for (size_t v = 0; v < PIPEVEC_GEMM_NR_VECTORS; ++v)
+            {
+              float8_t result = alpha * acc[r][v];
+
+              if (beta != 0.0f)
+                result += beta * load_float8 (c_row + v * 8);
+
+              store_float8 (c_row + v * 8, result);
+            }
+        }
+    }
+  else
+    {
+      /* Edge tile: spill the accumulators and write back only the
+       * part of the tile that is inside C */
+      float tile[PIPEVEC_GEMM_MR][PIPEVEC_GEMM_NR];
+
+      memcpy (tile, acc, sizeof (tile));
+
+      for (size_t r = 0; r < mr; ++r)
+        {
+          float *c_row = c + r * c_row_stride;
+
+          for (size_t q = 0; q < nr; ++q)
+            c_row[q] = alpha * tile[r][q] + (beta != 0.0f ? beta * c_row[q] : 0.0f);
+        }
+    }
+
+  if (epilogue != NULL)
+    apply_epilogue (epilogue, c, c_row_stride, i, j, mr, nr);
+}
+
+static float
+horizontal_sum (float8_t v)
+{
+  float lanes[8];
+
+  store_float8 (lanes, v);
+
+  return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+         ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+/* Dot product of two contiguous vectors. Four independent
+ * accumulators hide the latency of the vector adds. */
+static float
+dot_contiguous (const float *x,
+                const float *y,
+                size_t       k)
+{
+  float8_t acc0 = { 0 }, acc1 = { 0 }, acc2 = { 0 }, acc3 = { 0 };
+  size_t p = 0;
+
+  for (; p + 32 <= k; p += 32)
+    {
+      acc0 += load_float8 (x + p) * load_float8 (y + p);
+      acc1 += load_float8 (x + p + 8) * load_float8 (y + p + 8);
+      acc2 += load_float8 (x + p + 16) * load_float8 (y + p + 16);
+      acc3 += load_float8 (x + p + 24) * load_float8 (y + p + 24);
+    }
+
+  for (; p + 8 <= k; p += 8)
+    acc0 += load_float8 (x + p) * load_float8 (y + p);
+
+  float sum = horizontal_sum ((acc0 + acc1) + (acc2 + acc3));
+
+  for (; p < k; ++p)
+    sum += x[p] * y[p];
+
+  return sum;
+}
+
+static inline void
+store_scaled (float     *y,
+              float      value,
+              float      alpha,
+              float      beta)
+{
+  *y = alpha * value + (beta != 0.0f ? beta * *y : 0.0f);
+}
+
+/* Copy a strided vector into scratch if needed, so that the kernels
+ * only ever see unit stride vectors */
+static const float *
+gather_vector (const float *x,
+               ptrdiff_t    stride,
+               size_t       len,
+               float      **scratch)
+{
+  if (stride == 1)
+    return x;
+
+  *scratch = g_new (float, len);
+
+  for (size_t i = 0; i < len; ++i)
+    (*scratch)[i] = x[i * stride];
+
+  return *scratch;
+}
+
+/* y = alpha * M * x + beta * y, or y = alpha * x * M + beta * y,
+ * where M is rows x columns. Each task covers rows_per_task entries
+ * of y. */
+typedef struct {
+  size_t       rows;
+  size_t       columns;
+  size_t       rows_per_task;
+  float        alpha;
+  const float *matrix;
+  ptrdiff_t    matrix_stride;
+  const float *x;
+  float        beta;
+  float       *y;
+  ptrdiff_t    y_stride;
+} GemvJob;
+
+/* Split n_items into one contiguous run per thread, with as many
+ * threads as the cost model chooses */
+static size_t
+split_n_tasks (size_t  n_items,
+               double  flops_per_item,
+               double  bytes_per_item,
+               size_t *items_per_task)
+{
+  size_t n_threads = pipevec_dispatch_loop_threads (n_items, flops_per_item, bytes_per_item);
+
+  *items_per_task = MAX ((n_items + n_threads - 1) / n_threads, 1);
+
+  return (n_items + *items_per_task - 1) / *items_per_task;
+}
+
+/* Each row of a streamed product is work_per_row multiply-adds over
+ * as many floats of the matrix operand */
+static size_t
+gemv_n_tasks (size_t  rows,
+              size_t  work_per_row,
+              size_t *rows_per_task)
+{
+  return split_n_tasks (rows, 2.0 * work_per_row, sizeof (float) * work_per_row, rows_per_task);
+}
+
+/* y[i] = alpha * (M[i, :] . x) + beta * y[i], for M with unit stride rows */
+static void
+gemv_dot_task (size_t   task,
+               gpointer user_data)
+{
+  GemvJob *job = user_data;
+  size_t first = task * job->rows_per_task;
+  size_t last = MIN (first + job->rows_per_task, job->rows);
+
+  for (size_t i = first; i < last; ++i)
+    store_scaled (job->y + i * job->y_stride,
+                  dot_contiguous (job->matrix + i * job->matrix_stride, job->x, job->columns),
+                  job->alpha,
+                  job->beta);
+}
+
+static void
+gemv_dot (size_t       rows,
+          size_t       k,
+          float        alpha,
+          const float *matrix,
+          ptrdiff_t    matrix_stride,
+          const float *x,
+          ptrdiff_t    x_stride,
+          float        beta,
+          float       *y,
+          ptrdiff_t    y_stride)
+{
+  g_autofree float *x_scratch = NULL;
+  GemvJob job = {
+    .rows = rows,
+    .columns = k,
+    .alpha = alpha,
+    .matrix = matrix,
+    .matrix_stride = matrix_stride,
+    .x = gather_vector (x, x_stride, k, &x_scratch),
+    .beta = beta,
+    .y = y,
+    .y_stride = y_stride
+  };
+
+  pipevec_parallel_for (gemv_n_tasks (rows, k, &job.rows_per_task), gemv_dot_task, &job);
+}
+
+/* y[j] = alpha * sum_p x[p] * M[p, j] + beta * y[j], for M with unit
+ * stride rows. Each task owns a block of columns and streams its part
+ * of every row of M through accumulators that stay in L1. */
+static void
+gemv_axpy_task (size_t   task,
+                gpointer user_data)
+{
+  GemvJob *job = user_data;
+  size_t first = task * job->rows_per_task;
+  size_t last = MIN (first + job->rows_per_task, job->columns);
+
+  for (size_t j0 = first; j0 < last; j0 += PIPEVEC_GEMV_COLUMN_BLOCK)
+    {
+      float acc[PIPEVEC_GEMV_COLUMN_BLOCK] __attribute__((aligned (32)));
+      size_t width = MIN (PIPEVEC_GEMV_COLUMN_BLOCK, last - j0);
+      size_t vector_width = width - width % 8;
+
+      memset (acc, 0, sizeof (float) * width);
+
+      for (size_t p = 0; p < job->rows; ++p)
+        {
+          const float *row = job->matrix + p * job->matrix_stride + j0;
+          float8_t x_p = { 0 };
+          size_t j = 0;
+
+          x_p += job->x[p];
+
+          for (; j < vector_width; j += 8)
+            store_float8 (acc + j, load_float8 (acc + j) + x_p * load_float8 (row + j));
+
+          for (; j < width; ++j)
+            acc[j] += job->x[p] * row[j];
+        }
+
+      for (size_t j = 0; j < width; ++j)
+        store_scaled (job->y + (j0 + j) * job->y_stride, acc[j], job->alpha, job->beta);
+    }
+}
+
+static void
+gemv_axpy (size_t       k,
+           size_t       columns,
+           float        alpha,
+           const float *x,
+           ptrdiff_t    x_stride,
+           const float *matrix,
+           ptrdiff_t    matrix_stride,
+           float        beta,
+           float       *y,
+           ptrdiff_t    y_stride)
+{
+  g_autofree float *x_scratch = NULL;
+  GemvJob job = {
+    .rows = k,
+    .columns = columns,
+    .alpha = alpha,
+    .matrix = matrix,
+    .matrix_stride = matrix_stride,
+    .x = gather_vector (x, x_stride, k, &x_scratch),
+    .beta = beta,
+    .y = y,
+    .y_stride = y_stride
+  };
+
+  pipevec_parallel_for (gemv_n_tasks (columns, k, &job.rows_per_task), gemv_axpy_task, &job);
+}
+
+typedef struct {
+  size_t                     m;
+  size_t                     n;
+  size_t                     rows_per_task;
+  float                      alpha;
+  const float               *a;
+  ptrdiff_t                  a_stride;
+  const float               *b;
+  float                      beta;
+  float                     *c;
+  size_t                     c_row_stride;
+  const PipevecGemmEpilogue *epilogue;
+} OuterProductJob;
+
+/* C[i, :] = alpha * a[i] * b + beta * C[i, :] */
+static void
+outer_product_task (size_t   task,
+                    gpointer user_data)
+{
+  OuterProductJob *job = user_data;
+  size_t first = task * job->rows_per_task;
+  size_t last = MIN (first + job->rows_per_task, job->m);
+  size_t vector_width = job->n - job->n % 8;
+  float8_t beta_vector = { 0 };
+
+  beta_vector += job->beta;
+
+  for (size_t i = first; i < last; ++i)
+    {
+      float *c_row = job->c + i * job->c_row_stride;
+      float scale = job->alpha * job->a[i * job->a_stride];
+      float8_t scale_vector = { 0 };
+      size_t j = 0;
+
+      scale_vector += scale;
+
+      for (; j < vector_width; j += 8)
+        {
+          float8_t result = scale_vector * load_float8 (job->b + j);
+
+          if (job->beta != 0.0f)
+            result += beta_vector * load_float8 (c_row + j);
+
+          store_float8 (c_row + j, result);
+        }
+
+      for (; j < job->n; ++j)
+        store_scaled (c_row + j, job->b[j], scale, job->beta);
+
+      if (job->epilogue != NULL)
+        apply_epilogue (job->epilogue, c_row, job->c_row_stride, i, 0, 1, job->n);
+    }
+}
+
+static void
+outer_product (size_t                     m,
+               size_t                     n,
+               float                      alpha,
+               const float               *a,
+               ptrdiff_t                  a_stride,
+               const float               *b,
+               ptrdiff_t                  b_stride,
+               float                      beta,
+               float                     *c,
+               size_t                     c_row_stride,
+               const PipevecGemmEpilogue *epilogue)
+{
+  g_autofree float *b_scratch = NULL;
+  OuterProductJob job = {
+    .m = m,
+    .n = n,
+    .alpha = alpha,
+    .a = a,
+    .a_stride = a_stride,
+    .b = gather_vector (b, b_stride, n, &b_scratch),
+    .beta = beta,
+    .c = c,
+    .c_row_stride = c_row_stride,
+    .epilogue = epilogue
+  };
+
+  pipevec_parallel_for (gemv_n_tasks (m, n, &job.rows_per_task), outer_product_task, &job);
+}
+
+/* Dispatch products where m, n or k is 1 to the streaming kernels.
+ * Returns FALSE if the matrix operand has no unit stride dimension to
+ * stream along, in which case the general path handles it. */
+static gboolean
+gemm_thin (size_t                     m,
+           size_t                     n,
+           size_t                     k,
+           float                      alpha,
+           const float               *a,
+           ptrdiff_t                  a_row_stride,
+           ptrdiff_t                  a_col_stride,
+           const float               *b,
+           ptrdiff_t                  b_row_stride,
+           ptrdiff_t                  b_col_stride,
+           float                      beta,
+           float                     *c,
+           size_t                     c_row_stride,
+           const PipevecGemmEpilogue *epilogue)
+{
+  if (k == 1)
+    {
+      outer_product (m, n, alpha, a, a_row_stride, b, b_col_stride, beta, c, c_row_stride, epilogue);
+      return TRUE;
+    }
+
+  /* Matrix times vector: C is a single column */
+  if (n == 1 && a_col_stride == 1)
+    gemv_dot (m, k, alpha, a, a_row_stride, b, b_row_stride, beta, c, c_row_stride);
+  else if (n == 1 && a_row_stride == 1)
+    gemv_axpy (k, m, alpha, b, b_row_stride, a, a_col_stride, beta, c, c_row_stride);
+
+  /* Vector times matrix: C is a single row */
+  else if (m == 1 && b_col_stride == 1)
+    gemv_axpy (k, n, alpha, a, a_col_stride, b, b_row_stride, beta, c, 1);
+  else if (m == 1 && b_row_stride == 1)
+    gemv_dot (n, k, alpha, b, b_col_stride, a, a_col_stride, beta, c, 1);
+  else
+    return FALSE;
+
+  /* The output is a single vector, so a second pass over it
+   * is cheap next to streaming the matrix */
+  if (epilogue != NULL)
+    apply_epilogue (epilogue, c, c_row_stride, 0, 0, m, n);
+
+  return TRUE;
+}
+
+/* Offset the residual of an epilogue to the given product in a batch */
+static const PipevecGemmEpilogue *
+epilogue_for_batch (const PipevecGemmEpilogue *epilogue,
+                    ptrdiff_t                  c_offset,
+                    PipevecGemmEpilogue       *storage)
+{
+  if (epilogue == NULL)
+    return NULL;
+
+  *storage = *epilogue;
+
+  if (storage->residual != NULL)
+    storage->residual += c_offset;
+
+  return storage;
+}
+
+/* Offset of the panels for the block of B starting at row pc and
+ * column jc. Blocks are stored one column block after another, and
+ * every column block but the last is nc_block columns wide, which
+ * is a multiple of nr. */
+static size_t
+packed_b_offset (size_t k,
+                 size_t n,
+                 size_t nr,
+                 size_t nc_block,
+                 size_t pc,
+                 size_t jc)
+{
+  return jc * k + pc * apply_padding (MIN (nc_block, n - jc), nr);
+}
+
+/* One block of B against the rows of C, split between threads. Each
+ * task owns a run of rows_per_task rows, a whole number of
+ * microkernel tiles, and packs its blocks of A into its own buffer of
+ * packed_a_size floats. */
+typedef struct {
+  size_t                     m;
+  size_t                     rows_per_task;
+  size_t                     block_m;
+  size_t                     kc;
+  size_t                     nc;
+  size_t                     jc;
+  float                      alpha;
+  const float               *a;
+  ptrdiff_t                  a_row_stride;
+  ptrdiff_t                  a_col_stride;
+  gboolean                   pack_a;
+  float                     *packed_a;
+  size_t                     packed_a_size;
+  const float               *b_panels;
+  float                      beta;
+  float                     *c;
+  size_t                     c_row_stride;
+  const PipevecGemmEpilogue *epilogue;
+} BlockedJob;
+
+static void
+gemm_blocked_task (size_t   task,
+                   gpointer user_data)
+{
+  BlockedJob *job = user_data;
+  size_t first = task * job->rows_per_task;
+  size_t last = MIN (first + job->rows_per_task, job->m);
+  float *packed_a = job->packed_a + task * job->packed_a_size;
+
+  for (size_t ic = first; ic < last; ic += job->block_m)
+    {
+      size_t mc = MIN (job->block_m, last - ic);
+
+      if (job->pack_a)
+        pack_a (mc, job->kc,
+                job->a + ic * job->a_row_stride,
+                job->a_row_stride, job->a_col_stride,
+                packed_a);
+
+      for (size_t jr = 0; jr < job->nc; jr += PIPEVEC_GEMM_NR)
+        {
+          for (size_t ir = 0; ir < mc; ir += PIPEVEC_GEMM_MR)
+            {
+              microkernel (job->kc,
+                           packed_a + (ir / PIPEVEC_GEMM_MR) * job->kc * PIPEVEC_GEMM_MR,
+                           job->b_panels + (jr / PIPEVEC_GEMM_NR) * job->kc * PIPEVEC_GEMM_NR,
+                           job->alpha,
+                           job->beta,
+                           job->c + (ic + ir) * job->c_row_stride + jr,
+                           job->c_row_stride,
+                           MIN (PIPEVEC_GEMM_MR, mc - ir),
+                           MIN (PIPEVEC_GEMM_NR, job->nc - jr),
+                           job->epilogue,
+                           ic + ir,
+                           job->jc + jr);
+            }
+        }
+    }
+}
+
+/* The packed, blocked product, with cache blocks of the sizes in
+ * blocking. B is either packed panel by panel as the loop goes, or,
+ * if prepacked_b is set, read from panels packed by
+ * pipevec_gemm_pack_b() with prepacked_layout, which are shared by
+ * the whole batch. In that case the blocks of k and n follow the
+ * layout instead. The rows of C are split between up to n_threads
+ * threads, which share each packed block of B and pack their own
+ * blocks of A. The packing buffers come from the installed allocator.
+ * Returns FALSE with error set, before touching C, if they could not
+ * be allocated. */
+static gboolean
+gemm_blocked (size_t                         n_batches,
+              size_t                         m,
+              size_t                         n,
+              size_t                         k,
+              float                          alpha,
+              const float                   *a,
+              ptrdiff_t                      a_batch_stride,
+              ptrdiff_t                      a_row_stride,
+              ptrdiff_t                      a_col_stride,
+              const float                   *b,
+              ptrdiff_t                      b_batch_stride,
+              ptrdiff_t                      b_row_stride,
+              ptrdiff_t                      b_col_stride,
+              const PipevecGemmPackedLayout *prepacked_layout,
+              const float                   *prepacked_b,
+              float                          beta,
+              float                         *c,
+              ptrdiff_t                      c_batch_stride,
+              size_t                         c_row_stride,
+              const PipevecGemmBlocking     *blocking,
+              size_t                         n_threads,
+              const PipevecGemmEpilogue     *epilogue,
+              GError                       **error)
+{
+  PipevecGemmEpilogue batch_epilogue;
+  size_t block_m = blocking->mc;
+  size_t block_k = prepacked_b != NULL ? prepacked_layout->kc : blocking->kc;
+  size_t block_n = prepacked_b != NULL ? prepacked_layout->nc : blocking->nc;
+  size_t kc_max = MIN (k, block_k);
+  size_t nc_max = MIN (n, block_n);
+  size_t rows_per_task = MAX (apply_padding ((m + n_threads - 1) / n_threads, PIPEVEC_GEMM_MR),
+                              PIPEVEC_GEMM_MR);
+  size_t n_tasks = (m + rows_per_task - 1) / rows_per_task;
+  size_t mc_max = MIN (rows_per_task, block_m);
+  size_t packed_a_size = kc_max * apply_padding (mc_max, PIPEVEC_GEMM_MR);
+  size_t packed_a_bytes = sizeof (float) * packed_a_size * n_tasks;
+  size_t packed_b_bytes = sizeof (float) * kc_max * apply_padding (nc_max, PIPEVEC_GEMM_NR);
+  PipevecAllocator *packed_a_allocator = NULL;
+  PipevecAllocator *packed_b_allocator = NULL;
+  float *packed_a = NULL;
+  float *packed_b = NULL;
+
+  packed_a = pipevec_allocator_alloc (packed_a_bytes, &packed_a_allocator, error);
+
+  if (packed_a == NULL)
+    return FALSE;
+
+  if (prepacked_b == NULL)
+    {
+      packed_b = pipevec_allocator_alloc (packed_b_bytes, &packed_b_allocator, error);
+
+      if (packed_b == NULL)
+        {
+          pipevec_allocator_free (packed_a_allocator, packed_a, packed_a_bytes);
+          return FALSE;
+        }
+    }
+
+  BlockedJob job = {
+    .m = m,
+    .rows_per_task = rows_per_task,
+    .block_m = block_m,
+    .alpha = alpha,
+    .a_row_stride = a_row_stride,
+    .a_col_stride = a_col_stride,
+    .packed_a = packed_a,
+    .packed_a_size = packed_a_size,
+    .c_row_stride = c_row_stride
+  };
+
+  for (size_t jc = 0; jc < n; jc += block_n)
+    {
+      size_t nc = MIN (block_n, n - jc);
+
+      for (size_t pc = 0; pc < k; pc += block_k)
+        {
+          size_t kc = MIN (block_k, k - pc);
+
+          /* Only the first slice of k applies beta, the
+           * rest accumulate on top of it */
+          float beta_for_slice = pc == 0 ? beta : 1.0f;
+
+          for (size_t batch = 0; batch < n_batches; ++batch)
+            {
+              /* The epilogue can only run once C holds the
+               * whole sum, which is after the last slice of k */
+              const PipevecGemmEpilogue *slice_epilogue =
+                pc + kc == k ?
+                epilogue_for_batch (epilogue, batch * c_batch_stride, &batch_epilogue) :
+                NULL;
+
+              const float *b_panels = packed_b;
+
+              /* Panels of a shared operand are already packed
+               * from the first product in the batch */
+              if (prepacked_b != NULL)
+                b_panels = prepacked_b + packed_b_offset (k, n,
+                                                          PIPEVEC_GEMM_NR,
+                                                          block_n,
+                                                          pc, jc);
+              else if (batch == 0 || b_batch_stride != 0)
+                pack_b (kc, nc,
+                        b + batch * b_batch_stride + pc * b_row_stride + jc * b_col_stride,
+                        b_row_stride, b_col_stride,
+                        packed_b);
+
+              job.kc = kc;
+              job.nc = nc;
+              job.jc = jc;
+              job.a = a + batch * a_batch_stride + pc * a_col_stride;
+
+              /* Each task packs into the same buffer every time, so
+               * a shared A that fits in one block per task is still
+               * packed from the first product in the batch */
+              job.pack_a = batch == 0 || a_batch_stride != 0 || rows_per_task > block_m;
+              job.b_panels = b_panels;
+              job.beta = beta_for_slice;
+              job.c = c + batch * c_batch_stride + jc;
+              job.epilogue = slice_epilogue;
+
+              pipevec_parallel_for_n_threads (n_tasks, n_threads, gemm_blocked_task, &job);
+            }
+        }
+    }
+
+  pipevec_allocator_free (packed_a_allocator, packed_a, packed_a_bytes);
+
+  if (packed_b != NULL)
+    pipevec_allocator_free (packed_b_allocator, packed_b, packed_b_bytes);
+
+  return TRUE;
+}
+
+/* Batches of small matrices, such as 3 x 3 or 4 x 4 transforms, are
+ * dominated by loop and index overhead in the general kernels. When
+ * rows are padded to a whole number of float8_t, a row of B or C is
+ * one or two vectors, so C[i, :] is a sum of k vector multiply-adds.
+ * One kernel is generated per k and row width; with both known at
+ * compile time, the loops over them unroll completely and B stays in
+ * registers for every row of A. */
+typedef void (*SmallKernel) (size_t       m,
+                             size_t       n,
+                             float        alpha,
+                             const float *a,
+                             size_t       a_row_stride,
+                             const float *b,
+                             size_t       b_row_stride,
+                             float       *c,
+                             size_t       c_row_stride);
+
+static inline __attribute__((always_inline)) void
+small_kernel (size_t       k,
+              size_t       n_vectors,
+              size_t       m,
+              size_t       n,
+              float        alpha,
+              const float *a,
+              size_t       a_row_stride,
+              const float *b,
+              size_t       b_row_stride,
+              float       *c,
+              size_t       c_row_stride)
+{
+  float8_t b_rows[PIPEVEC_GEMM_SMALL_MAX][2];
+
+  /* The padding lanes of the last vector compute a_row[p] * 0,
+   * which is NaN rather than zero if a_row[p] or alpha is not
+   * finite, so they are cleared before storing */
+  mask8_t last_mask = mask8_first (n - 8 * (n_vectors - 1));
+
+  for (size_t p = 0; p < k; ++p)
+    for (size_t v = 0; v < n_vectors; ++v)
+      b_rows[p][v] = load_float8 (b + p * b_row_stride + v * 8);
+
+  for (size_t i = 0; i < m; ++i)
+    {
+      const float *a_row = a + i * a_row_stride;
+      float8_t acc[2] = { { 0 }, { 0 } };
+
+      for (size_t p = 0; p < k; ++p)
+        for (size_t v = 0; v < n_vectors; ++v)
+          acc[v] += a_row[p] * b_rows[p][v];
+
+      for (size_t v = 0; v < n_vectors; ++v)
+        acc[v] *= alpha;
+
+      acc[n_vectors - 1] = (float8_t) ((mask8_t) acc[n_vectors - 1] & last_mask);
+
+      for (size_t v = 0; v < n_vectors; ++v)
+        store_float8 (c + i * c_row_stride + v * 8, acc[v]);
+    }
+}
+
+#define PIPEVEC_DEFINE_SMALL_KERNEL(k, n_vectors) \
+  static void \
+  small_kernel_##k##_##n_vectors (size_t       m, \
+                                  size_t       n, \
+                                  float        alpha, \
+                                  const float *a, \
+                                  size_t       a_row_stride, \
+                                  const float *b, \
+                                  size_t       b_row_stride, \
+                                  float       *c, \
+                                  size_t       c_row_stride) \
+  { \
+    small_kernel (k, n_vectors, m, n, alpha, a, a_row_stride, b, b_row_stride, c, c_row_stride); \
+  }
+
+#define PIPEVEC_DEFINE_SMALL_KERNELS(k) \
+  PIPEVEC_DEFINE_SMALL_KERNEL (k, 1) \
+  PIPEVEC_DEFINE_SMALL_KERNEL (k, 2)
+
+PIPEVEC_DEFINE_SMALL_KERNELS (1)
+PIPEVEC_DEFINE_SMALL_KERNELS (2)
+PIPEVEC_DEFINE_SMALL_KERNELS (3)
+PIPEVEC_DEFINE_SMALL_KERNELS (4)
+PIPEVEC_DEFINE_SMALL_KERNELS (5)
+PIPEVEC_DEFINE_SMALL_KERNELS (6)
+PIPEVEC_DEFINE_SMALL_KERNELS (7)
+PIPEVEC_DEFINE_SMALL_KERNELS (8)
+PIPEVEC_DEFINE_SMALL_KERNELS (9)
+PIPEVEC_DEFINE_SMALL_KERNELS (10)
+PIPEVEC_DEFINE_SMALL_KERNELS (11)
+PIPEVEC_DEFINE_SMALL_KERNELS (12)
+PIPEVEC_DEFINE_SMALL_KERNELS (13)
+PIPEVEC_DEFINE_SMALL_KERNELS (14)
+PIPEVEC_DEFINE_SMALL_KERNELS (15)
+PIPEVEC_DEFINE_SMALL_KERNELS (16)
+
+#define PIPEVEC_SMALL_KERNELS(k) { small_kernel_##k##_1, small_kernel_##k##_2 }
+
+/* Indexed by k - 1 and the number of vectors per row - 1 */
+static const SmallKernel small_kernels[PIPEVEC_GEMM_SMALL_MAX][2] = {
+  PIPEVEC_SMALL_KERNELS (1),
+  PIPEVEC_SMALL_KERNELS (2),
+  PIPEVEC_SMALL_KERNELS (3),
+  PIPEVEC_SMALL_KERNELS (4),
+  PIPEVEC_SMALL_KERNELS (5),
+  PIPEVEC_SMALL_KERNELS (6),
+  PIPEVEC_SMALL_KERNELS (7),
+  PIPEVEC_SMALL_KERNELS (8),
+  PIPEVEC_SMALL_KERNELS (9),
+  PIPEVEC_SMALL_KERNELS (10),
+  PIPEVEC_SMALL_KERNELS (11),
+  PIPEVEC_SMALL_KERNELS (12),
+  PIPEVEC_SMALL_KERNELS (13),
+  PIPEVEC_SMALL_KERNELS (14),
+  PIPEVEC_SMALL_KERNELS (15),
+  PIPEVEC_SMALL_KERNELS (16)
+};
+
+typedef struct {
+  SmallKernel                kernel;
+  size_t                     n_batches;
+  size_t                     batches_per_task;
+  size_t                     m;
+  size_t                     n;
+  float                      alpha;
+  const float               *a;
+  ptrdiff_t                  a_batch_stride;
+  size_t                     a_row_stride;
+  const float               *b;
+  ptrdiff_t                  b_batch_stride;
+  size_t                     b_row_stride;
+  float                     *c;
+  ptrdiff_t                  c_batch_stride;
+  size_t                     c_row_stride;
+  const PipevecGemmEpilogue *epilogue;
+} SmallGemmJob;
+
+static void
+small_gemm_task (size_t   task,
+                 gpointer user_data)
+{
+  SmallGemmJob *job = user_data;
+  size_t first = task * job->batches_per_task;
+  size_t last = MIN (first + job->batches_per_task, job->n_batches);
+  PipevecGemmEpilogue batch_epilogue;
+
+  for (size_t batch = first; batch < last; ++batch)
+    {
+      float *c_batch = job->c + batch * job->c_batch_stride;
+
+      job->kernel (job->m,
+                   job->n,
+                   job->alpha,
+                   job->a + batch * job->a_batch_stride, job->a_row_stride,
+                   job->b + batch * job->b_batch_stride, job->b_row_stride,
+                   c_batch, job->c_row_stride);
+
+      if (job->epilogue != NULL)
+        apply_epilogue (epilogue_for_batch (job->epilogue, batch * job->c_batch_stride, &batch_epilogue),
+                        c_batch, job->c_row_stride,
+                        0, 0,
+                        job->m, job->n);
+    }
+}
+
+/**
+ * pipevec_gemm_small_batched:
+ * @n_batches: Number of products to compute.
+ * @m: Rows of each A and C.
+ * @n: Columns of each B and C.
+ * @k: Columns of each A and rows of each B.
+ * @alpha: Scale applied to A * B.
+ * @a: The first row-major A operand.
+ * @a_batch_stride: Distance in floats between consecutive A operands.
+ * @a_row_stride: Distance in floats between rows of A.
+ * @b: The first row-major B operand.
+ * @b_batch_stride: Distance in floats between consecutive B operands.
+ * @b_row_stride: Distance in floats between rows of B.
+ * @c: The first row-major output.
+ * @c_batch_stride: Distance in floats between consecutive outputs.
+ * @c_row_stride: Distance in floats between rows of C.
+ * @epilogue: (nullable): Elementwise operations to finish each
+ *            output with.
+ *
+ * Compute C_i = alpha * A_i * B_i for a batch of small matrices with
+ * kernels specialized for each size. Rows of B must be padded with
+ * zeros up to a multiple of 8 floats, as in a #PipevecTensor, and
+ * rows of C are written up to the same width. Their padding is
+ * written as zero even when A holds values that are not finite.
+ * The batch is split between threads.
+ *
+ * Returns: %FALSE, without doing anything, if a dimension is too
+ *          large for the fixed-size kernels.
+ */
+gboolean
+pipevec_gemm_small_batched (size_t                     n_batches,
+                            size_t                     m,
+                            size_t                     n,
+                            size_t                     k,
+                            float                      alpha,
+                            const float               *a,
+                            ptrdiff_t                  a_batch_stride,
+                            size_t                     a_row_stride,
+                            const float               *b,
+                            ptrdiff_t                  b_batch_stride,
+                            size_t                     b_row_stride,
+                            float                     *c,
+                            ptrdiff_t                  c_batch_stride,
+                            size_t                     c_row_stride,
+                            const PipevecGemmEpilogue *epilogue)
+{
+  if (m > PIPEVEC_GEMM_SMALL_MAX ||
+      n > PIPEVEC_GEMM_SMALL_MAX ||
+      k > PIPEVEC_GEMM_SMALL_MAX ||
+      k == 0)
+    return FALSE;
+
+  if (n_batches == 0 || m == 0 || n == 0)
+    return TRUE;
+
+  SmallGemmJob job = {
+    .kernel = small_kernels[k - 1][apply_padding (n, 8) / 8 - 1],
+    .n_batches = n_batches,
+    .m = m,
+    .n = n,
+    .alpha = alpha,
+    .a = a,
+    .a_batch_stride = a_batch_stride,
+    .a_row_stride = a_row_stride,
+    .b = b,
+    .b_batch_stride = b_batch_stride,
+    .b_row_stride = b_row_stride,
+    .c = c,
+    .c_batch_stride = c_batch_stride,
+    .c_row_stride = c_row_stride,
+    .epilogue = epilogue
+  };
+
+  pipevec_parallel_for (split_n_tasks (n_batches,
+                                      2.0 * m * n * k,
+                                      sizeof (float) * (m * k + k * n + m * n),
+                                      &job.batches_per_task),
+                        small_gemm_task,
+                        &job);
+
+  return TRUE;
+}
+
+/**
+ * pipevec_gemm:
+ * @m: Rows of A and C.
+ * @n: Columns of B and C.
+ * @k: Columns of A and rows of B.
+ * @alpha: Scale applied to A * B.
+ * @a: The A operand.
+ * @a_row_stride: Distance in floats between rows of A.
+ * @a_col_stride: Distance in floats between columns of A.
+ * @b: The B operand.
+ * @b_row_stride: Distance in floats between rows of B.
+ * @b_col_stride: Distance in floats between columns of B.
+ * @beta: Scale applied to C before accumulating. If zero, C is
+ *        not read.
+ * @c: The row-major output.
+ * @c_row_stride: Distance in floats between rows of C.
+ *
+ * Compute C = alpha * A * B + beta * C. The operands are described
+ * by a row and a column stride, so a transposed operand is passed
+ * by swapping its strides rather than by copying it.
+ */
+void
+pipevec_gemm (size_t       m,
+              size_t       n,
+              size_t       k,
+              float        alpha,
+              const float *a,
+              ptrdiff_t    a_row_stride,
+              ptrdiff_t    a_col_stride,
+              const float *b,
+              ptrdiff_t    b_row_stride,
+              ptrdiff_t    b_col_stride,
+              float        beta,
+              float       *c,
+              size_t       c_row_stride)
+{
+  pipevec_gemm_batched (1, m, n, k,
+                        alpha,
+                        a, 0, a_row_stride, a_col_stride,
+                        b, 0, b_row_stride, b_col_stride,
+                        beta,
+                        c, 0, c_row_stride);
+}
+
+/**
+ * pipevec_gemm_batched:
+ * @n_batches: Number of products to compute.
+ * @m: Rows of each A and C.
+ * @n: Columns of each B and C.
+ * @k: Columns of each A and rows of each B.
+ * @alpha: Scale applied to A * B.
+ * @a: The first A operand.
+ * @a_batch_stride: Distance in floats between consecutive A operands,
+ *                  or zero if every product shares the same A.
+ * @a_row_stride: Distance in floats between rows of A.
+ * @a_col_stride: Distance in floats between columns of A.
+ * @b: The first B operand.
+ * @b_batch_stride: Distance in floats between consecutive B operands,
+ *                  or zero if every product shares the same B.
+ * @b_row_stride: Distance in floats between rows of B.
+ * @b_col_stride: Distance in floats between columns of B.
+ * @beta: Scale applied to C before accumulating. If zero, C is
+ *        not read.
+ * @c: The first row-major output.
+ * @c_batch_stride: Distance in floats between consecutive outputs.
+ * @c_row_stride: Distance in floats between rows of C.
+ *
+ * Compute C_i = alpha * A_i * B_i + beta * C_i for each i in the batch.
+ * A shared B (a zero @b_batch_stride) is packed once per panel and
+ * reused for every product in the batch. A shared A that fits in a
+ * single block of rows is reused the same way.
+ *
+ * This cannot fail, since the factorizations built on it have no way
+ * to report an error part way through. If the packing buffers cannot
+ * be allocated, the product is computed with the unpacked loop
+ * instead, which needs no memory of its own. Use
+ * pipevec_gemm_batched_fused() to be told about the failure.
+ */
+void
+pipevec_gemm_batched (size_t       n_batches,
+                      size_t       m,
+                      size_t       n,
+                      size_t       k,
+                      float        alpha,
+                      const float *a,
+                      ptrdiff_t    a_batch_stride,
+                      ptrdiff_t    a_row_stride,
+                      ptrdiff_t    a_col_stride,
+                      const float *b,
+                      ptrdiff_t    b_batch_stride,
+                      ptrdiff_t    b_row_stride,
+                      ptrdiff_t    b_col_stride,
+                      float        beta,
+                      float       *c,
+                      ptrdiff_t    c_batch_stride,
+                      size_t       c_row_stride)
+{
+  if (pipevec_gemm_batched_fused (n_batches, m, n, k,
+                                  alpha,
+                                  a, a_batch_stride, a_row_stride, a_col_stride,
+                                  b, b_batch_stride, b_row_stride, b_col_stride,
+                                  beta,
+                                  c, c_batch_stride, c_row_stride,
+                                  NULL,
+                                  NULL))
+    return;
+
+  /* C is untouched when the packing buffers cannot be allocated */
+  for (size_t batch = 0; batch < n_batches; ++batch)
+    gemm_direct (m, n, k,
+                 alpha,
+                 a + batch * a_batch_stride, a_row_stride, a_col_stride,
+                 b + batch * b_batch_stride, b_row_stride, b_col_stride,
+                 beta,
+                 c + batch * c_batch_stride, c_row_stride,
+                 NULL);
+}
+
+/**
+ * pipevec_gemm_batched_fused:
+ * @n_batches: Number of products to compute.
+ * @m: Rows of each A and C.
+ * @n: Columns of each B and C.
+ * @k: Columns of each A and rows of each B.
+ * @alpha: Scale applied to A * B.
+ * @a: The first A operand.
+ * @a_batch_stride: Distance in floats between consecutive A operands.
+ * @a_row_stride: Distance in floats between rows of A.
+ * @a_col_stride: Distance in floats between columns of A.
+ * @b: The first B operand.
+ * @b_batch_stride: Distance in floats between consecutive B operands.
+ * @b_row_stride: Distance in floats between rows of B.
+ * @b_col_stride: Distance in floats between columns of B.
+ * @beta: Scale applied to C before accumulating.
+ * @c: The first row-major output.
+ * @c_batch_stride: Distance in floats between consecutive outputs.
+ * @c_row_stride: Distance in floats between rows of C.
+ * @epilogue: (nullable): Elementwise operations to finish each
+ *            output with.
+ * @error: A #GError return location.
+ *
+ * Like pipevec_gemm_batched(), but finish each tile of C with
+ * @epilogue as soon as its last slice of k is accumulated, while the
+ * tile is still in cache, instead of making further passes over C.
+ *
+ * Returns: %TRUE on success. %FALSE with %PIPEVEC_ERROR_OUT_OF_MEMORY
+ *          set if the blocked product could not allocate its packing
+ *          buffers from the installed allocator, in which case C is
+ *          left untouched.
+ */
+gboolean
+pipevec_gemm_batched_fused (size_t                     n_batches,
+                            size_t                     m,
+                            size_t                     n,
+                            size_t                     k,
+                            float                      alpha,
+                            const float               *a,
+                            ptrdiff_t                  a_batch_stride,
+                            ptrdiff_t                  a_row_stride,
+                            ptrdiff_t                  a_col_stride,
+                            const float               *b,
+                            ptrdiff_t                  b_batch_stride,
+                            ptrdiff_t                  b_row_stride,
+                            ptrdiff_t                  b_col_stride,
+                            float                      beta,
+                            float                     *c,
+                            ptrdiff_t                  c_batch_stride,
+                            size_t                     c_row_stride,
+                            const PipevecGemmEpilogue *epilogue,
+                            GError                   **error)
+{
+  PipevecGemmEpilogue batch_epilogue;
+  PipevecGemmBlocking blocking;
+
+  if (n_batches == 0 || m == 0 || n == 0)
+    return TRUE;
+
+  /* With an empty inner dimension, A * B is zero and only beta and
+   * the epilogue are left to apply. The blocked product finishes C in
+   * its last slice of k, of which there are none, so do it directly. */
+  if (k == 0)
+    {
+      for (size_t batch = 0; batch < n_batches; ++batch)
+        gemm_direct (m, n, 0,
+                     alpha,
+                     a, a_row_stride, a_col_stride,
+                     b, b_row_stride, b_col_stride,
+                     beta,
+                     c + batch * c_batch_stride, c_row_stride,
+                     epilogue_for_batch (epilogue, batch * c_batch_stride, &batch_epilogue));
+
+      return TRUE;
+    }
+
+  /* A batch of row-major A operands stacked one after another
+   * against a shared B is a single taller product. The residual
+   * of an epilogue is laid out like C, so it stacks the same way. */
+  if (n_batches > 1 &&
+      b_batch_stride == 0 &&
+      a_batch_stride == (ptrdiff_t) m * a_row_stride &&
+      c_batch_stride == (ptrdiff_t) (m * c_row_stride))
+    {
+      m *= n_batches;
+      n_batches = 1;
+    }
+
+  PipevecDispatchVariant variant = pipevec_dispatch_gemm_variant (m, n, k, m == 1 || n == 1 || k == 1);
+
+  if (variant == PIPEVEC_DISPATCH_VARIANT_STREAMING)
+    {
+      size_t batch = 0;
+
+      for (; batch < n_batches; ++batch)
+        if (!gemm_thin (m, n, k,
+                        alpha,
+                        a + batch * a_batch_stride, a_row_stride, a_col_stride,
+                        b + batch * b_batch_stride, b_row_stride, b_col_stride,
+                        beta,
+                        c + batch * c_batch_stride, c_row_stride,
+                        epilogue_for_batch (epilogue, batch * c_batch_stride, &batch_epilogue)))
+          break;
+
+      if (batch == n_batches)
+        return TRUE;
+
+      /* There was no unit stride dimension to stream along */
+      variant = pipevec_dispatch_gemm_variant (m, n, k, FALSE);
+    }
+
+  if (variant == PIPEVEC_DISPATCH_VARIANT_BLOCKED)
+    {
+      pipevec_autotune_current_gemm_blocking (&blocking);
+
+      return gemm_blocked (n_batches, m, n, k,
+                           alpha,
+                           a, a_batch_stride, a_row_stride, a_col_stride,
+                           b, b_batch_stride, b_row_stride, b_col_stride,
+                           NULL, NULL,
+                           beta,
+                           c, c_batch_stride, c_row_stride,
+                           &blocking,
+                           pipevec_dispatch_blocked_gemm_threads (m, n, k),
+                           epilogue,
+                           error);
+    }
+
+  /* Packing would cost more than it saves */
+  for (size_t batch = 0; batch < n_batches; ++batch)
+    gemm_direct (m, n, k,
+                 alpha,
+                 a + batch * a_batch_stride, a_row_stride, a_col_stride,
+                 b + batch * b_batch_stride, b_row_stride, b_col_stride,
+                 beta,
+                 c + batch * c_batch_stride, c_row_stride,
+                 epilogue_for_batch (epilogue, batch * c_batch_stride, &batch_epilogue));
+
+  return TRUE;
+}
+
+/**
+ * pipevec_gemm_get_packed_layout:
+ * @layout: (out caller-allocates): The layout of packed B panels.
+ *
+ * Get the panel layout that the blocked product currently packs B
+ * into. The panel width depends on the microkernel the engine was
+ * built with and the block sizes on the tuned cache blocking.
+ */
+void
+pipevec_gemm_get_packed_layout (PipevecGemmPackedLayout *layout)
+{
+  PipevecGemmBlocking blocking;
+
+  pipevec_autotune_current_gemm_blocking (&blocking);
+
+  layout->nr = PIPEVEC_GEMM_NR;
+  layout->kc = blocking.kc;
+  layout->nc = blocking.nc;
+}
+
+/**
+ * pipevec_gemm_packed_b_size:
+ * @layout: A #PipevecGemmPackedLayout.
+ * @k: Rows of B.
+ * @n: Columns of B.
+ *
+ * Returns: The number of floats needed to hold a k x n B packed
+ *          with @layout.
+ */
+size_t
+pipevec_gemm_packed_b_size (const PipevecGemmPackedLayout *layout,
+                            size_t                         k,
+                            size_t                         n)
+{
+  return k * apply_padding (n, layout->nr);
+}
+
+/**
+ * pipevec_gemm_pack_b:
+ * @layout: The #PipevecGemmPackedLayout to pack with. Its panel
+ *          width must be the one pipevec_gemm_get_packed_layout()
+ *          gives.
+ * @k: Rows of B.
+ * @n: Columns of B.
+ * @b: The B operand.
+ * @b_row_stride: Distance in floats between rows of B.
+ * @b_col_stride: Distance in floats between columns of B.
+ * @packed: Storage for pipevec_gemm_packed_b_size() floats, aligned
+ *          to a float8_t.
+ *
+ * Pack all of B into the panels that the blocked product would
+ * otherwise pack on every call, in the order it reads them.
+ */
+void
+pipevec_gemm_pack_b (const PipevecGemmPackedLayout *layout,
+                     size_t                         k,
+                     size_t                         n,
+                     const float                   *b,
+                     ptrdiff_t                      b_row_stride,
+                     ptrdiff_t                      b_col_stride,
+                     float                         *packed)
+{
+  g_return_if_fail (layout->nr == PIPEVEC_GEMM_NR);
+
+  for (size_t jc = 0; jc < n; jc += layout->nc)
+    for (size_t pc = 0; pc < k; pc += layout->kc)
+      pack_b (MIN (layout->kc, k - pc),
+              MIN (layout->nc, n - jc),
+              b + pc * b_row_stride + jc * b_col_stride,
+              b_row_stride, b_col_stride,
+              packed + packed_b_offset (k, n, layout->nr, layout->nc, pc, jc));
+}
+
+/**
+ * pipevec_gemm_unpack_b:
+ * @layout: The #PipevecGemmPackedLayout that @packed was packed with.
+ * @k: Rows of B.
+ * @n: Columns of B.
+ * @packed: Packed panels of B.
+ * @b: The row-major output.
+ * @b_row_stride: Distance in floats between rows of @b.
+ *
+ * Undo pipevec_gemm_pack_b(), possibly for a layout packed by an
+ * engine built for a different microkernel.
+ */
+void
+pipevec_gemm_unpack_b (const PipevecGemmPackedLayout *layout,
+                       size_t                         k,
+                       size_t                         n,
+                       const float                   *packed,
+                       float                         *b,
+                       size_t                         b_row_stride)
+{
+  for (size_t jc = 0; jc < n; jc += layout->nc)
+    for (size_t pc = 0; pc < k; pc += layout->kc)
+      {
+        size_t kc = MIN (layout->kc, k - pc);
+        size_t nc = MIN (layout->nc, n - jc);
+        const float *block = packed + packed_b_offset (k, n, layout->nr, layout->nc, pc, jc);
+
+        for (size_t jr = 0; jr < nc; jr += layout->nr)
+          {
+            const float *panel = block + (jr / layout->nr) * kc * layout->nr;
+            size_t nr = MIN (layout->nr, nc - jr);
+
+            for (size_t p = 0; p < kc; ++p)
+              memcpy (b + (pc + p) * b_row_stride + jc + jr,
+                      panel + p * layout->nr,
+                      sizeof (float) * nr);
+          }
+      }
+}
+
+/**
+ * pipevec_gemm_batched_fused_packed:
+ * @n_batches: Number of products to compute.
+ * @m: Rows of each A and C.
+ * @n: Columns of B and C.
+ * @k: Columns of each A and rows of B.
+ * @alpha: Scale applied to A * B.
+ * @a: The first A operand.
+ * @a_batch_stride: Distance in floats between consecutive A operands.
+ * @a_row_stride: Distance in floats between rows of A.
+ * @a_col_stride: Distance in floats between columns of A.
+ * @layout: The #PipevecGemmPackedLayout @packed_b was packed with.
+ * @packed_b: B, packed by pipevec_gemm_pack_b() and shared by every
+ *            product in the batch.
+ * @beta: Scale applied to C before accumulating.
+ * @c: The first row-major output.
+ * @c_batch_stride: Distance in floats between consecutive outputs.
+ * @c_row_stride: Distance in floats between rows of C.
+ * @epilogue: (nullable): Elementwise operations to finish each
+ *            output with.
+ * @error: A #GError return location.
+ *
+ * Like pipevec_gemm_batched_fused(), but with B already packed, so
+ * that a weight matrix used for many products is only packed once.
+ * Every shape goes through the blocked product, since that is the
+ * only path that reads packed panels.
+ *
+ * Returns: %TRUE on success. %FALSE with %PIPEVEC_ERROR_OUT_OF_MEMORY
+ *          set if the buffer for packing A could not be allocated.
+ */
+gboolean
+pipevec_gemm_batched_fused_packed (size_t                         n_batches,
+                                   size_t                         m,
+                                   size_t                         n,
+                                   size_t                         k,
+                                   float                          alpha,
+                                   const float                   *a,
+                                   ptrdiff_t                      a_batch_stride,
+                                   ptrdiff_t                      a_row_stride,
+                                   ptrdiff_t                      a_col_stride,
+                                   const PipevecGemmPackedLayout *layout,
+                                   const float                   *packed_b,
+                                   float                          beta,
+                                   float                         *c,
+                                   ptrdiff_t                      c_batch_stride,
+                                   size_t                         c_row_stride,
+                                   const PipevecGemmEpilogue     *epilogue,
+                                   GError                       **error)
+{
+  PipevecGemmBlocking blocking;
+
+  if (n_batches == 0 || m == 0 || n == 0)
+    return TRUE;
+
+  g_return_val_if_fail (k > 0, FALSE);
+  g_return_val_if_fail (layout->nr == PIPEVEC_GEMM_NR, FALSE);
+
+  if (n_batches > 1 &&
+      a_batch_stride == (ptrdiff_t) m * a_row_stride &&
+      c_batch_stride == (ptrdiff_t) (m * c_row_stride))
+    {
+      m *= n_batches;
+      n_batches = 1;
+    }
+
+  pipevec_autotune_current_gemm_blocking (&blocking);
+
+  return gemm_blocked (n_batches, m, n, k,
+                       alpha,
+                       a, a_batch_stride, a_row_stride, a_col_stride,
+                       NULL, 0, 0, 0,
+                       layout, packed_b,
+                       beta,
+                       c, c_batch_stride, c_row_stride,
+                       &blocking,
+                       pipevec_dispatch_blocked_gemm_threads (m, n, k),
+                       epilogue,
+                       error);
+}
+
+/**
+ * pipevec_gemm_get_microkernel_shape:
+ * @mr: (out): Rows of the tile of C computed by the microkernel.
+ * @nr: (out): Columns of the tile of C computed by the microkernel.
+ *
+ * Get the shape of the microkernel this engine was built with. The
+ * cache blocks must be whole multiples of it.
+ */
+void
+pipevec_gemm_get_microkernel_shape (size_t *mr,
+                                    size_t *nr)
+{
+  *mr = PIPEVEC_GEMM_MR;
+  *nr = PIPEVEC_GEMM_NR;
+}
+
+/**
+ * pipevec_gemm_with_blocking:
+ * @blocking: The cache blocking to use.
+ * @m: Rows of A and C.
+ * @n: Columns of B and C.
+ * @k: Columns of A and rows of B.
+ * @a: The row-major A operand.
+ * @b: The row-major B operand.
+ * @c: The row-major output.
+ *
+ * Compute C = A * B for contiguous operands with the blocked product
+ * and the given cache blocking on the calling thread, regardless of
+ * their shape. This is used to time candidate blockings.
+ *
+ * Returns: %FALSE if the packing buffers could not be allocated.
+ */
+gboolean
+pipevec_gemm_with_blocking (const PipevecGemmBlocking *blocking,
+                            size_t                     m,
+                            size_t                     n,
+                            size_t                     k,
+                            const float               *a,
+                            const float               *b,
+                            float                     *c)
+{
+  return gemm_blocked (1, m, n, k,
+                       1.0f,
+                       a, 0, k, 1,
+                       b, 0, n, 1,
+                       NULL, NULL,
+                       0.0f,
+                       c, 0, n,
+                       blocking,
+                       1,
+                       NULL,
+                       NULL);
+}
+
+/**
+ * pipevec_gemm_unblocked:
+ * @m: Rows of A and C.
+ * @n: Columns of B and C.
+ * @k: Columns of A and rows of B.
+ * @a: The row-major A operand.
+ * @b: The row-major B operand.
+ * @c: The row-major output.
+ *
+ * Compute C = A * B for contiguous operands with the unpacked loop,
+ * regardless of their shape. This is used to calibrate the cost
+ * model that chooses between the two.
+ */
+void
+pipevec_gemm_unblocked (size_t       m,
+                        size_t       n,
+                        size_t       k,
+                        const float *a,
+                        const float *b,
+                        float       *c)
+{
+  gemm_direct (m, n, k,
+               1.0f,
+               a, k, 1,
+               b, n, 1,
+               0.0f,
+               c, n,
+               NULL);
+}
@@ -0,0 +1,38 @@
+/*
+ * /pipevec/pipevec-memory-private.h
+ *
+ * Hooks for accounting tensor storage.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include <pipevec/pipevec-memory.h>
+
+G_BEGIN_DECLS
+
+gboolean pipevec_memory_reserve (GArray  *shape,
+                                 size_t   bytes,
+                                 GError **error);
+
+void pipevec_memory_release (GArray *shape,
+                             size_t  bytes);
+
+G_END_DECLS
@@ -0,0 +1,595 @@
+/*
+ * /pipevec/pipevec-memory.c
+ *
+ * Accounting of the memory held by tensors.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-memory.h>
+#include <pipevec/pipevec-memory-private.h>
+#include <pipevec/pipevec-sysprof-private.h>
+#include <pipevec/pipevec-tensor-private.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Live bytes are kept in one atomic counter so that the peak and the
+ * soft limit are exact. The number of tensors and the histogram by
+ * shape are kept per thread, behind a lock that only a snapshot
+ * contends for, and summed when a snapshot is taken. Storage is often
+ * freed on a different thread to the one that allocated it, so the
+ * per-thread counts can go negative. */
+
+typedef struct {
+  gint64 n_tensors;
+  gint64 bytes;
+} PipevecMemoryShapeCount;
+
+typedef struct {
+  GMutex lock;
+  gint64 live_tensors;
+  GHashTable *shapes;
+} PipevecMemoryThreadState;
+
+typedef struct {
+  GArray *shape;
+  guint64 n_tensors;
+  guint64 bytes;
+} PipevecMemoryShapeEntry;
+
+struct _PipevecMemorySnapshot {
+  PipevecMemoryStats stats;
+  GArray *shapes;
+};
+
+static gsize live_bytes = 0;
+static gsize peak_bytes = 0;
+static gsize limit_bytes = 0;
+
+/* Every thread's state, and the counts of threads that have exited */
+static GMutex registry_lock;
+static GPtrArray *thread_states = NULL;
+static PipevecMemoryThreadState *retired_state = NULL;
+
+static void thread_state_free (gpointer data);
+
+static GPrivate thread_state = G_PRIVATE_INIT (thread_state_free);
+
+G_DEFINE_BOXED_TYPE (PipevecMemorySnapshot,
+                     pipevec_memory_snapshot,
+                     pipevec_memory_snapshot_copy,
+                     pipevec_memory_snapshot_free)
+
+static guint
+shape_hash (gconstpointer key)
+{
+  const GArray *shape = key;
+  guint hash = shape->len;
+
+  for (guint i = 0; i < shape->len; ++i)
+    hash = hash * 31 + (guint) g_array_index (shape, size_t, i);
+
+  return hash;
+}
+
+static gboolean
+shape_equal (gconstpointer a,
+             gconstpointer b)
+{
+  const GArray *lhs = a;
+  const GArray *rhs = b;
+
+  return lhs->len == rhs->len &&
+         memcmp (lhs->data, rhs->data, sizeof (size_t) * lhs->len) == 0;
+}
+
+static GHashTable *
+shape_table_new (void)
+{
+  return g_hash_table_new_full (shape_hash,
+                                shape_equal,
+                                (GDestroyNotify) g_array_unref,
+                                g_free);
+}
+
+static void
+shape_table_add (GHashTable *table,
+                 GArray     *shape,
+                 gint64      n_tensors,
+                 gint64      bytes)
+{
+  PipevecMemoryShapeCount *count = g_hash_table_lookup (table, shape);
+
+  if (count == NULL)
+    {
+      count = g_new0 (PipevecMemoryShapeCount, 1);
+      g_hash_table_insert (table, g_array_copy (shape), count);
+    }
+
+  count->n_tensors += n_tensors;
+  count->bytes += bytes;
+}
+
+static PipevecMemoryThreadState *
+thread_state_new (void)
+{
+  PipevecMemoryThreadState *state = g_new0 (PipevecMemoryThreadState, 1);
+
+  g_mutex_init (&state->lock);
+  state->shapes = shape_table_new ();
+
+  return state;
+}
+
+/* Add the counts of @src to @dst. The caller holds the lock of @src,
+ * and of @dst if other threads can see it. */
+static void
+thread_state_merge (PipevecMemoryThreadState *dst,
+                    PipevecMemoryThreadState *src)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  dst->live_tensors += src->live_tensors;
+
+  g_hash_table_iter_init (&iter, src->shapes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      PipevecMemoryShapeCount *count = value;
+
+      shape_table_add (dst->shapes, key, count->n_tensors, count->bytes);
+    }
+}
+
+static void
+thread_state_free (gpointer data)
+{
+  PipevecMemoryThreadState *state = data;
+
+  /* The thread is exiting, so keep its counts for the tensors it
+   * allocated that are still alive */
+  g_mutex_lock (&registry_lock);
+  g_ptr_array_remove_fast (thread_states, state);
+
+  g_mutex_lock (&state->lock);
+  thread_state_merge (retired_state, state);
+  g_mutex_unlock (&state->lock);
+  g_mutex_unlock (&registry_lock);
+
+  g_hash_table_unref (state->shapes);
+  g_mutex_clear (&state->lock);
+  g_free (state);
+}
+
+static void
+ensure_initialized (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *requested_limit = g_getenv ("PIPEVEC_MEMORY_LIMIT");
+
+      thread_states = g_ptr_array_new ();
+      retired_state = thread_state_new ();
+
+      if (requested_limit != NULL)
+        limit_bytes = (gsize) g_ascii_strtoull (requested_limit, NULL, 10);
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+static PipevecMemoryThreadState *
+get_thread_state (void)
+{
+  PipevecMemoryThreadState *state = g_private_get (&thread_state);
+
+  if (state == NULL)
+    {
+      state = thread_state_new ();
+
+      g_mutex_lock (&registry_lock);
+      g_ptr_array_add (thread_states, state);
+      g_mutex_unlock (&registry_lock);
+
+      g_private_set (&thread_state, state);
+    }
+
+  return state;
+}
+
+static void
+count_shape (GArray *shape,
+             gint64  n_tensors,
+             gint64  bytes)
+{
+  PipevecMemoryThreadState *state = get_thread_state ();
+
+  g_mutex_lock (&state->lock);
+  state->live_tensors += n_tensors;
+  shape_table_add (state->shapes, shape, n_tensors, bytes);
+  g_mutex_unlock (&state->lock);
+}
+
+/**
+ * pipevec_memory_reserve:
+ * @shape: (element-type gsize): Shape of the tensor being allocated.
+ * @bytes: Size of its storage, including padding.
+ * @error: A #GError return location.
+ *
+ * Account for tensor storage that is about to be allocated. If this
+ * would take the live storage over the soft limit, nothing is
+ * counted and %PIPEVEC_ERROR_OUT_OF_MEMORY is returned instead.
+ * Every successful call must be balanced by pipevec_memory_release()
+ * once the storage is freed.
+ *
+ * Returns: %TRUE if the storage can be allocated, %FALSE with @error set otherwise.
+ */
+gboolean
+pipevec_memory_reserve (GArray  *shape,
+                        size_t   bytes,
+                        GError **error)
+{
+  ensure_initialized ();
+
+  gsize limit = g_atomic_pointer_get (&limit_bytes);
+  gsize live;
+
+  if (limit == 0)
+    {
+      live = g_atomic_pointer_add (&live_bytes, bytes) + bytes;
+    }
+  else
+    {
+      gsize current;
+
+      do
+        {
+          current = g_atomic_pointer_get (&live_bytes);
+
+          if (current + bytes > limit)
+            {
+              g_autofree char *formatted_shape = pipevec_format_shape (shape);
+
+              g_set_error (error,
+                           PIPEVEC_ERROR,
+                           PIPEVEC_ERROR_OUT_OF_MEMORY,
+                           "Allocating %" G_GSIZE_FORMAT " bytes for a tensor of shape %s "
+                           "would exceed the memory limit of %" G_GSIZE_FORMAT " bytes, "
+                           "with %" G_GSIZE_FORMAT " bytes in use",
+                           bytes,
+                           formatted_shape,
+                           limit,
+                           current);
+              return FALSE;
+            }
+
+          live = current + bytes;
+        }
+      while (!g_atomic_pointer_compare_and_exchange (&live_bytes, current, live));
+    }
+
+  for (;;)
+    {
+      gsize peak = g_atomic_pointer_get (&peak_bytes);
+
+      if (live <= peak ||
+          g_atomic_pointer_compare_and_exchange (&peak_bytes, peak, live))
+        break;
+    }
+
+  count_shape (shape, 1, bytes);
+  pipevec_sysprof_set_live_bytes (live);
+
+  return TRUE;
+}
+
+/**
+ * pipevec_memory_release:
+ * @shape: (element-type gsize): Shape of the tensor that was allocated.
+ * @bytes: Size of its storage, as passed to pipevec_memory_reserve().
+ *
+ * Account for tensor storage being freed.
+ */
+void
+pipevec_memory_release (GArray *shape,
+                        size_t  bytes)
+{
+  gsize live = g_atomic_pointer_add (&live_bytes, -(gssize) bytes) - bytes;
+
+  count_shape (shape, -1, -(gint64) bytes);
+  pipevec_sysprof_set_live_bytes (live);
+}
+
+/**
+ * pipevec_memory_get_limit:
+ *
+ * Get the soft limit on the memory held by tensors. This is set
+ * from the `PIPEVEC_MEMORY_LIMIT` environment variable, in bytes,
+ * if it is present.
+ *
+ * Returns: The limit in bytes, or 0 if there is none.
+ */
+guint64
+pipevec_memory_get_limit (void)
+{
+  ensure_initialized ();
+
+  return g_atomic_pointer_get (&limit_bytes);
+}
+
+/**
+ * pipevec_memory_set_limit:
+ * @limit: The most bytes of storage that tensors may hold, or 0 for
+ *         no limit.
+ *
+ * Set a soft limit on the memory held by tensors. Once allocating
+ * a tensor would go over the limit, the operation creating it fails
+ * with %PIPEVEC_ERROR_OUT_OF_MEMORY, so that a process can shed load
+ * before the system runs out of memory. Lowering the limit below
+ * what is already allocated does not free anything. Temporary
+ * buffers that operations use internally are not counted.
+ */
+void
+pipevec_memory_set_limit (guint64 limit)
+{
+  ensure_initialized ();
+
+  g_atomic_pointer_set (&limit_bytes, (gsize) limit);
+}
+
+/**
+ * pipevec_memory_reset_peak:
+ *
+ * Start measuring the peak from the memory held by tensors now.
+ */
+void
+pipevec_memory_reset_peak (void)
+{
+  ensure_initialized ();
+
+  g_atomic_pointer_set (&peak_bytes, g_atomic_pointer_get (&live_bytes));
+}
+
+static int
+compare_shape_entries (const void *a,
+                       const void *b)
+{
+  const PipevecMemoryShapeEntry *lhs = a;
+  const PipevecMemoryShapeEntry *rhs = b;
+
+  if (lhs->bytes != rhs->bytes)
+    return lhs->bytes < rhs->bytes ? 1 : -1;
+
+  return lhs->n_tensors < rhs->n_tensors ? 1 : lhs->n_tensors > rhs->n_tensors ? -1 : 0;
+}
+
+/**
+ * pipevec_memory_get_snapshot:
+ *
+ * Get the memory held by tensors as it is now, with a histogram of
+ * the live tensors by shape. Counts from different threads are read
+ * one after another, so they may be slightly out of step with each
+ * other while tensors are being allocated.
+ *
+ * Returns: (transfer full): A new #PipevecMemorySnapshot.
+ */
+PipevecMemorySnapshot *
+pipevec_memory_get_snapshot (void)
+{
+  PipevecMemorySnapshot *snapshot = g_new0 (PipevecMemorySnapshot, 1);
+  PipevecMemoryThreadState *totals = thread_state_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+
+  ensure_initialized ();
+
+  g_mutex_lock (&registry_lock);
+  thread_state_merge (totals, retired_state);
+
+  for (guint i = 0; i < thread_states->len; ++i)
+    {
+      PipevecMemoryThreadState *state = g_ptr_array_index (thread_states, i);
+
+      g_mutex_lock (&state->lock);
+      thread_state_merge (totals, state);
+      g_mutex_unlock (&state->lock);
+    }
+  g_mutex_unlock (&registry_lock);
+
+  snapshot->stats.live_tensors = (guint64) MAX (totals->live_tensors, 0);
+  snapshot->stats.live_bytes = g_atomic_pointer_get (&live_bytes);
+  snapshot->stats.peak_bytes = g_atomic_pointer_get (&peak_bytes);
+  snapshot->stats.limit_bytes = g_atomic_pointer_get (&limit_bytes);
+  snapshot->shapes = g_array_new (FALSE, FALSE, sizeof (PipevecMemoryShapeEntry));
+
+  g_hash_table_iter_init (&iter, totals->shapes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      PipevecMemoryShapeCount *count = value;
+      PipevecMemoryShapeEntry entry = {
+        .shape = g_array_copy (key),
+        .n_tensors = (guint64) count->n_tensors,
+        .bytes = (guint64) count->bytes
+      };
+
+      if (count->n_tensors <= 0)
+        {
+          g_array_unref (entry.shape);
+          continue;
+        }
+
+      g_array_append_val (snapshot->shapes, entry);
+    }
+
+  qsort (snapshot->shapes->data,
+         snapshot->shapes->len,
+         sizeof (PipevecMemoryShapeEntry),
+         compare_shape_entries);
+
+  g_hash_table_unref (totals->shapes);
+  g_mutex_clear (&totals->lock);
+  g_free (totals);
+
+  return snapshot;
+}
+
+/**
+ * pipevec_memory_snapshot_copy:
+ * @snapshot: A #PipevecMemorySnapshot
+ *
+ * Copy @snapshot.
+ *
+ * Returns: (transfer full): A new #PipevecMemorySnapshot.
+ */
+PipevecMemorySnapshot *
+pipevec_memory_snapshot_copy (PipevecMemorySnapshot *snapshot)
+{
+  PipevecMemorySnapshot *copy = g_new0 (PipevecMemorySnapshot, 1);
+
+  copy->stats = snapshot->stats;
+  copy->shapes = g_array_copy (snapshot->shapes);
+
+  for (guint i = 0; i < copy->shapes->len; ++i)
+    {
+      PipevecMemoryShapeEntry *entry = &g_array_index (copy->shapes, PipevecMemoryShapeEntry, i);
+
+      entry->shape = g_array_copy (entry->shape);
+    }
+
+  return copy;
+}
+
+/**
+ * pipevec_memory_snapshot_free:
+ * @snapshot: A #PipevecMemorySnapshot
+ *
+ * Free @snapshot.
+ */
+void
+pipevec_memory_snapshot_free (PipevecMemorySnapshot *snapshot)
+{
+  for (guint i = 0; i < snapshot->shapes->len; ++i)
+    g_array_unref (g_array_index (snapshot->shapes, PipevecMemoryShapeEntry, i).shape);
+
+  g_array_unref (snapshot->shapes);
+  g_free (snapshot);
+}
+
+/**
+ * pipevec_memory_snapshot_get_stats:
+ * @snapshot: A #PipevecMemorySnapshot
+ *
+ * Get the totals in @snapshot.
+ *
+ * Returns: (transfer none): The #PipevecMemoryStats in @snapshot.
+ */
+const PipevecMemoryStats *
+pipevec_memory_snapshot_get_stats (PipevecMemorySnapshot *snapshot)
+{
+  return &snapshot->stats;
+}
+
+/**
+ * pipevec_memory_snapshot_get_n_shapes:
+ * @snapshot: A #PipevecMemorySnapshot
+ *
+ * Get the number of distinct shapes of live tensors in @snapshot.
+ *
+ * Returns: The number of entries in the histogram.
+ */
+size_t
+pipevec_memory_snapshot_get_n_shapes (PipevecMemorySnapshot *snapshot)
+{
+  return snapshot->shapes->len;
+}
+
+/**
+ * pipevec_memory_snapshot_get_shape:
+ * @snapshot: A #PipevecMemorySnapshot
+ * @index: Index of the histogram entry, with the entries holding the
+ *         most memory first.
+ * @n_tensors: (out) (optional): Return location for the number of
+ *             live tensors with this shape.
+ * @bytes: (out) (optional): Return location for the bytes of storage
+ *         that they hold.
+ *
+ * Get an entry of the histogram of live tensors by shape.
+ *
+ * Returns: (transfer none) (element-type gsize): The shape.
+ */
+GArray *
+pipevec_memory_snapshot_get_shape (PipevecMemorySnapshot *snapshot,
+                                   size_t                 index,
+                                   guint64               *n_tensors,
+                                   guint64               *bytes)
+{
+  g_return_val_if_fail (index < snapshot->shapes->len, NULL);
+
+  PipevecMemoryShapeEntry *entry = &g_array_index (snapshot->shapes, PipevecMemoryShapeEntry, index);
+
+  if (n_tensors != NULL)
+    *n_tensors = entry->n_tensors;
+
+  if (bytes != NULL)
+    *bytes = entry->bytes;
+
+  return entry->shape;
+}
+
+/**
+ * pipevec_memory_snapshot_to_string:
+ * @snapshot: A #PipevecMemorySnapshot
+ *
+ * Format the totals in @snapshot followed by the histogram of live
+ * tensors by shape as a table.
+ *
+ * Returns: (transfer full): The formatted summary.
+ */
+char *
+pipevec_memory_snapshot_to_string (PipevecMemorySnapshot *snapshot)
+{
+  GString *summary = g_string_new (NULL);
+
+  g_string_append_printf (summary,
+                          "live tensors %" G_GUINT64_FORMAT ", live MB %.3f, peak MB %.3f",
+                          snapshot->stats.live_tensors,
+                          snapshot->stats.live_bytes / 1e6,
+                          snapshot->stats.peak_bytes / 1e6);
+
+  if (snapshot->stats.limit_bytes > 0)
+    g_string_append_printf (summary, ", limit MB %.3f", snapshot->stats.limit_bytes / 1e6);
+
+  g_string_append_printf (summary, "\n%-24s %10s %12s\n", "shape", "tensors", "MB");
+
+  for (guint i = 0; i < snapshot->shapes->len; ++i)
+    {
+      PipevecMemoryShapeEntry *entry = &g_array_index (snapshot->shapes, PipevecMemoryShapeEntry, i);
+      g_autofree char *formatted_shape = pipevec_format_shape (entry->shape);
+
+      g_string_append_printf (summary,
+                              "%-24s %10" G_GUINT64_FORMAT " %12.3f\n",
+                              formatted_shape,
+                              entry->n_tensors,
+                              entry->bytes / 1e6);
+    }
+
+  return g_string_free (summary, FALSE);
+}
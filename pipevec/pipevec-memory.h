@@ -0,0 +1,76 @@
+/*
+ * /pipevec/pipevec-memory.h
+ *
+ * Accounting of the memory held by tensors.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PipevecMemoryStats:
+ * @live_tensors: Number of tensors that have storage allocated.
+ * @live_bytes: Bytes of tensor storage allocated, including padding.
+ * @peak_bytes: The most that @live_bytes has been since the process
+ *              started or pipevec_memory_reset_peak() was called.
+ * @limit_bytes: The soft limit on @live_bytes, or 0 if there is none.
+ *
+ * Totals of the memory held by tensors and packed tensors.
+ */
+typedef struct {
+  guint64 live_tensors;
+  guint64 live_bytes;
+  guint64 peak_bytes;
+  guint64 limit_bytes;
+} PipevecMemoryStats;
+
+typedef struct _PipevecMemorySnapshot PipevecMemorySnapshot;
+
+#define PIPEVEC_TYPE_MEMORY_SNAPSHOT (pipevec_memory_snapshot_get_type ())
+GType pipevec_memory_snapshot_get_type (void);
+
+guint64 pipevec_memory_get_limit (void);
+
+void pipevec_memory_set_limit (guint64 limit);
+
+void pipevec_memory_reset_peak (void);
+
+PipevecMemorySnapshot * pipevec_memory_get_snapshot (void);
+
+PipevecMemorySnapshot * pipevec_memory_snapshot_copy (PipevecMemorySnapshot *snapshot);
+
+void pipevec_memory_snapshot_free (PipevecMemorySnapshot *snapshot);
+
+const PipevecMemoryStats * pipevec_memory_snapshot_get_stats (PipevecMemorySnapshot *snapshot);
+
+size_t pipevec_memory_snapshot_get_n_shapes (PipevecMemorySnapshot *snapshot);
+
+GArray * pipevec_memory_snapshot_get_shape (PipevecMemorySnapshot *snapshot,
+                                            size_t                 index,
+                                            guint64               *n_tensors,
+                                            guint64               *bytes);
+
+char * pipevec_memory_snapshot_to_string (PipevecMemorySnapshot *snapshot);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PipevecMemorySnapshot, pipevec_memory_snapshot_free)
+
+G_END_DECLS
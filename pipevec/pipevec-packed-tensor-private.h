@@ -0,0 +1,42 @@
+/*
+ * /pipevec/pipevec-packed-tensor-private.h
+ *
+ * Internal accessors for Pipevec Packed Tensor.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-packed-tensor.h>
+#include <pipevec/pipevec-tensor-private.h>
+
+G_BEGIN_DECLS
+
+GArray * pipevec_packed_tensor_get_shape_array (PipevecPackedTensor *packed);
+
+const float * pipevec_packed_tensor_get_panels (PipevecPackedTensor *packed);
+
+const PipevecGemmPackedLayout * pipevec_packed_tensor_get_layout (PipevecPackedTensor *packed);
+
+void pipevec_packed_tensor_get_matrix_view (PipevecPackedTensor     *packed,
+                                            PipevecTensorMatrixView *view);
+
+G_END_DECLS
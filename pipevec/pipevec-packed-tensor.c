@@ -0,0 +1,436 @@
+/*
+ * /pipevec/pipevec-packed-tensor.c
+ *
+ * Weight matrices packed ahead of time for repeated inner products.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-packed-tensor.h>
+#include <pipevec/pipevec-packed-tensor-private.h>
+#include <pipevec/pipevec-allocator-private.h>
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-memory-private.h>
+#include <pipevec/pipevec-profile-private.h>
+#include <pipevec/pipevec-errors.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Saved packed tensors start with this header, followed by the
+ * panels. Everything is in the byte order of the machine that saved
+ * the file, which the byte order mark detects. The layout fields
+ * record the microkernel the panels were packed for. */
+#define PIPEVEC_PACKED_TENSOR_MAGIC "PVPACKED"
+#define PIPEVEC_PACKED_TENSOR_VERSION 1
+#define PIPEVEC_PACKED_TENSOR_BYTE_ORDER_MARK 0x01020304
+
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  uint64_t rows;
+  uint64_t columns;
+  uint64_t nr;
+  uint64_t kc;
+  uint64_t nc;
+} PipevecPackedTensorHeader;
+
+struct _PipevecPackedTensor
+{
+  GObject parent_instance;
+
+  /* (K, N) */
+  GArray *shape;
+
+  /* Aligned, allocated with @allocator */
+  float *panels;
+  size_t panels_size;
+  PipevecAllocator *allocator;
+
+  /* The panels do not have to follow the current cache blocking,
+   * only the microkernel's panel width */
+  PipevecGemmPackedLayout layout;
+};
+
+G_DEFINE_TYPE (PipevecPackedTensor, pipevec_packed_tensor, G_TYPE_OBJECT);
+
+static gboolean
+alloc_panels (PipevecPackedTensor            *packed,
+              const PipevecGemmPackedLayout  *layout,
+              size_t                          rows,
+              size_t                          columns,
+              GError                        **error)
+{
+  size_t size = sizeof (float) * pipevec_gemm_packed_b_size (layout, rows, columns);
+
+  g_array_set_size (packed->shape, 2);
+  g_array_index (packed->shape, size_t, 0) = rows;
+  g_array_index (packed->shape, size_t, 1) = columns;
+
+  if (!pipevec_memory_reserve (packed->shape, size, error))
+    return FALSE;
+
+  packed->panels = pipevec_allocator_alloc (size, &packed->allocator, error);
+
+  if (packed->panels == NULL)
+    {
+      pipevec_memory_release (packed->shape, size);
+      return FALSE;
+    }
+
+  packed->panels_size = size;
+  pipevec_profile_count_allocation (size);
+
+  packed->layout = *layout;
+
+  return TRUE;
+}
+
+/**
+ * pipevec_tensor_pack_for_matmul:
+ * @tensor: A #PipevecTensor of shape (K, N)
+ * @error: A #GError out pointer.
+ *
+ * Pack @tensor into the panel layout that the matrix product engine
+ * reads its right hand operand in. The layout depends on the
+ * microkernel, and so on the instruction set pipevec was built for,
+ * and on the cache blocking in use when @tensor is packed.
+ *
+ * A weight matrix that is used as the right hand side of many inner
+ * products can be packed once and passed to
+ * pipevec_tensor_inner_product_packed() instead, which skips packing
+ * it again on every call.
+ *
+ * Returns: (transfer full): A new #PipevecPackedTensor, or %NULL
+ *          with @error set.
+ */
+PipevecPackedTensor *
+pipevec_tensor_pack_for_matmul (PipevecTensor  *tensor,
+                                GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_PACK_FOR_MATMUL);
+  GArray *shape = pipevec_tensor_get_shape_array (tensor);
+  PipevecGemmPackedLayout layout;
+  PipevecTensorMatrixView view;
+
+  if (shape->len != 2)
+    {
+      g_autofree char *formatted_shape = pipevec_format_shape (shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_BAD_SHAPE,
+                   "Only matrices can be packed, but the tensor has shape %s",
+                   formatted_shape);
+      return NULL;
+    }
+
+  pipevec_profile_scope_set_shape (&scope, shape);
+
+  g_autoptr(PipevecPackedTensor) packed = g_object_new (PIPEVEC_TYPE_PACKED_TENSOR, NULL);
+
+  pipevec_tensor_get_matrix_view (tensor, &view);
+  pipevec_gemm_get_packed_layout (&layout);
+
+  if (!alloc_panels (packed, &layout, view.rows, view.columns, error))
+    return NULL;
+
+  pipevec_gemm_pack_b (&layout,
+                       view.rows, view.columns,
+                       view.data, view.row_stride, 1,
+                       packed->panels);
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     sizeof (float) * view.rows * view.columns,
+                                     sizeof (float) * view.rows * view.columns,
+                                     0);
+
+  return g_steal_pointer (&packed);
+}
+
+/**
+ * pipevec_packed_tensor_save:
+ * @packed: A #PipevecPackedTensor
+ * @filename: The file to write to.
+ * @error: A #GError out pointer.
+ *
+ * Write @packed to @filename, so that it can be loaded again by
+ * pipevec_packed_tensor_load() without packing it again.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set on failure.
+ */
+gboolean
+pipevec_packed_tensor_save (PipevecPackedTensor  *packed,
+                            const char           *filename,
+                            GError              **error)
+{
+  const PipevecGemmPackedLayout *layout = &packed->layout;
+  PipevecPackedTensorHeader header;
+  size_t rows = g_array_index (packed->shape, size_t, 0);
+  size_t columns = g_array_index (packed->shape, size_t, 1);
+  size_t panels_size = sizeof (float) * pipevec_gemm_packed_b_size (layout, rows, columns);
+  g_autofree char *contents = g_malloc (sizeof (header) + panels_size);
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, PIPEVEC_PACKED_TENSOR_MAGIC, sizeof (header.magic));
+  header.version = PIPEVEC_PACKED_TENSOR_VERSION;
+  header.byte_order_mark = PIPEVEC_PACKED_TENSOR_BYTE_ORDER_MARK;
+  header.rows = rows;
+  header.columns = columns;
+  header.nr = layout->nr;
+  header.kc = layout->kc;
+  header.nc = layout->nc;
+
+  memcpy (contents, &header, sizeof (header));
+  memcpy (contents + sizeof (header), packed->panels, panels_size);
+
+  return g_file_set_contents (filename, contents, sizeof (header) + panels_size, error);
+}
+
+static gboolean
+check_header (const PipevecPackedTensorHeader  *header,
+              size_t                            length,
+              GError                          **error)
+{
+  PipevecGemmPackedLayout layout;
+
+  if (memcmp (header->magic, PIPEVEC_PACKED_TENSOR_MAGIC, sizeof (header->magic)) != 0)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_DATA,
+                   "Not a packed tensor");
+      return FALSE;
+    }
+
+  if (header->byte_order_mark != PIPEVEC_PACKED_TENSOR_BYTE_ORDER_MARK ||
+      header->version != PIPEVEC_PACKED_TENSOR_VERSION)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_DATA,
+                   "Packed tensor was saved by an incompatible version or byte order");
+      return FALSE;
+    }
+
+  /* Every column block but the last must be a whole number of
+   * panels for the panels to be found again */
+  if (header->rows == 0 || header->columns == 0 ||
+      header->nr == 0 || header->kc == 0 || header->nc == 0 ||
+      header->nc % header->nr != 0 ||
+      header->rows > SIZE_MAX / sizeof (float) ||
+      header->columns > SIZE_MAX - header->nr)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_DATA,
+                   "Packed tensor has an invalid shape or layout");
+      return FALSE;
+    }
+
+  layout.nr = header->nr;
+  layout.kc = header->kc;
+  layout.nc = header->nc;
+
+  size_t padded_columns = pipevec_gemm_packed_b_size (&layout, 1, header->columns);
+
+  if (padded_columns > (SIZE_MAX / sizeof (float)) / header->rows ||
+      length - sizeof (*header) != sizeof (float) * header->rows * padded_columns)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_DATA,
+                   "Packed tensor is truncated or has trailing data");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * pipevec_packed_tensor_load:
+ * @filename: A file written by pipevec_packed_tensor_save().
+ * @error: A #GError out pointer.
+ *
+ * Load a packed tensor saved by pipevec_packed_tensor_save(). If the
+ * file was packed for a different microkernel than the one this
+ * build of pipevec uses, for instance on a machine with a different
+ * instruction set, it is repacked for this one. Panels packed with
+ * different cache blocking are used as they are.
+ *
+ * Returns: (transfer full): A new #PipevecPackedTensor, or %NULL
+ *          with @error set.
+ */
+PipevecPackedTensor *
+pipevec_packed_tensor_load (const char  *filename,
+                            GError     **error)
+{
+  g_autofree char *contents = NULL;
+  gsize length = 0;
+  PipevecPackedTensorHeader header;
+  PipevecGemmPackedLayout layout, file_layout;
+
+  if (!g_file_get_contents (filename, &contents, &length, error))
+    return NULL;
+
+  if (length < sizeof (header))
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_DATA,
+                   "Packed tensor is truncated");
+      return NULL;
+    }
+
+  memcpy (&header, contents, sizeof (header));
+
+  if (!check_header (&header, length, error))
+    return NULL;
+
+  g_autoptr(PipevecPackedTensor) packed = g_object_new (PIPEVEC_TYPE_PACKED_TENSOR, NULL);
+
+  pipevec_gemm_get_packed_layout (&layout);
+  file_layout.nr = header.nr;
+  file_layout.kc = header.kc;
+  file_layout.nc = header.nc;
+
+  if (file_layout.nr == layout.nr)
+    {
+      if (!alloc_panels (packed, &file_layout, header.rows, header.columns, error))
+        return NULL;
+
+      memcpy (packed->panels,
+              contents + sizeof (header),
+              length - sizeof (header));
+      return g_steal_pointer (&packed);
+    }
+
+  /* Packed for another microkernel: unpack and pack again */
+  if (!alloc_panels (packed, &layout, header.rows, header.columns, error))
+    return NULL;
+
+  g_autofree float *unpacked = g_new (float, header.rows * header.columns);
+  g_autofree float *file_panels = g_malloc (length - sizeof (header));
+
+  /* The panels in contents are not necessarily aligned */
+  memcpy (file_panels, contents + sizeof (header), length - sizeof (header));
+
+  pipevec_gemm_unpack_b (&file_layout,
+                         header.rows, header.columns,
+                         file_panels,
+                         unpacked, header.columns);
+  pipevec_gemm_pack_b (&layout,
+                       header.rows, header.columns,
+                       unpacked, header.columns, 1,
+                       packed->panels);
+
+  return g_steal_pointer (&packed);
+}
+
+/**
+ * pipevec_packed_tensor_get_shape_array:
+ * @packed: A #PipevecPackedTensor
+ *
+ * Returns: (transfer none) (element-type gulong): The (K, N) shape
+ *          of the tensor @packed was packed from.
+ */
+GArray *
+pipevec_packed_tensor_get_shape_array (PipevecPackedTensor *packed)
+{
+  return packed->shape;
+}
+
+/**
+ * pipevec_packed_tensor_get_panels:
+ * @packed: A #PipevecPackedTensor
+ *
+ * Returns: (transfer none): The panels, in the layout given by
+ *          pipevec_packed_tensor_get_layout().
+ */
+const float *
+pipevec_packed_tensor_get_panels (PipevecPackedTensor *packed)
+{
+  return packed->panels;
+}
+
+/**
+ * pipevec_packed_tensor_get_layout:
+ * @packed: A #PipevecPackedTensor
+ *
+ * Returns: (transfer none): The layout the panels of @packed were
+ *          packed with.
+ */
+const PipevecGemmPackedLayout *
+pipevec_packed_tensor_get_layout (PipevecPackedTensor *packed)
+{
+  return &packed->layout;
+}
+
+/**
+ * pipevec_packed_tensor_get_matrix_view:
+ * @packed: A #PipevecPackedTensor
+ * @view: (out caller-allocates): A #PipevecTensorMatrixView to fill in.
+ *
+ * Describe the shape of @packed as a single matrix. The panels are
+ * not row-major, so the view has no data and must only be used for
+ * its dimensions.
+ */
+void
+pipevec_packed_tensor_get_matrix_view (PipevecPackedTensor     *packed,
+                                       PipevecTensorMatrixView *view)
+{
+  view->data = NULL;
+  view->n_batches = 1;
+  view->rows = g_array_index (packed->shape, size_t, 0);
+  view->columns = g_array_index (packed->shape, size_t, 1);
+  view->row_stride = 0;
+  view->batch_stride = 0;
+}
+
+static void
+pipevec_packed_tensor_finalize (GObject *object)
+{
+  PipevecPackedTensor *packed = PIPEVEC_PACKED_TENSOR (object);
+
+  if (packed->panels != NULL)
+    {
+      pipevec_memory_release (packed->shape, packed->panels_size);
+      pipevec_allocator_free (g_steal_pointer (&packed->allocator),
+                              g_steal_pointer (&packed->panels),
+                              packed->panels_size);
+    }
+
+  g_clear_pointer (&packed->shape, g_array_unref);
+
+  G_OBJECT_CLASS (pipevec_packed_tensor_parent_class)->finalize (object);
+}
+
+static void
+pipevec_packed_tensor_class_init (PipevecPackedTensorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = pipevec_packed_tensor_finalize;
+}
+
+static void
+pipevec_packed_tensor_init (PipevecPackedTensor *packed)
+{
+  packed->shape = g_array_new (FALSE, FALSE, sizeof (size_t));
+  packed->panels = NULL;
+}
@@ -0,0 +1,57 @@
+/*
+ * /pipevec/pipevec-packed-tensor.h
+ *
+ * Weight matrices packed ahead of time for repeated inner products.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include <pipevec/pipevec-tensor.h>
+
+G_BEGIN_DECLS
+
+#define PIPEVEC_TYPE_PACKED_TENSOR pipevec_packed_tensor_get_type ()
+G_DECLARE_FINAL_TYPE (PipevecPackedTensor, pipevec_packed_tensor, PIPEVEC, PACKED_TENSOR, GObject)
+
+PipevecPackedTensor * pipevec_tensor_pack_for_matmul (PipevecTensor  *tensor,
+                                                      GError        **error);
+
+gboolean pipevec_packed_tensor_save (PipevecPackedTensor  *packed,
+                                     const char           *filename,
+                                     GError              **error);
+
+PipevecPackedTensor * pipevec_packed_tensor_load (const char  *filename,
+                                                  GError     **error);
+
+PipevecTensor * pipevec_tensor_inner_product_packed (PipevecTensor        *lhs,
+                                                     PipevecPackedTensor  *rhs,
+                                                     GError              **error);
+
+PipevecTensor * pipevec_tensor_inner_product_packed_fused (PipevecTensor        *lhs,
+                                                           PipevecPackedTensor  *rhs,
+                                                           float                 alpha,
+                                                           PipevecTensor        *bias,
+                                                           PipevecActivation     activation,
+                                                           PipevecTensor        *residual,
+                                                           float                 beta,
+                                                           GError              **error);
+
+G_END_DECLS
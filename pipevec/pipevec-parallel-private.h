@@ -0,0 +1,44 @@
+/*
+ * /pipevec/pipevec-parallel-private.h
+ *
+ * Shared worker threads for data-parallel loops.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <stddef.h>
+
+G_BEGIN_DECLS
+
+typedef void (*PipevecParallelFunc) (size_t   index,
+                                     gpointer user_data);
+
+size_t pipevec_parallel_get_n_threads (void);
+
+void pipevec_parallel_for (size_t              n_tasks,
+                           PipevecParallelFunc func,
+                           gpointer            user_data);
+
+void pipevec_parallel_for_n_threads (size_t              n_tasks,
+                                     size_t              max_threads,
+                                     PipevecParallelFunc func,
+                                     gpointer            user_data);
+
+G_END_DECLS
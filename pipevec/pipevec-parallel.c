@@ -0,0 +1,238 @@
+/*
+ * /pipevec/pipevec-parallel.c
+ *
+ * Shared worker threads for data-parallel loops.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-parallel-private.h>
+#include <pipevec/pipevec-sysprof-private.h>
+#include <pipevec/pipevec-trace-private.h>
+
+#include <stdlib.h>
+
+/* A parallel loop hands out task indices from a shared counter. The
+ * calling thread takes part in the loop too, so a loop never waits on
+ * a worker that has not started yet unless there is work for it. */
+typedef struct {
+  PipevecParallelFunc func;
+  gpointer            user_data;
+  size_t              n_tasks;
+  gsize               next_task;
+
+  GMutex              lock;
+  GCond               done;
+  size_t              n_running_workers;
+
+  /* Whether a trace was active when the loop started, and when */
+  gboolean            tracing;
+  guint64             start_ns;
+} PipevecParallelJob;
+
+static GThreadPool *worker_pool = NULL;
+static size_t n_threads = 0;
+
+/* Set on worker threads so that a parallel loop started from inside
+ * another one runs serially instead of waiting on its own pool. */
+static GPrivate in_worker = G_PRIVATE_INIT (NULL);
+
+static void
+run_tasks (PipevecParallelJob *job)
+{
+  pipevec_sysprof_add_busy_threads (1);
+
+  for (;;)
+    {
+      size_t index = g_atomic_pointer_add (&job->next_task, 1);
+
+      if (index >= job->n_tasks)
+        break;
+
+      if (job->tracing)
+        {
+          guint64 start_ns = pipevec_trace_now ();
+
+          job->func (index, job->user_data);
+          pipevec_trace_record ("parallel", "task", start_ns, pipevec_trace_now (), "index", index);
+          continue;
+        }
+
+      job->func (index, job->user_data);
+    }
+
+  pipevec_sysprof_add_busy_threads (-1);
+}
+
+static void
+worker_func (gpointer data,
+             gpointer user_data G_GNUC_UNUSED)
+{
+  PipevecParallelJob *job = data;
+
+  /* Time spent in the pool's queue before a thread picked the job up */
+  if (job->tracing)
+    pipevec_trace_record ("parallel", "queue_wait", job->start_ns, pipevec_trace_now (), NULL, 0);
+
+  g_private_set (&in_worker, GUINT_TO_POINTER (TRUE));
+  run_tasks (job);
+
+  g_mutex_lock (&job->lock);
+  if (--job->n_running_workers == 0)
+    g_cond_signal (&job->done);
+  g_mutex_unlock (&job->lock);
+}
+
+static void
+ensure_pool (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *requested = g_getenv ("PIPEVEC_NUM_THREADS");
+
+      n_threads = requested != NULL ? (size_t) g_ascii_strtoull (requested, NULL, 10) : 0;
+
+      if (n_threads == 0)
+        n_threads = g_get_num_processors ();
+
+      /* The calling thread is one of the n_threads */
+      if (n_threads > 1)
+        worker_pool = g_thread_pool_new (worker_func,
+                                         NULL,
+                                         (gint) n_threads - 1,
+                                         FALSE,
+                                         NULL);
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/**
+ * pipevec_parallel_get_n_threads:
+ *
+ * Get the number of threads that pipevec_parallel_for() spreads work
+ * over, including the calling thread. This is the number of processors
+ * unless overridden with the PIPEVEC_NUM_THREADS environment variable.
+ *
+ * Returns: The number of threads, at least 1.
+ */
+size_t
+pipevec_parallel_get_n_threads (void)
+{
+  ensure_pool ();
+
+  return n_threads;
+}
+
+/**
+ * pipevec_parallel_for:
+ * @n_tasks: Number of tasks to run.
+ * @func: (scope call): Function called once with each index in [0, @n_tasks).
+ * @user_data: Data passed to @func.
+ *
+ * Run @func for every task index, spread over the shared worker
+ * threads, and return once all of them have completed. Tasks may run
+ * in any order and concurrently, so they must not write to shared
+ * state without synchronisation.
+ */
+void
+pipevec_parallel_for (size_t              n_tasks,
+                      PipevecParallelFunc func,
+                      gpointer            user_data)
+{
+  pipevec_parallel_for_n_threads (n_tasks, 0, func, user_data);
+}
+
+/**
+ * pipevec_parallel_for_n_threads:
+ * @n_tasks: Number of tasks to run.
+ * @max_threads: Most threads to spread the tasks over, including the
+ *               calling thread, or 0 for all of them.
+ * @func: (scope call): Function called once with each index in [0, @n_tasks).
+ * @user_data: Data passed to @func.
+ *
+ * Like pipevec_parallel_for(), but wake at most @max_threads - 1
+ * workers. With @max_threads set to 1 the tasks run on the calling
+ * thread without touching the pool at all.
+ */
+void
+pipevec_parallel_for_n_threads (size_t              n_tasks,
+                                size_t              max_threads,
+                                PipevecParallelFunc func,
+                                gpointer            user_data)
+{
+  ensure_pool ();
+
+  if (max_threads == 0)
+    max_threads = n_threads;
+
+  if (worker_pool == NULL ||
+      n_tasks < 2 ||
+      max_threads < 2 ||
+      g_private_get (&in_worker) != NULL)
+    {
+      for (size_t i = 0; i < n_tasks; ++i)
+        func (i, user_data);
+
+      return;
+    }
+
+  PipevecParallelJob job = {
+    .func = func,
+    .user_data = user_data,
+    .n_tasks = n_tasks,
+    .next_task = 0,
+    .n_running_workers = MIN (n_tasks, MIN (n_threads, max_threads)) - 1,
+    .tracing = pipevec_trace_get_active ()
+  };
+
+  if (job.tracing)
+    job.start_ns = pipevec_trace_now ();
+
+  g_mutex_init (&job.lock);
+  g_cond_init (&job.done);
+
+  size_t n_workers = job.n_running_workers;
+
+  for (size_t i = 0; i < n_workers; ++i)
+    g_thread_pool_push (worker_pool, &job, NULL);
+
+  run_tasks (&job);
+
+  guint64 join_start_ns = job.tracing ? pipevec_trace_now () : 0;
+
+  /* The job lives on our stack, so wait for every worker to let
+   * go of it, not just for the last task to finish */
+  g_mutex_lock (&job.lock);
+  while (job.n_running_workers > 0)
+    g_cond_wait (&job.done, &job.lock);
+  g_mutex_unlock (&job.lock);
+
+  /* Time waiting on slower workers shows how unbalanced the loop was */
+  if (job.tracing)
+    {
+      guint64 end_ns = pipevec_trace_now ();
+
+      pipevec_trace_record ("parallel", "join_wait", join_start_ns, end_ns, NULL, 0);
+      pipevec_trace_record ("parallel", "parallel_for", job.start_ns, end_ns, "n_tasks", n_tasks);
+    }
+
+  g_mutex_clear (&job.lock);
+  g_cond_clear (&job.done);
+}
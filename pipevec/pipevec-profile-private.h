@@ -0,0 +1,86 @@
+/*
+ * /pipevec/pipevec-profile-private.h
+ *
+ * Instrumentation hooks for the profiling counters.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include <pipevec/pipevec-profile.h>
+
+G_BEGIN_DECLS
+
+/* A profiled call to a public operation. Declare one with
+ *
+ *   g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (op);
+ *
+ * at the start of the operation and call
+ * pipevec_profile_scope_set_traffic() once it has succeeded. The
+ * call is recorded when the scope goes out of scope. Operations
+ * called by other operations are not counted separately, their
+ * cost is part of the outermost one, but they do show up nested
+ * inside it in traces and Sysprof captures, where
+ * pipevec_profile_scope_set_shape() adds the shape of the main
+ * operand to the mark. */
+typedef struct {
+  PipevecProfileOp op;
+  gboolean recording;
+  gboolean nested;
+  gboolean tracing;
+  gboolean marking;
+  GArray *shape;
+  guint64 start_ns;
+  guint64 start_allocations;
+  guint64 start_allocated_bytes;
+  guint64 bytes_read;
+  guint64 bytes_written;
+  guint64 flops;
+} PipevecProfileScope;
+
+PipevecProfileScope pipevec_profile_scope_begin (PipevecProfileOp op);
+
+void pipevec_profile_scope_end (PipevecProfileScope *scope);
+
+static inline void
+pipevec_profile_scope_set_traffic (PipevecProfileScope *scope,
+                                   guint64              bytes_read,
+                                   guint64              bytes_written,
+                                   guint64              flops)
+{
+  scope->bytes_read = bytes_read;
+  scope->bytes_written = bytes_written;
+  scope->flops = flops;
+}
+
+static inline void
+pipevec_profile_scope_set_shape (PipevecProfileScope *scope,
+                                 GArray              *shape)
+{
+  /* Copied, since tensors reuse their shape arrays once finalized */
+  if (scope->marking && scope->shape == NULL)
+    scope->shape = g_array_copy (shape);
+}
+
+void pipevec_profile_count_allocation (size_t bytes);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (PipevecProfileScope, pipevec_profile_scope_end)
+
+G_END_DECLS
@@ -0,0 +1,429 @@
+/*
+ * /pipevec/pipevec-profile.c
+ *
+ * Per-operation profiling counters.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-profile.h>
+#include <pipevec/pipevec-profile-private.h>
+#include <pipevec/pipevec-sysprof-private.h>
+#include <pipevec/pipevec-trace-private.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Profiling is off unless PIPEVEC_PROFILE=1 is set in the environment,
+ * in which case a summary is printed to stderr when the process exits,
+ * or it is turned on with pipevec_profile_set_enabled(). While it is
+ * off, an operation only checks a flag when it starts. Byte and FLOP
+ * counts are computed from the logical shapes of the operands, so
+ * they do not include padding, temporary copies or the packing that
+ * the matrix product does internally. */
+
+struct _PipevecProfileSnapshot {
+  PipevecProfileCounters counters[PIPEVEC_PROFILE_N_OPS];
+};
+
+/* Operations that are in progress on one thread, so that nested
+ * operations and allocations go to the outermost operation */
+typedef struct {
+  guint depth;
+  guint64 allocations;
+  guint64 allocated_bytes;
+} PipevecProfileThreadState;
+
+static const char *op_names[] = {
+  "set_data",
+  "get_data",
+  "reshape",
+  "copy",
+  "map",
+  "add_tensor",
+  "add_scalar",
+  "sub_tensor",
+  "sub_scalar",
+  "multiply_tensor",
+  "multiply_scalar",
+  "divide_tensor",
+  "divide_scalar",
+  "inner_product",
+  "pack_for_matmul",
+  "einsum",
+  "tensordot",
+  "cholesky",
+  "lu",
+  "triangular_solve",
+  "solve",
+  "qr",
+  "lstsq",
+  "eigh",
+  "concat",
+  "split",
+  "permute",
+  "compare",
+  "hash"
+};
+
+G_STATIC_ASSERT (G_N_ELEMENTS (op_names) == PIPEVEC_PROFILE_N_OPS);
+
+static gint profile_enabled = FALSE;
+static GMutex counters_lock;
+static PipevecProfileCounters counters[PIPEVEC_PROFILE_N_OPS];
+static GPrivate thread_state = G_PRIVATE_INIT (g_free);
+
+G_DEFINE_BOXED_TYPE (PipevecProfileSnapshot,
+                     pipevec_profile_snapshot,
+                     pipevec_profile_snapshot_copy,
+                     pipevec_profile_snapshot_free)
+
+static PipevecProfileThreadState *
+get_thread_state (void)
+{
+  PipevecProfileThreadState *state = g_private_get (&thread_state);
+
+  if (state == NULL)
+    {
+      state = g_new0 (PipevecProfileThreadState, 1);
+      g_private_set (&thread_state, state);
+    }
+
+  return state;
+}
+
+static void
+print_summary_at_exit (void)
+{
+  g_autoptr(PipevecProfileSnapshot) snapshot = pipevec_profile_get_snapshot ();
+  g_autofree char *summary = pipevec_profile_snapshot_to_string (snapshot);
+
+  g_printerr ("%s", summary);
+}
+
+static void
+ensure_initialized (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      if (g_strcmp0 (g_getenv ("PIPEVEC_PROFILE"), "1") == 0)
+        {
+          g_atomic_int_set (&profile_enabled, TRUE);
+          atexit (print_summary_at_exit);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/**
+ * pipevec_profile_scope_begin:
+ * @op: The #PipevecProfileOp being called.
+ *
+ * Start timing a call to @op if profiling is enabled and no other
+ * operation is in progress on this thread, or if a trace or a
+ * Sysprof capture is being recorded.
+ *
+ * Returns: A #PipevecProfileScope to pass to pipevec_profile_scope_end().
+ */
+PipevecProfileScope
+pipevec_profile_scope_begin (PipevecProfileOp op)
+{
+  PipevecProfileScope scope = {
+    .op = op,
+    .tracing = pipevec_trace_get_active (),
+    .marking = pipevec_sysprof_get_active ()
+  };
+
+  if (G_LIKELY (!pipevec_profile_get_enabled ()))
+    {
+      if (scope.tracing || scope.marking)
+        scope.start_ns = pipevec_trace_now ();
+
+      return scope;
+    }
+
+  PipevecProfileThreadState *state = get_thread_state ();
+
+  if (state->depth++ > 0)
+    scope.nested = TRUE;
+  else
+    scope.recording = TRUE;
+
+  scope.start_allocations = state->allocations;
+  scope.start_allocated_bytes = state->allocated_bytes;
+  scope.start_ns = pipevec_trace_now ();
+
+  return scope;
+}
+
+/**
+ * pipevec_profile_scope_end:
+ * @scope: A #PipevecProfileScope from pipevec_profile_scope_begin().
+ *
+ * Add the call in @scope to the counters for its operation and
+ * to the trace and the Sysprof capture.
+ */
+void
+pipevec_profile_scope_end (PipevecProfileScope *scope)
+{
+  if (!scope->recording && !scope->nested && !scope->tracing && !scope->marking)
+    return;
+
+  guint64 end_ns = pipevec_trace_now ();
+
+  if (scope->tracing)
+    pipevec_trace_record ("op", op_names[scope->op], scope->start_ns, end_ns, NULL, 0);
+
+  if (scope->marking)
+    {
+      pipevec_sysprof_mark (op_names[scope->op],
+                            scope->start_ns,
+                            end_ns,
+                            scope->shape,
+                            scope->bytes_read + scope->bytes_written);
+      g_clear_pointer (&scope->shape, g_array_unref);
+    }
+
+  if (!scope->recording && !scope->nested)
+    return;
+
+  PipevecProfileThreadState *state = get_thread_state ();
+
+  --state->depth;
+
+  if (!scope->recording)
+    return;
+
+  guint64 elapsed_ns = end_ns - scope->start_ns;
+  PipevecProfileCounters *op_counters = &counters[scope->op];
+
+  g_mutex_lock (&counters_lock);
+  op_counters->calls += 1;
+  op_counters->wall_time_ns += elapsed_ns;
+  op_counters->bytes_read += scope->bytes_read;
+  op_counters->bytes_written += scope->bytes_written;
+  op_counters->flops += scope->flops;
+  op_counters->allocations += state->allocations - scope->start_allocations;
+  op_counters->allocated_bytes += state->allocated_bytes - scope->start_allocated_bytes;
+  g_mutex_unlock (&counters_lock);
+}
+
+/**
+ * pipevec_profile_count_allocation:
+ * @bytes: The size of the allocation.
+ *
+ * Count an allocation of tensor storage against the operation in
+ * progress on this thread, if any.
+ */
+void
+pipevec_profile_count_allocation (size_t bytes)
+{
+  if (G_LIKELY (!pipevec_profile_get_enabled ()))
+    return;
+
+  PipevecProfileThreadState *state = get_thread_state ();
+
+  if (state->depth == 0)
+    return;
+
+  state->allocations += 1;
+  state->allocated_bytes += bytes;
+}
+
+/**
+ * pipevec_profile_get_enabled:
+ *
+ * Check whether operations are being profiled.
+ *
+ * Returns: %TRUE if profiling counters are being collected.
+ */
+gboolean
+pipevec_profile_get_enabled (void)
+{
+  ensure_initialized ();
+
+  return g_atomic_int_get (&profile_enabled);
+}
+
+/**
+ * pipevec_profile_set_enabled:
+ * @enabled: Whether to collect profiling counters.
+ *
+ * Start or stop collecting profiling counters. Counters collected
+ * so far are kept until pipevec_profile_reset() is called. The
+ * summary at exit is only printed when profiling was enabled with
+ * the `PIPEVEC_PROFILE=1` environment variable.
+ */
+void
+pipevec_profile_set_enabled (gboolean enabled)
+{
+  ensure_initialized ();
+
+  g_atomic_int_set (&profile_enabled, enabled);
+}
+
+/**
+ * pipevec_profile_reset:
+ *
+ * Set all of the profiling counters back to zero.
+ */
+void
+pipevec_profile_reset (void)
+{
+  g_mutex_lock (&counters_lock);
+  memset (counters, 0, sizeof (counters));
+  g_mutex_unlock (&counters_lock);
+}
+
+/**
+ * pipevec_profile_get_snapshot:
+ *
+ * Get a copy of the profiling counters of every operation, as
+ * they are now.
+ *
+ * Returns: (transfer full): A new #PipevecProfileSnapshot.
+ */
+PipevecProfileSnapshot *
+pipevec_profile_get_snapshot (void)
+{
+  PipevecProfileSnapshot *snapshot = g_new (PipevecProfileSnapshot, 1);
+
+  g_mutex_lock (&counters_lock);
+  memcpy (snapshot->counters, counters, sizeof (counters));
+  g_mutex_unlock (&counters_lock);
+
+  return snapshot;
+}
+
+/**
+ * pipevec_profile_snapshot_copy:
+ * @snapshot: A #PipevecProfileSnapshot
+ *
+ * Copy @snapshot.
+ *
+ * Returns: (transfer full): A new #PipevecProfileSnapshot.
+ */
+PipevecProfileSnapshot *
+pipevec_profile_snapshot_copy (PipevecProfileSnapshot *snapshot)
+{
+  PipevecProfileSnapshot *copy = g_new (PipevecProfileSnapshot, 1);
+
+  *copy = *snapshot;
+
+  return copy;
+}
+
+/**
+ * pipevec_profile_snapshot_free:
+ * @snapshot: A #PipevecProfileSnapshot
+ *
+ * Free @snapshot.
+ */
+void
+pipevec_profile_snapshot_free (PipevecProfileSnapshot *snapshot)
+{
+  g_free (snapshot);
+}
+
+/**
+ * pipevec_profile_snapshot_get_counters:
+ * @snapshot: A #PipevecProfileSnapshot
+ * @op: A #PipevecProfileOp
+ *
+ * Get the counters for @op in @snapshot.
+ *
+ * Returns: (transfer none): The #PipevecProfileCounters for @op.
+ */
+const PipevecProfileCounters *
+pipevec_profile_snapshot_get_counters (PipevecProfileSnapshot *snapshot,
+                                       PipevecProfileOp        op)
+{
+  g_return_val_if_fail (op < PIPEVEC_PROFILE_N_OPS, NULL);
+
+  return &snapshot->counters[op];
+}
+
+/**
+ * pipevec_profile_snapshot_to_string:
+ * @snapshot: A #PipevecProfileSnapshot
+ *
+ * Format the counters in @snapshot as a table, with one row for
+ * each operation that was called at least once.
+ *
+ * Returns: (transfer full): The formatted table.
+ */
+char *
+pipevec_profile_snapshot_to_string (PipevecProfileSnapshot *snapshot)
+{
+  GString *summary = g_string_new (NULL);
+
+  g_string_append_printf (summary,
+                          "%-18s %10s %12s %10s %10s %10s %10s %9s %8s %10s\n",
+                          "op",
+                          "calls",
+                          "total ms",
+                          "mean us",
+                          "MB read",
+                          "MB written",
+                          "GFLOP",
+                          "GFLOP/s",
+                          "allocs",
+                          "MB alloc");
+
+  for (size_t op = 0; op < PIPEVEC_PROFILE_N_OPS; ++op)
+    {
+      const PipevecProfileCounters *op_counters = &snapshot->counters[op];
+      double seconds = op_counters->wall_time_ns / 1e9;
+
+      if (op_counters->calls == 0)
+        continue;
+
+      g_string_append_printf (summary,
+                              "%-18s %10" G_GUINT64_FORMAT " %12.3f %10.3f %10.3f %10.3f %10.3f %9.3f %8" G_GUINT64_FORMAT " %10.3f\n",
+                              op_names[op],
+                              op_counters->calls,
+                              op_counters->wall_time_ns / 1e6,
+                              op_counters->wall_time_ns / 1e3 / op_counters->calls,
+                              op_counters->bytes_read / 1e6,
+                              op_counters->bytes_written / 1e6,
+                              op_counters->flops / 1e9,
+                              seconds > 0.0 ? op_counters->flops / 1e9 / seconds : 0.0,
+                              op_counters->allocations,
+                              op_counters->allocated_bytes / 1e6);
+    }
+
+  return g_string_free (summary, FALSE);
+}
+
+/**
+ * pipevec_profile_op_get_name:
+ * @op: A #PipevecProfileOp
+ *
+ * Get the name of @op as it appears in profiling summaries.
+ *
+ * Returns: (transfer none): The name of @op.
+ */
+const char *
+pipevec_profile_op_get_name (PipevecProfileOp op)
+{
+  g_return_val_if_fail (op < PIPEVEC_PROFILE_N_OPS, NULL);
+
+  return op_names[op];
+}
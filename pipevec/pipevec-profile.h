@@ -0,0 +1,149 @@
+/*
+ * /pipevec/pipevec-profile.h
+ *
+ * Per-operation profiling counters.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PipevecProfileOp:
+ * @PIPEVEC_PROFILE_OP_SET_DATA: pipevec_tensor_set_data()
+ * @PIPEVEC_PROFILE_OP_GET_DATA: pipevec_tensor_get_data()
+ * @PIPEVEC_PROFILE_OP_RESHAPE: pipevec_tensor_reshape()
+ * @PIPEVEC_PROFILE_OP_COPY: pipevec_tensor_copy()
+ * @PIPEVEC_PROFILE_OP_MAP: pipevec_tensor_map()
+ * @PIPEVEC_PROFILE_OP_ADD_TENSOR: pipevec_tensor_add_tensor()
+ * @PIPEVEC_PROFILE_OP_ADD_SCALAR: pipevec_tensor_add_scalar()
+ * @PIPEVEC_PROFILE_OP_SUB_TENSOR: pipevec_tensor_sub_tensor()
+ * @PIPEVEC_PROFILE_OP_SUB_SCALAR: pipevec_tensor_sub_scalar()
+ * @PIPEVEC_PROFILE_OP_MULTIPLY_TENSOR: pipevec_tensor_multiply_tensor()
+ * @PIPEVEC_PROFILE_OP_MULTIPLY_SCALAR: pipevec_tensor_multiply_scalar()
+ * @PIPEVEC_PROFILE_OP_DIVIDE_TENSOR: pipevec_tensor_divide_tensor()
+ * @PIPEVEC_PROFILE_OP_DIVIDE_SCALAR: pipevec_tensor_divide_scalar()
+ * @PIPEVEC_PROFILE_OP_INNER_PRODUCT: All of the inner product variants,
+ *                                    fused and packed.
+ * @PIPEVEC_PROFILE_OP_PACK_FOR_MATMUL: pipevec_tensor_pack_for_matmul()
+ * @PIPEVEC_PROFILE_OP_EINSUM: pipevec_tensor_einsum()
+ * @PIPEVEC_PROFILE_OP_TENSORDOT: pipevec_tensor_tensordot()
+ * @PIPEVEC_PROFILE_OP_CHOLESKY: pipevec_tensor_cholesky()
+ * @PIPEVEC_PROFILE_OP_LU: pipevec_tensor_lu()
+ * @PIPEVEC_PROFILE_OP_TRIANGULAR_SOLVE: pipevec_tensor_triangular_solve()
+ * @PIPEVEC_PROFILE_OP_SOLVE: pipevec_tensor_solve()
+ * @PIPEVEC_PROFILE_OP_QR: pipevec_tensor_qr()
+ * @PIPEVEC_PROFILE_OP_LSTSQ: pipevec_tensor_lstsq()
+ * @PIPEVEC_PROFILE_OP_EIGH: pipevec_tensor_eigh()
+ * @PIPEVEC_PROFILE_OP_CONCAT: pipevec_tensor_concat()
+ * @PIPEVEC_PROFILE_OP_SPLIT: pipevec_tensor_split() and
+ *                            pipevec_tensor_chunk()
+ * @PIPEVEC_PROFILE_OP_PERMUTE: pipevec_tensor_permute() and
+ *                              pipevec_tensor_transpose()
+ * @PIPEVEC_PROFILE_OP_COMPARE: pipevec_tensor_equal() and
+ *                              pipevec_tensor_allclose()
+ * @PIPEVEC_PROFILE_OP_HASH: pipevec_tensor_hash()
+ * @PIPEVEC_PROFILE_N_OPS: The number of operation types.
+ *
+ * The types of operation that profiling counters are kept for.
+ */
+typedef enum {
+  PIPEVEC_PROFILE_OP_SET_DATA,
+  PIPEVEC_PROFILE_OP_GET_DATA,
+  PIPEVEC_PROFILE_OP_RESHAPE,
+  PIPEVEC_PROFILE_OP_COPY,
+  PIPEVEC_PROFILE_OP_MAP,
+  PIPEVEC_PROFILE_OP_ADD_TENSOR,
+  PIPEVEC_PROFILE_OP_ADD_SCALAR,
+  PIPEVEC_PROFILE_OP_SUB_TENSOR,
+  PIPEVEC_PROFILE_OP_SUB_SCALAR,
+  PIPEVEC_PROFILE_OP_MULTIPLY_TENSOR,
+  PIPEVEC_PROFILE_OP_MULTIPLY_SCALAR,
+  PIPEVEC_PROFILE_OP_DIVIDE_TENSOR,
+  PIPEVEC_PROFILE_OP_DIVIDE_SCALAR,
+  PIPEVEC_PROFILE_OP_INNER_PRODUCT,
+  PIPEVEC_PROFILE_OP_PACK_FOR_MATMUL,
+  PIPEVEC_PROFILE_OP_EINSUM,
+  PIPEVEC_PROFILE_OP_TENSORDOT,
+  PIPEVEC_PROFILE_OP_CHOLESKY,
+  PIPEVEC_PROFILE_OP_LU,
+  PIPEVEC_PROFILE_OP_TRIANGULAR_SOLVE,
+  PIPEVEC_PROFILE_OP_SOLVE,
+  PIPEVEC_PROFILE_OP_QR,
+  PIPEVEC_PROFILE_OP_LSTSQ,
+  PIPEVEC_PROFILE_OP_EIGH,
+  PIPEVEC_PROFILE_OP_CONCAT,
+  PIPEVEC_PROFILE_OP_SPLIT,
+  PIPEVEC_PROFILE_OP_PERMUTE,
+  PIPEVEC_PROFILE_OP_COMPARE,
+  PIPEVEC_PROFILE_OP_HASH,
+  PIPEVEC_PROFILE_N_OPS
+} PipevecProfileOp;
+
+/**
+ * PipevecProfileCounters:
+ * @calls: Number of calls, including ones that failed.
+ * @wall_time_ns: Total wall clock time spent in the calls, in nanoseconds.
+ * @bytes_read: Bytes of tensor elements read by successful calls.
+ * @bytes_written: Bytes of tensor elements written by successful calls.
+ * @flops: Floating point operations done by successful calls.
+ * @allocations: Number of tensor storage allocations.
+ * @allocated_bytes: Bytes of tensor storage allocated.
+ *
+ * Counters accumulated for one type of operation.
+ */
+typedef struct {
+  guint64 calls;
+  guint64 wall_time_ns;
+  guint64 bytes_read;
+  guint64 bytes_written;
+  guint64 flops;
+  guint64 allocations;
+  guint64 allocated_bytes;
+} PipevecProfileCounters;
+
+typedef struct _PipevecProfileSnapshot PipevecProfileSnapshot;
+
+#define PIPEVEC_TYPE_PROFILE_SNAPSHOT (pipevec_profile_snapshot_get_type ())
+GType pipevec_profile_snapshot_get_type (void);
+
+gboolean pipevec_profile_get_enabled (void);
+
+void pipevec_profile_set_enabled (gboolean enabled);
+
+void pipevec_profile_reset (void);
+
+PipevecProfileSnapshot * pipevec_profile_get_snapshot (void);
+
+PipevecProfileSnapshot * pipevec_profile_snapshot_copy (PipevecProfileSnapshot *snapshot);
+
+void pipevec_profile_snapshot_free (PipevecProfileSnapshot *snapshot);
+
+const PipevecProfileCounters * pipevec_profile_snapshot_get_counters (PipevecProfileSnapshot *snapshot,
+                                                                       PipevecProfileOp        op);
+
+char * pipevec_profile_snapshot_to_string (PipevecProfileSnapshot *snapshot);
+
+const char * pipevec_profile_op_get_name (PipevecProfileOp op);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PipevecProfileSnapshot, pipevec_profile_snapshot_free)
+
+G_END_DECLS
@@ -0,0 +1,76 @@
+/*
+ * /pipevec/pipevec-sysprof-private.h
+ *
+ * Sysprof capture marks and counters.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* When pipevec is built against sysprof-capture, operations leave a
+ * mark in the capture of any Sysprof session that the process is
+ * running under, and the live tensor storage and the number of busy
+ * threads are published as counters. Otherwise these compile out. */
+#ifdef PIPEVEC_HAVE_SYSPROF
+
+gboolean pipevec_sysprof_get_active (void);
+
+void pipevec_sysprof_mark (const char *name,
+                           guint64     start_ns,
+                           guint64     end_ns,
+                           GArray     *shape,
+                           guint64     bytes);
+
+void pipevec_sysprof_set_live_bytes (gint64 value);
+
+void pipevec_sysprof_add_busy_threads (gint delta);
+
+#else
+
+static inline gboolean
+pipevec_sysprof_get_active (void)
+{
+  return FALSE;
+}
+
+static inline void
+pipevec_sysprof_mark (const char *name G_GNUC_UNUSED,
+                      guint64     start_ns G_GNUC_UNUSED,
+                      guint64     end_ns G_GNUC_UNUSED,
+                      GArray     *shape G_GNUC_UNUSED,
+                      guint64     bytes G_GNUC_UNUSED)
+{
+}
+
+static inline void
+pipevec_sysprof_set_live_bytes (gint64 value G_GNUC_UNUSED)
+{
+}
+
+static inline void
+pipevec_sysprof_add_busy_threads (gint delta G_GNUC_UNUSED)
+{
+}
+
+#endif
+
+G_END_DECLS
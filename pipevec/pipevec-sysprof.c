@@ -0,0 +1,177 @@
+/*
+ * /pipevec/pipevec-sysprof.c
+ *
+ * Sysprof capture marks and counters.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-sysprof-private.h>
+
+#ifdef PIPEVEC_HAVE_SYSPROF
+
+#include <sysprof-capture.h>
+
+/* The collector writes to a ring buffer shared with Sysprof and does
+ * nothing when the process was not started under a Sysprof session,
+ * so there is nothing to turn on here. Timestamps from
+ * pipevec_trace_now() use the same clock as Sysprof. */
+
+enum {
+  COUNTER_LIVE_BYTES,
+  COUNTER_BUSY_THREADS,
+  N_COUNTERS
+};
+
+static gint busy_threads = 0;
+static guint counter_ids[N_COUNTERS];
+
+static void
+define_counter (SysprofCaptureCounter *counter,
+                guint                  id,
+                const char            *name,
+                const char            *description)
+{
+  g_strlcpy (counter->category, "pipevec", sizeof (counter->category));
+  g_strlcpy (counter->name, name, sizeof (counter->name));
+  g_strlcpy (counter->description, description, sizeof (counter->description));
+  counter->id = id;
+  counter->type = SYSPROF_CAPTURE_COUNTER_INT64;
+  counter->value.v64 = 0;
+}
+
+static void
+ensure_counters (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      SysprofCaptureCounter counters[N_COUNTERS];
+      guint base = sysprof_collector_request_counters (N_COUNTERS);
+
+      for (guint i = 0; i < N_COUNTERS; ++i)
+        counter_ids[i] = base + i;
+
+      define_counter (&counters[COUNTER_LIVE_BYTES],
+                      counter_ids[COUNTER_LIVE_BYTES],
+                      "Live tensor bytes",
+                      "Bytes of tensor storage allocated");
+      define_counter (&counters[COUNTER_BUSY_THREADS],
+                      counter_ids[COUNTER_BUSY_THREADS],
+                      "Busy threads",
+                      "Threads running parallel tasks");
+      sysprof_collector_define_counters (counters, N_COUNTERS);
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+static void
+set_counter (guint  counter,
+             gint64 value)
+{
+  SysprofCaptureCounterValue counter_value = { .v64 = value };
+
+  ensure_counters ();
+  sysprof_collector_set_counters (&counter_ids[counter], &counter_value, 1);
+}
+
+/**
+ * pipevec_sysprof_get_active:
+ *
+ * Check whether the process is running under a Sysprof session.
+ *
+ * Returns: %TRUE if marks will be written to a capture.
+ */
+gboolean
+pipevec_sysprof_get_active (void)
+{
+  return sysprof_collector_is_active ();
+}
+
+/**
+ * pipevec_sysprof_mark:
+ * @name: Name of the operation.
+ * @start_ns: When the operation started, from pipevec_trace_now().
+ * @end_ns: When the operation finished.
+ * @shape: (nullable): Shape of the main operand, if any.
+ * @bytes: Bytes read and written by the operation.
+ *
+ * Add a mark for a call to @name to the capture.
+ */
+void
+pipevec_sysprof_mark (const char *name,
+                      guint64     start_ns,
+                      guint64     end_ns,
+                      GArray     *shape,
+                      guint64     bytes)
+{
+  g_autoptr(GString) message = g_string_new (NULL);
+
+  if (shape != NULL)
+    {
+      g_string_append_c (message, '[');
+
+      for (guint i = 0; i < shape->len; ++i)
+        g_string_append_printf (message,
+                                "%s%" G_GSIZE_FORMAT,
+                                i > 0 ? ", " : "",
+                                g_array_index (shape, size_t, i));
+
+      g_string_append (message, "], ");
+    }
+
+  g_string_append_printf (message, "%" G_GUINT64_FORMAT " bytes", bytes);
+
+  sysprof_collector_mark ((gint64) start_ns,
+                          (gint64) (end_ns - start_ns),
+                          "pipevec",
+                          name,
+                          message->str);
+}
+
+/**
+ * pipevec_sysprof_set_live_bytes:
+ * @value: Bytes of tensor storage allocated.
+ *
+ * Update the live tensor storage counter after tensor storage was
+ * allocated or freed.
+ */
+void
+pipevec_sysprof_set_live_bytes (gint64 value)
+{
+  if (sysprof_collector_is_active ())
+    set_counter (COUNTER_LIVE_BYTES, value);
+}
+
+/**
+ * pipevec_sysprof_add_busy_threads:
+ * @delta: Change in the number of threads running parallel tasks.
+ *
+ * Track threads starting or finishing their share of a parallel loop.
+ */
+void
+pipevec_sysprof_add_busy_threads (gint delta)
+{
+  gint value = g_atomic_int_add (&busy_threads, delta) + delta;
+
+  if (sysprof_collector_is_active ())
+    set_counter (COUNTER_BUSY_THREADS, value);
+}
+
+#endif
@@ -0,0 +1,1207 @@
+/*
+ * /pipevec/pipevec-tensor-einsum.c
+ *
+ * Einstein summation over Pipevec Tensors.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-tensor-einsum.h>
+#include <pipevec/pipevec-tensor-private.h>
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-dispatch-private.h>
+#include <pipevec/pipevec-profile-private.h>
+#include <pipevec/pipevec-errors.h>
+
+#include <math.h>
+
+/* Subscripts are the letters a-z and A-Z, so a set of them
+ * fits in a single 64 bit mask */
+#define PIPEVEC_EINSUM_MAX_LABELS 52
+
+/* The longest subscript allowed for a single operand, counting
+ * repeated labels */
+#define PIPEVEC_EINSUM_MAX_DIMS 32
+
+/* Contraction orders are searched exhaustively for at most this
+ * many operands and chosen greedily beyond that */
+#define PIPEVEC_EINSUM_OPTIMAL_PATH_MAX_OPERANDS 5
+
+typedef guint64 EinsumLabelSet;
+
+/* A strided view of an operand with one entry per distinct label.
+ * Repeated labels in a subscript (a diagonal) are folded into one
+ * entry whose stride is the sum of the strides of the repeats. */
+typedef struct {
+  size_t     n_dims;
+  int        labels[PIPEVEC_EINSUM_MAX_LABELS];
+  size_t     sizes[PIPEVEC_EINSUM_MAX_LABELS];
+  ptrdiff_t  strides[PIPEVEC_EINSUM_MAX_LABELS];
+  float     *data;
+
+  /* Intermediate results own their storage */
+  float     *owned_data;
+} EinsumOperand;
+
+typedef struct {
+  size_t n_dims;
+  int    labels[PIPEVEC_EINSUM_MAX_DIMS];
+} EinsumTerm;
+
+static int
+einsum_label_from_char (char c)
+{
+  if (c >= 'a' && c <= 'z')
+    return c - 'a';
+
+  if (c >= 'A' && c <= 'Z')
+    return 26 + c - 'A';
+
+  return -1;
+}
+
+static char
+einsum_char_from_label (int label)
+{
+  return label < 26 ? 'a' + label : 'A' + label - 26;
+}
+
+static EinsumLabelSet
+einsum_operand_label_set (const EinsumOperand *operand)
+{
+  EinsumLabelSet set = 0;
+
+  for (size_t i = 0; i < operand->n_dims; ++i)
+    set |= G_GUINT64_CONSTANT (1) << operand->labels[i];
+
+  return set;
+}
+
+static gboolean
+einsum_set_contains (EinsumLabelSet set,
+                     int            label)
+{
+  return (set & (G_GUINT64_CONSTANT (1) << label)) != 0;
+}
+
+static ptrdiff_t
+einsum_operand_stride_for_label (const EinsumOperand *operand,
+                                 int                  label)
+{
+  for (size_t i = 0; i < operand->n_dims; ++i)
+    if (operand->labels[i] == label)
+      return operand->strides[i];
+
+  return 0;
+}
+
+static void
+einsum_operand_clear (EinsumOperand *operand)
+{
+  g_clear_pointer (&operand->owned_data, g_free);
+}
+
+/* Parse "ij,jk->ik" into one term per operand and an output term. When
+ * there is no "->", the output is every label used exactly once, in
+ * alphabetical order. */
+static gboolean
+einsum_parse (const char  *subscripts,
+              size_t       n_operands,
+              EinsumTerm  *inputs,
+              EinsumTerm  *output,
+              GError     **error)
+{
+  size_t n_terms = 0;
+  gboolean in_output = FALSE;
+  EinsumTerm *term = &inputs[0];
+  size_t counts[PIPEVEC_EINSUM_MAX_LABELS] = { 0 };
+
+  if (n_operands == 0)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Einsum needs at least one operand");
+      return FALSE;
+    }
+
+  memset (inputs, 0, sizeof (EinsumTerm) * n_operands);
+  memset (output, 0, sizeof (EinsumTerm));
+
+  for (const char *p = subscripts; *p != '\0'; ++p)
+    {
+      if (*p == ' ')
+        continue;
+
+      if (*p == ',' && !in_output)
+        {
+          if (++n_terms == n_operands)
+            break;
+
+          term = &inputs[n_terms];
+          continue;
+        }
+
+      if (*p == '-' && p[1] == '>' && !in_output)
+        {
+          in_output = TRUE;
+          term = output;
+          ++p;
+          continue;
+        }
+
+      int label = einsum_label_from_char (*p);
+
+      if (label < 0 || term->n_dims == PIPEVEC_EINSUM_MAX_DIMS)
+        {
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_INVALID_ARGUMENT,
+                       "Invalid einsum subscripts \"%s\" at position %zu",
+                       subscripts,
+                       (size_t) (p - subscripts));
+          return FALSE;
+        }
+
+      term->labels[term->n_dims++] = label;
+
+      if (!in_output)
+        ++counts[label];
+    }
+
+  if (n_terms + 1 != n_operands)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Einsum subscripts \"%s\" do not describe %zu operands",
+                   subscripts,
+                   n_operands);
+      return FALSE;
+    }
+
+  if (!in_output)
+    {
+      /* Uppercase sorts before lowercase, as in ASCII */
+      for (int i = 0; i < PIPEVEC_EINSUM_MAX_LABELS; ++i)
+        {
+          int label = (i + 26) % PIPEVEC_EINSUM_MAX_LABELS;
+
+          if (counts[label] == 1)
+            output->labels[output->n_dims++] = label;
+        }
+
+      return TRUE;
+    }
+
+  EinsumLabelSet seen = 0;
+
+  for (size_t i = 0; i < output->n_dims; ++i)
+    {
+      int label = output->labels[i];
+
+      if (counts[label] == 0 || einsum_set_contains (seen, label))
+        {
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_INVALID_ARGUMENT,
+                       "Output subscript '%c' in \"%s\" must appear once in the output and in some input",
+                       einsum_char_from_label (label),
+                       subscripts);
+          return FALSE;
+        }
+
+      seen |= G_GUINT64_CONSTANT (1) << label;
+    }
+
+  return TRUE;
+}
+
+/* Strides of each dimension of the padded storage of a tensor, in floats */
+static void
+einsum_tensor_strides (PipevecTensor *tensor,
+                       ptrdiff_t     *strides)
+{
+  GArray *padded_shape = pipevec_tensor_get_padded_shape_array (tensor);
+  ptrdiff_t stride = 1;
+
+  for (size_t i = padded_shape->len; i-- > 0;)
+    {
+      strides[i] = stride;
+      stride *= g_array_index (padded_shape, size_t, i);
+    }
+}
+
+static gboolean
+einsum_operand_init_for_tensor (EinsumOperand     *operand,
+                                PipevecTensor     *tensor,
+                                const EinsumTerm  *term,
+                                size_t             operand_index,
+                                size_t            *label_sizes,
+                                GError           **error)
+{
+  GArray *shape = pipevec_tensor_get_shape_array (tensor);
+  ptrdiff_t dim_strides[PIPEVEC_EINSUM_MAX_DIMS];
+
+  if (shape->len != term->n_dims)
+    {
+      g_autofree char *formatted_shape = pipevec_format_shape (shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_DIMENSION_MISMATCH,
+                   "Operand %zu of shape %s has %u dimensions, but its subscript names %zu",
+                   operand_index,
+                   formatted_shape,
+                   shape->len,
+                   term->n_dims);
+      return FALSE;
+    }
+
+  einsum_tensor_strides (tensor, dim_strides);
+
+  memset (operand, 0, sizeof (EinsumOperand));
+  operand->data = pipevec_tensor_get_storage (tensor);
+
+  for (size_t d = 0; d < term->n_dims; ++d)
+    {
+      int label = term->labels[d];
+      size_t size = g_array_index (shape, size_t, d);
+      size_t i;
+
+      if (label_sizes[label] != 0 && label_sizes[label] != size)
+        {
+          g_autofree char *formatted_shape = pipevec_format_shape (shape);
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_DIMENSION_MISMATCH,
+                       "Subscript '%c' has size %zu in operand %zu of shape %s, but size %zu elsewhere",
+                       einsum_char_from_label (label),
+                       size,
+                       operand_index,
+                       formatted_shape,
+                       label_sizes[label]);
+          return FALSE;
+        }
+
+      label_sizes[label] = size;
+
+      for (i = 0; i < operand->n_dims; ++i)
+        if (operand->labels[i] == label)
+          break;
+
+      if (i == operand->n_dims)
+        {
+          operand->labels[i] = label;
+          operand->sizes[i] = size;
+          operand->strides[i] = 0;
+          ++operand->n_dims;
+        }
+
+      operand->strides[i] += dim_strides[d];
+    }
+
+  return TRUE;
+}
+
+/* A contiguous row-major intermediate with the given labels, in order */
+static void
+einsum_operand_init_contiguous (EinsumOperand *operand,
+                                const int     *labels,
+                                size_t         n_labels,
+                                const size_t  *label_sizes)
+{
+  ptrdiff_t stride = 1;
+
+  memset (operand, 0, sizeof (EinsumOperand));
+  operand->n_dims = n_labels;
+
+  for (size_t i = n_labels; i-- > 0;)
+    {
+      operand->labels[i] = labels[i];
+      operand->sizes[i] = label_sizes[labels[i]];
+      operand->strides[i] = stride;
+      stride *= operand->sizes[i];
+    }
+
+  operand->owned_data = g_new (float, stride);
+  operand->data = operand->owned_data;
+}
+
+/* Odometer over a set of dimensions, tracking an offset into each of
+ * up to three operands as it goes */
+typedef struct {
+  size_t    n_dims;
+  size_t    sizes[PIPEVEC_EINSUM_MAX_LABELS];
+  ptrdiff_t strides[3][PIPEVEC_EINSUM_MAX_LABELS];
+  size_t    index[PIPEVEC_EINSUM_MAX_LABELS];
+  ptrdiff_t offsets[3];
+} EinsumIterator;
+
+static void
+einsum_iterator_init (EinsumIterator       *iterator,
+                      const int            *labels,
+                      size_t                n_labels,
+                      const size_t         *label_sizes,
+                      const EinsumOperand **operands,
+                      size_t                n_operands)
+{
+  memset (iterator, 0, sizeof (EinsumIterator));
+  iterator->n_dims = n_labels;
+
+  for (size_t d = 0; d < n_labels; ++d)
+    {
+      iterator->sizes[d] = label_sizes[labels[d]];
+
+      for (size_t o = 0; o < n_operands; ++o)
+        iterator->strides[o][d] = einsum_operand_stride_for_label (operands[o], labels[d]);
+    }
+}
+
+/* Advance to the next index, returning FALSE once every
+ * index has been visited */
+static gboolean
+einsum_iterator_next (EinsumIterator *iterator)
+{
+  for (size_t d = iterator->n_dims; d-- > 0;)
+    {
+      if (++iterator->index[d] < iterator->sizes[d])
+        {
+          for (size_t o = 0; o < 3; ++o)
+            iterator->offsets[o] += iterator->strides[o][d];
+
+          return TRUE;
+        }
+
+      for (size_t o = 0; o < 3; ++o)
+        iterator->offsets[o] -= iterator->strides[o][d] * (ptrdiff_t) (iterator->sizes[d] - 1);
+
+      iterator->index[d] = 0;
+    }
+
+  return FALSE;
+}
+
+/* dst = src, summing over every label of src that dst does not have.
+ * This covers permutes, diagonals, traces and reductions, none of
+ * which are worth more than a direct loop. */
+static void
+einsum_reduce (const EinsumOperand *src,
+               const EinsumOperand *dst,
+               const size_t        *label_sizes)
+{
+  EinsumLabelSet dst_labels = einsum_operand_label_set (dst);
+  int summed[PIPEVEC_EINSUM_MAX_LABELS];
+  size_t n_summed = 0;
+  EinsumIterator outer, inner;
+
+  for (size_t i = 0; i < src->n_dims; ++i)
+    if (!einsum_set_contains (dst_labels, src->labels[i]))
+      summed[n_summed++] = src->labels[i];
+
+  einsum_iterator_init (&outer, dst->labels, dst->n_dims, label_sizes,
+                        (const EinsumOperand *[]) { src, dst }, 2);
+  einsum_iterator_init (&inner, summed, n_summed, label_sizes,
+                        (const EinsumOperand *[]) { src }, 1);
+
+  do
+    {
+      const float *src_data = src->data + outer.offsets[0];
+      float sum = 0.0f;
+
+      do
+        sum += src_data[inner.offsets[0]];
+      while (einsum_iterator_next (&inner));
+
+      dst->data[outer.offsets[1]] = sum;
+    }
+  while (einsum_iterator_next (&outer));
+}
+
+/* Whether the labels of a group can be treated as a single dimension
+ * of an operand, and if so, the stride of that dimension. Labels of
+ * size 1 do not affect the layout. */
+static gboolean
+einsum_group_flatten (const EinsumOperand *operand,
+                      const int           *group,
+                      size_t               n_group,
+                      const size_t        *label_sizes,
+                      ptrdiff_t           *stride)
+{
+  gboolean have_inner = FALSE;
+  ptrdiff_t inner_stride = 0;
+  size_t inner_size = 1;
+
+  for (size_t i = n_group; i-- > 0;)
+    {
+      size_t size = label_sizes[group[i]];
+      ptrdiff_t label_stride = einsum_operand_stride_for_label (operand, group[i]);
+
+      if (size == 1)
+        continue;
+
+      if (!have_inner)
+        {
+          *stride = label_stride;
+          have_inner = TRUE;
+        }
+      else if (label_stride != inner_stride * (ptrdiff_t) inner_size)
+        return FALSE;
+
+      inner_stride = label_stride;
+      inner_size = size;
+    }
+
+  if (!have_inner)
+    *stride = 0;
+
+  return TRUE;
+}
+
+static size_t
+einsum_group_size (const int    *group,
+                   size_t        n_group,
+                   const size_t *label_sizes)
+{
+  size_t size = 1;
+
+  for (size_t i = 0; i < n_group; ++i)
+    size *= label_sizes[group[i]];
+
+  return size;
+}
+
+/* Replace an operand with a contiguous copy laid out as the
+ * concatenation of the given groups */
+static void
+einsum_operand_pack (EinsumOperand *operand,
+                     const int     *first,
+                     size_t         n_first,
+                     const int     *second,
+                     size_t         n_second,
+                     const int     *third,
+                     size_t         n_third,
+                     const size_t  *label_sizes)
+{
+  int labels[PIPEVEC_EINSUM_MAX_LABELS];
+  EinsumOperand packed;
+
+  memcpy (labels, first, sizeof (int) * n_first);
+  memcpy (labels + n_first, second, sizeof (int) * n_second);
+  memcpy (labels + n_first + n_second, third, sizeof (int) * n_third);
+
+  einsum_operand_init_contiguous (&packed, labels, n_first + n_second + n_third, label_sizes);
+  einsum_reduce (operand, &packed, label_sizes);
+  einsum_operand_clear (operand);
+
+  *operand = packed;
+}
+
+/* Whether the GEMM can write its rows (the labels in m) and columns
+ * (the labels in n) straight into output. Columns have unit stride. */
+static gboolean
+einsum_output_is_writable (const EinsumOperand *output,
+                           const int           *m,
+                           size_t               n_m,
+                           const int           *n,
+                           size_t               n_n,
+                           const size_t        *label_sizes,
+                           ptrdiff_t           *row_stride)
+{
+  ptrdiff_t col_stride;
+
+  return einsum_group_flatten (output, m, n_m, label_sizes, row_stride) &&
+         einsum_group_flatten (output, n, n_n, label_sizes, &col_stride) &&
+         (col_stride == 1 || einsum_group_size (n, n_n, label_sizes) == 1);
+}
+
+typedef struct {
+  size_t       m;
+  size_t       n;
+  size_t       k;
+  const float *a;
+  ptrdiff_t    a_row_stride;
+  ptrdiff_t    a_col_stride;
+  const float *b;
+  ptrdiff_t    b_row_stride;
+  ptrdiff_t    b_col_stride;
+  float       *c;
+  size_t       c_row_stride;
+  ptrdiff_t   *offsets;
+} EinsumGemmBatch;
+
+static void
+einsum_gemm_batch_item (size_t   batch_index,
+                        gpointer user_data)
+{
+  EinsumGemmBatch *batch = user_data;
+  const ptrdiff_t *offsets = batch->offsets + 3 * batch_index;
+
+  pipevec_gemm (batch->m, batch->n, batch->k,
+                1.0f,
+                batch->a + offsets[0], batch->a_row_stride, batch->a_col_stride,
+                batch->b + offsets[1], batch->b_row_stride, batch->b_col_stride,
+                0.0f,
+                batch->c + offsets[2], batch->c_row_stride);
+}
+
+static int
+einsum_compare_rank (gconstpointer a,
+                     gconstpointer b,
+                     gpointer      user_data)
+{
+  const int *rank = user_data;
+
+  return rank[*(const int *) a] - rank[*(const int *) b];
+}
+
+/* Contract a pair of operands into result, keeping only the labels in
+ * keep. Labels shared by both operands and kept are batch dimensions,
+ * labels shared and not kept are summed over, and the rest become the
+ * rows and columns of a GEMM, so that every pairwise contraction is a
+ * single (batched) call into the GEMM engine. Strides are passed
+ * through as they are, so transposed operands are never copied unless
+ * their labels cannot be flattened into one dimension.
+ *
+ * If output is non-NULL and can be written to directly by the GEMM,
+ * the result is written there and result refers to it. */
+static void
+einsum_contract (EinsumOperand       *a,
+                 EinsumOperand       *b,
+                 EinsumLabelSet       keep,
+                 const int           *rank,
+                 const size_t        *label_sizes,
+                 const EinsumOperand *output,
+                 EinsumOperand       *result)
+{
+  EinsumLabelSet a_labels = einsum_operand_label_set (a);
+  EinsumLabelSet b_labels = einsum_operand_label_set (b);
+  int batch[PIPEVEC_EINSUM_MAX_LABELS], m[PIPEVEC_EINSUM_MAX_LABELS];
+  int n[PIPEVEC_EINSUM_MAX_LABELS], k[PIPEVEC_EINSUM_MAX_LABELS];
+  size_t n_batch = 0, n_m = 0, n_n = 0, n_k = 0;
+
+  /* Labels of a single operand that are not kept were summed out
+   * before any contraction, so those are all kept here */
+  for (size_t i = 0; i < a->n_dims; ++i)
+    {
+      int label = a->labels[i];
+
+      if (!einsum_set_contains (b_labels, label))
+        m[n_m++] = label;
+      else if (einsum_set_contains (keep, label))
+        batch[n_batch++] = label;
+      else
+        k[n_k++] = label;
+    }
+
+  for (size_t i = 0; i < b->n_dims; ++i)
+    if (!einsum_set_contains (a_labels, b->labels[i]))
+      n[n_n++] = b->labels[i];
+
+  /* Order the free labels the way they appear in the output, which
+   * makes it likely that the last contraction can write straight
+   * into the output tensor */
+  g_qsort_with_data (batch, n_batch, sizeof (int), einsum_compare_rank, (gpointer) rank);
+  g_qsort_with_data (m, n_m, sizeof (int), einsum_compare_rank, (gpointer) rank);
+  g_qsort_with_data (n, n_n, sizeof (int), einsum_compare_rank, (gpointer) rank);
+
+  ptrdiff_t c_row_stride = 0;
+  gboolean write_output = output != NULL &&
+                          einsum_output_is_writable (output, m, n_m, n, n_n, label_sizes, &c_row_stride);
+
+  /* If the output is transposed relative to this order, compute
+   * C^T = B^T * A^T instead, which is the same contraction with the
+   * operands swapped */
+  if (output != NULL && !write_output &&
+      einsum_output_is_writable (output, n, n_n, m, n_m, label_sizes, &c_row_stride))
+    {
+      EinsumOperand *swapped_operand = a;
+      int swapped_labels[PIPEVEC_EINSUM_MAX_LABELS];
+      size_t swapped_n = n_m;
+
+      a = b;
+      b = swapped_operand;
+      memcpy (swapped_labels, m, sizeof (int) * n_m);
+      memcpy (m, n, sizeof (int) * n_n);
+      memcpy (n, swapped_labels, sizeof (int) * swapped_n);
+      n_m = n_n;
+      n_n = swapped_n;
+      write_output = TRUE;
+    }
+
+  ptrdiff_t a_row_stride, a_col_stride, b_row_stride, b_col_stride;
+
+  if (!einsum_group_flatten (a, m, n_m, label_sizes, &a_row_stride) ||
+      !einsum_group_flatten (a, k, n_k, label_sizes, &a_col_stride))
+    {
+      einsum_operand_pack (a, batch, n_batch, m, n_m, k, n_k, label_sizes);
+      einsum_group_flatten (a, m, n_m, label_sizes, &a_row_stride);
+      einsum_group_flatten (a, k, n_k, label_sizes, &a_col_stride);
+    }
+
+  if (!einsum_group_flatten (b, k, n_k, label_sizes, &b_row_stride) ||
+      !einsum_group_flatten (b, n, n_n, label_sizes, &b_col_stride))
+    {
+      einsum_operand_pack (b, batch, n_batch, k, n_k, n, n_n, label_sizes);
+      einsum_group_flatten (b, k, n_k, label_sizes, &b_row_stride);
+      einsum_group_flatten (b, n, n_n, label_sizes, &b_col_stride);
+    }
+
+  size_t m_size = einsum_group_size (m, n_m, label_sizes);
+  size_t n_size = einsum_group_size (n, n_n, label_sizes);
+  size_t k_size = einsum_group_size (k, n_k, label_sizes);
+
+  if (write_output)
+    {
+      *result = *output;
+    }
+  else
+    {
+      int labels[PIPEVEC_EINSUM_MAX_LABELS];
+
+      memcpy (labels, batch, sizeof (int) * n_batch);
+      memcpy (labels + n_batch, m, sizeof (int) * n_m);
+      memcpy (labels + n_batch + n_m, n, sizeof (int) * n_n);
+
+      einsum_operand_init_contiguous (result, labels, n_batch + n_m + n_n, label_sizes);
+      einsum_group_flatten (result, m, n_m, label_sizes, &c_row_stride);
+    }
+
+  if (m_size == 1)
+    c_row_stride = n_size;
+
+  EinsumIterator iterator;
+  size_t n_batches = einsum_group_size (batch, n_batch, label_sizes);
+  g_autofree ptrdiff_t *offsets = g_new (ptrdiff_t, 3 * n_batches);
+
+  einsum_iterator_init (&iterator, batch, n_batch, label_sizes,
+                        (const EinsumOperand *[]) { a, b, result }, 3);
+
+  for (size_t i = 0; i < n_batches; ++i)
+    {
+      memcpy (offsets + 3 * i, iterator.offsets, sizeof (ptrdiff_t) * 3);
+      einsum_iterator_next (&iterator);
+    }
+
+  EinsumGemmBatch gemm_batch = {
+    .m = m_size,
+    .n = n_size,
+    .k = k_size,
+    .a = a->data,
+    .a_row_stride = a_row_stride,
+    .a_col_stride = a_col_stride,
+    .b = b->data,
+    .b_row_stride = b_row_stride,
+    .b_col_stride = b_col_stride,
+    .c = result->data,
+    .c_row_stride = (size_t) c_row_stride,
+    .offsets = offsets
+  };
+
+  pipevec_dispatch_parallel_for (n_batches,
+                                 2.0 * m_size * n_size * k_size,
+                                 sizeof (float) * (m_size * k_size + k_size * n_size + m_size * n_size),
+                                 einsum_gemm_batch_item,
+                                 &gemm_batch);
+}
+
+static guint64
+einsum_tensor_bytes (PipevecTensor *tensor)
+{
+  PipevecTensorMatrixView view;
+
+  pipevec_tensor_get_matrix_view (tensor, &view);
+
+  return pipevec_tensor_matrix_view_bytes (&view);
+}
+
+/* Multiply-adds needed to contract two operands: one for every
+ * combination of all of their labels */
+static double
+einsum_pair_cost (EinsumLabelSet  labels,
+                  const size_t   *label_sizes)
+{
+  double cost = 1.0;
+
+  for (int label = 0; label < PIPEVEC_EINSUM_MAX_LABELS; ++label)
+    if (einsum_set_contains (labels, label))
+      cost *= (double) label_sizes[label];
+
+  return cost;
+}
+
+static EinsumLabelSet
+einsum_pair_result (const EinsumLabelSet *sets,
+                    size_t                n_sets,
+                    size_t                i,
+                    size_t                j,
+                    EinsumLabelSet        output)
+{
+  EinsumLabelSet others = output;
+
+  for (size_t o = 0; o < n_sets; ++o)
+    if (o != i && o != j)
+      others |= sets[o];
+
+  return (sets[i] | sets[j]) & others;
+}
+
+/* Remove sets i and j and append their contraction */
+static void
+einsum_sets_contract (EinsumLabelSet *sets,
+                      size_t          n_sets,
+                      size_t          i,
+                      size_t          j,
+                      EinsumLabelSet  result)
+{
+  size_t n_kept = 0;
+
+  for (size_t o = 0; o < n_sets; ++o)
+    if (o != i && o != j)
+      sets[n_kept++] = sets[o];
+
+  sets[n_kept] = result;
+}
+
+/* Exhaustively search for the contraction order with the fewest
+ * multiply-adds, writing it to path as pairs of positions. Each step
+ * removes the pair and appends its result, so positions refer to the
+ * list as it is after the previous steps. */
+static double
+einsum_optimal_path (const EinsumLabelSet *sets,
+                     size_t                n_sets,
+                     EinsumLabelSet        output,
+                     const size_t         *label_sizes,
+                     double                bound,
+                     size_t               *path)
+{
+  double best = INFINITY;
+
+  if (n_sets < 2)
+    return 0.0;
+
+  for (size_t i = 0; i < n_sets; ++i)
+    for (size_t j = i + 1; j < n_sets; ++j)
+      {
+        EinsumLabelSet next[PIPEVEC_EINSUM_OPTIMAL_PATH_MAX_OPERANDS];
+        size_t next_path[2 * PIPEVEC_EINSUM_OPTIMAL_PATH_MAX_OPERANDS];
+        EinsumLabelSet result = einsum_pair_result (sets, n_sets, i, j, output);
+        double cost = einsum_pair_cost (sets[i] | sets[j], label_sizes);
+
+        if (cost >= MIN (best, bound))
+          continue;
+
+        memcpy (next, sets, sizeof (EinsumLabelSet) * n_sets);
+        einsum_sets_contract (next, n_sets, i, j, result);
+        cost += einsum_optimal_path (next, n_sets - 1, output, label_sizes,
+                                     MIN (best, bound) - cost, next_path);
+
+        if (cost < best)
+          {
+            best = cost;
+            path[0] = i;
+            path[1] = j;
+            memcpy (path + 2, next_path, sizeof (size_t) * 2 * (n_sets - 2));
+          }
+      }
+
+  return best;
+}
+
+/* Repeatedly contract the cheapest pair, preferring the pair
+ * with the smaller result when costs tie */
+static void
+einsum_greedy_path (EinsumLabelSet *sets,
+                    size_t          n_sets,
+                    EinsumLabelSet  output,
+                    const size_t   *label_sizes,
+                    size_t         *path)
+{
+  for (; n_sets > 1; --n_sets, path += 2)
+    {
+      double best_cost = INFINITY, best_size = INFINITY;
+      EinsumLabelSet best_result = 0;
+
+      for (size_t i = 0; i < n_sets; ++i)
+        for (size_t j = i + 1; j < n_sets; ++j)
+          {
+            EinsumLabelSet result = einsum_pair_result (sets, n_sets, i, j, output);
+            double cost = einsum_pair_cost (sets[i] | sets[j], label_sizes);
+            double size = einsum_pair_cost (result, label_sizes);
+
+            if (cost < best_cost || (cost == best_cost && size < best_size))
+              {
+                best_cost = cost;
+                best_size = size;
+                best_result = result;
+                path[0] = i;
+                path[1] = j;
+              }
+          }
+
+      einsum_sets_contract (sets, n_sets, path[0], path[1], best_result);
+    }
+}
+
+static PipevecTensor *
+einsum_new_output (const EinsumTerm  *output,
+                   const size_t      *label_sizes,
+                   EinsumOperand     *view,
+                   GError           **error)
+{
+  g_autoptr(GArray) shape = g_array_new (FALSE, FALSE, sizeof (size_t));
+  g_autoptr(PipevecTensor) tensor = NULL;
+  ptrdiff_t strides[PIPEVEC_EINSUM_MAX_DIMS];
+
+  for (size_t i = 0; i < output->n_dims; ++i)
+    g_array_append_val (shape, label_sizes[output->labels[i]]);
+
+  /* A full reduction is returned as a single element */
+  if (output->n_dims == 0)
+    {
+      size_t one = 1;
+      g_array_append_val (shape, one);
+    }
+
+  if ((tensor = pipevec_tensor_new_for_shape (shape, error)) == NULL)
+    return NULL;
+
+  einsum_tensor_strides (tensor, strides);
+
+  memset (view, 0, sizeof (EinsumOperand));
+  view->n_dims = output->n_dims;
+  view->data = pipevec_tensor_get_storage (tensor);
+
+  for (size_t i = 0; i < output->n_dims; ++i)
+    {
+      view->labels[i] = output->labels[i];
+      view->sizes[i] = label_sizes[output->labels[i]];
+      view->strides[i] = strides[i];
+    }
+
+  return g_steal_pointer (&tensor);
+}
+
+/**
+ * pipevec_tensor_einsum:
+ * @subscripts: Einstein summation subscripts, such as "bij,bjk->bik".
+ * @operands: (array length=n_operands): The #PipevecTensor operands.
+ * @n_operands: Number of operands, which must match @subscripts.
+ * @error: A #GError out pointer.
+ *
+ * Evaluate an Einstein summation over @operands. Each operand is named
+ * by a comma separated subscript with one letter per dimension, and
+ * the output by the subscript after "->". Letters shared between
+ * operands are multiplied together, and letters missing from the
+ * output are summed over. Without "->", the output is every letter
+ * used exactly once, in alphabetical order. A letter repeated within
+ * one operand takes its diagonal.
+ *
+ * Operands are contracted a pair at a time in the order that needs
+ * the fewest multiply-adds, searched exhaustively for a few operands
+ * and greedily otherwise. Each pairwise contraction is lowered to a
+ * batched GEMM directly over the strides of its operands, so
+ * transposed operands are not copied.
+ *
+ * Returns: (transfer full): A new #PipevecTensor with the shape named
+ *          by the output subscript, or of shape (1) if it is empty,
+ *          or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_einsum (const char     *subscripts,
+                       PipevecTensor **operands,
+                       size_t          n_operands,
+                       GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_EINSUM);
+  g_autofree EinsumTerm *terms = g_new0 (EinsumTerm, MAX (n_operands, 1));
+  g_autofree EinsumOperand *views = g_new0 (EinsumOperand, MAX (n_operands, 1));
+  g_autofree size_t *path = g_new0 (size_t, 2 * MAX (n_operands, 1));
+  size_t label_sizes[PIPEVEC_EINSUM_MAX_LABELS] = { 0 };
+  int rank[PIPEVEC_EINSUM_MAX_LABELS];
+  EinsumTerm output_term;
+  EinsumOperand output;
+  EinsumLabelSet output_labels = 0;
+  g_autoptr(PipevecTensor) result = NULL;
+
+  if (!einsum_parse (subscripts, n_operands, terms, &output_term, error))
+    return NULL;
+
+  for (size_t i = 0; i < n_operands; ++i)
+    if (!einsum_operand_init_for_tensor (&views[i], operands[i], &terms[i], i, label_sizes, error))
+      return NULL;
+
+  if ((result = einsum_new_output (&output_term, label_sizes, &output, error)) == NULL)
+    return NULL;
+
+  /* Free labels are laid out in output order, then label order */
+  for (int label = 0; label < PIPEVEC_EINSUM_MAX_LABELS; ++label)
+    rank[label] = PIPEVEC_EINSUM_MAX_LABELS + label;
+
+  for (size_t i = 0; i < output_term.n_dims; ++i)
+    rank[output_term.labels[i]] = (int) i;
+
+  output_labels = einsum_operand_label_set (&output);
+
+  /* Sum out labels that only one operand uses first, so that
+   * every contraction only has to deal with shared labels */
+  for (size_t i = 0; n_operands > 1 && i < n_operands; ++i)
+    {
+      EinsumLabelSet others = output_labels;
+      int kept[PIPEVEC_EINSUM_MAX_LABELS];
+      size_t n_kept = 0;
+
+      for (size_t o = 0; o < n_operands; ++o)
+        if (o != i)
+          others |= einsum_operand_label_set (&views[o]);
+
+      for (size_t d = 0; d < views[i].n_dims; ++d)
+        if (einsum_set_contains (others, views[i].labels[d]))
+          kept[n_kept++] = views[i].labels[d];
+
+      if (n_kept < views[i].n_dims)
+        {
+          EinsumOperand reduced;
+
+          einsum_operand_init_contiguous (&reduced, kept, n_kept, label_sizes);
+          einsum_reduce (&views[i], &reduced, label_sizes);
+          views[i] = reduced;
+        }
+    }
+
+  g_autofree EinsumLabelSet *sets = g_new (EinsumLabelSet, n_operands);
+  size_t n_views = n_operands;
+  gboolean written_to_output = FALSE;
+  double flops = 0.0;
+
+  for (size_t i = 0; i < n_operands; ++i)
+    sets[i] = einsum_operand_label_set (&views[i]);
+
+  if (n_operands <= PIPEVEC_EINSUM_OPTIMAL_PATH_MAX_OPERANDS)
+    einsum_optimal_path (sets, n_operands, output_labels, label_sizes, INFINITY, path);
+  else
+    einsum_greedy_path (sets, n_operands, output_labels, label_sizes, path);
+
+  for (size_t step = 0; n_views > 1; ++step, --n_views)
+    {
+      size_t i = path[2 * step];
+      size_t j = path[2 * step + 1];
+      EinsumLabelSet keep = output_labels;
+      EinsumOperand contracted;
+
+      for (size_t o = 0; o < n_views; ++o)
+        if (o != i && o != j)
+          keep |= einsum_operand_label_set (&views[o]);
+
+      flops += 2.0 * einsum_pair_cost (einsum_operand_label_set (&views[i]) |
+                                       einsum_operand_label_set (&views[j]),
+                                       label_sizes);
+
+      einsum_contract (&views[i], &views[j], keep, rank, label_sizes,
+                       n_views == 2 ? &output : NULL,
+                       &contracted);
+      written_to_output = contracted.data == output.data;
+
+      einsum_operand_clear (&views[i]);
+      einsum_operand_clear (&views[j]);
+
+      size_t n_kept = 0;
+
+      for (size_t o = 0; o < n_views; ++o)
+        if (o != i && o != j)
+          views[n_kept++] = views[o];
+
+      views[n_kept] = contracted;
+    }
+
+  if (!written_to_output)
+    einsum_reduce (&views[0], &output, label_sizes);
+
+  einsum_operand_clear (&views[0]);
+
+  guint64 bytes_read = 0;
+
+  for (size_t i = 0; i < n_operands; ++i)
+    bytes_read += einsum_tensor_bytes (operands[i]);
+
+  pipevec_profile_scope_set_shape (&scope, pipevec_tensor_get_shape_array (result));
+  pipevec_profile_scope_set_traffic (&scope,
+                                     bytes_read,
+                                     einsum_tensor_bytes (result),
+                                     (guint64) flops);
+
+  return g_steal_pointer (&result);
+}
+
+static gboolean
+tensordot_check_axes (GArray  *shape,
+                      GArray  *axes,
+                      gboolean *contracted,
+                      GError  **error)
+{
+  for (size_t i = 0; i < axes->len; ++i)
+    {
+      size_t axis = g_array_index (axes, size_t, i);
+
+      if (axis >= shape->len || contracted[axis])
+        {
+          g_autofree char *formatted_shape = pipevec_format_shape (shape);
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_INVALID_ARGUMENT,
+                       "Axis %zu is out of range or repeated for shape %s",
+                       axis,
+                       formatted_shape);
+          return FALSE;
+        }
+
+      contracted[axis] = TRUE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * pipevec_tensor_tensordot:
+ * @lhs: A #PipevecTensor
+ * @rhs: A #PipevecTensor
+ * @lhs_axes: (element-type gulong): Axes of @lhs to contract.
+ * @rhs_axes: (element-type gulong): Axes of @rhs to contract, paired
+ *            with @lhs_axes in order.
+ * @error: A #GError out pointer.
+ *
+ * Sum the products of @lhs and @rhs over the paired axes. The result
+ * has the remaining axes of @lhs followed by the remaining axes of
+ * @rhs, each in their original order. This is the einsum in which the
+ * paired axes share a subscript, and is evaluated the same way, as a
+ * single GEMM over the strides of the operands wherever possible.
+ *
+ * Returns: (transfer full): A new #PipevecTensor, of shape (1) if
+ *          every axis was contracted, or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_tensordot (PipevecTensor  *lhs,
+                          PipevecTensor  *rhs,
+                          GArray         *lhs_axes,
+                          GArray         *rhs_axes,
+                          GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_TENSORDOT);
+  GArray *lhs_shape = pipevec_tensor_get_shape_array (lhs);
+  GArray *rhs_shape = pipevec_tensor_get_shape_array (rhs);
+  gboolean lhs_contracted[PIPEVEC_EINSUM_MAX_LABELS] = { FALSE };
+  gboolean rhs_contracted[PIPEVEC_EINSUM_MAX_LABELS] = { FALSE };
+
+  if (lhs_axes->len != rhs_axes->len ||
+      lhs_shape->len + rhs_shape->len - lhs_axes->len > PIPEVEC_EINSUM_MAX_LABELS ||
+      lhs_shape->len > PIPEVEC_EINSUM_MAX_DIMS ||
+      rhs_shape->len > PIPEVEC_EINSUM_MAX_DIMS)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Cannot contract %u axes of a %u dimensional tensor with %u axes of a %u dimensional tensor",
+                   lhs_axes->len,
+                   lhs_shape->len,
+                   rhs_axes->len,
+                   rhs_shape->len);
+      return NULL;
+    }
+
+  if (!tensordot_check_axes (lhs_shape, lhs_axes, lhs_contracted, error) ||
+      !tensordot_check_axes (rhs_shape, rhs_axes, rhs_contracted, error))
+    return NULL;
+
+  /* Give every axis of lhs its own subscript, reuse them for the
+   * paired axes of rhs and give the rest of rhs fresh ones */
+  char lhs_subscript[PIPEVEC_EINSUM_MAX_DIMS + 1] = { 0 };
+  char rhs_subscript[PIPEVEC_EINSUM_MAX_DIMS + 1] = { 0 };
+  char output_subscript[PIPEVEC_EINSUM_MAX_LABELS + 1] = { 0 };
+  size_t n_labels = 0, n_output = 0;
+
+  for (size_t i = 0; i < lhs_shape->len; ++i)
+    {
+      lhs_subscript[i] = einsum_char_from_label (n_labels++);
+
+      if (!lhs_contracted[i])
+        output_subscript[n_output++] = lhs_subscript[i];
+    }
+
+  for (size_t i = 0; i < lhs_axes->len; ++i)
+    {
+      size_t lhs_axis = g_array_index (lhs_axes, size_t, i);
+      size_t rhs_axis = g_array_index (rhs_axes, size_t, i);
+
+      if (g_array_index (lhs_shape, size_t, lhs_axis) != g_array_index (rhs_shape, size_t, rhs_axis))
+        {
+          g_autofree char *lhs_formatted_shape = pipevec_format_shape (lhs_shape);
+          g_autofree char *rhs_formatted_shape = pipevec_format_shape (rhs_shape);
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_DIMENSION_MISMATCH,
+                       "Axis %zu of %s does not match axis %zu of %s",
+                       lhs_axis,
+                       lhs_formatted_shape,
+                       rhs_axis,
+                       rhs_formatted_shape);
+          return NULL;
+        }
+
+      rhs_subscript[rhs_axis] = lhs_subscript[lhs_axis];
+    }
+
+  for (size_t i = 0; i < rhs_shape->len; ++i)
+    {
+      if (rhs_contracted[i])
+        continue;
+
+      rhs_subscript[i] = einsum_char_from_label (n_labels++);
+      output_subscript[n_output++] = rhs_subscript[i];
+    }
+
+  g_autofree char *subscripts = g_strdup_printf ("%s,%s->%s",
+                                                 lhs_subscript,
+                                                 rhs_subscript,
+                                                 output_subscript);
+  PipevecTensor *operands[] = { lhs, rhs };
+  g_autoptr(PipevecTensor) result = pipevec_tensor_einsum (subscripts,
+                                                           operands,
+                                                           G_N_ELEMENTS (operands),
+                                                           error);
+
+  if (result == NULL)
+    return NULL;
+
+  /* One multiply-add for every pair of lhs and rhs elements that
+   * agree on the contracted axes */
+  guint64 contracted_size = 1;
+
+  for (size_t i = 0; i < lhs_axes->len; ++i)
+    contracted_size *= g_array_index (lhs_shape, size_t, g_array_index (lhs_axes, size_t, i));
+
+  guint64 lhs_bytes = einsum_tensor_bytes (lhs);
+  guint64 rhs_bytes = einsum_tensor_bytes (rhs);
+
+  pipevec_profile_scope_set_shape (&scope, pipevec_tensor_get_shape_array (result));
+  pipevec_profile_scope_set_traffic (&scope,
+                                     lhs_bytes + rhs_bytes,
+                                     einsum_tensor_bytes (result),
+                                     contracted_size > 0 ?
+                                     2 * (lhs_bytes / sizeof (float)) * (rhs_bytes / sizeof (float)) / contracted_size :
+                                     0);
+
+  return g_steal_pointer (&result);
+}
@@ -0,0 +1,42 @@
+/*
+ * /pipevec/pipevec-tensor-einsum.h
+ *
+ * Einstein summation over Pipevec Tensors.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include <pipevec/pipevec-tensor.h>
+
+G_BEGIN_DECLS
+
+PipevecTensor * pipevec_tensor_einsum (const char     *subscripts,
+                                       PipevecTensor **operands,
+                                       size_t          n_operands,
+                                       GError        **error);
+
+PipevecTensor * pipevec_tensor_tensordot (PipevecTensor  *lhs,
+                                          PipevecTensor  *rhs,
+                                          GArray         *lhs_axes,
+                                          GArray         *rhs_axes,
+                                          GError        **error);
+
+G_END_DECLS
@@ -0,0 +1,389 @@
+/*
+ * /pipevec/pipevec-tensor-layout.c
+ *
+ * Layout conversions of Pipevec Tensors.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-tensor-layout.h>
+#include <pipevec/pipevec-tensor-private.h>
+#include <pipevec/pipevec-dispatch-private.h>
+#include <pipevec/pipevec-profile-private.h>
+#include <pipevec/pipevec-errors.h>
+
+/* A permutation either keeps the last axis in place, in which case
+ * whole padded rows move, or it swaps the last axis of the source
+ * with some other axis, which is a transpose between the two of them
+ * for every index of the remaining axes. NCHW to NHWC and back, and
+ * arrays of structures to structures of arrays and back, are all of
+ * the second kind.
+ *
+ * Transposes work on 8x8 tiles held in registers. Rows are padded
+ * to a multiple of 8 with zeroes, so every tile can be loaded and
+ * stored with full vectors: the padding of a source row transposes
+ * into destination rows past the end, which are not stored, and
+ * source rows past the end are zero, which is what the padding of
+ * the destination rows must be. */
+
+/* Source rows transposed by one task. With 8 floats of each in
+ * flight, the band and the tiles written from it stay in L1. */
+#define PIPEVEC_LAYOUT_BAND 64
+
+/* Transpose the 8x8 tile in r in place, interleaving pairs of rows,
+ * then pairs of those, then swapping halves, so that each step is a
+ * single shuffle instruction on AVX */
+static inline void
+transpose_float8x8 (float8_t r[8])
+{
+  float8_t t[8];
+  float8_t u[8];
+
+  for (size_t i = 0; i < 8; i += 2)
+    {
+      t[i] = __builtin_shufflevector (r[i], r[i + 1], 0, 8, 1, 9, 4, 12, 5, 13);
+      t[i + 1] = __builtin_shufflevector (r[i], r[i + 1], 2, 10, 3, 11, 6, 14, 7, 15);
+    }
+
+  for (size_t i = 0; i < 8; i += 4)
+    {
+      u[i] = __builtin_shufflevector (t[i], t[i + 2], 0, 1, 8, 9, 4, 5, 12, 13);
+      u[i + 1] = __builtin_shufflevector (t[i], t[i + 2], 2, 3, 10, 11, 6, 7, 14, 15);
+      u[i + 2] = __builtin_shufflevector (t[i + 1], t[i + 3], 0, 1, 8, 9, 4, 5, 12, 13);
+      u[i + 3] = __builtin_shufflevector (t[i + 1], t[i + 3], 2, 3, 10, 11, 6, 7, 14, 15);
+    }
+
+  for (size_t i = 0; i < 4; ++i)
+    {
+      r[i] = __builtin_shufflevector (u[i], u[i + 4], 0, 1, 2, 3, 8, 9, 10, 11);
+      r[i + 4] = __builtin_shufflevector (u[i], u[i + 4], 4, 5, 6, 7, 12, 13, 14, 15);
+    }
+}
+
+/* Offsets into the source and the destination of each index of the
+ * output axes in outer_axes, in row-major order. src_strides are
+ * those of the source axes and axes[j] is the source axis that
+ * output axis j comes from. */
+static void
+layout_offsets (const size_t *axes,
+                const size_t *outer_axes,
+                size_t        n_outer_axes,
+                const size_t *output_shape,
+                const size_t *src_strides,
+                const size_t *dst_strides,
+                size_t        n_offsets,
+                size_t       *src_offsets,
+                size_t       *dst_offsets)
+{
+  g_autofree size_t *index = g_new0 (size_t, MAX (n_outer_axes, 1));
+  size_t src = 0;
+  size_t dst = 0;
+
+  for (size_t k = 0; k < n_offsets; ++k)
+    {
+      src_offsets[k] = src;
+      dst_offsets[k] = dst;
+
+      for (size_t d = n_outer_axes; d-- > 0;)
+        {
+          size_t j = outer_axes[d];
+
+          src += src_strides[axes[j]];
+          dst += dst_strides[j];
+
+          if (++index[d] < output_shape[j])
+            break;
+
+          src -= index[d] * src_strides[axes[j]];
+          dst -= index[d] * dst_strides[j];
+          index[d] = 0;
+        }
+    }
+}
+
+typedef struct {
+  const float  *src;
+  float        *dst;
+  size_t        row_floats;
+  const size_t *src_offsets;
+} LayoutRows;
+
+static void
+layout_rows_item (size_t   row,
+                  gpointer user_data)
+{
+  const LayoutRows *rows = user_data;
+
+  memcpy (rows->dst + row * rows->row_floats,
+          rows->src + rows->src_offsets[row],
+          sizeof (float) * rows->row_floats);
+}
+
+typedef struct {
+  const float  *src;
+  float        *dst;
+  size_t        rows;            /* Along the source axis that becomes the last */
+  size_t        columns;         /* Along the last axis of the source */
+  size_t        src_row_stride;
+  size_t        dst_row_stride;
+  size_t        n_bands;
+  const size_t *src_offsets;
+  const size_t *dst_offsets;
+} LayoutTranspose;
+
+static void
+layout_transpose_item (size_t   index,
+                       gpointer user_data)
+{
+  const LayoutTranspose *transpose = user_data;
+  size_t outer = index / transpose->n_bands;
+  size_t band_start = (index % transpose->n_bands) * PIPEVEC_LAYOUT_BAND;
+  size_t band_end = MIN (band_start + PIPEVEC_LAYOUT_BAND, transpose->rows);
+  const float *src = transpose->src + transpose->src_offsets[outer];
+  float *dst = transpose->dst + transpose->dst_offsets[outer];
+
+  for (size_t y = 0; y < transpose->columns; y += 8)
+    {
+      size_t n_y = MIN (8, transpose->columns - y);
+
+      for (size_t x = band_start; x < band_end; x += 8)
+        {
+          size_t n_x = MIN (8, transpose->rows - x);
+          float8_t tile[8];
+
+          for (size_t i = 0; i < 8; ++i)
+            tile[i] = (i < n_x ?
+                       load_float8 (src + (x + i) * transpose->src_row_stride + y) :
+                       (float8_t) { 0 });
+
+          transpose_float8x8 (tile);
+
+          for (size_t j = 0; j < n_y; ++j)
+            store_float8 (dst + (y + j) * transpose->dst_row_stride + x, tile[j]);
+        }
+    }
+}
+
+/* Distance in floats between consecutive indices of each axis */
+static void
+padded_strides (GArray *padded_shape,
+                size_t *strides)
+{
+  size_t *padded_shape_data = (size_t *) padded_shape->data;
+  size_t stride = 1;
+
+  for (size_t i = padded_shape->len; i-- > 0;)
+    {
+      strides[i] = stride;
+      stride *= padded_shape_data[i];
+    }
+}
+
+static guint64
+layout_tensor_bytes (PipevecTensor *tensor)
+{
+  PipevecTensorMatrixView view;
+
+  pipevec_tensor_get_matrix_view (tensor, &view);
+
+  return pipevec_tensor_matrix_view_bytes (&view);
+}
+
+/**
+ * pipevec_tensor_permute:
+ * @tensor: A #PipevecTensor
+ * @axes: (element-type gulong): For each axis of the result, the axis
+ *        of @tensor that it comes from.
+ * @error: A #GError out pointer.
+ *
+ * Reorder the axes of @tensor, so that axis i of the result is axis
+ * @axes[i] of @tensor. For example, the axes (0, 2, 3, 1) turn an
+ * NCHW tensor into an NHWC one and (0, 3, 1, 2) turn it back.
+ *
+ * When the last axis stays in place, padded rows are copied whole.
+ * Otherwise the data is transposed in 8x8 tiles held in registers.
+ * Either way the work is split across threads over the other axes.
+ *
+ * Returns: (transfer full): A new #PipevecTensor or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_permute (PipevecTensor  *tensor,
+                        GArray         *axes,
+                        GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_PERMUTE);
+  GArray *shape = pipevec_tensor_get_shape_array (tensor);
+  size_t *shape_data = (size_t *) shape->data;
+  size_t *axes_data = (size_t *) axes->data;
+  size_t n_dims = shape->len;
+  g_autofree gboolean *seen = g_new0 (gboolean, n_dims);
+  gboolean valid = axes->len == n_dims;
+
+  for (size_t i = 0; valid && i < n_dims; ++i)
+    {
+      valid = axes_data[i] < n_dims && !seen[axes_data[i]];
+
+      if (valid)
+        seen[axes_data[i]] = TRUE;
+    }
+
+  if (!valid)
+    {
+      g_autofree char *formatted_axes = pipevec_format_shape (axes);
+      g_autofree char *formatted_shape = pipevec_format_shape (shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Axes %s are not a permutation of the axes of shape %s",
+                   formatted_axes,
+                   formatted_shape);
+      return NULL;
+    }
+
+  g_autoptr(GArray) output_shape = g_array_sized_new (FALSE, FALSE, sizeof (size_t), n_dims);
+
+  for (size_t i = 0; i < n_dims; ++i)
+    g_array_append_val (output_shape, shape_data[axes_data[i]]);
+
+  pipevec_profile_scope_set_shape (&scope, shape);
+
+  g_autoptr(PipevecTensor) result = pipevec_tensor_new_for_shape_uninitialized (output_shape, error);
+
+  if (result == NULL)
+    return NULL;
+
+  size_t *output_shape_data = (size_t *) output_shape->data;
+  GArray *padded_shape = pipevec_tensor_get_padded_shape_array (tensor);
+  GArray *output_padded_shape = pipevec_tensor_get_padded_shape_array (result);
+  g_autofree size_t *src_strides = g_new (size_t, n_dims);
+  g_autofree size_t *dst_strides = g_new (size_t, n_dims);
+  g_autofree size_t *outer_axes = g_new (size_t, n_dims);
+  size_t n_outer_axes = 0;
+  size_t n_outer = 1;
+  size_t last = axes_data[n_dims - 1];
+  size_t swapped = n_dims - 1;
+
+  padded_strides (padded_shape, src_strides);
+  padded_strides (output_padded_shape, dst_strides);
+
+  for (size_t j = 0; j < n_dims; ++j)
+    if (axes_data[j] == n_dims - 1)
+      swapped = j;
+
+  /* Every output axis other than the two in the transpose, or than
+   * the last one when rows are copied whole */
+  for (size_t j = 0; j < n_dims - 1; ++j)
+    {
+      if (j == swapped)
+        continue;
+
+      outer_axes[n_outer_axes++] = j;
+      n_outer *= output_shape_data[j];
+    }
+
+  g_autofree size_t *src_offsets = g_new (size_t, MAX (n_outer, 1));
+  g_autofree size_t *dst_offsets = g_new (size_t, MAX (n_outer, 1));
+
+  layout_offsets (axes_data, outer_axes, n_outer_axes, output_shape_data,
+                  src_strides, dst_strides, n_outer, src_offsets, dst_offsets);
+
+  if (last == n_dims - 1)
+    {
+      /* The offsets of the output rows are consecutive */
+      LayoutRows rows = {
+        .src = pipevec_tensor_get_storage (tensor),
+        .dst = pipevec_tensor_get_storage (result),
+        .row_floats = g_array_index (output_padded_shape, size_t, n_dims - 1),
+        .src_offsets = src_offsets
+      };
+
+      pipevec_dispatch_parallel_for (n_outer,
+                                     0.0,
+                                     2.0 * sizeof (float) * rows.row_floats,
+                                     layout_rows_item,
+                                     &rows);
+    }
+  else
+    {
+      LayoutTranspose transpose = {
+        .src = pipevec_tensor_get_storage (tensor),
+        .dst = pipevec_tensor_get_storage (result),
+        .rows = shape_data[last],
+        .columns = shape_data[n_dims - 1],
+        .src_row_stride = src_strides[last],
+        .dst_row_stride = dst_strides[swapped],
+        .n_bands = (shape_data[last] + PIPEVEC_LAYOUT_BAND - 1) / PIPEVEC_LAYOUT_BAND,
+        .src_offsets = src_offsets,
+        .dst_offsets = dst_offsets
+      };
+
+      pipevec_dispatch_parallel_for (n_outer * transpose.n_bands,
+                                     0.0,
+                                     2.0 * sizeof (float) * PIPEVEC_LAYOUT_BAND * transpose.columns,
+                                     layout_transpose_item,
+                                     &transpose);
+    }
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     layout_tensor_bytes (tensor),
+                                     layout_tensor_bytes (result),
+                                     0);
+
+  return g_steal_pointer (&result);
+}
+
+/**
+ * pipevec_tensor_transpose:
+ * @tensor: A #PipevecTensor with at least two dimensions.
+ * @error: A #GError out pointer.
+ *
+ * Swap the last two axes of @tensor, transposing each of the
+ * matrices in it. On a matrix with one row per record and one
+ * column per field, this converts between an array of structures
+ * and a structure of arrays.
+ *
+ * Returns: (transfer full): A new #PipevecTensor or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_transpose (PipevecTensor  *tensor,
+                          GError        **error)
+{
+  GArray *shape = pipevec_tensor_get_shape_array (tensor);
+
+  if (shape->len < 2)
+    {
+      g_autofree char *formatted_shape = pipevec_format_shape (shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Cannot transpose a tensor of shape %s, which has fewer than two dimensions",
+                   formatted_shape);
+      return NULL;
+    }
+
+  g_autoptr(GArray) axes = g_array_sized_new (FALSE, FALSE, sizeof (size_t), shape->len);
+
+  for (size_t i = 0; i < shape->len; ++i)
+    {
+      size_t axis = (i + 2 < shape->len ? i :
+                     i + 2 == shape->len ? i + 1 : i - 1);
+
+      g_array_append_val (axes, axis);
+    }
+
+  return pipevec_tensor_permute (tensor, axes, error);
+}
@@ -0,0 +1,2038 @@
+/*
+ * /pipevec/pipevec-tensor-linalg.c
+ *
+ * Dense linear algebra on batches of matrices held in a Pipevec Tensor.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-tensor-linalg.h>
+#include <pipevec/pipevec-tensor-private.h>
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-dispatch-private.h>
+#include <pipevec/pipevec-profile-private.h>
+#include <pipevec/pipevec-errors.h>
+
+#include <float.h>
+#include <math.h>
+
+/* All of the factorizations here are right-looking and blocked: a
+ * narrow panel of PIPEVEC_LINALG_BLOCK columns is factored with a
+ * simple loop, then the rest of the matrix is updated with a single
+ * call into the GEMM engine. For large matrices nearly all of the
+ * flops end up in that update. */
+#define PIPEVEC_LINALG_BLOCK 64
+
+/* Systems at most this large are solved entirely in registers,
+ * one float8_t per row. */
+#define PIPEVEC_LINALG_SMALL_SOLVE 8
+
+/* Tall-skinny QR splits the rows into blocks of at least this many
+ * rows (and at least twice as many rows as columns), one per thread,
+ * if the cost model says the threads pay off. */
+#define PIPEVEC_LINALG_TSQR_MIN_BLOCK_ROWS 1024
+
+/* Record the traffic of a successful factorization or solve. The
+ * FLOP counts passed in are the leading terms usually quoted for the
+ * LAPACK equivalents, per matrix, and ignore the extra work that
+ * blocking does. */
+static void
+profile_linalg (PipevecProfileScope *scope,
+                size_t               n_batches,
+                guint64              bytes_read,
+                guint64              bytes_written,
+                double               flops_per_matrix)
+{
+  pipevec_profile_scope_set_traffic (scope,
+                                     bytes_read,
+                                     bytes_written,
+                                     (guint64) (n_batches * flops_per_matrix));
+}
+
+/* Flops of a Householder QR factorization of an m x n matrix */
+static double
+householder_qr_flops (double m,
+                      double n)
+{
+  return m >= n ? 2.0 * n * n * (m - n / 3.0) : 2.0 * m * m * (n - m / 3.0);
+}
+
+static gboolean
+check_square_matrices (PipevecTensor  *tensor,
+                       GError        **error)
+{
+  GArray *shape = pipevec_tensor_get_shape_array (tensor);
+  size_t *shape_data = (size_t *) shape->data;
+
+  if (shape->len < 2 || shape_data[shape->len - 1] != shape_data[shape->len - 2])
+    {
+      g_autofree char *formatted_shape = pipevec_format_shape (shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_BAD_SHAPE,
+                   "Expected a batch of square matrices, but got shape %s",
+                   formatted_shape);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+check_right_hand_side (PipevecTensor  *a,
+                       PipevecTensor  *b,
+                       GError        **error)
+{
+  GArray *a_shape = pipevec_tensor_get_shape_array (a);
+  GArray *b_shape = pipevec_tensor_get_shape_array (b);
+  size_t *a_shape_data = (size_t *) a_shape->data;
+  size_t *b_shape_data = (size_t *) b_shape->data;
+  gboolean compatible = a_shape->len == b_shape->len;
+
+  for (size_t i = 0; compatible && i < a_shape->len - 1; ++i)
+    compatible = a_shape_data[i] == b_shape_data[i];
+
+  if (!compatible)
+    {
+      g_autofree char *formatted_a_shape = pipevec_format_shape (a_shape);
+      g_autofree char *formatted_b_shape = pipevec_format_shape (b_shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_DIMENSION_MISMATCH,
+                   "Right hand side of shape %s is not compatible with matrices of shape %s",
+                   formatted_b_shape,
+                   formatted_a_shape);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Unblocked Cholesky of the lower triangle of an n x n block */
+static gboolean
+cholesky_unblocked (size_t  n,
+                    float  *a,
+                    size_t  lda)
+{
+  for (size_t j = 0; j < n; ++j)
+    {
+      float *row_j = a + j * lda;
+      float diagonal = row_j[j];
+
+      for (size_t p = 0; p < j; ++p)
+        diagonal -= row_j[p] * row_j[p];
+
+      if (!(diagonal > 0.0f))
+        return FALSE;
+
+      diagonal = sqrtf (diagonal);
+      row_j[j] = diagonal;
+
+      for (size_t i = j + 1; i < n; ++i)
+        {
+          float *row_i = a + i * lda;
+          float value = row_i[j];
+
+          for (size_t p = 0; p < j; ++p)
+            value -= row_i[p] * row_j[p];
+
+          row_i[j] = value / diagonal;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Solve X * L^T = B in place for an m x n block B, where L is an
+ * n x n lower triangle. Each row of B is an independent forward
+ * substitution. */
+static void
+trsm_right_lower_transpose (size_t       m,
+                            size_t       n,
+                            const float *l,
+                            size_t       ldl,
+                            float       *b,
+                            size_t       ldb)
+{
+  for (size_t r = 0; r < m; ++r)
+    {
+      float *row = b + r * ldb;
+
+      for (size_t c = 0; c < n; ++c)
+        {
+          const float *l_row = l + c * ldl;
+          float value = row[c];
+
+          for (size_t p = 0; p < c; ++p)
+            value -= l_row[p] * row[p];
+
+          row[c] = value / l_row[c];
+        }
+    }
+}
+
+static gboolean
+cholesky_blocked (size_t  n,
+                  float  *a,
+                  size_t  lda)
+{
+  for (size_t j = 0; j < n; j += PIPEVEC_LINALG_BLOCK)
+    {
+      size_t jb = MIN (PIPEVEC_LINALG_BLOCK, n - j);
+      size_t rest = n - j - jb;
+      float *a11 = a + j * lda + j;
+      float *a21 = a + (j + jb) * lda + j;
+      float *a22 = a + (j + jb) * lda + j + jb;
+
+      if (!cholesky_unblocked (jb, a11, lda))
+        return FALSE;
+
+      if (rest == 0)
+        break;
+
+      trsm_right_lower_transpose (rest, jb, a11, lda, a21, lda);
+
+      /* A22 -= A21 * A21^T. Only the lower triangle is ever read
+       * again, so update one block row at a time and stop at the
+       * diagonal, which halves the work. */
+      for (size_t i = 0; i < rest; i += PIPEVEC_LINALG_BLOCK)
+        {
+          size_t ib = MIN (PIPEVEC_LINALG_BLOCK, rest - i);
+
+          pipevec_gemm (ib, i + ib, jb,
+                        -1.0f,
+                        a21 + i * lda, lda, 1,
+                        a21, 1, lda,
+                        1.0f,
+                        a22 + i * lda, lda);
+        }
+    }
+
+  return TRUE;
+}
+
+/* LU factorization with partial pivoting, P * A = L * U, stored in
+ * place with the unit diagonal of L implied. Row i was exchanged with
+ * row pivots[i], in order. */
+static gboolean
+lu_blocked (size_t  n,
+            float  *a,
+            size_t  lda,
+            size_t *pivots)
+{
+  for (size_t j = 0; j < n; j += PIPEVEC_LINALG_BLOCK)
+    {
+      size_t jb = MIN (PIPEVEC_LINALG_BLOCK, n - j);
+
+      /* Factor the panel A[j:n, j:j+jb] */
+      for (size_t c = j; c < j + jb; ++c)
+        {
+          size_t pivot = c;
+          float best = fabsf (a[c * lda + c]);
+
+          for (size_t r = c + 1; r < n; ++r)
+            {
+              float candidate = fabsf (a[r * lda + c]);
+
+              if (candidate > best)
+                {
+                  best = candidate;
+                  pivot = r;
+                }
+            }
+
+          if (!(best > 0.0f))
+            return FALSE;
+
+          pivots[c] = pivot;
+
+          /* Exchanging whole rows applies the permutation to
+           * the already factored columns on the left and the
+           * not yet updated columns on the right at once. */
+          if (pivot != c)
+            {
+              float *row_c = a + c * lda;
+              float *row_pivot = a + pivot * lda;
+
+              for (size_t q = 0; q < n; ++q)
+                {
+                  float tmp = row_c[q];
+                  row_c[q] = row_pivot[q];
+                  row_pivot[q] = tmp;
+                }
+            }
+
+          float inverse = 1.0f / a[c * lda + c];
+          const float *row_c = a + c * lda;
+
+          for (size_t r = c + 1; r < n; ++r)
+            {
+              float *row_r = a + r * lda;
+              float multiplier = row_r[c] * inverse;
+
+              row_r[c] = multiplier;
+
+              for (size_t q = c + 1; q < j + jb; ++q)
+                row_r[q] -= multiplier * row_c[q];
+            }
+        }
+
+      size_t rest = n - j - jb;
+
+      if (rest == 0)
+        break;
+
+      /* A12 = L11^-1 * A12 */
+      for (size_t r = j + 1; r < j + jb; ++r)
+        {
+          float *row_r = a + r * lda;
+
+          for (size_t p = j; p < r; ++p)
+            {
+              float multiplier = row_r[p];
+              const float *row_p = a + p * lda;
+
+              for (size_t q = j + jb; q < n; ++q)
+                row_r[q] -= multiplier * row_p[q];
+            }
+        }
+
+      /* A22 -= A21 * A12 */
+      pipevec_gemm (rest, rest, jb,
+                    -1.0f,
+                    a + (j + jb) * lda + j, lda, 1,
+                    a + j * lda + j + jb, lda, 1,
+                    1.0f,
+                    a + (j + jb) * lda + j + jb, lda);
+    }
+
+  return TRUE;
+}
+
+/* Solve T * X = B in place for an n x k block B, where T is the lower
+ * triangle of the matrix described by the strides. Passing swapped
+ * strides solves with the transpose of an upper triangle instead. */
+static void
+trsm_left_lower (size_t       n,
+                 size_t       k,
+                 const float *t,
+                 ptrdiff_t    t_row_stride,
+                 ptrdiff_t    t_col_stride,
+                 gboolean     unit_diagonal,
+                 float       *b,
+                 size_t       ldb)
+{
+  for (size_t i0 = 0; i0 < n; i0 += PIPEVEC_LINALG_BLOCK)
+    {
+      size_t ib = MIN (PIPEVEC_LINALG_BLOCK, n - i0);
+
+      for (size_t i = i0; i < i0 + ib; ++i)
+        {
+          float *row_i = b + i * ldb;
+
+          for (size_t p = i0; p < i; ++p)
+            {
+              float multiplier = t[i * t_row_stride + p * t_col_stride];
+              const float *row_p = b + p * ldb;
+
+              for (size_t q = 0; q < k; ++q)
+                row_i[q] -= multiplier * row_p[q];
+            }
+
+          if (!unit_diagonal)
+            {
+              float inverse = 1.0f / t[i * t_row_stride + i * t_col_stride];
+
+              for (size_t q = 0; q < k; ++q)
+                row_i[q] *= inverse;
+            }
+        }
+
+      if (i0 + ib < n)
+        pipevec_gemm (n - i0 - ib, k, ib,
+                      -1.0f,
+                      t + (i0 + ib) * t_row_stride + i0 * t_col_stride, t_row_stride, t_col_stride,
+                      b + i0 * ldb, ldb, 1,
+                      1.0f,
+                      b + (i0 + ib) * ldb, ldb);
+    }
+}
+
+/* Solve T * X = B in place where T is the upper triangle of the
+ * matrix described by the strides. Blocks are processed from the
+ * bottom up. */
+static void
+trsm_left_upper (size_t       n,
+                 size_t       k,
+                 const float *t,
+                 ptrdiff_t    t_row_stride,
+                 ptrdiff_t    t_col_stride,
+                 gboolean     unit_diagonal,
+                 float       *b,
+                 size_t       ldb)
+{
+  size_t n_blocks = (n + PIPEVEC_LINALG_BLOCK - 1) / PIPEVEC_LINALG_BLOCK;
+
+  for (size_t block = n_blocks; block-- > 0;)
+    {
+      size_t i0 = block * PIPEVEC_LINALG_BLOCK;
+      size_t ib = MIN (PIPEVEC_LINALG_BLOCK, n - i0);
+
+      for (size_t i = i0 + ib; i-- > i0;)
+        {
+          float *row_i = b + i * ldb;
+
+          for (size_t p = i + 1; p < i0 + ib; ++p)
+            {
+              float multiplier = t[i * t_row_stride + p * t_col_stride];
+              const float *row_p = b + p * ldb;
+
+              for (size_t q = 0; q < k; ++q)
+                row_i[q] -= multiplier * row_p[q];
+            }
+
+          if (!unit_diagonal)
+            {
+              float inverse = 1.0f / t[i * t_row_stride + i * t_col_stride];
+
+              for (size_t q = 0; q < k; ++q)
+                row_i[q] *= inverse;
+            }
+        }
+
+      if (i0 > 0)
+        pipevec_gemm (i0, k, ib,
+                      -1.0f,
+                      t + i0 * t_col_stride, t_row_stride, t_col_stride,
+                      b + i0 * ldb, ldb, 1,
+                      1.0f,
+                      b, ldb);
+    }
+}
+
+static void
+trsm_left (size_t                       n,
+           size_t                       k,
+           const float                 *t,
+           size_t                       ldt,
+           PipevecTriangularSolveFlags  flags,
+           float                       *b,
+           size_t                       ldb)
+{
+  gboolean lower = (flags & PIPEVEC_TRIANGULAR_SOLVE_LOWER) != 0;
+  gboolean unit_diagonal = (flags & PIPEVEC_TRIANGULAR_SOLVE_UNIT_DIAGONAL) != 0;
+  ptrdiff_t row_stride = ldt;
+  ptrdiff_t col_stride = 1;
+
+  /* The transpose of a lower triangle is an upper triangle and
+   * vice versa, so transposing is just a matter of swapping
+   * the strides */
+  if (flags & PIPEVEC_TRIANGULAR_SOLVE_TRANSPOSE)
+    {
+      row_stride = 1;
+      col_stride = ldt;
+      lower = !lower;
+    }
+
+  if (lower)
+    trsm_left_lower (n, k, t, row_stride, col_stride, unit_diagonal, b, ldb);
+  else
+    trsm_left_upper (n, k, t, row_stride, col_stride, unit_diagonal, b, ldb);
+}
+
+/* Solve A * X = B for n <= 8 and k <= 8 with Gaussian elimination and
+ * partial pivoting, keeping every row of A and B in a register. Rows
+ * past n are filled in with the identity so that the loops have a
+ * fixed trip count and can be fully unrolled. The row padding of both
+ * operands is zero, so the extra rows never interact with the real
+ * ones. */
+static gboolean
+solve_small (const float *a,
+             size_t       lda,
+             float       *b,
+             size_t       ldb,
+             size_t       n)
+{
+  float8_t rows[PIPEVEC_LINALG_SMALL_SOLVE];
+  float8_t rhs[PIPEVEC_LINALG_SMALL_SOLVE];
+
+  for (size_t r = 0; r < PIPEVEC_LINALG_SMALL_SOLVE; ++r)
+    {
+      if (r < n)
+        {
+          rows[r] = load_float8 (a + r * lda);
+          rhs[r] = load_float8 (b + r * ldb);
+        }
+      else
+        {
+          float8_t unit = { 0 };
+
+          unit[r] = 1.0f;
+          rows[r] = unit;
+          rhs[r] = (float8_t) { 0 };
+        }
+    }
+
+  for (size_t c = 0; c < PIPEVEC_LINALG_SMALL_SOLVE; ++c)
+    {
+      size_t pivot = c;
+      float best = fabsf (rows[c][c]);
+
+      for (size_t r = c + 1; r < PIPEVEC_LINALG_SMALL_SOLVE; ++r)
+        {
+          float candidate = fabsf (rows[r][c]);
+
+          if (candidate > best)
+            {
+              best = candidate;
+              pivot = r;
+            }
+        }
+
+      if (!(best > 0.0f))
+        return FALSE;
+
+      float8_t tmp = rows[c];
+      rows[c] = rows[pivot];
+      rows[pivot] = tmp;
+
+      tmp = rhs[c];
+      rhs[c] = rhs[pivot];
+      rhs[pivot] = tmp;
+
+      float inverse = 1.0f / rows[c][c];
+
+      for (size_t r = c + 1; r < PIPEVEC_LINALG_SMALL_SOLVE; ++r)
+        {
+          float multiplier = rows[r][c] * inverse;
+
+          rows[r] -= multiplier * rows[c];
+          rhs[r] -= multiplier * rhs[c];
+        }
+    }
+
+  for (size_t c = PIPEVEC_LINALG_SMALL_SOLVE; c-- > 0;)
+    {
+      for (size_t j = c + 1; j < PIPEVEC_LINALG_SMALL_SOLVE; ++j)
+        rhs[c] -= rows[c][j] * rhs[j];
+
+      rhs[c] *= 1.0f / rows[c][c];
+    }
+
+  for (size_t r = 0; r < n; ++r)
+    store_float8 (b + r * ldb, rhs[r]);
+
+  return TRUE;
+}
+
+/**
+ * pipevec_tensor_cholesky:
+ * @tensor: A #PipevecTensor of shape (..., N, N)
+ * @error: A #GError out pointer.
+ *
+ * Compute the Cholesky factorization A = L * L^T of each symmetric
+ * positive definite matrix in @tensor. Only the lower triangle of
+ * each matrix is read.
+ *
+ * Returns: (transfer full): A new #PipevecTensor holding the lower
+ *          triangular factors L, or %NULL with @error set if a matrix
+ *          is not positive definite.
+ */
+PipevecTensor *
+pipevec_tensor_cholesky (PipevecTensor  *tensor,
+                         GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_CHOLESKY);
+
+  pipevec_profile_scope_set_shape (&scope, pipevec_tensor_get_shape_array (tensor));
+
+  if (!check_square_matrices (tensor, error))
+    return NULL;
+
+  g_autoptr(PipevecTensor) factor = pipevec_tensor_copy (tensor, error);
+
+  if (factor == NULL)
+    return NULL;
+
+  PipevecTensorMatrixView view;
+  pipevec_tensor_get_matrix_view (factor, &view);
+
+  for (size_t batch_index = 0; batch_index < view.n_batches; ++batch_index)
+    {
+      float *matrix = view.data + batch_index * view.batch_stride;
+
+      if (!cholesky_blocked (view.rows, matrix, view.row_stride))
+        {
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_NOT_POSITIVE_DEFINITE,
+                       "Matrix %zu in the batch is not positive definite",
+                       batch_index);
+          return NULL;
+        }
+
+      /* Clear the upper triangle, which still holds the input */
+      for (size_t i = 0; i < view.rows; ++i)
+        memset (matrix + i * view.row_stride + i + 1,
+                0,
+                sizeof (float) * (view.columns - i - 1));
+    }
+
+  profile_linalg (&scope,
+                  view.n_batches,
+                  pipevec_tensor_matrix_view_bytes (&view),
+                  pipevec_tensor_matrix_view_bytes (&view),
+                  pow (view.rows, 3) / 3.0);
+
+  return g_steal_pointer (&factor);
+}
+
+/**
+ * pipevec_tensor_lu:
+ * @tensor: A #PipevecTensor of shape (..., N, N)
+ * @pivots: (out) (optional) (transfer full) (element-type gulong): Return location
+ *          for the row exchanges, N per matrix.
+ * @error: A #GError out pointer.
+ *
+ * Compute the LU factorization with partial pivoting P * A = L * U of
+ * each matrix in @tensor. L and U are stored in the same matrix, with
+ * the unit diagonal of L implied. For each matrix, row i was exchanged
+ * with row @pivots[i], in increasing order of i.
+ *
+ * Returns: (transfer full): A new #PipevecTensor holding the factors,
+ *          or %NULL with @error set if a matrix is singular.
+ */
+PipevecTensor *
+pipevec_tensor_lu (PipevecTensor  *tensor,
+                   GArray        **pivots,
+                   GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_LU);
+
+  pipevec_profile_scope_set_shape (&scope, pipevec_tensor_get_shape_array (tensor));
+
+  if (!check_square_matrices (tensor, error))
+    return NULL;
+
+  g_autoptr(PipevecTensor) factor = pipevec_tensor_copy (tensor, error);
+
+  if (factor == NULL)
+    return NULL;
+
+  PipevecTensorMatrixView view;
+  pipevec_tensor_get_matrix_view (factor, &view);
+
+  g_autoptr(GArray) pivot_array = g_array_sized_new (FALSE, TRUE, sizeof (size_t), view.n_batches * view.rows);
+  g_array_set_size (pivot_array, view.n_batches * view.rows);
+
+  for (size_t batch_index = 0; batch_index < view.n_batches; ++batch_index)
+    {
+      if (!lu_blocked (view.rows,
+                       view.data + batch_index * view.batch_stride,
+                       view.row_stride,
+                       &g_array_index (pivot_array, size_t, batch_index * view.rows)))
+        {
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_SINGULAR_MATRIX,
+                       "Matrix %zu in the batch is singular",
+                       batch_index);
+          return NULL;
+        }
+    }
+
+  if (pivots != NULL)
+    *pivots = g_steal_pointer (&pivot_array);
+
+  profile_linalg (&scope,
+                  view.n_batches,
+                  pipevec_tensor_matrix_view_bytes (&view),
+                  pipevec_tensor_matrix_view_bytes (&view),
+                  2.0 * pow (view.rows, 3) / 3.0);
+
+  return g_steal_pointer (&factor);
+}
+
+/**
+ * pipevec_tensor_triangular_solve:
+ * @a: A #PipevecTensor of shape (..., N, N) holding triangular matrices.
+ * @b: A #PipevecTensor of shape (..., N, K) holding right hand sides.
+ * @flags: #PipevecTriangularSolveFlags selecting the triangle of @a.
+ * @error: A #GError out pointer.
+ *
+ * Solve T * X = B for each pair of matrices in @a and @b, where T is
+ * the triangle of @a selected by @flags. The other triangle of @a
+ * is not read.
+ *
+ * Returns: (transfer full): A new #PipevecTensor of shape (..., N, K),
+ *          or %NULL with @error set if a diagonal entry is zero.
+ */
+PipevecTensor *
+pipevec_tensor_triangular_solve (PipevecTensor                *a,
+                                 PipevecTensor                *b,
+                                 PipevecTriangularSolveFlags   flags,
+                                 GError                      **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_TRIANGULAR_SOLVE);
+
+  pipevec_profile_scope_set_shape (&scope, pipevec_tensor_get_shape_array (a));
+
+  if (!check_square_matrices (a, error) ||
+      !check_right_hand_side (a, b, error))
+    return NULL;
+
+  g_autoptr(PipevecTensor) solution = pipevec_tensor_copy (b, error);
+
+  if (solution == NULL)
+    return NULL;
+
+  PipevecTensorMatrixView a_view, x_view;
+  pipevec_tensor_get_matrix_view (a, &a_view);
+  pipevec_tensor_get_matrix_view (solution, &x_view);
+
+  for (size_t batch_index = 0; batch_index < a_view.n_batches; ++batch_index)
+    {
+      const float *t = a_view.data + batch_index * a_view.batch_stride;
+
+      if (!(flags & PIPEVEC_TRIANGULAR_SOLVE_UNIT_DIAGONAL))
+        {
+          for (size_t i = 0; i < a_view.rows; ++i)
+            {
+              if (t[i * a_view.row_stride + i] == 0.0f)
+                {
+                  g_set_error (error,
+                               PIPEVEC_ERROR,
+                               PIPEVEC_ERROR_SINGULAR_MATRIX,
+                               "Matrix %zu in the batch has a zero on the diagonal",
+                               batch_index);
+                  return NULL;
+                }
+            }
+        }
+
+      trsm_left (a_view.rows,
+                 x_view.columns,
+                 t,
+                 a_view.row_stride,
+                 flags,
+                 x_view.data + batch_index * x_view.batch_stride,
+                 x_view.row_stride);
+    }
+
+  profile_linalg (&scope,
+                  a_view.n_batches,
+                  pipevec_tensor_matrix_view_bytes (&a_view) + pipevec_tensor_matrix_view_bytes (&x_view),
+                  pipevec_tensor_matrix_view_bytes (&x_view),
+                  (double) a_view.rows * a_view.rows * x_view.columns);
+
+  return g_steal_pointer (&solution);
+}
+
+/**
+ * pipevec_tensor_solve:
+ * @a: A #PipevecTensor of shape (..., N, N)
+ * @b: A #PipevecTensor of shape (..., N, K)
+ * @error: A #GError out pointer.
+ *
+ * Solve A * X = B for each pair of matrices in @a and @b, using an
+ * LU factorization with partial pivoting. Batches of systems with
+ * N and K of at most 8 are solved without leaving registers.
+ *
+ * Returns: (transfer full): A new #PipevecTensor of shape (..., N, K),
+ *          or %NULL with @error set if a matrix is singular.
+ */
+PipevecTensor *
+pipevec_tensor_solve (PipevecTensor  *a,
+                      PipevecTensor  *b,
+                      GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_SOLVE);
+
+  pipevec_profile_scope_set_shape (&scope, pipevec_tensor_get_shape_array (a));
+
+  if (!check_square_matrices (a, error) ||
+      !check_right_hand_side (a, b, error))
+    return NULL;
+
+  g_autoptr(PipevecTensor) solution = pipevec_tensor_copy (b, error);
+
+  if (solution == NULL)
+    return NULL;
+
+  PipevecTensorMatrixView a_view, x_view;
+  pipevec_tensor_get_matrix_view (a, &a_view);
+  pipevec_tensor_get_matrix_view (solution, &x_view);
+
+  guint64 bytes_read = pipevec_tensor_matrix_view_bytes (&a_view) + pipevec_tensor_matrix_view_bytes (&x_view);
+  double flops = 2.0 * pow (a_view.rows, 3) / 3.0 + 2.0 * a_view.rows * a_view.rows * x_view.columns;
+
+  if (a_view.rows <= PIPEVEC_LINALG_SMALL_SOLVE &&
+      x_view.columns <= PIPEVEC_LINALG_SMALL_SOLVE)
+    {
+      for (size_t batch_index = 0; batch_index < a_view.n_batches; ++batch_index)
+        {
+          if (!solve_small (a_view.data + batch_index * a_view.batch_stride,
+                            a_view.row_stride,
+                            x_view.data + batch_index * x_view.batch_stride,
+                            x_view.row_stride,
+                            a_view.rows))
+            {
+              g_set_error (error,
+                           PIPEVEC_ERROR,
+                           PIPEVEC_ERROR_SINGULAR_MATRIX,
+                           "Matrix %zu in the batch is singular",
+                           batch_index);
+              return NULL;
+            }
+        }
+
+      profile_linalg (&scope, a_view.n_batches, bytes_read, pipevec_tensor_matrix_view_bytes (&x_view), flops);
+
+      return g_steal_pointer (&solution);
+    }
+
+  g_autoptr(GArray) pivots = NULL;
+  g_autoptr(PipevecTensor) factor = pipevec_tensor_lu (a, &pivots, error);
+
+  if (factor == NULL)
+    return NULL;
+
+  PipevecTensorMatrixView lu_view;
+  pipevec_tensor_get_matrix_view (factor, &lu_view);
+
+  for (size_t batch_index = 0; batch_index < lu_view.n_batches; ++batch_index)
+    {
+      const float *lu = lu_view.data + batch_index * lu_view.batch_stride;
+      const size_t *batch_pivots = &g_array_index (pivots, size_t, batch_index * lu_view.rows);
+      float *x = x_view.data + batch_index * x_view.batch_stride;
+
+      /* Apply the row exchanges to B, then solve with L and U */
+      for (size_t i = 0; i < lu_view.rows; ++i)
+        {
+          if (batch_pivots[i] == i)
+            continue;
+
+          float *row_i = x + i * x_view.row_stride;
+          float *row_pivot = x + batch_pivots[i] * x_view.row_stride;
+
+          for (size_t q = 0; q < x_view.columns; ++q)
+            {
+              float tmp = row_i[q];
+              row_i[q] = row_pivot[q];
+              row_pivot[q] = tmp;
+            }
+        }
+
+      trsm_left (lu_view.rows, x_view.columns, lu, lu_view.row_stride,
+                 PIPEVEC_TRIANGULAR_SOLVE_LOWER | PIPEVEC_TRIANGULAR_SOLVE_UNIT_DIAGONAL,
+                 x, x_view.row_stride);
+      trsm_left (lu_view.rows, x_view.columns, lu, lu_view.row_stride,
+                 PIPEVEC_TRIANGULAR_SOLVE_NONE,
+                 x, x_view.row_stride);
+    }
+
+  profile_linalg (&scope, a_view.n_batches, bytes_read, pipevec_tensor_matrix_view_bytes (&x_view), flops);
+
+  return g_steal_pointer (&solution);
+}
+
+/* Householder QR
+ *
+ * A = Q * R where Q = H_1 * H_2 * ... * H_k and H_i = I - tau_i v_i v_i^T.
+ * The factored matrix holds R on and above the diagonal and the
+ * reflectors v_i (whose leading 1 is implied) below it. Each panel of
+ * PIPEVEC_LINALG_BLOCK reflectors is aggregated into the compact WY form
+ * I - V T V^T, where T is upper triangular, so that applying a whole
+ * panel costs two calls into the GEMM engine. The T factors of every
+ * panel are kept next to the factored matrix so that Q can be applied
+ * later without recomputing them. */
+typedef struct {
+  size_t  m;
+  size_t  n;
+  float  *a;
+  size_t  lda;
+  float  *t;
+} HouseholderFactor;
+
+static size_t
+householder_n_panels (size_t m,
+                      size_t n)
+{
+  return (MIN (m, n) + PIPEVEC_LINALG_BLOCK - 1) / PIPEVEC_LINALG_BLOCK;
+}
+
+static float *
+householder_t_new (size_t m,
+                   size_t n)
+{
+  return g_new0 (float, MAX (householder_n_panels (m, n), 1) * PIPEVEC_LINALG_BLOCK * PIPEVEC_LINALG_BLOCK);
+}
+
+/* Turn x (of length len, at stride) into a Householder vector, leaving
+ * beta in x[0] and v[1:] below it. Returns tau, which is zero if x is
+ * already a multiple of e_1. */
+static float
+householder_vector (size_t  len,
+                    float  *x,
+                    size_t  stride)
+{
+  float alpha = x[0];
+  double tail_norm2 = 0.0;
+
+  for (size_t i = 1; i < len; ++i)
+    tail_norm2 += (double) x[i * stride] * x[i * stride];
+
+  if (tail_norm2 == 0.0)
+    return 0.0f;
+
+  float beta = -copysignf ((float) sqrt ((double) alpha * alpha + tail_norm2), alpha);
+  float scale = 1.0f / (alpha - beta);
+
+  for (size_t i = 1; i < len; ++i)
+    x[i * stride] *= scale;
+
+  x[0] = beta;
+
+  return (beta - alpha) / beta;
+}
+
+/* Unblocked QR of a rows x jb panel, applying each reflector to the
+ * columns of the panel to its right. */
+static void
+householder_panel (size_t  rows,
+                   size_t  jb,
+                   float  *a,
+                   size_t  lda,
+                   float  *taus,
+                   float  *work)
+{
+  for (size_t c = 0; c < jb; ++c)
+    {
+      float tau = householder_vector (rows - c, a + c * lda + c, lda);
+      size_t width = jb - c - 1;
+
+      taus[c] = tau;
+
+      if (tau == 0.0f || width == 0)
+        continue;
+
+      /* w = v^T * A[c:, c+1:], walking A by rows */
+      float *a_c = a + c * lda + c + 1;
+
+      memcpy (work, a_c, sizeof (float) * width);
+
+      for (size_t r = c + 1; r < rows; ++r)
+        {
+          float v_r = a[r * lda + c];
+          const float *a_r = a + r * lda + c + 1;
+
+          for (size_t q = 0; q < width; ++q)
+            work[q] += v_r * a_r[q];
+        }
+
+      /* A[c:, c+1:] -= tau * v * w^T */
+      for (size_t q = 0; q < width; ++q)
+        a_c[q] -= tau * work[q];
+
+      for (size_t r = c + 1; r < rows; ++r)
+        {
+          float factor = tau * a[r * lda + c];
+          float *a_r = a + r * lda + c + 1;
+
+          for (size_t q = 0; q < width; ++q)
+            a_r[q] -= factor * work[q];
+        }
+    }
+}
+
+/* Copy the reflectors of a panel into a dense rows x jb matrix with the
+ * implied unit diagonal and zeros above it, so it can be fed to GEMM */
+static void
+householder_extract_reflectors (size_t       rows,
+                                size_t       jb,
+                                const float *a,
+                                size_t       lda,
+                                float       *v)
+{
+  for (size_t r = 0; r < rows; ++r)
+    for (size_t c = 0; c < jb; ++c)
+      v[r * jb + c] = r > c ? a[r * lda + c] : (r == c ? 1.0f : 0.0f);
+}
+
+/* Form the upper triangular jb x jb T such that
+ * H_1 * ... * H_jb = I - V * T * V^T */
+static void
+householder_form_t (size_t       rows,
+                    size_t       jb,
+                    const float *v,
+                    const float *taus,
+                    float       *t)
+{
+  float z[PIPEVEC_LINALG_BLOCK];
+
+  memset (t, 0, sizeof (float) * jb * jb);
+
+  for (size_t i = 0; i < jb; ++i)
+    {
+      t[i * jb + i] = taus[i];
+
+      if (i == 0 || taus[i] == 0.0f)
+        continue;
+
+      /* z = V[:, :i]^T * v_i, where v_i is zero above row i */
+      memset (z, 0, sizeof (float) * i);
+
+      for (size_t r = i; r < rows; ++r)
+        {
+          float v_ri = v[r * jb + i];
+
+          for (size_t p = 0; p < i; ++p)
+            z[p] += v[r * jb + p] * v_ri;
+        }
+
+      /* T[:i, i] = -tau_i * T[:i, :i] * z */
+      for (size_t p = 0; p < i; ++p)
+        {
+          float sum = 0.0f;
+
+          for (size_t q = p; q < i; ++q)
+            sum += t[p * jb + q] * z[q];
+
+          t[p * jb + i] = -taus[i] * sum;
+        }
+    }
+}
+
+/* C = (I - V * op(T) * V^T) * C for a rows x k block C, where op(T) is
+ * T, or T^T when applying the transpose. w is jb x k scratch. */
+static void
+householder_apply_block (size_t       rows,
+                         size_t       jb,
+                         const float *v,
+                         const float *t,
+                         gboolean     transpose,
+                         float       *c,
+                         size_t       ldc,
+                         size_t       k,
+                         float       *w)
+{
+  pipevec_gemm (jb, k, rows,
+                1.0f,
+                v, 1, jb,
+                c, ldc, 1,
+                0.0f,
+                w, k);
+
+  /* W = op(T) * W in place. Walk the rows in the order that only
+   * reads rows which have not been overwritten yet. */
+  if (transpose)
+    {
+      for (size_t i = jb; i-- > 0;)
+        {
+          float *w_i = w + i * k;
+
+          for (size_t q = 0; q < k; ++q)
+            w_i[q] *= t[i * jb + i];
+
+          for (size_t p = 0; p < i; ++p)
+            {
+              float factor = t[p * jb + i];
+              const float *w_p = w + p * k;
+
+              for (size_t q = 0; q < k; ++q)
+                w_i[q] += factor * w_p[q];
+            }
+        }
+    }
+  else
+    {
+      for (size_t i = 0; i < jb; ++i)
+        {
+          float *w_i = w + i * k;
+
+          for (size_t q = 0; q < k; ++q)
+            w_i[q] *= t[i * jb + i];
+
+          for (size_t p = i + 1; p < jb; ++p)
+            {
+              float factor = t[i * jb + p];
+              const float *w_p = w + p * k;
+
+              for (size_t q = 0; q < k; ++q)
+                w_i[q] += factor * w_p[q];
+            }
+        }
+    }
+
+  pipevec_gemm (rows, k, jb,
+                -1.0f,
+                v, jb, 1,
+                w, k, 1,
+                1.0f,
+                c, ldc);
+}
+
+static void
+householder_factor (HouseholderFactor *factor)
+{
+  size_t m = factor->m;
+  size_t n = factor->n;
+  size_t lda = factor->lda;
+  size_t n_reflectors = MIN (m, n);
+  g_autofree float *v = g_new (float, m * PIPEVEC_LINALG_BLOCK);
+  g_autofree float *w = g_new (float, PIPEVEC_LINALG_BLOCK * MAX (n, 1));
+  float taus[PIPEVEC_LINALG_BLOCK];
+
+  for (size_t j = 0, panel = 0; j < n_reflectors; j += PIPEVEC_LINALG_BLOCK, ++panel)
+    {
+      size_t jb = MIN (PIPEVEC_LINALG_BLOCK, n_reflectors - j);
+      size_t rows = m - j;
+      float *a_jj = factor->a + j * lda + j;
+      float *t = factor->t + panel * PIPEVEC_LINALG_BLOCK * PIPEVEC_LINALG_BLOCK;
+
+      householder_panel (rows, jb, a_jj, lda, taus, w);
+      householder_extract_reflectors (rows, jb, a_jj, lda, v);
+      householder_form_t (rows, jb, v, taus, t);
+
+      if (j + jb < n)
+        householder_apply_block (rows, jb, v, t, TRUE, a_jj + jb, lda, n - j - jb, w);
+    }
+}
+
+/* C = Q * C, or C = Q^T * C when transpose is set, for an m x k block C */
+static void
+householder_apply (const HouseholderFactor *factor,
+                   gboolean                 transpose,
+                   float                   *c,
+                   size_t                   ldc,
+                   size_t                   k)
+{
+  size_t m = factor->m;
+  size_t n_reflectors = MIN (m, factor->n);
+  size_t n_panels = householder_n_panels (m, factor->n);
+  g_autofree float *v = g_new (float, m * PIPEVEC_LINALG_BLOCK);
+  g_autofree float *w = g_new (float, PIPEVEC_LINALG_BLOCK * MAX (k, 1));
+
+  /* Q^T = H_k * ... * H_1 applies the first panel first,
+   * Q = H_1 * ... * H_k applies the last panel first */
+  for (size_t i = 0; i < n_panels; ++i)
+    {
+      size_t panel = transpose ? i : n_panels - 1 - i;
+      size_t j = panel * PIPEVEC_LINALG_BLOCK;
+      size_t jb = MIN (PIPEVEC_LINALG_BLOCK, n_reflectors - j);
+      size_t rows = m - j;
+
+      householder_extract_reflectors (rows, jb, factor->a + j * factor->lda + j, factor->lda, v);
+      householder_apply_block (rows, jb, v,
+                               factor->t + panel * PIPEVEC_LINALG_BLOCK * PIPEVEC_LINALG_BLOCK,
+                               transpose,
+                               c + j * ldc, ldc, k, w);
+    }
+}
+
+/* Tall-skinny QR: factor row blocks independently in parallel, then
+ * factor the stacked n x n triangles of the blocks. Q is the product
+ * of the block diagonal Q of the blocks and the Q of the stack. */
+typedef struct {
+  size_t             n_blocks;
+  size_t             block_rows;
+  HouseholderFactor  whole;
+  HouseholderFactor *blocks;
+  HouseholderFactor  stack;
+
+  /* Used when applying Q or Q^T to c */
+  float             *c;
+  size_t             ldc;
+  size_t             k;
+} TallSkinnyFactor;
+
+static void
+tall_skinny_get_block (TallSkinnyFactor *tsqr,
+                       size_t            block,
+                       size_t           *first_row,
+                       size_t           *n_rows)
+{
+  *first_row = block * tsqr->block_rows;
+  *n_rows = block + 1 == tsqr->n_blocks ? tsqr->whole.m - *first_row : tsqr->block_rows;
+}
+
+static void
+tall_skinny_factor_block (size_t   block,
+                          gpointer user_data)
+{
+  TallSkinnyFactor *tsqr = user_data;
+  HouseholderFactor *factor = &tsqr->blocks[block];
+  size_t first_row;
+
+  tall_skinny_get_block (tsqr, block, &first_row, &factor->m);
+  factor->n = tsqr->whole.n;
+  factor->a = tsqr->whole.a + first_row * tsqr->whole.lda;
+  factor->lda = tsqr->whole.lda;
+  factor->t = householder_t_new (factor->m, factor->n);
+
+  householder_factor (factor);
+}
+
+static void
+tall_skinny_apply_transpose_block (size_t   block,
+                                   gpointer user_data)
+{
+  TallSkinnyFactor *tsqr = user_data;
+  size_t first_row, n_rows;
+
+  tall_skinny_get_block (tsqr, block, &first_row, &n_rows);
+  householder_apply (&tsqr->blocks[block], TRUE, tsqr->c + first_row * tsqr->ldc, tsqr->ldc, tsqr->k);
+}
+
+static void
+tall_skinny_apply_block (size_t   block,
+                         gpointer user_data)
+{
+  TallSkinnyFactor *tsqr = user_data;
+  size_t first_row, n_rows;
+
+  tall_skinny_get_block (tsqr, block, &first_row, &n_rows);
+  householder_apply (&tsqr->blocks[block], FALSE, tsqr->c + first_row * tsqr->ldc, tsqr->ldc, tsqr->k);
+}
+
+static size_t
+tall_skinny_n_blocks (size_t m,
+                      size_t n)
+{
+  size_t min_block_rows = MAX (PIPEVEC_LINALG_TSQR_MIN_BLOCK_ROWS, 2 * n);
+
+  size_t n_threads = pipevec_dispatch_loop_threads (m,
+                                                    householder_qr_flops (m, n) / m,
+                                                    sizeof (float) * n);
+
+  return MIN (n_threads, m / min_block_rows);
+}
+
+static void
+tall_skinny_factor (TallSkinnyFactor *tsqr)
+{
+  size_t n = tsqr->whole.n;
+
+  tsqr->block_rows = tsqr->whole.m / tsqr->n_blocks;
+  tsqr->blocks = g_new0 (HouseholderFactor, tsqr->n_blocks);
+
+  pipevec_parallel_for (tsqr->n_blocks, tall_skinny_factor_block, tsqr);
+
+  /* Stack the R factors of the blocks and factor them again */
+  tsqr->stack.m = tsqr->n_blocks * n;
+  tsqr->stack.n = n;
+  tsqr->stack.lda = apply_padding (n, 8);
+  tsqr->stack.a = g_new0 (float, tsqr->stack.m * tsqr->stack.lda);
+  tsqr->stack.t = householder_t_new (tsqr->stack.m, n);
+
+  for (size_t block = 0; block < tsqr->n_blocks; ++block)
+    for (size_t i = 0; i < n; ++i)
+      memcpy (tsqr->stack.a + (block * n + i) * tsqr->stack.lda + i,
+              tsqr->blocks[block].a + i * tsqr->whole.lda + i,
+              sizeof (float) * (n - i));
+
+  householder_factor (&tsqr->stack);
+}
+
+static void
+tall_skinny_clear (TallSkinnyFactor *tsqr)
+{
+  for (size_t block = 0; block < tsqr->n_blocks; ++block)
+    g_free (tsqr->blocks[block].t);
+
+  g_clear_pointer (&tsqr->blocks, g_free);
+  g_clear_pointer (&tsqr->stack.a, g_free);
+  g_clear_pointer (&tsqr->stack.t, g_free);
+}
+
+/* C = Q^T * C for an m x k block C. Only the top n rows of the result
+ * are meaningful afterwards; they are returned in the top of C. */
+static void
+tall_skinny_apply_transpose (TallSkinnyFactor *tsqr,
+                             float            *c,
+                             size_t            ldc,
+                             size_t            k)
+{
+  size_t n = tsqr->whole.n;
+
+  tsqr->c = c;
+  tsqr->ldc = ldc;
+  tsqr->k = k;
+  pipevec_parallel_for (tsqr->n_blocks, tall_skinny_apply_transpose_block, tsqr);
+
+  g_autofree float *stacked = g_new0 (float, tsqr->stack.m * k);
+
+  for (size_t block = 0; block < tsqr->n_blocks; ++block)
+    for (size_t i = 0; i < n; ++i)
+      memcpy (stacked + (block * n + i) * k,
+              c + (block * tsqr->block_rows + i) * ldc,
+              sizeof (float) * k);
+
+  householder_apply (&tsqr->stack, TRUE, stacked, k, k);
+
+  for (size_t i = 0; i < n; ++i)
+    memcpy (c + i * ldc, stacked + i * k, sizeof (float) * k);
+}
+
+/* Write the thin m x n Q into q */
+static void
+tall_skinny_form_q (TallSkinnyFactor *tsqr,
+                    float            *q,
+                    size_t            ldq)
+{
+  size_t n = tsqr->whole.n;
+  g_autofree float *stacked = g_new0 (float, tsqr->stack.m * n);
+
+  for (size_t i = 0; i < n; ++i)
+    stacked[i * n + i] = 1.0f;
+
+  householder_apply (&tsqr->stack, FALSE, stacked, n, n);
+
+  for (size_t block = 0; block < tsqr->n_blocks; ++block)
+    for (size_t i = 0; i < n; ++i)
+      memcpy (q + (block * tsqr->block_rows + i) * ldq,
+              stacked + (block * n + i) * n,
+              sizeof (float) * n);
+
+  tsqr->c = q;
+  tsqr->ldc = ldq;
+  tsqr->k = n;
+  pipevec_parallel_for (tsqr->n_blocks, tall_skinny_apply_block, tsqr);
+}
+
+typedef struct {
+  PipevecTensorMatrixView a;
+  PipevecTensorMatrixView q;
+  PipevecTensorMatrixView r;
+  PipevecTensorMatrixView b;
+  gboolean                want_q;
+} QRBatch;
+
+/* Copy the upper triangle (or trapezoid) of the factored matrix into r */
+static void
+householder_copy_r (const float *a,
+                    size_t       lda,
+                    size_t       rows,
+                    size_t       columns,
+                    float       *r,
+                    size_t       ldr)
+{
+  for (size_t i = 0; i < rows; ++i)
+    memcpy (r + i * ldr + i, a + i * lda + i, sizeof (float) * (columns - i));
+}
+
+static void
+qr_batch_item (size_t   batch_index,
+               gpointer user_data)
+{
+  QRBatch *batch = user_data;
+  size_t m = batch->a.rows;
+  size_t n = batch->a.columns;
+  size_t n_reflectors = MIN (m, n);
+  size_t n_blocks = batch->a.n_batches == 1 ? tall_skinny_n_blocks (m, n) : 0;
+  HouseholderFactor factor = {
+    .m = m,
+    .n = n,
+    .a = batch->a.data + batch_index * batch->a.batch_stride,
+    .lda = batch->a.row_stride
+  };
+
+  float *q = batch->want_q ? batch->q.data + batch_index * batch->q.batch_stride : NULL;
+
+  if (n_blocks > 1)
+    {
+      TallSkinnyFactor tsqr = { .n_blocks = n_blocks, .whole = factor };
+
+      tall_skinny_factor (&tsqr);
+      householder_copy_r (tsqr.stack.a, tsqr.stack.lda, n, n,
+                          batch->r.data + batch_index * batch->r.batch_stride,
+                          batch->r.row_stride);
+
+      if (q != NULL)
+        tall_skinny_form_q (&tsqr, q, batch->q.row_stride);
+
+      tall_skinny_clear (&tsqr);
+      return;
+    }
+
+  g_autofree float *t = householder_t_new (m, n);
+  factor.t = t;
+  householder_factor (&factor);
+  householder_copy_r (factor.a, factor.lda, n_reflectors, n,
+                      batch->r.data + batch_index * batch->r.batch_stride,
+                      batch->r.row_stride);
+
+  if (q != NULL)
+    {
+      for (size_t i = 0; i < n_reflectors; ++i)
+        q[i * batch->q.row_stride + i] = 1.0f;
+
+      householder_apply (&factor, FALSE, q, batch->q.row_stride, n_reflectors);
+    }
+}
+
+static PipevecTensor *
+new_tensor_with_trailing_shape (PipevecTensor  *like,
+                                size_t          rows,
+                                size_t          columns,
+                                GError        **error)
+{
+  g_autoptr(GArray) shape = g_array_copy (pipevec_tensor_get_shape_array (like));
+
+  g_array_index (shape, size_t, shape->len - 2) = rows;
+  g_array_index (shape, size_t, shape->len - 1) = columns;
+
+  return pipevec_tensor_new_for_shape (shape, error);
+}
+
+/**
+ * pipevec_tensor_qr:
+ * @tensor: A #PipevecTensor of shape (..., M, N)
+ * @q: (out) (optional) (transfer full): Return location for the
+ *     orthonormal factors, of shape (..., M, min(M, N)).
+ * @r: (out) (optional) (transfer full): Return location for the upper
+ *     triangular factors, of shape (..., min(M, N), N).
+ * @error: A #GError out pointer.
+ *
+ * Compute the reduced QR factorization A = Q * R of each matrix in
+ * @tensor using blocked Householder reflectors. A single tall and
+ * skinny matrix is split into row blocks that are factored in
+ * parallel (TSQR).
+ *
+ * Returns: %TRUE on success, %FALSE with @error set on failure.
+ */
+gboolean
+pipevec_tensor_qr (PipevecTensor  *tensor,
+                   PipevecTensor **q,
+                   PipevecTensor **r,
+                   GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_QR);
+  GArray *shape = pipevec_tensor_get_shape_array (tensor);
+
+  pipevec_profile_scope_set_shape (&scope, shape);
+
+  if (shape->len < 2)
+    {
+      g_autofree char *formatted_shape = pipevec_format_shape (shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_BAD_SHAPE,
+                   "Expected a batch of matrices, but got shape %s",
+                   formatted_shape);
+      return FALSE;
+    }
+
+  size_t m = g_array_index (shape, size_t, shape->len - 2);
+  size_t n = g_array_index (shape, size_t, shape->len - 1);
+  size_t n_reflectors = MIN (m, n);
+
+  g_autoptr(PipevecTensor) factored = pipevec_tensor_copy (tensor, error);
+  g_autoptr(PipevecTensor) q_tensor = NULL;
+  g_autoptr(PipevecTensor) r_tensor = NULL;
+
+  if (factored == NULL)
+    return FALSE;
+
+  r_tensor = new_tensor_with_trailing_shape (tensor, n_reflectors, n, error);
+
+  if (r_tensor == NULL)
+    return FALSE;
+
+  if (q != NULL)
+    {
+      q_tensor = new_tensor_with_trailing_shape (tensor, m, n_reflectors, error);
+
+      if (q_tensor == NULL)
+        return FALSE;
+    }
+
+  QRBatch batch = { .want_q = q_tensor != NULL };
+
+  pipevec_tensor_get_matrix_view (factored, &batch.a);
+  pipevec_tensor_get_matrix_view (r_tensor, &batch.r);
+
+  if (q_tensor != NULL)
+    pipevec_tensor_get_matrix_view (q_tensor, &batch.q);
+
+  pipevec_dispatch_parallel_for (batch.a.n_batches,
+                                 householder_qr_flops (m, n) +
+                                 (q_tensor != NULL ? householder_qr_flops (m, n_reflectors) : 0.0),
+                                 (double) pipevec_tensor_matrix_view_bytes (&batch.a) / MAX (batch.a.n_batches, 1),
+                                 qr_batch_item,
+                                 &batch);
+
+  /* Forming Q costs about as much again as the factorization */
+  profile_linalg (&scope,
+                  batch.a.n_batches,
+                  pipevec_tensor_matrix_view_bytes (&batch.a),
+                  pipevec_tensor_matrix_view_bytes (&batch.r) +
+                  (q_tensor != NULL ? pipevec_tensor_matrix_view_bytes (&batch.q) : 0),
+                  householder_qr_flops (m, n) +
+                  (q_tensor != NULL ? householder_qr_flops (m, n_reflectors) : 0.0));
+
+  if (q != NULL)
+    *q = g_steal_pointer (&q_tensor);
+
+  if (r != NULL)
+    *r = g_steal_pointer (&r_tensor);
+
+  return TRUE;
+}
+
+/* Whether the n x n upper triangle r has a diagonal entry that is
+ * negligible next to the largest one, making the problem rank deficient */
+static gboolean
+upper_triangle_is_rank_deficient (const float *r,
+                                  size_t       ldr,
+                                  size_t       n,
+                                  size_t       m)
+{
+  float largest = 0.0f;
+
+  for (size_t i = 0; i < n; ++i)
+    largest = MAX (largest, fabsf (r[i * ldr + i]));
+
+  for (size_t i = 0; i < n; ++i)
+    if (!(fabsf (r[i * ldr + i]) > largest * FLT_EPSILON * MAX (m, n)))
+      return TRUE;
+
+  return FALSE;
+}
+
+static void
+lstsq_batch_item (size_t   batch_index,
+                  gpointer user_data)
+{
+  QRBatch *batch = user_data;
+  size_t m = batch->a.rows;
+  size_t n = batch->a.columns;
+  size_t k = batch->b.columns;
+  size_t n_blocks = batch->a.n_batches == 1 ? tall_skinny_n_blocks (m, n) : 0;
+  float *b = batch->b.data + batch_index * batch->b.batch_stride;
+  float *r = batch->r.data + batch_index * batch->r.batch_stride;
+  HouseholderFactor factor = {
+    .m = m,
+    .n = n,
+    .a = batch->a.data + batch_index * batch->a.batch_stride,
+    .lda = batch->a.row_stride
+  };
+
+  if (n_blocks > 1)
+    {
+      TallSkinnyFactor tsqr = { .n_blocks = n_blocks, .whole = factor };
+
+      tall_skinny_factor (&tsqr);
+      tall_skinny_apply_transpose (&tsqr, b, batch->b.row_stride, k);
+      householder_copy_r (tsqr.stack.a, tsqr.stack.lda, n, n, r, batch->r.row_stride);
+      tall_skinny_clear (&tsqr);
+      return;
+    }
+
+  g_autofree float *t = householder_t_new (m, n);
+  factor.t = t;
+  householder_factor (&factor);
+  householder_apply (&factor, TRUE, b, batch->b.row_stride, k);
+  householder_copy_r (factor.a, factor.lda, n, n, r, batch->r.row_stride);
+}
+
+/**
+ * pipevec_tensor_lstsq:
+ * @a: A #PipevecTensor of shape (..., M, N) with M >= N and full column rank.
+ * @b: A #PipevecTensor of shape (..., M, K)
+ * @error: A #GError out pointer.
+ *
+ * Find the X minimizing || A * X - B || for each pair of matrices in
+ * @a and @b, through a Householder QR factorization of A. Q is never
+ * formed; its reflectors are applied to B directly.
+ *
+ * Returns: (transfer full): A new #PipevecTensor of shape (..., N, K),
+ *          or %NULL with @error set if a matrix is rank deficient.
+ */
+PipevecTensor *
+pipevec_tensor_lstsq (PipevecTensor  *a,
+                      PipevecTensor  *b,
+                      GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_LSTSQ);
+  GArray *shape = pipevec_tensor_get_shape_array (a);
+
+  pipevec_profile_scope_set_shape (&scope, shape);
+
+  if (shape->len < 2 ||
+      g_array_index (shape, size_t, shape->len - 2) < g_array_index (shape, size_t, shape->len - 1))
+    {
+      g_autofree char *formatted_shape = pipevec_format_shape (shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_BAD_SHAPE,
+                   "Expected a batch of matrices with at least as many rows as columns, but got shape %s",
+                   formatted_shape);
+      return NULL;
+    }
+
+  if (!check_right_hand_side (a, b, error))
+    return NULL;
+
+  size_t n = g_array_index (shape, size_t, shape->len - 1);
+  size_t k = g_array_index (pipevec_tensor_get_shape_array (b),
+                            size_t,
+                            pipevec_tensor_get_shape_array (b)->len - 1);
+
+  g_autoptr(PipevecTensor) factored = pipevec_tensor_copy (a, error);
+  g_autoptr(PipevecTensor) rhs = NULL;
+  g_autoptr(PipevecTensor) r_tensor = NULL;
+  g_autoptr(PipevecTensor) solution = NULL;
+
+  if (factored == NULL ||
+      (rhs = pipevec_tensor_copy (b, error)) == NULL ||
+      (r_tensor = new_tensor_with_trailing_shape (a, n, n, error)) == NULL ||
+      (solution = new_tensor_with_trailing_shape (a, n, k, error)) == NULL)
+    return NULL;
+
+  QRBatch batch = { .want_q = FALSE };
+  PipevecTensorMatrixView x_view;
+
+  pipevec_tensor_get_matrix_view (factored, &batch.a);
+  pipevec_tensor_get_matrix_view (rhs, &batch.b);
+  pipevec_tensor_get_matrix_view (r_tensor, &batch.r);
+  pipevec_tensor_get_matrix_view (solution, &x_view);
+
+  pipevec_dispatch_parallel_for (batch.a.n_batches,
+                                 householder_qr_flops (batch.a.rows, n) +
+                                 (4.0 * batch.a.rows * n - 2.0 * n * n) * k,
+                                 (double) (pipevec_tensor_matrix_view_bytes (&batch.a) +
+                                           pipevec_tensor_matrix_view_bytes (&batch.b)) / MAX (batch.a.n_batches, 1),
+                                 lstsq_batch_item,
+                                 &batch);
+
+  /* Q^T * B is in the top n rows of B, so X = R^-1 * (Q^T * B) */
+  for (size_t batch_index = 0; batch_index < batch.a.n_batches; ++batch_index)
+    {
+      const float *r = batch.r.data + batch_index * batch.r.batch_stride;
+      float *x = x_view.data + batch_index * x_view.batch_stride;
+
+      if (upper_triangle_is_rank_deficient (r, batch.r.row_stride, n, batch.a.rows))
+        {
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_SINGULAR_MATRIX,
+                       "Matrix %zu in the batch is rank deficient",
+                       batch_index);
+          return NULL;
+        }
+
+      memcpy (x,
+              batch.b.data + batch_index * batch.b.batch_stride,
+              sizeof (float) * n * x_view.row_stride);
+      trsm_left (n, k, r, batch.r.row_stride, PIPEVEC_TRIANGULAR_SOLVE_NONE, x, x_view.row_stride);
+    }
+
+  /* Factoring A, applying Q^T to B and the triangular solve */
+  profile_linalg (&scope,
+                  batch.a.n_batches,
+                  pipevec_tensor_matrix_view_bytes (&batch.a) + pipevec_tensor_matrix_view_bytes (&batch.b),
+                  pipevec_tensor_matrix_view_bytes (&x_view),
+                  householder_qr_flops (batch.a.rows, n) +
+                  (4.0 * batch.a.rows * n - 2.0 * n * n) * k +
+                  (double) n * n * k);
+
+  return g_steal_pointer (&solution);
+}
+
+/* Symmetric eigendecomposition
+ *
+ * Each matrix is reduced to tridiagonal form with Householder
+ * reflections, accumulating the reflections into an orthogonal basis,
+ * and the tridiagonal matrix is then diagonalized with the implicit QL
+ * algorithm, rotating the basis along with it. The work is done in
+ * double precision on a small scratch buffer per matrix: the matrices
+ * this is meant for are small, so the O(n^3) work is cheap next to
+ * accuracy lost to cancellation in the rotations. */
+typedef struct {
+  PipevecTensorMatrixView  a;
+  PipevecTensorMatrixView  values;
+  PipevecTensorMatrixView  vectors;
+  gboolean                *converged;
+} EighBatch;
+
+/* Reduce the symmetric n x n matrix in v to tridiagonal form, with the
+ * diagonal in d and the subdiagonal in e[1:], and replace v with the
+ * orthogonal transformation that was applied. */
+static void
+tridiagonalize (size_t  n,
+                double *v,
+                double *d,
+                double *e)
+{
+  for (size_t j = 0; j < n; ++j)
+    d[j] = v[(n - 1) * n + j];
+
+  for (size_t i = n - 1; i > 0; --i)
+    {
+      double scale = 0.0;
+      double h = 0.0;
+
+      for (size_t k = 0; k < i; ++k)
+        scale += fabs (d[k]);
+
+      if (scale == 0.0)
+        {
+          e[i] = d[i - 1];
+
+          for (size_t j = 0; j < i; ++j)
+            {
+              d[j] = v[(i - 1) * n + j];
+              v[i * n + j] = 0.0;
+              v[j * n + i] = 0.0;
+            }
+
+          d[i] = h;
+          continue;
+        }
+
+      /* Generate the Householder vector for row i */
+      for (size_t k = 0; k < i; ++k)
+        {
+          d[k] /= scale;
+          h += d[k] * d[k];
+        }
+
+      double f = d[i - 1];
+      double g = f > 0.0 ? -sqrt (h) : sqrt (h);
+
+      e[i] = scale * g;
+      h -= f * g;
+      d[i - 1] = f - g;
+
+      for (size_t j = 0; j < i; ++j)
+        e[j] = 0.0;
+
+      /* Apply the similarity transformation to the remaining columns */
+      for (size_t j = 0; j < i; ++j)
+        {
+          f = d[j];
+          v[j * n + i] = f;
+          g = e[j] + v[j * n + j] * f;
+
+          for (size_t k = j + 1; k < i; ++k)
+            {
+              g += v[k * n + j] * d[k];
+              e[k] += v[k * n + j] * f;
+            }
+
+          e[j] = g;
+        }
+
+      f = 0.0;
+
+      for (size_t j = 0; j < i; ++j)
+        {
+          e[j] /= h;
+          f += e[j] * d[j];
+        }
+
+      double hh = f / (h + h);
+
+      for (size_t j = 0; j < i; ++j)
+        e[j] -= hh * d[j];
+
+      for (size_t j = 0; j < i; ++j)
+        {
+          f = d[j];
+          g = e[j];
+
+          for (size_t k = j; k < i; ++k)
+            v[k * n + j] -= f * e[k] + g * d[k];
+
+          d[j] = v[(i - 1) * n + j];
+          v[i * n + j] = 0.0;
+        }
+
+      d[i] = h;
+    }
+
+  /* Accumulate the transformations */
+  for (size_t i = 0; i + 1 < n; ++i)
+    {
+      v[(n - 1) * n + i] = v[i * n + i];
+      v[i * n + i] = 1.0;
+
+      double h = d[i + 1];
+
+      if (h != 0.0)
+        {
+          for (size_t k = 0; k <= i; ++k)
+            d[k] = v[k * n + i + 1] / h;
+
+          for (size_t j = 0; j <= i; ++j)
+            {
+              double g = 0.0;
+
+              for (size_t k = 0; k <= i; ++k)
+                g += v[k * n + i + 1] * v[k * n + j];
+
+              for (size_t k = 0; k <= i; ++k)
+                v[k * n + j] -= g * d[k];
+            }
+        }
+
+      for (size_t k = 0; k <= i; ++k)
+        v[k * n + i + 1] = 0.0;
+    }
+
+  for (size_t j = 0; j < n; ++j)
+    {
+      d[j] = v[(n - 1) * n + j];
+      v[(n - 1) * n + j] = 0.0;
+    }
+
+  v[(n - 1) * n + n - 1] = 1.0;
+  e[0] = 0.0;
+}
+
+/* Diagonalize the tridiagonal matrix in d and e with implicitly
+ * shifted QL iterations, rotating the columns of v to match. Returns
+ * FALSE if an eigenvalue did not converge. */
+static gboolean
+tridiagonal_ql (size_t  n,
+                double *v,
+                double *d,
+                double *e)
+{
+  const size_t max_iterations = 30 * n;
+  double shift = 0.0;
+  double tolerance = 0.0;
+
+  for (size_t i = 1; i < n; ++i)
+    e[i - 1] = e[i];
+
+  e[n - 1] = 0.0;
+
+  for (size_t l = 0; l < n; ++l)
+    {
+      size_t m = l;
+
+      tolerance = MAX (tolerance, fabs (d[l]) + fabs (e[l]));
+
+      /* Find a negligible subdiagonal element, splitting the matrix.
+       * e[n - 1] is zero, so this always stops. */
+      while (fabs (e[m]) > DBL_EPSILON * tolerance)
+        ++m;
+
+      /* Iterate until e[l] becomes negligible */
+      for (size_t iteration = 0; m > l && fabs (e[l]) > DBL_EPSILON * tolerance; ++iteration)
+        {
+          if (iteration == max_iterations)
+            return FALSE;
+
+          /* Wilkinson shift from the leading 2 x 2 block */
+          double g = d[l];
+          double p = (d[l + 1] - g) / (2.0 * e[l]);
+          double r = copysign (hypot (p, 1.0), p);
+
+          d[l] = e[l] / (p + r);
+          d[l + 1] = e[l] * (p + r);
+
+          double dl1 = d[l + 1];
+          double h = g - d[l];
+
+          for (size_t i = l + 2; i < n; ++i)
+            d[i] -= h;
+
+          shift += h;
+
+          /* Chase the bulge back up with Givens rotations */
+          p = d[m];
+
+          double c = 1.0, c2 = 1.0, c3 = 1.0;
+          double s = 0.0, s2 = 0.0;
+          double el1 = e[l + 1];
+
+          for (size_t i = m; i-- > l;)
+            {
+              c3 = c2;
+              c2 = c;
+              s2 = s;
+              g = c * e[i];
+              h = c * p;
+              r = hypot (p, e[i]);
+              e[i + 1] = s * r;
+              s = e[i] / r;
+              c = p / r;
+              p = c * d[i] - s * g;
+              d[i + 1] = h + s * (c * g + s * d[i]);
+
+              for (size_t k = 0; k < n; ++k)
+                {
+                  double *row = v + k * n;
+                  double right = row[i + 1];
+
+                  row[i + 1] = s * row[i] + c * right;
+                  row[i] = c * row[i] - s * right;
+                }
+            }
+
+          p = -s * s2 * c3 * el1 * e[l] / dl1;
+          e[l] = s * p;
+          d[l] = c * p;
+        }
+
+      d[l] += shift;
+      e[l] = 0.0;
+    }
+
+  return TRUE;
+}
+
+static void
+eigh_batch_item (size_t   batch_index,
+                 gpointer user_data)
+{
+  EighBatch *batch = user_data;
+  size_t n = batch->a.rows;
+  const float *a = batch->a.data + batch_index * batch->a.batch_stride;
+  float *values = batch->values.data + batch_index * batch->values.row_stride;
+  float *vectors = batch->vectors.data + batch_index * batch->vectors.batch_stride;
+  size_t ldv = batch->vectors.row_stride;
+  g_autofree double *scratch = g_new (double, n * n + 2 * n);
+  double *v = scratch;
+  double *d = v + n * n;
+  double *e = d + n;
+
+  if (n == 0)
+    {
+      batch->converged[batch_index] = TRUE;
+      return;
+    }
+
+  /* Only the lower triangle is read, as with the other factorizations */
+  for (size_t i = 0; i < n; ++i)
+    for (size_t j = 0; j <= i; ++j)
+      v[i * n + j] = v[j * n + i] = a[i * batch->a.row_stride + j];
+
+  tridiagonalize (n, v, d, e);
+  batch->converged[batch_index] = tridiagonal_ql (n, v, d, e);
+
+  /* Selection sort into ascending order, which is cheap next to the
+   * rest of the decomposition and keeps the columns in step */
+  for (size_t i = 0; i < n; ++i)
+    {
+      size_t smallest = i;
+
+      for (size_t j = i + 1; j < n; ++j)
+        if (d[j] < d[smallest])
+          smallest = j;
+
+      values[i] = (float) d[smallest];
+      d[smallest] = d[i];
+
+      for (size_t k = 0; k < n; ++k)
+        {
+          double *row = v + k * n;
+          double column = row[smallest];
+
+          row[smallest] = row[i];
+          vectors[k * ldv + i] = (float) column;
+        }
+    }
+}
+
+/**
+ * pipevec_tensor_eigh:
+ * @tensor: A #PipevecTensor of shape (..., N, N) holding symmetric matrices.
+ * @eigenvalues: (out) (optional) (transfer full): Return location for the
+ *               eigenvalues of each matrix in ascending order, of shape (..., N).
+ * @eigenvectors: (out) (optional) (transfer full): Return location for the
+ *                eigenvectors, of shape (..., N, N). Column i is the unit
+ *                eigenvector for eigenvalue i.
+ * @error: A #GError out pointer.
+ *
+ * Compute the eigendecomposition A = V * diag(w) * V^T of each symmetric
+ * matrix in @tensor. Only the lower triangle of each matrix is read.
+ * Matrices in the batch are decomposed in parallel.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set on failure.
+ */
+gboolean
+pipevec_tensor_eigh (PipevecTensor  *tensor,
+                     PipevecTensor **eigenvalues,
+                     PipevecTensor **eigenvectors,
+                     GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_EIGH);
+
+  pipevec_profile_scope_set_shape (&scope, pipevec_tensor_get_shape_array (tensor));
+
+  if (!check_square_matrices (tensor, error))
+    return FALSE;
+
+  GArray *shape = pipevec_tensor_get_shape_array (tensor);
+  g_autoptr(GArray) values_shape = g_array_copy (shape);
+  g_autoptr(PipevecTensor) values_tensor = NULL;
+  g_autoptr(PipevecTensor) vectors_tensor = NULL;
+
+  g_array_set_size (values_shape, values_shape->len - 1);
+
+  if ((values_tensor = pipevec_tensor_new_for_shape (values_shape, error)) == NULL ||
+      (vectors_tensor = pipevec_tensor_new_for_shape (shape, error)) == NULL)
+    return FALSE;
+
+  EighBatch batch;
+
+  pipevec_tensor_get_matrix_view (tensor, &batch.a);
+  pipevec_tensor_get_matrix_view (values_tensor, &batch.values);
+  pipevec_tensor_get_matrix_view (vectors_tensor, &batch.vectors);
+
+  g_autofree gboolean *converged = g_new0 (gboolean, batch.a.n_batches);
+  batch.converged = converged;
+
+  pipevec_dispatch_parallel_for (batch.a.n_batches,
+                                 9.0 * pow (batch.a.rows, 3),
+                                 (double) pipevec_tensor_matrix_view_bytes (&batch.a) / MAX (batch.a.n_batches, 1),
+                                 eigh_batch_item,
+                                 &batch);
+
+  for (size_t batch_index = 0; batch_index < batch.a.n_batches; ++batch_index)
+    {
+      if (!converged[batch_index])
+        {
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_NOT_CONVERGED,
+                       "Eigenvalues of matrix %zu in the batch did not converge",
+                       batch_index);
+          return FALSE;
+        }
+    }
+
+  /* Tridiagonal reduction and QL iterations with eigenvectors */
+  profile_linalg (&scope,
+                  batch.a.n_batches,
+                  pipevec_tensor_matrix_view_bytes (&batch.a),
+                  pipevec_tensor_matrix_view_bytes (&batch.values) +
+                  pipevec_tensor_matrix_view_bytes (&batch.vectors),
+                  9.0 * pow (batch.a.rows, 3));
+
+  if (eigenvalues != NULL)
+    *eigenvalues = g_steal_pointer (&values_tensor);
+
+  if (eigenvectors != NULL)
+    *eigenvectors = g_steal_pointer (&vectors_tensor);
+
+  return TRUE;
+}
@@ -0,0 +1,77 @@
+/*
+ * /pipevec/pipevec-tensor-linalg.h
+ *
+ * Dense linear algebra on batches of matrices held in a Pipevec Tensor.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include <pipevec/pipevec-tensor.h>
+
+G_BEGIN_DECLS
+
+/**
+ * PipevecTriangularSolveFlags:
+ * @PIPEVEC_TRIANGULAR_SOLVE_NONE: Use the upper triangle as-is.
+ * @PIPEVEC_TRIANGULAR_SOLVE_LOWER: Use the lower triangle instead of the upper one.
+ * @PIPEVEC_TRIANGULAR_SOLVE_TRANSPOSE: Solve with the transpose of the triangle.
+ * @PIPEVEC_TRIANGULAR_SOLVE_UNIT_DIAGONAL: Assume the diagonal is all ones and do not read it.
+ *
+ * Flags describing which system pipevec_tensor_triangular_solve() solves.
+ */
+typedef enum {
+  PIPEVEC_TRIANGULAR_SOLVE_NONE = 0,
+  PIPEVEC_TRIANGULAR_SOLVE_LOWER = 1 << 0,
+  PIPEVEC_TRIANGULAR_SOLVE_TRANSPOSE = 1 << 1,
+  PIPEVEC_TRIANGULAR_SOLVE_UNIT_DIAGONAL = 1 << 2
+} PipevecTriangularSolveFlags;
+
+PipevecTensor * pipevec_tensor_cholesky (PipevecTensor  *tensor,
+                                         GError        **error);
+
+PipevecTensor * pipevec_tensor_lu (PipevecTensor  *tensor,
+                                   GArray        **pivots,
+                                   GError        **error);
+
+PipevecTensor * pipevec_tensor_triangular_solve (PipevecTensor                *a,
+                                                 PipevecTensor                *b,
+                                                 PipevecTriangularSolveFlags   flags,
+                                                 GError                      **error);
+
+PipevecTensor * pipevec_tensor_solve (PipevecTensor  *a,
+                                      PipevecTensor  *b,
+                                      GError        **error);
+
+gboolean pipevec_tensor_qr (PipevecTensor  *tensor,
+                            PipevecTensor **q,
+                            PipevecTensor **r,
+                            GError        **error);
+
+PipevecTensor * pipevec_tensor_lstsq (PipevecTensor  *a,
+                                      PipevecTensor  *b,
+                                      GError        **error);
+
+gboolean pipevec_tensor_eigh (PipevecTensor  *tensor,
+                              PipevecTensor **eigenvalues,
+                              PipevecTensor **eigenvectors,
+                              GError        **error);
+
+G_END_DECLS
@@ -0,0 +1,117 @@
+/*
+ * /pipevec/pipevec-tensor-private.h
+ *
+ * Internal accessors for Pipevec Tensor, shared between the
+ * translation units that implement tensor operations.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <pipevec/pipevec-tensor.h>
+
+G_BEGIN_DECLS
+
+typedef float float8_t __attribute__((vector_size(8 * (sizeof (float)))));
+
+/* Unaligned loads and stores of a float8_t. These compile down to
+ * single vector moves, but unlike a pointer cast they are valid for
+ * any float pointer. */
+static inline float8_t
+load_float8 (const float *src)
+{
+  float8_t v;
+  memcpy (&v, src, sizeof (v));
+  return v;
+}
+
+static inline void
+store_float8 (float *dst, float8_t v)
+{
+  memcpy (dst, &v, sizeof (v));
+}
+
+/* Lanes of a comparison between two float8_t, all ones where it
+ * holds and zero where it does not */
+typedef gint32 mask8_t __attribute__((vector_size(8 * (sizeof (gint32)))));
+
+/* The first n lanes, for the last vector of a row, whose other
+ * lanes are padding */
+static inline mask8_t
+mask8_first (size_t n)
+{
+  const mask8_t lanes = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+  return lanes < (gint32) n;
+}
+
+static inline size_t
+apply_padding (size_t original, size_t vector_size)
+{
+  return original + ((vector_size - (original % vector_size)) % vector_size);
+}
+
+/**
+ * PipevecTensorMatrixView:
+ * @data: Start of the padded storage.
+ * @n_batches: Product of all but the two trailing dimensions.
+ * @rows: Size of the second to last dimension.
+ * @columns: Size of the last dimension, without padding.
+ * @row_stride: Size of the last dimension, with padding.
+ * @batch_stride: Distance in floats between consecutive matrices.
+ *
+ * A view of a tensor as a batch of row-major matrices.
+ */
+typedef struct {
+  float  *data;
+  size_t  n_batches;
+  size_t  rows;
+  size_t  columns;
+  size_t  row_stride;
+  size_t  batch_stride;
+} PipevecTensorMatrixView;
+
+/* Bytes of the elements in @view, without the padding */
+static inline guint64
+pipevec_tensor_matrix_view_bytes (const PipevecTensorMatrixView *view)
+{
+  return sizeof (float) * view->n_batches * view->rows * view->columns;
+}
+
+PipevecTensor * pipevec_tensor_new_for_shape (GArray  *shape,
+                                              GError **error);
+
+PipevecTensor * pipevec_tensor_new_for_shape_uninitialized (GArray  *shape,
+                                                            GError **error);
+
+float * pipevec_tensor_get_storage (PipevecTensor *tensor);
+
+GArray * pipevec_tensor_get_shape_array (PipevecTensor *tensor);
+
+GArray * pipevec_tensor_get_padded_shape_array (PipevecTensor *tensor);
+
+void pipevec_tensor_get_matrix_view (PipevecTensor           *tensor,
+                                     PipevecTensorMatrixView *view);
+
+char * pipevec_format_shape (GArray *shape);
+
+G_END_DECLS
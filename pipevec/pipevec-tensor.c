@@ -21,27 +21,117 @@
  */
 
 #include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-private.h>
+#include <pipevec/pipevec-allocator-private.h>
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-packed-tensor-private.h>
+#include <pipevec/pipevec-profile-private.h>
+#include <pipevec/pipevec-memory-private.h>
 #include <pipevec/pipevec-errors.h>
 
 #include <glib-object.h>
 
-typedef float float8_t __attribute__((vector_size(8 * (sizeof (float)))));
-
 struct _PipevecTensor
 {
   GObject parent_instance;
 };
 
+/* Storage that is shared between a tensor and the views of it
+ * returned by split and chunk, and freed with the last of them.
+ * It keeps the shape that it was reserved under, since the tensor
+ * that reserved it may be reshaped while views are still alive. */
+typedef struct {
+  gint              ref_count;
+  float            *array;
+  size_t            bytes;
+  PipevecAllocator *allocator;
+  GArray           *shape;
+} PipevecTensorSharedStorage;
+
 typedef struct _PipevecTensorPrivate {
   /* @array is aligned and the allocation is entirely managed
-   * by ourselves. The length is implicit in the form of @shape */
-  float  *array;
-  GArray *shape;
-  GArray *padded_shape;
+   * by ourselves, through @allocator. The length is implicit in
+   * the form of @padded_shape. Once a view is taken, the storage
+   * belongs to @shared instead and @array may point into the
+   * middle of it, at the start of a padded row. */
+  float                      *array;
+  PipevecAllocator           *allocator;
+  PipevecTensorSharedStorage *shared;
+  GArray                     *shape;
+  GArray                     *padded_shape;
 } PipevecTensorPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (PipevecTensor, pipevec_tensor, G_TYPE_OBJECT);
 
+/* Every tensor has two shape arrays. Finalized tensors hand theirs
+ * back to a small free list on the thread that drops them and new
+ * tensors take them from there, so that short-lived results do not
+ * allocate and free them each time. A shape is always copied into
+ * the arrays, never shared, so nothing else can hold on to them. */
+#define PIPEVEC_TENSOR_SHAPE_POOL_SIZE 64
+
+typedef struct {
+  size_t  n_arrays;
+  GArray *arrays[PIPEVEC_TENSOR_SHAPE_POOL_SIZE];
+} PipevecTensorShapePool;
+
+static void
+shape_pool_free (gpointer data)
+{
+  PipevecTensorShapePool *pool = data;
+
+  for (size_t i = 0; i < pool->n_arrays; ++i)
+    g_array_unref (pool->arrays[i]);
+
+  g_free (pool);
+}
+
+static GPrivate shape_pool = G_PRIVATE_INIT (shape_pool_free);
+
+static GArray *
+shape_array_new (void)
+{
+  PipevecTensorShapePool *pool = g_private_get (&shape_pool);
+
+  if (pool != NULL && pool->n_arrays > 0)
+    return pool->arrays[--pool->n_arrays];
+
+  return g_array_new (FALSE, FALSE, sizeof (size_t));
+}
+
+static void
+shape_array_release (GArray *array)
+{
+  PipevecTensorShapePool *pool = g_private_get (&shape_pool);
+
+  if (pool == NULL)
+    {
+      pool = g_new0 (PipevecTensorShapePool, 1);
+      g_private_set (&shape_pool, pool);
+    }
+
+  if (pool->n_arrays == PIPEVEC_TENSOR_SHAPE_POOL_SIZE)
+    {
+      g_array_unref (array);
+      return;
+    }
+
+  g_array_set_size (array, 0);
+  pool->arrays[pool->n_arrays++] = array;
+}
+
+/* Copy the contents of src into dst, which has a single owner */
+static void
+shape_array_assign (GArray *dst,
+                    GArray *src)
+{
+  if (dst == src)
+    return;
+
+  g_array_set_size (dst, src->len);
+  memcpy (dst->data, src->data, sizeof (size_t) * src->len);
+}
+
 static size_t
 array_size_t_product (size_t *data, size_t len)
 {
@@ -62,21 +152,64 @@ format_size_t_array (size_t *data, size_t len) {
 
   for (size_t i = 0; i < len; ++i)
     {
-      strv[i + 1] = g_strdup_printf(i != (len - 1) ? "%zu, " : "%zu", i);
+      strv[i + 1] = g_strdup_printf(i != (len - 1) ? "%zu, " : "%zu", data[i]);
     }
 
-  strv[len - 2] = g_strdup("]");
-  strv[len - 1] = NULL;
+  strv[len + 1] = g_strdup("]");
+  strv[len + 2] = NULL;
 
   char *formatted = g_strjoinv ("", strv);
 
   return formatted;
 }
 
-static inline size_t
-apply_padding (size_t original, size_t vector_size)
+/* Size of the unpadded elements of a tensor with this shape */
+static guint64
+shape_bytes (GArray *shape)
+{
+  return sizeof (float) * array_size_t_product ((size_t *) shape->data, shape->len);
+}
+
+/* Size of the storage of a tensor, including padding */
+static size_t
+storage_bytes (PipevecTensorPrivate *priv)
+{
+  return shape_bytes (priv->padded_shape);
+}
+
+static void
+shared_storage_unref (PipevecTensorSharedStorage *shared)
+{
+  if (!g_atomic_int_dec_and_test (&shared->ref_count))
+    return;
+
+  pipevec_memory_release (shared->shape, shared->bytes);
+  pipevec_allocator_free (shared->allocator, shared->array, shared->bytes);
+  shape_array_release (shared->shape);
+  g_free (shared);
+}
+
+static void
+free_storage (PipevecTensorPrivate *priv)
 {
-  return original + ((vector_size - (original % vector_size)) % vector_size);
+  if (priv->array == NULL)
+    return;
+
+  if (priv->shared != NULL)
+    {
+      /* The allocator belongs to the shared storage now */
+      priv->array = NULL;
+      priv->allocator = NULL;
+      g_clear_pointer (&priv->shared, shared_storage_unref);
+      return;
+    }
+
+  size_t bytes = storage_bytes (priv);
+
+  pipevec_memory_release (priv->shape, bytes);
+  pipevec_allocator_free (g_steal_pointer (&priv->allocator),
+                          g_steal_pointer (&priv->array),
+                          bytes);
 }
 
 /**
@@ -104,72 +237,63 @@ pipevec_tensor_alloc_shape (PipevecTensor  *tensor,
     apply_padding (shape_data[shape->len - 1], 8)
   );
 
-  float *array = NULL;
-  int align_error = posix_memalign ((void **) &array,
-                                    sizeof(float8_t),
-                                    sizeof(float8_t) * padded_shape);
-  if (align_error != 0)
+  if (!pipevec_memory_reserve (shape, sizeof (float) * padded_shape, error))
+    return FALSE;
+
+  PipevecAllocator *allocator = NULL;
+  float *array = pipevec_allocator_alloc (sizeof (float) * padded_shape,
+                                          &allocator,
+                                          error);
+
+  if (array == NULL)
     {
-      g_set_error (error,
-                   PIPEVEC_ERROR,
-                   PIPEVEC_ERROR_INTERNAL,
-                   "Unable to allocate memory: %s",
-                   strerror(align_error));
+      pipevec_memory_release (shape, sizeof (float) * padded_shape);
       return FALSE;
     }
 
-  /* Clear all existing data and copy in the new data, after allocating
-   * new aligned memory for it */
-  g_clear_pointer (&priv->shape, g_array_unref);
-  g_clear_pointer (&priv->padded_shape, g_array_unref);
-  g_clear_pointer (&priv->array, g_free);
+  pipevec_profile_count_allocation (sizeof (float) * padded_shape);
 
-  priv->shape = g_array_ref (shape);
-  priv->padded_shape = g_array_copy (priv->shape);
-  g_array_index (priv->padded_shape, float, priv->padded_shape->len - 1) = \
-    apply_padding (g_array_index(priv->padded_shape, float, priv->padded_shape->len - 1), 8);
+  /* Clear all existing data and copy in the new data, after allocating
+   * new aligned memory for it. The old storage is released under the
+   * old shape, which it was reserved with. The shape is copied rather
+   * than shared with the caller, so that the same holds even if the
+   * caller goes on to reuse their array. */
+  free_storage (priv);
+
+  priv->array = array;
+  priv->allocator = allocator;
+  shape_array_assign (priv->shape, shape);
+  shape_array_assign (priv->padded_shape, shape);
+  g_array_index (priv->padded_shape, size_t, priv->padded_shape->len - 1) = \
+    apply_padding (g_array_index(priv->padded_shape, size_t, priv->padded_shape->len - 1), 8);
 
   return TRUE;
 }
 
-/** 
- * pipevec_tensor_set_data:
- * @tensor: A #PipevecTensor
- * @contents: (transfer none) (element-type gfloat): A #GArray containing floating point values.
- * @shape: (transfer none) (element-type gulong): A #GArray describing the dimension of the array.
- * @error: A #GError return pointer
- *
- * Set the data in the tensor.
- *
- * This function always copies the data from the source and always costs
- * at least O(N). The reason for this is that we don't expect to be setting
- * data very often and we may want to perform optimizations such as padding
- * and alignment internally. If @shape does not align with the length of
- * @contents, then we return %FALSE. Otherwise return %TRUE and this
- * @tensor will have array contents as specified by @shape and @contents.
- *
- * Returns: %TRUE if successful, %FALSE with @error set on error.
- */
-gboolean
-pipevec_tensor_set_data (PipevecTensor *tensor,
-                         GArray        *contents,
-                         GArray        *shape,
-                         GError       **error)
+/* Copy n_contents unpadded floats into the storage of tensor, which
+ * is reallocated for shape */
+static gboolean
+set_data_from_floats (PipevecTensor  *tensor,
+                      const float    *contents,
+                      size_t          n_contents,
+                      GArray         *shape,
+                      GError        **error)
 {
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_SET_DATA);
   PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
   size_t *shape_data = (size_t *) shape->data;
   size_t shape_product = array_size_t_product (shape_data, shape->len);
 
-  if (shape_product != contents->len)
+  if (shape_product != n_contents)
     {
       g_autofree gchar *formatted_shape = format_size_t_array (shape_data, shape->len);
       g_set_error (error,
                    PIPEVEC_ERROR,
                    PIPEVEC_ERROR_BAD_SHAPE,
-                   "Shape %s has product %zu which does not match array length %ui",
+                   "Shape %s has product %zu which does not match array length %zu",
                    formatted_shape,
                    shape_product,
-                   shape->len);
+                   n_contents);
       return FALSE;
     }
 
@@ -179,27 +303,132 @@ pipevec_tensor_set_data (PipevecTensor *tensor,
 
   /* Now we can copy the unpadded data until our tensor.
    * This always suceeds and the contents of the old tensor
-   * have been destroyed at this point. */
-  float *passed_array = (float *) contents->data;
-  size_t leading_shape = shape_product / shape_data[shape->len - 1];
-  size_t inner_shape_padding = g_array_index(priv->padded_shape, float, priv->padded_shape->len - 1);
+   * have been destroyed at this point. Rows are copied whole
+   * and then the padding after each is cleared. */
+  size_t inner_shape_padding = g_array_index(priv->padded_shape, size_t, priv->padded_shape->len - 1);
   size_t inner_shape_no_padding = shape_data[shape->len - 1];
+  size_t leading_shape = inner_shape_no_padding > 0 ? shape_product / inner_shape_no_padding : 0;
 
-  for (size_t i = 0; i < leading_shape; ++i) {
-    for (size_t j = 0; j < inner_shape_no_padding; ++j) {
-      priv->array[i * inner_shape_padding + j] = passed_array[i * inner_shape_no_padding + j];
+  if (inner_shape_padding == inner_shape_no_padding)
+    {
+      if (shape_product > 0)
+        memcpy (priv->array, contents, sizeof (float) * shape_product);
     }
-
-    /* Then add the padding */
-    for (size_t j = inner_shape_no_padding; j < inner_shape_padding; ++j) {
-      priv->array[i * inner_shape_padding + j] = 0.0f;
+  else
+    {
+      for (size_t i = 0; i < leading_shape; ++i)
+        {
+          memcpy (priv->array + i * inner_shape_padding,
+                  contents + i * inner_shape_no_padding,
+                  sizeof (float) * inner_shape_no_padding);
+          memset (priv->array + i * inner_shape_padding + inner_shape_no_padding,
+                  0,
+                  sizeof (float) * (inner_shape_padding - inner_shape_no_padding));
+        }
     }
-  }
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     sizeof (float) * shape_product,
+                                     sizeof (float) * shape_product,
+                                     0);
 
   /* Everything else is set, so we can return now */
   return TRUE;
 }
 
+/* Copy the contents of tensor without the padding into a buffer of
+ * the unpadded size */
+static void
+get_data_into_floats (PipevecTensor *tensor,
+                      float         *buffer)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_GET_DATA);
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+  size_t *shape_data = (size_t *) priv->shape->data;
+  size_t n_elements = array_size_t_product (shape_data, priv->shape->len);
+  size_t inner_shape_no_padding = shape_data[priv->shape->len - 1];
+  size_t inner_shape_padding = apply_padding (inner_shape_no_padding, 8);
+  size_t leading_shape = inner_shape_no_padding > 0 ? n_elements / inner_shape_no_padding : 0;
+
+  /* We have to make sure that we ignore padding */
+  if (inner_shape_padding == inner_shape_no_padding)
+    {
+      if (n_elements > 0)
+        memcpy (buffer, priv->array, sizeof (float) * n_elements);
+    }
+  else
+    {
+      for (size_t i = 0; i < leading_shape; ++i)
+        memcpy (buffer + i * inner_shape_no_padding,
+                priv->array + i * inner_shape_padding,
+                sizeof (float) * inner_shape_no_padding);
+    }
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     sizeof (float) * n_elements,
+                                     sizeof (float) * n_elements,
+                                     0);
+}
+
+static size_t
+tensor_n_elements (PipevecTensor *tensor)
+{
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+
+  return array_size_t_product ((size_t *) priv->shape->data, priv->shape->len);
+}
+
+/** 
+ * pipevec_tensor_set_data:
+ * @tensor: A #PipevecTensor
+ * @contents: (transfer none) (element-type gfloat): A #GArray containing floating point values.
+ * @shape: (transfer none) (element-type gulong): A #GArray describing the dimension of the array.
+ * @error: A #GError return pointer
+ *
+ * Set the data in the tensor.
+ *
+ * This function always copies the data from the source and always costs
+ * at least O(N). The reason for this is that we don't expect to be setting
+ * data very often and we may want to perform optimizations such as padding
+ * and alignment internally. If @shape does not align with the length of
+ * @contents, then we return %FALSE. Otherwise return %TRUE and this
+ * @tensor will have array contents as specified by @shape and @contents.
+ *
+ * Returns: %TRUE if successful, %FALSE with @error set on error.
+ */
+gboolean
+pipevec_tensor_set_data (PipevecTensor *tensor,
+                         GArray        *contents,
+                         GArray        *shape,
+                         GError       **error)
+{
+  return set_data_from_floats (tensor, (const float *) contents->data, contents->len, shape, error);
+}
+
+/**
+ * pipevec_tensor_set_data_from_buffer:
+ * @tensor: A #PipevecTensor
+ * @contents: (transfer none) (array length=n_contents): The floating point values.
+ * @n_contents: The number of values in @contents.
+ * @shape: (transfer none) (element-type gulong): A #GArray describing the dimension of the array.
+ * @error: A #GError return pointer
+ *
+ * Like pipevec_tensor_set_data(), but take the values from a plain
+ * buffer. Language bindings can pass the memory of a typed array
+ * here without converting it element by element.
+ *
+ * Returns: %TRUE if successful, %FALSE with @error set on error.
+ */
+gboolean
+pipevec_tensor_set_data_from_buffer (PipevecTensor  *tensor,
+                                     const float    *contents,
+                                     size_t          n_contents,
+                                     GArray         *shape,
+                                     GError        **error)
+{
+  return set_data_from_floats (tensor, contents, n_contents, shape, error);
+}
+
 /**
  * pipevec_tensor_get_data:
  * @tensor: A #PipevecTensor
@@ -213,29 +442,75 @@ pipevec_tensor_set_data (PipevecTensor *tensor,
 GArray *
 pipevec_tensor_get_data (PipevecTensor  *tensor)
 {
-  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
-  size_t *shape_data = (size_t *) priv->shape->data;
-  size_t return_value_len = array_size_t_product (shape_data, priv->shape->len);
-  GArray *return_value = g_array_sized_new (FALSE, FALSE, sizeof (float), return_value_len);
-  float *return_value_data = (float *) return_value->data;
+  size_t n_elements = tensor_n_elements (tensor);
+  GArray *return_value = g_array_sized_new (FALSE, FALSE, sizeof (float), n_elements);
+
+  return_value->len = n_elements;
+  get_data_into_floats (tensor, (float *) return_value->data);
+
+  return return_value;
+}
+
+/**
+ * pipevec_tensor_get_bytes:
+ * @tensor: A #PipevecTensor
+ *
+ * Like pipevec_tensor_get_data(), but return the values packed into
+ * a #GBytes in native byte order, which language bindings can wrap
+ * as a typed array without converting it element by element.
+ *
+ * Returns: (transfer full): A new #GBytes containing the tensor data.
+ */
+GBytes *
+pipevec_tensor_get_bytes (PipevecTensor *tensor)
+{
+  size_t n_elements = tensor_n_elements (tensor);
+  float *buffer = g_new (float, n_elements);
 
-  return_value->len = return_value_len;
+  get_data_into_floats (tensor, buffer);
 
-  /* OK, now we can copy from our array back into the return_value -
-   * we have to make sure that we ignore padding */
-  size_t *shape_data_no_padding = (size_t *) shape_data;
+  return g_bytes_new_take (buffer, sizeof (float) * n_elements);
+}
 
-  size_t leading_shape = return_value_len / shape_data_no_padding[priv->shape->len - 1];
-  size_t inner_shape_no_padding = shape_data_no_padding[priv->shape->len - 1];
-  size_t inner_shape_padding = apply_padding (shape_data[priv->shape->len - 1], 8);
+/**
+ * pipevec_tensor_read_data:
+ * @tensor: A #PipevecTensor
+ * @buffer: (out caller-allocates) (array length=n_buffer): Where to
+ *          write the values.
+ * @n_buffer: The number of values that fit in @buffer.
+ * @error: A #GError return pointer
+ *
+ * Like pipevec_tensor_get_data(), but write the values into a buffer
+ * that the caller owns, such as the memory of an existing typed
+ * array, without allocating anything.
+ *
+ * Returns: %TRUE if successful, %FALSE with @error set if @n_buffer
+ *          is not the number of elements in @tensor.
+ */
+gboolean
+pipevec_tensor_read_data (PipevecTensor  *tensor,
+                          float          *buffer,
+                          size_t          n_buffer,
+                          GError        **error)
+{
+  size_t n_elements = tensor_n_elements (tensor);
 
-  for (size_t i = 0; i < leading_shape; ++i) {
-    for (size_t j = 0; j < inner_shape_no_padding; ++j) {
-      return_value_data[i * inner_shape_no_padding + j] = priv->array[i * inner_shape_padding + j];
+  if (n_buffer != n_elements)
+    {
+      g_autofree char *formatted_shape = pipevec_format_shape (pipevec_tensor_get_shape_array (tensor));
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_BAD_SHAPE,
+                   "Tensor of shape %s has %zu elements, but the buffer has room for %zu",
+                   formatted_shape,
+                   n_elements,
+                   n_buffer);
+      return FALSE;
     }
-  }
 
-  return return_value;
+  get_data_into_floats (tensor, buffer);
+
+  return TRUE;
 }
 
 /**
@@ -256,11 +531,21 @@ pipevec_tensor_reshape (PipevecTensor  *tensor,
                         GArray         *shape,
                         GError        **error)
 {
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_RESHAPE);
+
   /* First, grab the data */
-  GArray *data = pipevec_tensor_get_data (tensor);
+  g_autoptr(GArray) data = pipevec_tensor_get_data (tensor);
 
   /* Then, set the data with the new shape */
-  return pipevec_tensor_set_data (tensor, data, shape, error);
+  if (!pipevec_tensor_set_data (tensor, data, shape, error))
+    return FALSE;
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     sizeof (float) * data->len,
+                                     sizeof (float) * data->len,
+                                     0);
+
+  return TRUE;
 }
 
 /**
@@ -308,6 +593,7 @@ PipevecTensor *
 pipevec_tensor_copy (PipevecTensor  *tensor,
                      GError        **error)
 {
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_COPY);
   g_autoptr(PipevecTensor) new_tensor = g_object_new (PIPEVEC_TYPE_TENSOR, NULL);
   PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
 
@@ -319,93 +605,526 @@ pipevec_tensor_copy (PipevecTensor  *tensor,
                                                error))
     return NULL;
 
+  pipevec_profile_scope_set_traffic (&scope,
+                                     shape_bytes (priv->shape),
+                                     shape_bytes (priv->shape),
+                                     0);
+
   return g_steal_pointer (&new_tensor);
 }
 
-static inline void
-set_location (GArray *location,
-              GArray *shape,
-              size_t  i)
+static gboolean
+check_axis (GArray  *shape,
+            size_t   axis,
+            GError **error)
 {
-  /* Counting down on the shape, compute the index
-   * we're at on each dimension */
-  int product = 1;
-  size_t *location_data = (size_t *) location->data;
-  size_t *shape_data = (size_t *) shape->data;
+  if (axis >= shape->len)
+    {
+      g_autofree char *formatted_shape = format_size_t_array ((size_t *) shape->data, shape->len);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Axis %zu is out of range for shape %s",
+                   axis,
+                   formatted_shape);
+      return FALSE;
+    }
 
-  for (int j = shape->len - 1; j >= 0; --j) {
-    location_data[j] = (i / product) % shape_data[j];
-    product *= shape_data[j];
-  }
+  return TRUE;
 }
 
-/**
- * pipevec_tensor_map:
- * @src: A #PipevecTensor
- * @func: (scope call): A #PipevecTensorMapFunction to be applied to each element
- * @user_data: Some user data to be provided to @func
- * @error: A #GError out pointer.
- *
- * Apply @func to each element in @src, returning the result as a copy.
- *
- * Returns: (transfer full): A new #PipevecTensor with the map function applied.
- */
-PipevecTensor *
-pipevec_tensor_map (PipevecTensor             *src,
-                    PipevecTensorMapFunction   func,
-                    gpointer                  *user_data,
-                    GError                   **error)
+/* Copy n floats between rows whose elements start at different
+ * offsets within their padding, a vector at a time */
+static inline void
+copy_floats (float       *dst,
+             const float *src,
+             size_t       n)
 {
-  g_autoptr(PipevecTensor) dst = pipevec_tensor_copy (src, error);
+  size_t i = 0;
 
-  if (dst == NULL)
-    return NULL;
+  for (; i + 8 <= n; i += 8)
+    store_float8 (dst + i, load_float8 (src + i));
 
-  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (dst);
+  for (; i < n; ++i)
+    dst[i] = src[i];
+}
 
-  /* Now loop over the tensor and apply the map function to it */
-  size_t *shape_data_no_padding = (size_t *) priv->shape->data;
-  size_t *shape_data_with_padding = (size_t *) priv->padded_shape->data;
+/* Hand the storage of a tensor over to a shared block, if that has
+ * not happened yet, and take a reference on the block for a view.
+ * Callers taking views of the same tensor on different threads agree
+ * on one block through the compare and exchange. */
+static PipevecTensorSharedStorage *
+share_storage (PipevecTensorPrivate *priv)
+{
+  PipevecTensorSharedStorage *shared = g_atomic_pointer_get (&priv->shared);
 
-  size_t leading_shape = (
-    array_size_t_product (shape_data_no_padding, priv->shape->len) /
-    shape_data_no_padding[priv->shape->len - 1]
-  );
-  size_t inner_shape = shape_data_no_padding[priv->shape->len - 1];
-  size_t inner_shape_padding = shape_data_with_padding[priv->padded_shape->len - 1];
+  if (shared == NULL)
+    {
+      PipevecTensorSharedStorage *created = g_new0 (PipevecTensorSharedStorage, 1);
 
-  GArray *location = g_array_sized_new (FALSE, FALSE, sizeof(gfloat), priv->shape->len);
+      created->ref_count = 1;
+      created->array = priv->array;
+      created->bytes = storage_bytes (priv);
+      created->allocator = priv->allocator;
+      created->shape = shape_array_new ();
+      shape_array_assign (created->shape, priv->shape);
 
-  for (size_t i = 0; i < leading_shape; ++i)
-    {
-      for (size_t j = 0; j < inner_shape; ++j)
+      if (g_atomic_pointer_compare_and_exchange (&priv->shared, NULL, created))
         {
-          set_location (location, priv->shape, i * inner_shape + j);
-          priv->array[i * inner_shape_padding + j] = func(priv->array[i * inner_shape_padding + j],
-                                                          location,
-                                                          user_data);
+          shared = created;
+        }
+      else
+        {
+          shape_array_release (created->shape);
+          g_free (created);
+          shared = g_atomic_pointer_get (&priv->shared);
         }
     }
 
-  return g_steal_pointer (&dst);
+  g_atomic_int_inc (&shared->ref_count);
+
+  return shared;
 }
 
-static gboolean
-shape_subset_equal (GArray *lhs, GArray *rhs, size_t offset_from_end)
+/* Make a tensor of shape over the storage of tensor, starting offset
+ * floats in, which must be the start of a padded row */
+static PipevecTensor *
+tensor_new_view (PipevecTensor *tensor,
+                 GArray        *shape,
+                 size_t         offset)
 {
-  if (lhs->len != rhs->len)
-    return FALSE;
+  PipevecTensor *view = g_object_new (PIPEVEC_TYPE_TENSOR, NULL);
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+  PipevecTensorPrivate *view_priv = pipevec_tensor_get_instance_private (view);
 
-  if (lhs->len < offset_from_end)
-    return FALSE;
+  view_priv->shared = share_storage (priv);
+  view_priv->array = priv->array + offset;
+  shape_array_assign (view_priv->shape, shape);
+  shape_array_assign (view_priv->padded_shape, shape);
+  g_array_index (view_priv->padded_shape, size_t, shape->len - 1) = \
+    g_array_index (priv->padded_shape, size_t, shape->len - 1);
 
-  size_t *ldata = (size_t *) lhs->data;
-  size_t *rdata = (size_t *) rhs->data;
+  return view;
+}
 
-  for (size_t i = 0; i < (lhs->len - offset_from_end); ++i)
-    {
-      if (ldata[i] != rdata[i])
-        return FALSE;
+/**
+ * pipevec_tensor_concat:
+ * @tensors: (array length=n_tensors): The #PipevecTensor values to join.
+ * @n_tensors: Number of tensors in @tensors, at least one.
+ * @axis: The axis to join them along.
+ * @error: A #GError out pointer.
+ *
+ * Join @tensors end to end along @axis. They must all have the same
+ * shape, apart from the size of @axis. The result is allocated once
+ * and whole runs of padded rows are copied into it, unless @axis is
+ * the last one, in which case each row is repacked from the rows of
+ * @tensors.
+ *
+ * Returns: (transfer full): A new #PipevecTensor or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_concat (PipevecTensor **tensors,
+                       size_t          n_tensors,
+                       size_t          axis,
+                       GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_CONCAT);
+
+  if (n_tensors == 0)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Concatenation needs at least one tensor");
+      return NULL;
+    }
+
+  PipevecTensorPrivate *first_priv = pipevec_tensor_get_instance_private (tensors[0]);
+
+  if (!check_axis (first_priv->shape, axis, error))
+    return NULL;
+
+  g_autoptr(GArray) shape = g_array_copy (first_priv->shape);
+  size_t *shape_data = (size_t *) shape->data;
+  size_t n_dims = shape->len;
+  guint64 bytes_read = 0;
+
+  shape_data[axis] = 0;
+
+  for (size_t i = 0; i < n_tensors; ++i)
+    {
+      PipevecTensorPrivate *tensor_priv = pipevec_tensor_get_instance_private (tensors[i]);
+      size_t *tensor_shape_data = (size_t *) tensor_priv->shape->data;
+      gboolean matches = tensor_priv->shape->len == n_dims;
+
+      for (size_t j = 0; matches && j < n_dims; ++j)
+        matches = j == axis || tensor_shape_data[j] == shape_data[j];
+
+      if (!matches)
+        {
+          g_autofree char *first_formatted_shape = pipevec_format_shape (first_priv->shape);
+          g_autofree char *formatted_shape = pipevec_format_shape (tensor_priv->shape);
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_DIMENSION_MISMATCH,
+                       "Cannot concatenate tensor %zu of shape %s with a tensor of shape %s along axis %zu",
+                       i,
+                       formatted_shape,
+                       first_formatted_shape,
+                       axis);
+          return NULL;
+        }
+
+      shape_data[axis] += tensor_shape_data[axis];
+      bytes_read += shape_bytes (tensor_priv->shape);
+    }
+
+  pipevec_profile_scope_set_shape (&scope, shape);
+
+  /* Every element of the result, and its padding, is written below,
+   * so the storage does not need to be cleared first */
+  g_autoptr(PipevecTensor) result = g_object_new (PIPEVEC_TYPE_TENSOR, NULL);
+
+  if (!pipevec_tensor_alloc_shape (result, shape, error))
+    return NULL;
+
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (result);
+  size_t *padded_shape_data = (size_t *) priv->padded_shape->data;
+
+  if (axis == n_dims - 1)
+    {
+      size_t n_rows = array_size_t_product (shape_data, n_dims - 1);
+      size_t row_stride = padded_shape_data[n_dims - 1];
+
+      for (size_t row = 0; row < n_rows; ++row)
+        {
+          float *dst_row = priv->array + row * row_stride;
+          size_t offset = 0;
+
+          for (size_t i = 0; i < n_tensors; ++i)
+            {
+              PipevecTensorPrivate *tensor_priv = pipevec_tensor_get_instance_private (tensors[i]);
+              size_t columns = g_array_index (tensor_priv->shape, size_t, n_dims - 1);
+              size_t tensor_row_stride = g_array_index (tensor_priv->padded_shape, size_t, n_dims - 1);
+
+              copy_floats (dst_row + offset,
+                           tensor_priv->array + row * tensor_row_stride,
+                           columns);
+              offset += columns;
+            }
+
+          memset (dst_row + offset, 0, sizeof (float) * (row_stride - offset));
+        }
+    }
+  else
+    {
+      /* The padded rows of every tensor are the same length, so
+       * each one contributes a contiguous block per index of the
+       * axes before @axis */
+      size_t n_outer = array_size_t_product (shape_data, axis);
+      size_t inner = array_size_t_product (padded_shape_data + axis + 1, n_dims - axis - 1);
+      float *dst = priv->array;
+
+      for (size_t outer = 0; outer < n_outer; ++outer)
+        {
+          for (size_t i = 0; i < n_tensors; ++i)
+            {
+              PipevecTensorPrivate *tensor_priv = pipevec_tensor_get_instance_private (tensors[i]);
+              size_t block = g_array_index (tensor_priv->shape, size_t, axis) * inner;
+
+              memcpy (dst, tensor_priv->array + outer * block, sizeof (float) * block);
+              dst += block;
+            }
+        }
+    }
+
+  pipevec_profile_scope_set_traffic (&scope, bytes_read, shape_bytes (shape), 0);
+
+  return g_steal_pointer (&result);
+}
+
+/* Split tensor along axis into pieces of the given sizes, which the
+ * caller has checked add up to the size of the axis. Pieces taken
+ * along the first axis that is not of size one share the storage of
+ * tensor, since each of them is a contiguous run of its padded rows.
+ * That does not hold for the last axis, whose pieces are rows of
+ * their own padding. */
+static GPtrArray *
+split_into_sizes (PipevecTensor  *tensor,
+                  const size_t   *sizes,
+                  size_t          n_sizes,
+                  size_t          axis,
+                  GError        **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_SPLIT);
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+  size_t *shape_data = (size_t *) priv->shape->data;
+  size_t *padded_shape_data = (size_t *) priv->padded_shape->data;
+  size_t n_dims = priv->shape->len;
+  size_t n_outer = array_size_t_product (shape_data, axis);
+  size_t inner = array_size_t_product (padded_shape_data + axis + 1, n_dims - axis - 1);
+  gboolean views = n_outer == 1 && axis < n_dims - 1;
+  guint64 bytes_copied = 0;
+
+  g_autoptr(GPtrArray) pieces = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GArray) piece_shape = g_array_copy (priv->shape);
+  size_t start = 0;
+
+  pipevec_profile_scope_set_shape (&scope, priv->shape);
+
+  for (size_t i = 0; i < n_sizes; ++i)
+    {
+      g_array_index (piece_shape, size_t, axis) = sizes[i];
+
+      if (views)
+        {
+          g_ptr_array_add (pieces, tensor_new_view (tensor, piece_shape, start * inner));
+          start += sizes[i];
+          continue;
+        }
+
+      g_autoptr(PipevecTensor) piece = g_object_new (PIPEVEC_TYPE_TENSOR, NULL);
+
+      if (!pipevec_tensor_alloc_shape (piece, piece_shape, error))
+        return NULL;
+
+      PipevecTensorPrivate *piece_priv = pipevec_tensor_get_instance_private (piece);
+
+      if (axis == n_dims - 1)
+        {
+          size_t n_rows = array_size_t_product (shape_data, n_dims - 1);
+          size_t row_stride = padded_shape_data[n_dims - 1];
+          size_t piece_row_stride = g_array_index (piece_priv->padded_shape, size_t, n_dims - 1);
+
+          for (size_t row = 0; row < n_rows; ++row)
+            {
+              float *dst_row = piece_priv->array + row * piece_row_stride;
+
+              copy_floats (dst_row, priv->array + row * row_stride + start, sizes[i]);
+              memset (dst_row + sizes[i], 0, sizeof (float) * (piece_row_stride - sizes[i]));
+            }
+        }
+      else
+        {
+          size_t block = sizes[i] * inner;
+
+          for (size_t outer = 0; outer < n_outer; ++outer)
+            memcpy (piece_priv->array + outer * block,
+                    priv->array + (outer * shape_data[axis] + start) * inner,
+                    sizeof (float) * block);
+        }
+
+      bytes_copied += shape_bytes (piece_shape);
+      start += sizes[i];
+      g_ptr_array_add (pieces, g_steal_pointer (&piece));
+    }
+
+  pipevec_profile_scope_set_traffic (&scope, bytes_copied, bytes_copied, 0);
+
+  return g_steal_pointer (&pieces);
+}
+
+/**
+ * pipevec_tensor_split:
+ * @tensor: A #PipevecTensor
+ * @sizes: (element-type gulong): The size of each piece along @axis.
+ * @axis: The axis to split along.
+ * @error: A #GError out pointer.
+ *
+ * Split @tensor along @axis into pieces of @sizes, which must be
+ * positive and add up to the size of @axis.
+ *
+ * If every axis before @axis has size one, as when @axis is the
+ * first one, and @axis is not the last, the pieces are views that
+ * share the storage of @tensor rather than copies of it. Setting
+ * the data of @tensor or of a piece replaces its storage rather than
+ * writing into it, so views behave just like copies, except that
+ * all of the storage of @tensor stays alive until every piece that
+ * shares it has been released.
+ *
+ * Returns: (transfer full) (element-type PipevecTensor): The pieces,
+ *          in order, or %NULL with @error set.
+ */
+GPtrArray *
+pipevec_tensor_split (PipevecTensor  *tensor,
+                      GArray         *sizes,
+                      size_t          axis,
+                      GError        **error)
+{
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+
+  if (!check_axis (priv->shape, axis, error))
+    return NULL;
+
+  size_t *sizes_data = (size_t *) sizes->data;
+  size_t total = 0;
+  gboolean positive = TRUE;
+
+  for (size_t i = 0; i < sizes->len; ++i)
+    {
+      positive = positive && sizes_data[i] > 0;
+      total += sizes_data[i];
+    }
+
+  if (!positive || total != g_array_index (priv->shape, size_t, axis))
+    {
+      g_autofree char *formatted_sizes = format_size_t_array (sizes_data, sizes->len);
+      g_autofree char *formatted_shape = pipevec_format_shape (priv->shape);
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Sizes %s do not split axis %zu of shape %s",
+                   formatted_sizes,
+                   axis,
+                   formatted_shape);
+      return NULL;
+    }
+
+  return split_into_sizes (tensor, sizes_data, sizes->len, axis, error);
+}
+
+/**
+ * pipevec_tensor_chunk:
+ * @tensor: A #PipevecTensor
+ * @n_chunks: How many pieces to split @tensor into.
+ * @axis: The axis to split along.
+ * @error: A #GError out pointer.
+ *
+ * Split @tensor along @axis into @n_chunks pieces of the same size,
+ * apart from the last, which may be smaller. If @axis is too short
+ * for that, fewer pieces are returned. The pieces are views of
+ * @tensor in the same cases as for pipevec_tensor_split().
+ *
+ * Returns: (transfer full) (element-type PipevecTensor): The pieces,
+ *          in order, or %NULL with @error set.
+ */
+GPtrArray *
+pipevec_tensor_chunk (PipevecTensor  *tensor,
+                      size_t          n_chunks,
+                      size_t          axis,
+                      GError        **error)
+{
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+
+  if (n_chunks == 0)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_INVALID_ARGUMENT,
+                   "Cannot split a tensor into zero chunks");
+      return NULL;
+    }
+
+  if (!check_axis (priv->shape, axis, error))
+    return NULL;
+
+  size_t size = g_array_index (priv->shape, size_t, axis);
+  size_t chunk_size = (size + n_chunks - 1) / n_chunks;
+  g_autoptr(GArray) sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+
+  for (size_t start = 0; start < size; start += chunk_size)
+    {
+      size_t piece_size = MIN (chunk_size, size - start);
+      g_array_append_val (sizes, piece_size);
+    }
+
+  return split_into_sizes (tensor, (size_t *) sizes->data, sizes->len, axis, error);
+}
+
+static inline void
+set_location (GArray *location,
+              GArray *shape,
+              size_t  i)
+{
+  /* Counting down on the shape, compute the index
+   * we're at on each dimension */
+  int product = 1;
+  size_t *location_data = (size_t *) location->data;
+  size_t *shape_data = (size_t *) shape->data;
+
+  for (int j = shape->len - 1; j >= 0; --j) {
+    location_data[j] = (i / product) % shape_data[j];
+    product *= shape_data[j];
+  }
+}
+
+/**
+ * pipevec_tensor_map:
+ * @src: A #PipevecTensor
+ * @func: (scope call): A #PipevecTensorMapFunction to be applied to each element
+ * @user_data: Some user data to be provided to @func
+ * @error: A #GError out pointer.
+ *
+ * Apply @func to each element in @src, returning the result as a copy.
+ *
+ * Returns: (transfer full): A new #PipevecTensor with the map function applied.
+ */
+PipevecTensor *
+pipevec_tensor_map (PipevecTensor             *src,
+                    PipevecTensorMapFunction   func,
+                    gpointer                  *user_data,
+                    GError                   **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_MAP);
+  g_autoptr(PipevecTensor) dst = pipevec_tensor_copy (src, error);
+
+  if (dst == NULL)
+    return NULL;
+
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (dst);
+
+  pipevec_profile_scope_set_shape (&scope, priv->shape);
+
+  /* Now loop over the tensor and apply the map function to it */
+  size_t *shape_data_no_padding = (size_t *) priv->shape->data;
+  size_t *shape_data_with_padding = (size_t *) priv->padded_shape->data;
+
+  size_t leading_shape = (
+    array_size_t_product (shape_data_no_padding, priv->shape->len) /
+    shape_data_no_padding[priv->shape->len - 1]
+  );
+  size_t inner_shape = shape_data_no_padding[priv->shape->len - 1];
+  size_t inner_shape_padding = shape_data_with_padding[priv->padded_shape->len - 1];
+
+  g_autoptr(GArray) location = g_array_sized_new (FALSE, FALSE, sizeof (size_t), priv->shape->len);
+
+  g_array_set_size (location, priv->shape->len);
+
+  for (size_t i = 0; i < leading_shape; ++i)
+    {
+      for (size_t j = 0; j < inner_shape; ++j)
+        {
+          set_location (location, priv->shape, i * inner_shape + j);
+          priv->array[i * inner_shape_padding + j] = func(priv->array[i * inner_shape_padding + j],
+                                                          location,
+                                                          user_data);
+        }
+    }
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     shape_bytes (priv->shape),
+                                     shape_bytes (priv->shape),
+                                     0);
+
+  return g_steal_pointer (&dst);
+}
+
+static gboolean
+shape_subset_equal (GArray *lhs, GArray *rhs, size_t offset_from_end)
+{
+  if (lhs->len != rhs->len)
+    return FALSE;
+
+  if (lhs->len < offset_from_end)
+    return FALSE;
+
+  size_t *ldata = (size_t *) lhs->data;
+  size_t *rdata = (size_t *) rhs->data;
+
+  for (size_t i = 0; i < (lhs->len - offset_from_end); ++i)
+    {
+      if (ldata[i] != rdata[i])
+        return FALSE;
     }
 
   return TRUE;
@@ -445,11 +1164,15 @@ static PipevecTensor *
 pipevec_tensor_do_elementwise_op (PipevecTensor                 *lhs,
                                   PipevecTensor                 *rhs,
                                   PipevecTensorElementwiseFunc   func,
+                                  PipevecProfileOp               op,
                                   GError                       **error)
 {
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (op);
   PipevecTensorPrivate *lhs_priv = pipevec_tensor_get_instance_private (lhs);
   PipevecTensorPrivate *rhs_priv = pipevec_tensor_get_instance_private (rhs);
 
+  pipevec_profile_scope_set_shape (&scope, lhs_priv->shape);
+
   if (!check_shapes_elementwise (lhs_priv->shape, rhs_priv->shape, error))
     return NULL;
 
@@ -480,6 +1203,11 @@ pipevec_tensor_do_elementwise_op (PipevecTensor                 *lhs,
         }
     }
 
+  pipevec_profile_scope_set_traffic (&scope,
+                                     2 * shape_bytes (lhs_priv->shape),
+                                     shape_bytes (lhs_priv->shape),
+                                     leading_shape * inner_shape);
+
   return g_steal_pointer (&dst);
 }
 
@@ -487,10 +1215,14 @@ static PipevecTensor *
 pipevec_tensor_do_scalar_op (PipevecTensor                 *lhs,
                              float                          rhs,
                              PipevecTensorElementwiseFunc   func,
+                             PipevecProfileOp               op,
                              GError                       **error)
 {
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (op);
   PipevecTensorPrivate *lhs_priv = pipevec_tensor_get_instance_private (lhs);
 
+  pipevec_profile_scope_set_shape (&scope, lhs_priv->shape);
+
   g_autoptr(PipevecTensor) dst = pipevec_tensor_copy (lhs, error);
 
   if (dst == NULL)
@@ -518,6 +1250,11 @@ pipevec_tensor_do_scalar_op (PipevecTensor                 *lhs,
         }
     }
 
+  pipevec_profile_scope_set_traffic (&scope,
+                                     shape_bytes (lhs_priv->shape),
+                                     shape_bytes (lhs_priv->shape),
+                                     leading_shape * inner_shape);
+
   return g_steal_pointer (&dst);
 }
 
@@ -543,7 +1280,7 @@ pipevec_tensor_add_tensor (PipevecTensor  *lhs,
                            PipevecTensor  *rhs,
                            GError        **error)
 {
-  return pipevec_tensor_do_elementwise_op (lhs, rhs, add, error);
+  return pipevec_tensor_do_elementwise_op (lhs, rhs, add, PIPEVEC_PROFILE_OP_ADD_TENSOR, error);
 }
 
 /**
@@ -561,13 +1298,13 @@ pipevec_tensor_add_scalar (PipevecTensor  *lhs,
                            float           rhs,
                            GError        **error)
 {
-  return pipevec_tensor_do_scalar_op (lhs, rhs, add, error);
+  return pipevec_tensor_do_scalar_op (lhs, rhs, add, PIPEVEC_PROFILE_OP_ADD_SCALAR, error);
 }
 
 static inline float
 sub (float lhs, float rhs)
 {
-  return lhs + rhs;
+  return lhs - rhs;
 }
 
 /**
@@ -585,7 +1322,7 @@ pipevec_tensor_sub_tensor (PipevecTensor  *lhs,
                            PipevecTensor  *rhs,
                            GError        **error)
 {
-  return pipevec_tensor_do_elementwise_op (lhs, rhs, sub, error);
+  return pipevec_tensor_do_elementwise_op (lhs, rhs, sub, PIPEVEC_PROFILE_OP_SUB_TENSOR, error);
 }
 
 /**
@@ -603,7 +1340,7 @@ pipevec_tensor_sub_scalar (PipevecTensor  *lhs,
                            float           rhs,
                            GError        **error)
 {
-  return pipevec_tensor_do_scalar_op (lhs, rhs, sub, error);
+  return pipevec_tensor_do_scalar_op (lhs, rhs, sub, PIPEVEC_PROFILE_OP_SUB_SCALAR, error);
 }
 
 static inline float
@@ -627,7 +1364,7 @@ pipevec_tensor_multiply_tensor (PipevecTensor  *lhs,
                                 PipevecTensor  *rhs,
                                 GError        **error)
 {
-  return pipevec_tensor_do_elementwise_op (lhs, rhs, mul, error);
+  return pipevec_tensor_do_elementwise_op (lhs, rhs, mul, PIPEVEC_PROFILE_OP_MULTIPLY_TENSOR, error);
 }
 
 /**
@@ -645,7 +1382,7 @@ pipevec_tensor_multiply_scalar (PipevecTensor  *lhs,
                                 float           rhs,
                                 GError        **error)
 {
-  return pipevec_tensor_do_scalar_op (lhs, rhs, mul, error);
+  return pipevec_tensor_do_scalar_op (lhs, rhs, mul, PIPEVEC_PROFILE_OP_MULTIPLY_SCALAR, error);
 }
 
 static inline float
@@ -669,7 +1406,7 @@ pipevec_tensor_divide_tensor (PipevecTensor  *lhs,
                               PipevecTensor  *rhs,
                               GError        **error)
 {
-  return pipevec_tensor_do_elementwise_op (lhs, rhs, divide, error);
+  return pipevec_tensor_do_elementwise_op (lhs, rhs, divide, PIPEVEC_PROFILE_OP_DIVIDE_TENSOR, error);
 }
 
 /**
@@ -687,125 +1424,907 @@ pipevec_tensor_divide_scalar (PipevecTensor  *lhs,
                               float           rhs,
                               GError        **error)
 {
-  return pipevec_tensor_do_scalar_op (lhs, rhs, divide, error);
+  return pipevec_tensor_do_scalar_op (lhs, rhs, divide, PIPEVEC_PROFILE_OP_DIVIDE_SCALAR, error);
+}
+
+/* Vectors compared between checks for a difference, so that the
+ * inner loop does not branch */
+#define PIPEVEC_TENSOR_COMPARE_BLOCK 8
+
+static inline gboolean
+mask8_any (mask8_t mask)
+{
+  guint64 lanes[4];
+
+  memcpy (lanes, &mask, sizeof (lanes));
+
+  return (lanes[0] | lanes[1] | lanes[2] | lanes[3]) != 0;
+}
+
+static inline float8_t
+abs_float8 (float8_t v)
+{
+  return (float8_t) ((mask8_t) v & 0x7fffffff);
+}
+
+/* The rows of a tensor that comparisons and hashes walk. Only the
+ * first @columns floats of each are read as elements and the padding
+ * after them is masked off, so that a stray value left there by a
+ * kernel cannot change the result. */
+typedef struct {
+  size_t n_rows;
+  size_t columns;
+  size_t row_stride;
+  size_t n_full;   /* Columns covered by whole vectors */
+  mask8_t tail;    /* Lanes of the vector at n_full that are elements */
+} TensorRows;
+
+static void
+tensor_rows_init (TensorRows           *rows,
+                  PipevecTensorPrivate *priv)
+{
+  size_t *shape_data = (size_t *) priv->shape->data;
+  size_t n_dims = priv->shape->len;
+
+  rows->n_rows = array_size_t_product (shape_data, n_dims - 1);
+  rows->columns = shape_data[n_dims - 1];
+  rows->row_stride = g_array_index (priv->padded_shape, size_t, n_dims - 1);
+  rows->n_full = rows->columns - rows->columns % 8;
+  rows->tail = mask8_first (rows->columns - rows->n_full);
 }
 
 /**
- * pipevec_tensor_inner_product_tensor:
+ * pipevec_tensor_equal:
  * @lhs: A #PipevecTensor
  * @rhs: A #PipevecTensor
- * @error: A #GError out pointer.
  *
- * Compute the inner product of two tensors.
+ * Check whether @lhs and @rhs have the same shape and equal
+ * elements. Elements compare as floats do, so 0 equals -0 and
+ * tensors containing NaN are never equal.
  *
- * Returns: (transfer full): A new #PipevecTensor.
+ * Rows are compared in vectors up to their last element, masking
+ * off the padding after it, and the comparison stops at the first
+ * block of vectors with a difference.
+ *
+ * Returns: %TRUE if the tensors are equal.
  */
-PipevecTensor *
-pipevec_tensor_inner_product_tensor (PipevecTensor  *lhs,
-                                     PipevecTensor  *rhs,
-                                     GError        **error)
+gboolean
+pipevec_tensor_equal (PipevecTensor *lhs,
+                      PipevecTensor *rhs)
 {
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_COMPARE);
   PipevecTensorPrivate *lhs_priv = pipevec_tensor_get_instance_private (lhs);
   PipevecTensorPrivate *rhs_priv = pipevec_tensor_get_instance_private (rhs);
+  TensorRows rows;
 
-  size_t *shape_lhs = (size_t *) lhs_priv->shape->data;
-  size_t *shape_rhs = (size_t *) rhs_priv->shape->data;
+  if (!shapes_equal (lhs_priv->shape, rhs_priv->shape))
+    return FALSE;
 
-  if (!shape_subset_equal (lhs_priv->shape, rhs_priv->shape, 2))
-    {
-      g_autofree char *lhs_formatted_shape = format_size_t_array (shape_lhs, lhs_priv->shape->len);
-      g_autofree char *rhs_formatted_shape = format_size_t_array (shape_rhs, rhs_priv->shape->len);
-      g_set_error (error,
-                   PIPEVEC_ERROR,
-                   PIPEVEC_ERROR_BAD_SHAPE,
-                   "%s and %s must have the same leading shape",
-                   lhs_formatted_shape,
-                   rhs_formatted_shape);
-      return NULL;
-    }
+  pipevec_profile_scope_set_shape (&scope, lhs_priv->shape);
+  tensor_rows_init (&rows, lhs_priv);
+
+  mask8_t differ = { 0 };
+  size_t pending = 0;
 
-  if (shape_lhs[lhs_priv->shape->len - 1] != shape_rhs[rhs_priv->shape->len - 2])
+  for (size_t row = 0; row < rows.n_rows; ++row)
     {
-      g_autofree char *lhs_formatted_shape = format_size_t_array (shape_lhs, lhs_priv->shape->len);
-      g_autofree char *rhs_formatted_shape = format_size_t_array (shape_rhs, rhs_priv->shape->len);
-      g_set_error (error,
+      const float *a = lhs_priv->array + row * rows.row_stride;
+      const float *b = rhs_priv->array + row * rows.row_stride;
+
+      for (size_t j = 0; j < rows.n_full; j += 8)
+        differ |= load_float8 (a + j) != load_float8 (b + j);
+
+      if (rows.n_full < rows.columns)
+        differ |= (load_float8 (a + rows.n_full) != load_float8 (b + rows.n_full)) & rows.tail;
+
+      pending += (rows.columns + 7) / 8;
+
+      if (pending >= PIPEVEC_TENSOR_COMPARE_BLOCK || row + 1 == rows.n_rows)
+        {
+          if (mask8_any (differ))
+            {
+              pipevec_profile_scope_set_traffic (&scope,
+                                                 2 * sizeof (float) * (row + 1) * rows.columns,
+                                                 0,
+                                                 0);
+              return FALSE;
+            }
+
+          pending = 0;
+        }
+    }
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     2 * sizeof (float) * rows.n_rows * rows.columns,
+                                     0,
+                                     0);
+
+  return TRUE;
+}
+
+/**
+ * pipevec_tensor_allclose:
+ * @lhs: A #PipevecTensor
+ * @rhs: A #PipevecTensor
+ * @rtol: The tolerance relative to the elements of @rhs, at least zero.
+ * @atol: The absolute tolerance, at least zero.
+ *
+ * Check whether @lhs and @rhs have the same shape and each pair of
+ * elements a and b is within |a - b| <= @atol + @rtol * |b|. Like
+ * pipevec_tensor_equal(), this ignores the row padding and stops at
+ * the first block of elements with a difference, and tensors
+ * containing NaN are never close.
+ *
+ * Returns: %TRUE if the tensors are close.
+ */
+gboolean
+pipevec_tensor_allclose (PipevecTensor *lhs,
+                         PipevecTensor *rhs,
+                         float          rtol,
+                         float          atol)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_COMPARE);
+  PipevecTensorPrivate *lhs_priv = pipevec_tensor_get_instance_private (lhs);
+  PipevecTensorPrivate *rhs_priv = pipevec_tensor_get_instance_private (rhs);
+  TensorRows rows;
+
+  g_return_val_if_fail (rtol >= 0.0f && atol >= 0.0f, FALSE);
+
+  if (!shapes_equal (lhs_priv->shape, rhs_priv->shape))
+    return FALSE;
+
+  pipevec_profile_scope_set_shape (&scope, lhs_priv->shape);
+  tensor_rows_init (&rows, lhs_priv);
+
+  mask8_t far = { 0 };
+  size_t pending = 0;
+
+  for (size_t row = 0; row < rows.n_rows; ++row)
+    {
+      const float *a = lhs_priv->array + row * rows.row_stride;
+      const float *b = rhs_priv->array + row * rows.row_stride;
+
+      /* Written so that a NaN anywhere fails the comparison */
+      for (size_t j = 0; j < rows.n_full; j += 8)
+        {
+          float8_t va = load_float8 (a + j);
+          float8_t vb = load_float8 (b + j);
+
+          far |= ~(abs_float8 (va - vb) <= atol + rtol * abs_float8 (vb));
+        }
+
+      if (rows.n_full < rows.columns)
+        {
+          float8_t va = load_float8 (a + rows.n_full);
+          float8_t vb = load_float8 (b + rows.n_full);
+
+          far |= ~(abs_float8 (va - vb) <= atol + rtol * abs_float8 (vb)) & rows.tail;
+        }
+
+      pending += (rows.columns + 7) / 8;
+
+      if (pending >= PIPEVEC_TENSOR_COMPARE_BLOCK || row + 1 == rows.n_rows)
+        {
+          if (mask8_any (far))
+            {
+              pipevec_profile_scope_set_traffic (&scope,
+                                                 2 * sizeof (float) * (row + 1) * rows.columns,
+                                                 0,
+                                                 3 * (row + 1) * rows.columns);
+              return FALSE;
+            }
+
+          pending = 0;
+        }
+    }
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     2 * sizeof (float) * rows.n_rows * rows.columns,
+                                     0,
+                                     3 * rows.n_rows * rows.columns);
+
+  return TRUE;
+}
+
+/* The hash follows the structure of XXH3's long input loop: each
+ * stripe of 8 floats is mixed with a key into four 64 bit
+ * accumulators with 32x32->64 bit multiplies, the accumulators are
+ * scrambled every few stripes and folded together at the end. The
+ * key changes from stripe to stripe so that reordering the stripes
+ * changes the hash. */
+typedef guint64 hash_lanes_t __attribute__((vector_size(4 * (sizeof (guint64)))));
+
+#define PIPEVEC_HASH_PRIME32_1 G_GUINT64_CONSTANT (0x9E3779B1)
+#define PIPEVEC_HASH_PRIME64_1 G_GUINT64_CONSTANT (0x9E3779B185EBCA87)
+#define PIPEVEC_HASH_PRIME64_2 G_GUINT64_CONSTANT (0xC2B2AE3D27D4EB4F)
+#define PIPEVEC_HASH_PRIME64_3 G_GUINT64_CONSTANT (0x165667B19E3779F9)
+
+/* Stripes accumulated between scrambles */
+#define PIPEVEC_HASH_STRIPES_PER_BLOCK 16
+
+/* Mix the lanes of stripe in mask into the accumulators */
+static inline hash_lanes_t
+hash_accumulate (hash_lanes_t acc,
+                 float8_t     stripe,
+                 mask8_t      mask,
+                 hash_lanes_t key)
+{
+  hash_lanes_t data;
+
+  /* Adding zero turns -0 into 0, so that tensors that are equal
+   * hash the same. Lanes outside the mask hash as zero. */
+  stripe = (float8_t) ((mask8_t) (stripe + 0.0f) & mask);
+  memcpy (&data, &stripe, sizeof (data));
+
+  hash_lanes_t keyed = data ^ key;
+
+  acc += (keyed & 0xffffffff) * (keyed >> 32);
+  acc += __builtin_shufflevector (data, data, 1, 0, 3, 2);
+
+  return acc;
+}
+
+static inline hash_lanes_t
+hash_scramble (hash_lanes_t acc,
+               hash_lanes_t key)
+{
+  acc ^= acc >> 47;
+  acc ^= key;
+  acc *= PIPEVEC_HASH_PRIME32_1;
+
+  return acc;
+}
+
+static inline guint64
+hash_avalanche (guint64 h)
+{
+  h ^= h >> 37;
+  h *= PIPEVEC_HASH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+/**
+ * pipevec_tensor_hash:
+ * @tensor: A #PipevecTensor
+ *
+ * Compute a 64 bit fingerprint of the shape and elements of @tensor,
+ * in a single pass over its rows in vectors, ignoring the padding
+ * after each. Tensors that are pipevec_tensor_equal() have the same
+ * hash, including views and copies of each other. Tensors that
+ * differ are very likely to have different hashes, but this is not
+ * a cryptographic hash. Hashes are the same in every process on
+ * machines with the same byte order.
+ *
+ * Returns: The hash of @tensor.
+ */
+guint64
+pipevec_tensor_hash (PipevecTensor *tensor)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_HASH);
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+  size_t *shape_data = (size_t *) priv->shape->data;
+  const mask8_t all = mask8_first (8);
+  const hash_lanes_t key_step = {
+    PIPEVEC_HASH_PRIME64_1,
+    PIPEVEC_HASH_PRIME64_2,
+    PIPEVEC_HASH_PRIME64_3,
+    PIPEVEC_HASH_PRIME64_1 ^ PIPEVEC_HASH_PRIME64_2
+  };
+  hash_lanes_t key = key_step;
+  hash_lanes_t acc = {
+    PIPEVEC_HASH_PRIME32_1,
+    PIPEVEC_HASH_PRIME64_1,
+    PIPEVEC_HASH_PRIME64_2,
+    PIPEVEC_HASH_PRIME64_3
+  };
+  size_t n_stripes = 0;
+  TensorRows rows;
+
+  pipevec_profile_scope_set_shape (&scope, priv->shape);
+  tensor_rows_init (&rows, priv);
+
+  for (size_t row = 0; row < rows.n_rows; ++row)
+    {
+      const float *data = priv->array + row * rows.row_stride;
+
+      for (size_t j = 0; j < rows.columns; j += 8)
+        {
+          acc = hash_accumulate (acc,
+                                 load_float8 (data + j),
+                                 j < rows.n_full ? all : rows.tail,
+                                 key);
+          key += key_step;
+
+          if (++n_stripes % PIPEVEC_HASH_STRIPES_PER_BLOCK == 0)
+            acc = hash_scramble (acc, key);
+        }
+    }
+
+  acc = hash_scramble (acc, key);
+
+  /* Rows of every length hash the same number of lanes per vector,
+   * so the shape is what tells apart tensors that differ only in
+   * how their elements are split into rows */
+  guint64 h = priv->shape->len * PIPEVEC_HASH_PRIME64_1;
+
+  for (size_t i = 0; i < priv->shape->len; ++i)
+    h = (h ^ shape_data[i]) * PIPEVEC_HASH_PRIME64_2;
+
+  for (size_t i = 0; i < 4; ++i)
+    h = (h ^ hash_avalanche (acc[i])) * PIPEVEC_HASH_PRIME64_1;
+
+  pipevec_profile_scope_set_traffic (&scope, sizeof (float) * rows.n_rows * rows.columns, 0, 0);
+
+  return hash_avalanche (h);
+}
+
+/* Exactly one of rhs and packed_rhs is set */
+static PipevecTensor *
+inner_product_tensor (PipevecTensor        *lhs,
+                      PipevecTensor        *rhs,
+                      PipevecPackedTensor  *packed_rhs,
+                      float                 alpha,
+                      PipevecTensor        *bias,
+                      PipevecActivation     activation,
+                      PipevecTensor        *residual,
+                      float                 beta,
+                      GError              **error)
+{
+  g_auto(PipevecProfileScope) scope = pipevec_profile_scope_begin (PIPEVEC_PROFILE_OP_INNER_PRODUCT);
+  PipevecTensorPrivate *lhs_priv = pipevec_tensor_get_instance_private (lhs);
+  GArray *rhs_shape = (packed_rhs != NULL ?
+                       pipevec_packed_tensor_get_shape_array (packed_rhs) :
+                       pipevec_tensor_get_shape_array (rhs));
+
+  size_t *shape_lhs = (size_t *) lhs_priv->shape->data;
+  size_t *shape_rhs = (size_t *) rhs_shape->data;
+  PipevecTensorMatrixView lhs_view, rhs_view, dst_view;
+
+  pipevec_profile_scope_set_shape (&scope, lhs_priv->shape);
+  pipevec_tensor_get_matrix_view (lhs, &lhs_view);
+
+  if (packed_rhs != NULL)
+    pipevec_packed_tensor_get_matrix_view (packed_rhs, &rhs_view);
+  else
+    pipevec_tensor_get_matrix_view (rhs, &rhs_view);
+
+  if (lhs_view.columns != rhs_view.rows)
+    {
+      g_autofree char *lhs_formatted_shape = format_size_t_array (shape_lhs, lhs_priv->shape->len);
+      g_autofree char *rhs_formatted_shape = format_size_t_array (shape_rhs, rhs_shape->len);
+      g_set_error (error,
                    PIPEVEC_ERROR,
                    PIPEVEC_ERROR_BAD_SHAPE,
                    "Arrays of shape %s and %s are not compatible for inner product, %zu != %zu",
                    lhs_formatted_shape,
                    rhs_formatted_shape,
-                   shape_lhs[lhs_priv->shape->len - 1],
-                   shape_rhs[rhs_priv->shape->len - 2]);
+                   lhs_view.columns,
+                   rhs_view.rows);
       return NULL;
     }
 
-  /* Allocate a new tensor with shape (..., M, K)
-   * where the trailing dimensions where of lhs M, N
-   * and the trailing dimensions of rhs were N, K */
-  GArray *new_shape = g_array_copy (lhs_priv->shape);
-  g_array_index (new_shape, float, new_shape->len - 2) = \
-    g_array_index (lhs_priv->shape, float, lhs_priv->shape->len - 2);
-  g_array_index(new_shape, float, new_shape->len - 1) = \
-    g_array_index (rhs_priv->shape, float, rhs_priv->shape->len - 1);
+  /* The bias is a single row added to every row of the output */
+  if (bias != NULL)
+    {
+      PipevecTensorPrivate *bias_priv = pipevec_tensor_get_instance_private (bias);
+      size_t *shape_bias = (size_t *) bias_priv->shape->data;
 
-  g_autoptr(PipevecTensor) new_tensor = g_object_new (PIPEVEC_TYPE_TENSOR, NULL);
+      if (shape_bias[bias_priv->shape->len - 1] != rhs_view.columns ||
+          array_size_t_product (shape_bias, bias_priv->shape->len) != rhs_view.columns)
+        {
+          g_autofree char *bias_formatted_shape = format_size_t_array (shape_bias, bias_priv->shape->len);
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_BAD_SHAPE,
+                       "Bias of shape %s is not compatible with %zu output columns",
+                       bias_formatted_shape,
+                       rhs_view.columns);
+          return NULL;
+        }
+    }
 
-  if (!pipevec_tensor_alloc_shape (new_tensor, new_shape, NULL))
+  /* Broadcast the batch dimensions, aligned from the right. The
+   * stride of a broadcast dimension is zero, so the same matrix
+   * is visited for every index along it. */
+  size_t lhs_batch_dims = lhs_priv->shape->len > 2 ? lhs_priv->shape->len - 2 : 0;
+  size_t rhs_batch_dims = rhs_shape->len > 2 ? rhs_shape->len - 2 : 0;
+  size_t n_batch_dims = MAX (lhs_batch_dims, rhs_batch_dims);
+  g_autoptr(GArray) new_shape = g_array_sized_new (FALSE, FALSE, sizeof (size_t), n_batch_dims + 2);
+  g_autofree ptrdiff_t *lhs_strides = g_new0 (ptrdiff_t, n_batch_dims + 1);
+  g_autofree ptrdiff_t *rhs_strides = g_new0 (ptrdiff_t, n_batch_dims + 1);
+  g_autofree ptrdiff_t *dst_strides = g_new0 (ptrdiff_t, n_batch_dims + 1);
+  ptrdiff_t lhs_stride = lhs_view.batch_stride;
+  ptrdiff_t rhs_stride = rhs_view.batch_stride;
+
+  g_array_set_size (new_shape, n_batch_dims);
+
+  for (size_t d = n_batch_dims; d-- > 0;)
+    {
+      size_t lhs_size = d + lhs_batch_dims >= n_batch_dims ? shape_lhs[d + lhs_batch_dims - n_batch_dims] : 1;
+      size_t rhs_size = d + rhs_batch_dims >= n_batch_dims ? shape_rhs[d + rhs_batch_dims - n_batch_dims] : 1;
+
+      if (lhs_size != rhs_size && lhs_size != 1 && rhs_size != 1)
+        {
+          g_autofree char *lhs_formatted_shape = format_size_t_array (shape_lhs, lhs_priv->shape->len);
+          g_autofree char *rhs_formatted_shape = format_size_t_array (shape_rhs, rhs_shape->len);
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_BAD_SHAPE,
+                       "The leading dimensions of %s and %s cannot be broadcast together",
+                       lhs_formatted_shape,
+                       rhs_formatted_shape);
+          return NULL;
+        }
+
+      g_array_index (new_shape, size_t, d) = MAX (lhs_size, rhs_size);
+      lhs_strides[d] = lhs_size == 1 ? 0 : lhs_stride;
+      rhs_strides[d] = rhs_size == 1 ? 0 : rhs_stride;
+      lhs_stride *= lhs_size;
+      rhs_stride *= rhs_size;
+    }
+
+  /* The output has shape (..., M, N), without M if lhs was a vector */
+  if (lhs_priv->shape->len > 1)
+    g_array_append_val (new_shape, lhs_view.rows);
+
+  g_array_append_val (new_shape, rhs_view.columns);
+
+  /* The residual is read with the strides of the output, so
+   * it must have exactly the same shape */
+  if (residual != NULL)
+    {
+      PipevecTensorPrivate *residual_priv = pipevec_tensor_get_instance_private (residual);
+
+      if (residual_priv->shape->len != new_shape->len ||
+          memcmp (residual_priv->shape->data, new_shape->data, sizeof (size_t) * new_shape->len) != 0)
+        {
+          g_autofree char *residual_formatted_shape = format_size_t_array ((size_t *) residual_priv->shape->data,
+                                                                           residual_priv->shape->len);
+          g_autofree char *output_formatted_shape = format_size_t_array ((size_t *) new_shape->data,
+                                                                         new_shape->len);
+          g_set_error (error,
+                       PIPEVEC_ERROR,
+                       PIPEVEC_ERROR_DIMENSION_MISMATCH,
+                       "Residual of shape %s does not match output of shape %s",
+                       residual_formatted_shape,
+                       output_formatted_shape);
+          return NULL;
+        }
+    }
+
+  g_autoptr(PipevecTensor) new_tensor = pipevec_tensor_new_for_shape (new_shape, error);
+
+  if (new_tensor == NULL)
     return NULL;
 
-  PipevecTensorPrivate *new_tensor_priv = pipevec_tensor_get_instance_private (new_tensor);
+  pipevec_tensor_get_matrix_view (new_tensor, &dst_view);
 
-  /* Now we need to perform the inner product. First take the shape product
-   * of the leading components (eg, not including the two last components) */
-  size_t leading_batch_component_shape = array_size_t_product ((size_t *) new_tensor_priv->shape->data,
-                                                               new_tensor_priv->shape->len - 2);
-  size_t trailing_batch_component_padded = array_size_t_product ((size_t *) new_tensor_priv->padded_shape->data,
-                                                                 new_tensor_priv->padded_shape->len) / leading_batch_component_shape;
+  /* Without M, each product in the batch is a single row */
+  ptrdiff_t dst_stride = lhs_priv->shape->len > 1 ? dst_view.batch_stride : dst_view.row_stride;
 
-  size_t rows = g_array_index (new_tensor_priv->shape, float, new_tensor_priv->shape->len - 2);
-  size_t columns = g_array_index (new_tensor_priv->shape, float, new_tensor_priv->shape->len - 1);
-  size_t dot_product_vector_length = g_array_index (lhs_priv->shape, float, lhs_priv->shape->len - 1);
-  size_t row_length = g_array_index (new_tensor_priv->padded_shape, float, new_tensor_priv->padded_shape->len - 1);
-  size_t lhs_row_length = g_array_index (lhs_priv->padded_shape, float, lhs_priv->padded_shape->len - 1);
-  size_t rhs_row_length = g_array_index (rhs_priv->padded_shape, float, rhs_priv->padded_shape->len - 1);
+  for (size_t d = n_batch_dims; d-- > 0;)
+    {
+      dst_strides[d] = dst_stride;
+      dst_stride *= g_array_index (new_shape, size_t, d);
+    }
 
-  /* Iterate along the batches */
-  for (size_t batch_index = 0; batch_index < leading_batch_component_shape; ++batch_index)
+  /* Merge batch dimensions that are laid out one after the other in
+   * every operand, so that as much of the batch as possible goes to
+   * the GEMM engine in one call. When the rhs is shared across the
+   * whole batch this is usually all of it, and the engine reuses its
+   * packed panels for every batch. */
+  size_t n_outer_dims = n_batch_dims > 0 ? n_batch_dims - 1 : 0;
+  size_t inner_size = n_batch_dims > 0 ? g_array_index (new_shape, size_t, n_batch_dims - 1) : 1;
+
+  while (n_outer_dims > 0 &&
+         lhs_strides[n_outer_dims - 1] == lhs_strides[n_outer_dims] * (ptrdiff_t) inner_size &&
+         rhs_strides[n_outer_dims - 1] == rhs_strides[n_outer_dims] * (ptrdiff_t) inner_size &&
+         dst_strides[n_outer_dims - 1] == dst_strides[n_outer_dims] * (ptrdiff_t) inner_size)
     {
-      size_t batch_offset = batch_index * trailing_batch_component_padded;
+      inner_size *= g_array_index (new_shape, size_t, n_outer_dims - 1);
+      lhs_strides[n_outer_dims - 1] = lhs_strides[n_outer_dims];
+      rhs_strides[n_outer_dims - 1] = rhs_strides[n_outer_dims];
+      dst_strides[n_outer_dims - 1] = dst_strides[n_outer_dims];
+      --n_outer_dims;
+    }
+
+  size_t n_outer = array_size_t_product ((size_t *) new_shape->data, n_outer_dims);
+  gboolean has_epilogue = (bias != NULL ||
+                           activation != PIPEVEC_ACTIVATION_NONE ||
+                           residual != NULL);
+  PipevecGemmEpilogue epilogue = {
+    .bias = bias != NULL ? pipevec_tensor_get_storage (bias) : NULL,
+    .activation = activation,
+    .residual_scale = beta
+  };
+
+  for (size_t outer = 0; outer < n_outer; ++outer)
+    {
+      ptrdiff_t lhs_offset = 0, rhs_offset = 0, dst_offset = 0;
+      size_t remaining = outer;
 
-      /* Iterate the rows of the result */
-      for (size_t i = 0; i < rows; ++i)
+      for (size_t d = n_outer_dims; d-- > 0;)
         {
-          /* Iterate along the columns of the result */
-          for (size_t j = 0; j < columns; ++j)
-            {
-              size_t dst_offset = batch_index * trailing_batch_component_padded + i * row_length + j;
-              new_tensor_priv->array[dst_offset] = 0.0f;
-
-              /* Now iterate the columns of LHS to perform the dot product */
-              for (size_t k = 0; k < dot_product_vector_length; ++k)
-                {
-                  new_tensor_priv->array[dst_offset] += \
-                    lhs_priv->array[batch_offset + i * lhs_row_length + k] * \
-                    rhs_priv->array[batch_offset + k * rhs_row_length + j];
-                }
-            }
+          size_t size = g_array_index (new_shape, size_t, d);
+          size_t index = remaining % size;
+
+          remaining /= size;
+          lhs_offset += index * lhs_strides[d];
+          rhs_offset += index * rhs_strides[d];
+          dst_offset += index * dst_strides[d];
         }
+
+      if (residual != NULL)
+        epilogue.residual = pipevec_tensor_get_storage (residual) + dst_offset;
+
+      if (packed_rhs != NULL)
+        {
+          /* A packed rhs is a single matrix, so it has no batch
+           * dimensions and is shared by the whole batch */
+          if (!pipevec_gemm_batched_fused_packed (inner_size,
+                                                  lhs_view.rows,
+                                                  rhs_view.columns,
+                                                  lhs_view.columns,
+                                                  alpha,
+                                                  lhs_view.data + lhs_offset,
+                                                  n_batch_dims > 0 ? lhs_strides[n_outer_dims] : 0,
+                                                  lhs_view.row_stride,
+                                                  1,
+                                                  pipevec_packed_tensor_get_layout (packed_rhs),
+                                                  pipevec_packed_tensor_get_panels (packed_rhs),
+                                                  0.0f,
+                                                  dst_view.data + dst_offset,
+                                                  n_batch_dims > 0 ? dst_strides[n_outer_dims] : 0,
+                                                  dst_view.row_stride,
+                                                  has_epilogue ? &epilogue : NULL,
+                                                  error))
+            return NULL;
+
+          continue;
+        }
+
+      /* Rows of the tensors are padded with zeros, as the kernels
+       * for small matrices need */
+      if (pipevec_gemm_small_batched (inner_size,
+                                      lhs_view.rows,
+                                      rhs_view.columns,
+                                      lhs_view.columns,
+                                      alpha,
+                                      lhs_view.data + lhs_offset,
+                                      n_batch_dims > 0 ? lhs_strides[n_outer_dims] : 0,
+                                      lhs_view.row_stride,
+                                      rhs_view.data + rhs_offset,
+                                      n_batch_dims > 0 ? rhs_strides[n_outer_dims] : 0,
+                                      rhs_view.row_stride,
+                                      dst_view.data + dst_offset,
+                                      n_batch_dims > 0 ? dst_strides[n_outer_dims] : 0,
+                                      dst_view.row_stride,
+                                      has_epilogue ? &epilogue : NULL))
+        continue;
+
+      if (!pipevec_gemm_batched_fused (inner_size,
+                                       lhs_view.rows,
+                                       rhs_view.columns,
+                                       lhs_view.columns,
+                                       alpha,
+                                       lhs_view.data + lhs_offset,
+                                       n_batch_dims > 0 ? lhs_strides[n_outer_dims] : 0,
+                                       lhs_view.row_stride,
+                                       1,
+                                       rhs_view.data + rhs_offset,
+                                       n_batch_dims > 0 ? rhs_strides[n_outer_dims] : 0,
+                                       rhs_view.row_stride,
+                                       1,
+                                       0.0f,
+                                       dst_view.data + dst_offset,
+                                       n_batch_dims > 0 ? dst_strides[n_outer_dims] : 0,
+                                       dst_view.row_stride,
+                                       has_epilogue ? &epilogue : NULL,
+                                       error))
+        return NULL;
     }
 
+  size_t n_batches = array_size_t_product ((size_t *) new_shape->data, n_batch_dims);
+  guint64 bytes_read = shape_bytes (lhs_priv->shape) + shape_bytes (rhs_shape);
+
+  if (bias != NULL)
+    bytes_read += sizeof (float) * rhs_view.columns;
+
+  if (residual != NULL)
+    bytes_read += shape_bytes (new_shape);
+
+  pipevec_profile_scope_set_traffic (&scope,
+                                     bytes_read,
+                                     shape_bytes (new_shape),
+                                     2 * (guint64) n_batches * lhs_view.rows * lhs_view.columns * rhs_view.columns);
+
   return g_steal_pointer (&new_tensor);
 }
 
+/**
+ * pipevec_tensor_inner_product_tensor:
+ * @lhs: A #PipevecTensor of shape (..., M, K)
+ * @rhs: A #PipevecTensor of shape (..., K, N)
+ * @error: A #GError out pointer.
+ *
+ * Compute the matrix product of each pair of matrices in @lhs and
+ * @rhs. The leading (batch) dimensions are broadcast against each
+ * other: a dimension of size 1, or one that is missing from the
+ * shorter shape, is repeated to match the other operand. For example
+ * a (B, M, K) tensor times a (K, N) tensor gives a (B, M, N) tensor
+ * with the same (K, N) matrix used for every batch.
+ *
+ * Returns: (transfer full): A new #PipevecTensor.
+ */
+PipevecTensor *
+pipevec_tensor_inner_product_tensor (PipevecTensor  *lhs,
+                                     PipevecTensor  *rhs,
+                                     GError        **error)
+{
+  return inner_product_tensor (lhs, rhs, NULL,
+                               1.0f,
+                               NULL,
+                               PIPEVEC_ACTIVATION_NONE,
+                               NULL,
+                               0.0f,
+                               error);
+}
+
+/**
+ * pipevec_tensor_inner_product_tensor_fused:
+ * @lhs: A #PipevecTensor of shape (..., M, K)
+ * @rhs: A #PipevecTensor of shape (..., K, N)
+ * @alpha: Scale applied to the product.
+ * @bias: (nullable): A #PipevecTensor with N elements, added to
+ *        each row of the product.
+ * @activation: A #PipevecActivation applied after the bias.
+ * @residual: (nullable): A #PipevecTensor with the same shape as
+ *            the output, added after the activation.
+ * @beta: Scale applied to @residual.
+ * @error: A #GError out pointer.
+ *
+ * Compute activation (alpha * lhs * rhs + bias) + beta * residual,
+ * with batch dimensions broadcast as in
+ * pipevec_tensor_inner_product_tensor(). The bias, activation and
+ * residual are applied to each block of the output as soon as the
+ * block is computed, so the output is only written once instead of
+ * once for the product and once more for each elementwise operation.
+ *
+ * Returns: (transfer full): A new #PipevecTensor.
+ */
+PipevecTensor *
+pipevec_tensor_inner_product_tensor_fused (PipevecTensor      *lhs,
+                                           PipevecTensor      *rhs,
+                                           float               alpha,
+                                           PipevecTensor      *bias,
+                                           PipevecActivation   activation,
+                                           PipevecTensor      *residual,
+                                           float               beta,
+                                           GError            **error)
+{
+  return inner_product_tensor (lhs, rhs, NULL,
+                               alpha,
+                               bias,
+                               activation,
+                               residual,
+                               beta,
+                               error);
+}
+
+/**
+ * pipevec_tensor_inner_product_packed:
+ * @lhs: A #PipevecTensor of shape (..., M, K)
+ * @rhs: A #PipevecPackedTensor packed from a (K, N) tensor.
+ * @error: A #GError out pointer.
+ *
+ * Like pipevec_tensor_inner_product_tensor(), but with a weight
+ * matrix that was already packed by pipevec_tensor_pack_for_matmul(),
+ * so that it is not packed again on every call. @rhs is shared by
+ * every matrix in @lhs.
+ *
+ * Returns: (transfer full): A new #PipevecTensor.
+ */
+PipevecTensor *
+pipevec_tensor_inner_product_packed (PipevecTensor        *lhs,
+                                     PipevecPackedTensor  *rhs,
+                                     GError              **error)
+{
+  return inner_product_tensor (lhs, NULL, rhs,
+                               1.0f,
+                               NULL,
+                               PIPEVEC_ACTIVATION_NONE,
+                               NULL,
+                               0.0f,
+                               error);
+}
+
+/**
+ * pipevec_tensor_inner_product_packed_fused:
+ * @lhs: A #PipevecTensor of shape (..., M, K)
+ * @rhs: A #PipevecPackedTensor packed from a (K, N) tensor.
+ * @alpha: Scale applied to the product.
+ * @bias: (nullable): A #PipevecTensor with N elements, added to
+ *        each row of the product.
+ * @activation: A #PipevecActivation applied after the bias.
+ * @residual: (nullable): A #PipevecTensor with the same shape as
+ *            the output, added after the activation.
+ * @beta: Scale applied to @residual.
+ * @error: A #GError out pointer.
+ *
+ * Like pipevec_tensor_inner_product_tensor_fused(), but with a
+ * weight matrix packed by pipevec_tensor_pack_for_matmul().
+ *
+ * Returns: (transfer full): A new #PipevecTensor.
+ */
+PipevecTensor *
+pipevec_tensor_inner_product_packed_fused (PipevecTensor        *lhs,
+                                           PipevecPackedTensor  *rhs,
+                                           float                 alpha,
+                                           PipevecTensor        *bias,
+                                           PipevecActivation     activation,
+                                           PipevecTensor        *residual,
+                                           float                 beta,
+                                           GError              **error)
+{
+  return inner_product_tensor (lhs, NULL, rhs,
+                               alpha,
+                               bias,
+                               activation,
+                               residual,
+                               beta,
+                               error);
+}
+
+/**
+ * pipevec_tensor_new_for_shape_uninitialized:
+ * @shape: (element-type gulong): A #GArray describing the tensor shape.
+ * @error: An out #GError pointer.
+ *
+ * Like pipevec_tensor_new_for_shape(), but leave the storage as it
+ * was allocated. The caller must write every element of it,
+ * including zeroes in the row padding.
+ *
+ * Returns: (transfer full): A new #PipevecTensor or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_new_for_shape_uninitialized (GArray  *shape,
+                                            GError **error)
+{
+  g_autoptr(PipevecTensor) tensor = g_object_new (PIPEVEC_TYPE_TENSOR, NULL);
+
+  if (!pipevec_tensor_alloc_shape (tensor, shape, error))
+    return NULL;
+
+  return g_steal_pointer (&tensor);
+}
+
+/**
+ * pipevec_tensor_new_for_shape:
+ * @shape: (element-type gulong): A #GArray describing the tensor shape.
+ * @error: An out #GError pointer.
+ *
+ * Create a new tensor with storage for @shape. The storage,
+ * including the row padding, is zero-filled.
+ *
+ * Returns: (transfer full): A new #PipevecTensor or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_new_for_shape (GArray  *shape,
+                              GError **error)
+{
+  g_autoptr(PipevecTensor) tensor = pipevec_tensor_new_for_shape_uninitialized (shape, error);
+
+  if (tensor == NULL)
+    return NULL;
+
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+
+  memset (priv->array,
+          0,
+          sizeof (float) * array_size_t_product ((size_t *) priv->padded_shape->data,
+                                                 priv->padded_shape->len));
+
+  return g_steal_pointer (&tensor);
+}
+
+/**
+ * pipevec_tensor_get_storage:
+ * @tensor: A #PipevecTensor
+ *
+ * Get the padded, aligned storage of @tensor. Rows (the innermost
+ * dimension) are padded to a multiple of 8 floats and the padding
+ * is always zero.
+ *
+ * Returns: (transfer none): The internal storage of @tensor.
+ */
+float *
+pipevec_tensor_get_storage (PipevecTensor *tensor)
+{
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+
+  return priv->array;
+}
+
+/**
+ * pipevec_tensor_get_shape_array:
+ * @tensor: A #PipevecTensor
+ *
+ * Returns: (transfer none) (element-type gulong): The unpadded shape of @tensor.
+ */
+GArray *
+pipevec_tensor_get_shape_array (PipevecTensor *tensor)
+{
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+
+  return priv->shape;
+}
+
+/**
+ * pipevec_tensor_get_padded_shape_array:
+ * @tensor: A #PipevecTensor
+ *
+ * Returns: (transfer none) (element-type gulong): The padded shape of @tensor.
+ */
+GArray *
+pipevec_tensor_get_padded_shape_array (PipevecTensor *tensor)
+{
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+
+  return priv->padded_shape;
+}
+
+/**
+ * pipevec_tensor_get_matrix_view:
+ * @tensor: A #PipevecTensor
+ * @view: (out caller-allocates): A #PipevecTensorMatrixView to fill in.
+ *
+ * Describe @tensor as a batch of row-major matrices made up of its
+ * two trailing dimensions. A one dimensional tensor is a single row.
+ */
+void
+pipevec_tensor_get_matrix_view (PipevecTensor           *tensor,
+                                PipevecTensorMatrixView *view)
+{
+  PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
+  size_t *shape_data = (size_t *) priv->shape->data;
+  size_t *padded_shape_data = (size_t *) priv->padded_shape->data;
+  size_t n_dims = priv->shape->len;
+
+  view->data = priv->array;
+  view->columns = shape_data[n_dims - 1];
+  view->row_stride = padded_shape_data[n_dims - 1];
+  view->rows = n_dims > 1 ? shape_data[n_dims - 2] : 1;
+  view->n_batches = n_dims > 2 ? array_size_t_product (shape_data, n_dims - 2) : 1;
+  view->batch_stride = view->rows * view->row_stride;
+}
+
+/**
+ * pipevec_format_shape:
+ * @shape: (element-type gulong): A #GArray describing a tensor shape.
+ *
+ * Format @shape for use in error messages.
+ *
+ * Returns: (transfer full): A string like "[2, 3]".
+ */
+char *
+pipevec_format_shape (GArray *shape)
+{
+  return format_size_t_array ((size_t *) shape->data, shape->len);
+}
+
 void
 pipevec_tensor_finalize (GObject *object)
 {
   PipevecTensor *tensor = PIPEVEC_TENSOR (object);
   PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
 
-  g_clear_pointer (&priv->array, g_free);
-  g_clear_pointer (&priv->shape, g_array_unref);
-  g_clear_pointer (&priv->padded_shape, g_array_unref);
+  free_storage (priv);
+  g_clear_pointer (&priv->shape, shape_array_release);
+  g_clear_pointer (&priv->padded_shape, shape_array_release);
+
+  G_OBJECT_CLASS (pipevec_tensor_parent_class)->finalize (object);
 }
 
 void
@@ -821,8 +2340,8 @@ pipevec_tensor_init (PipevecTensor *tensor)
 {
   PipevecTensorPrivate *priv = pipevec_tensor_get_instance_private (tensor);
 
-  priv->shape = g_array_new (FALSE, FALSE, sizeof (size_t));
-  priv->padded_shape = g_array_new (FALSE, FALSE, sizeof (size_t));
+  priv->shape = shape_array_new ();
+  priv->padded_shape = shape_array_new ();
   priv->array = NULL;
 }
 
@@ -846,5 +2365,43 @@ pipevec_tensor_new (GArray  *shape,
   if (!pipevec_tensor_set_data (tensor, contents, shape, error))
     return NULL;
 
-  return tensor;
-}
\ No newline at end of file
+  return g_steal_pointer (&tensor);
+}
+
+/**
+ * pipevec_tensor_new_from_bytes:
+ * @shape: (element-type gulong): A #GArray describing the tensor shape.
+ * @contents: (transfer none): The flattened tensor contents, as
+ *            floats in native byte order.
+ * @error: An out #GError pointer.
+ *
+ * Like pipevec_tensor_new(), but take the contents from a #GBytes,
+ * which language bindings can make from a typed array without
+ * converting it element by element.
+ *
+ * Returns: (transfer full): A new #PipevecTensor or %NULL with @error set.
+ */
+PipevecTensor *
+pipevec_tensor_new_from_bytes (GArray  *shape,
+                               GBytes  *contents,
+                               GError **error)
+{
+  g_autoptr(PipevecTensor) tensor = g_object_new (PIPEVEC_TYPE_TENSOR, NULL);
+  gsize size = 0;
+  const float *data = g_bytes_get_data (contents, &size);
+
+  if (size % sizeof (float) != 0)
+    {
+      g_set_error (error,
+                   PIPEVEC_ERROR,
+                   PIPEVEC_ERROR_BAD_SHAPE,
+                   "Contents of %zu bytes are not a whole number of floats",
+                   size);
+      return NULL;
+    }
+
+  if (!set_data_from_floats (tensor, data, size / sizeof (float), shape, error))
+    return NULL;
+
+  return g_steal_pointer (&tensor);
+}
@@ -35,8 +35,21 @@ gboolean pipevec_tensor_set_data (PipevecTensor  *tensor,
                                   GArray         *shape,
                                   GError        **error);
 
+gboolean pipevec_tensor_set_data_from_buffer (PipevecTensor  *tensor,
+                                              const float    *contents,
+                                              size_t          n_contents,
+                                              GArray         *shape,
+                                              GError        **error);
+
 GArray * pipevec_tensor_get_data (PipevecTensor *tensor);
 
+GBytes * pipevec_tensor_get_bytes (PipevecTensor *tensor);
+
+gboolean pipevec_tensor_read_data (PipevecTensor  *tensor,
+                                   float          *buffer,
+                                   size_t          n_buffer,
+                                   GError        **error);
+
 PipevecTensor * pipevec_tensor_copy (PipevecTensor  *tensor,
                                      GError        **error);
 
@@ -44,6 +57,21 @@ gboolean pipevec_tensor_reshape (PipevecTensor  *tensor,
                                  GArray         *shape,
                                  GError        **error);
 
+PipevecTensor * pipevec_tensor_concat (PipevecTensor **tensors,
+                                       size_t          n_tensors,
+                                       size_t          axis,
+                                       GError        **error);
+
+GPtrArray * pipevec_tensor_split (PipevecTensor  *tensor,
+                                  GArray         *sizes,
+                                  size_t          axis,
+                                  GError        **error);
+
+GPtrArray * pipevec_tensor_chunk (PipevecTensor  *tensor,
+                                  size_t          n_chunks,
+                                  size_t          axis,
+                                  GError        **error);
+
 typedef float (*PipevecTensorMapFunction) (float     element,
                                            GArray   *indices,
                                            gpointer  user_data);
@@ -73,6 +101,35 @@ PipevecTensor * pipevec_tensor_inner_product_tensor (PipevecTensor  *lhs,
                                                      PipevecTensor  *rhs,
                                                      GError        **error);
 
+/**
+ * PipevecActivation:
+ * @PIPEVEC_ACTIVATION_NONE: Leave the value unchanged.
+ * @PIPEVEC_ACTIVATION_RELU: max (x, 0).
+ * @PIPEVEC_ACTIVATION_SIGMOID: 1 / (1 + exp (-x)).
+ * @PIPEVEC_ACTIVATION_TANH: tanh (x).
+ * @PIPEVEC_ACTIVATION_GELU: The tanh approximation of the Gaussian
+ *                           error linear unit.
+ *
+ * Elementwise activation functions that can be fused into
+ * pipevec_tensor_inner_product_tensor_fused().
+ */
+typedef enum {
+  PIPEVEC_ACTIVATION_NONE,
+  PIPEVEC_ACTIVATION_RELU,
+  PIPEVEC_ACTIVATION_SIGMOID,
+  PIPEVEC_ACTIVATION_TANH,
+  PIPEVEC_ACTIVATION_GELU
+} PipevecActivation;
+
+PipevecTensor * pipevec_tensor_inner_product_tensor_fused (PipevecTensor      *lhs,
+                                                           PipevecTensor      *rhs,
+                                                           float               alpha,
+                                                           PipevecTensor      *bias,
+                                                           PipevecActivation   activation,
+                                                           PipevecTensor      *residual,
+                                                           float               beta,
+                                                           GError            **error);
+
 PipevecTensor * pipevec_tensor_multiply_tensor (PipevecTensor  *lhs,
                                                 PipevecTensor  *rhs,
                                                 GError        **error);
@@ -89,10 +146,24 @@ PipevecTensor * pipevec_tensor_divide_scalar (PipevecTensor  *lhs,
                                               float           rhs,
                                               GError        **error);
 
+gboolean pipevec_tensor_equal (PipevecTensor *lhs,
+                               PipevecTensor *rhs);
+
+gboolean pipevec_tensor_allclose (PipevecTensor *lhs,
+                                  PipevecTensor *rhs,
+                                  float          rtol,
+                                  float          atol);
+
+guint64 pipevec_tensor_hash (PipevecTensor *tensor);
+
 
 PipevecTensor * pipevec_tensor_new (GArray  *shape,
                                     GArray  *contents,
                                     GError **error);
 
+PipevecTensor * pipevec_tensor_new_from_bytes (GArray  *shape,
+                                               GBytes  *contents,
+                                               GError **error);
+
 
 G_END_DECLS
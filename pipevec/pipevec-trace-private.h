@@ -0,0 +1,40 @@
+/*
+ * /pipevec/pipevec-trace-private.h
+ *
+ * Recording hooks for timeline tracing.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include <pipevec/pipevec-trace.h>
+
+G_BEGIN_DECLS
+
+guint64 pipevec_trace_now (void);
+
+void pipevec_trace_record (const char *category,
+                           const char *name,
+                           guint64     start_ns,
+                           guint64     end_ns,
+                           const char *arg_name,
+                           gint64      arg);
+
+G_END_DECLS
@@ -0,0 +1,362 @@
+/*
+ * /pipevec/pipevec-trace.c
+ *
+ * Timeline tracing of operations and worker threads.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <pipevec/pipevec-trace.h>
+#include <pipevec/pipevec-trace-private.h>
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Tracing records a begin and end time for every tensor operation,
+ * parallel loop, wait for a worker and task run by a worker, and
+ * writes them out as Chrome trace JSON, which chrome://tracing and
+ * the Perfetto UI both open.
+ *
+ * Events are appended to a buffer owned by the thread recording
+ * them, so recording never takes a lock. A buffer is a list of
+ * fixed size chunks that only ever grows. The number of events in
+ * it is published with an atomic store once each event is written,
+ * so the events recorded so far can be read from any thread.
+ * Starting a new trace bumps a generation counter, and each buffer
+ * drops the events of the old trace the next time its thread
+ * records one. Setting PIPEVEC_TRACE to a filename traces the whole
+ * process and writes the trace there at exit. */
+
+#define PIPEVEC_TRACE_CHUNK_EVENTS 4096
+
+/* A thread stops recording after this many events in one trace */
+#define PIPEVEC_TRACE_MAX_EVENTS (256 * PIPEVEC_TRACE_CHUNK_EVENTS)
+
+typedef struct {
+  const char *category;
+  const char *name;
+  const char *arg_name;
+  gint64      arg;
+  guint64     start_ns;
+  guint64     end_ns;
+} PipevecTraceEvent;
+
+typedef struct _PipevecTraceChunk PipevecTraceChunk;
+
+struct _PipevecTraceChunk {
+  PipevecTraceEvent  events[PIPEVEC_TRACE_CHUNK_EVENTS];
+  PipevecTraceChunk *next;
+};
+
+typedef struct {
+  gint64             tid;
+  gint               generation;
+  gint               n_events;
+  PipevecTraceChunk *first;
+
+  /* Only used by the owning thread */
+  PipevecTraceChunk *current;
+} PipevecTraceBuffer;
+
+static gint trace_active = FALSE;
+static gint trace_generation = 0;
+static guint64 trace_start_ns = 0;
+
+/* Buffers outlive their threads so that their events can still be
+ * written out, so they are owned by this list rather than the thread */
+static GMutex buffers_lock;
+static GPtrArray *buffers = NULL;
+static GPrivate thread_buffer = G_PRIVATE_INIT (NULL);
+
+static char *exit_filename = NULL;
+
+static gint64
+current_thread_id (void)
+{
+#if defined (__linux__) && defined (SYS_gettid)
+  return (gint64) syscall (SYS_gettid);
+#else
+  static gint next_id = 0;
+
+  return g_atomic_int_add (&next_id, 1) + 1;
+#endif
+}
+
+static PipevecTraceBuffer *
+get_thread_buffer (void)
+{
+  PipevecTraceBuffer *buffer = g_private_get (&thread_buffer);
+
+  if (buffer == NULL)
+    {
+      buffer = g_new0 (PipevecTraceBuffer, 1);
+      buffer->tid = current_thread_id ();
+      buffer->generation = g_atomic_int_get (&trace_generation);
+      buffer->first = g_new0 (PipevecTraceChunk, 1);
+      buffer->current = buffer->first;
+
+      g_mutex_lock (&buffers_lock);
+      if (buffers == NULL)
+        buffers = g_ptr_array_new ();
+      g_ptr_array_add (buffers, buffer);
+      g_mutex_unlock (&buffers_lock);
+
+      g_private_set (&thread_buffer, buffer);
+    }
+
+  return buffer;
+}
+
+static void
+start_trace (void)
+{
+  trace_start_ns = pipevec_trace_now ();
+  g_atomic_int_inc (&trace_generation);
+  g_atomic_int_set (&trace_active, TRUE);
+}
+
+static void
+write_trace_at_exit (void)
+{
+  g_autoptr(GError) error = NULL;
+
+  pipevec_trace_stop ();
+
+  if (!pipevec_trace_write_json (exit_filename, &error))
+    g_warning ("Could not write the trace to %s: %s", exit_filename, error->message);
+}
+
+static void
+ensure_initialized (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      const char *filename = g_getenv ("PIPEVEC_TRACE");
+
+      if (filename != NULL && *filename != '\0')
+        {
+          exit_filename = g_strdup (filename);
+          start_trace ();
+          atexit (write_trace_at_exit);
+        }
+
+      g_once_init_leave (&initialized, 1);
+    }
+}
+
+/**
+ * pipevec_trace_now:
+ *
+ * Get the time that trace events are recorded in.
+ *
+ * Returns: Nanoseconds on the monotonic clock.
+ */
+guint64
+pipevec_trace_now (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (guint64) now.tv_sec * G_GUINT64_CONSTANT (1000000000) + (guint64) now.tv_nsec;
+}
+
+/**
+ * pipevec_trace_record:
+ * @category: Category of the event, a static string.
+ * @name: Name of the event, a static string.
+ * @start_ns: When the event began, from pipevec_trace_now().
+ * @end_ns: When the event ended, from pipevec_trace_now().
+ * @arg_name: (nullable): Name of @arg, a static string, or %NULL
+ *            if the event has no argument.
+ * @arg: A value to attach to the event.
+ *
+ * Record an event on the calling thread. Callers should check
+ * pipevec_trace_get_active() when the event begins and only record
+ * it if tracing was active then.
+ */
+void
+pipevec_trace_record (const char *category,
+                      const char *name,
+                      guint64     start_ns,
+                      guint64     end_ns,
+                      const char *arg_name,
+                      gint64      arg)
+{
+  PipevecTraceBuffer *buffer = get_thread_buffer ();
+  gint generation = g_atomic_int_get (&trace_generation);
+
+  if (buffer->generation != generation)
+    {
+      g_atomic_int_set (&buffer->n_events, 0);
+      g_atomic_int_set (&buffer->generation, generation);
+      buffer->current = buffer->first;
+    }
+
+  gint n_events = buffer->n_events;
+
+  if (n_events >= PIPEVEC_TRACE_MAX_EVENTS)
+    return;
+
+  if (n_events > 0 && n_events % PIPEVEC_TRACE_CHUNK_EVENTS == 0)
+    {
+      if (buffer->current->next == NULL)
+        buffer->current->next = g_new0 (PipevecTraceChunk, 1);
+
+      buffer->current = buffer->current->next;
+    }
+
+  PipevecTraceEvent *event = &buffer->current->events[n_events % PIPEVEC_TRACE_CHUNK_EVENTS];
+
+  event->category = category;
+  event->name = name;
+  event->arg_name = arg_name;
+  event->arg = arg;
+  event->start_ns = start_ns;
+  event->end_ns = end_ns;
+
+  g_atomic_int_set (&buffer->n_events, n_events + 1);
+}
+
+/**
+ * pipevec_trace_start:
+ *
+ * Start recording a new trace, dropping the events of any earlier one.
+ */
+void
+pipevec_trace_start (void)
+{
+  ensure_initialized ();
+  start_trace ();
+}
+
+/**
+ * pipevec_trace_stop:
+ *
+ * Stop recording. The events recorded so far are kept until the
+ * next call to pipevec_trace_start().
+ */
+void
+pipevec_trace_stop (void)
+{
+  g_atomic_int_set (&trace_active, FALSE);
+}
+
+/**
+ * pipevec_trace_get_active:
+ *
+ * Check whether a trace is being recorded.
+ *
+ * Returns: %TRUE between pipevec_trace_start() and pipevec_trace_stop().
+ */
+gboolean
+pipevec_trace_get_active (void)
+{
+  ensure_initialized ();
+
+  return g_atomic_int_get (&trace_active);
+}
+
+static void
+append_event (GString                 *json,
+              gint64                   pid,
+              gint64                   tid,
+              const PipevecTraceEvent *event)
+{
+  guint64 start_ns = MAX (event->start_ns, trace_start_ns);
+  guint64 end_ns = MAX (event->end_ns, start_ns);
+
+  g_string_append_printf (json,
+                          ",\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\","
+                          "\"pid\":%" G_GINT64_FORMAT ",\"tid\":%" G_GINT64_FORMAT ","
+                          "\"ts\":%.3f,\"dur\":%.3f",
+                          event->category,
+                          event->name,
+                          pid,
+                          tid,
+                          (start_ns - trace_start_ns) / 1e3,
+                          (end_ns - start_ns) / 1e3);
+
+  if (event->arg_name != NULL)
+    g_string_append_printf (json,
+                            ",\"args\":{\"%s\":%" G_GINT64_FORMAT "}",
+                            event->arg_name,
+                            event->arg);
+
+  g_string_append_c (json, '}');
+}
+
+/**
+ * pipevec_trace_write_json:
+ * @filename: The file to write to.
+ * @error: A #GError out pointer.
+ *
+ * Write the events of the current or last trace to @filename in the
+ * Chrome trace event format, which can be opened in the Perfetto UI
+ * or chrome://tracing. Each event is a complete ("X") event on the
+ * thread that recorded it. Events still being recorded by other
+ * threads may be left out, so stop the trace first for a complete
+ * timeline.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set on failure.
+ */
+gboolean
+pipevec_trace_write_json (const char  *filename,
+                          GError     **error)
+{
+  g_autoptr(GString) json = g_string_new ("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  gint generation = g_atomic_int_get (&trace_generation);
+  gint64 pid = (gint64) getpid ();
+
+  g_string_append_printf (json,
+                          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%" G_GINT64_FORMAT ","
+                          "\"args\":{\"name\":\"pipevec\"}}",
+                          pid);
+
+  g_mutex_lock (&buffers_lock);
+
+  for (guint i = 0; buffers != NULL && i < buffers->len; ++i)
+    {
+      PipevecTraceBuffer *buffer = g_ptr_array_index (buffers, i);
+      gint n_events = g_atomic_int_get (&buffer->n_events);
+      PipevecTraceChunk *chunk = buffer->first;
+
+      if (g_atomic_int_get (&buffer->generation) != generation)
+        continue;
+
+      for (gint j = 0; j < n_events; ++j)
+        {
+          if (j > 0 && j % PIPEVEC_TRACE_CHUNK_EVENTS == 0)
+            chunk = chunk->next;
+
+          append_event (json, pid, buffer->tid, &chunk->events[j % PIPEVEC_TRACE_CHUNK_EVENTS]);
+        }
+    }
+
+  g_mutex_unlock (&buffers_lock);
+
+  g_string_append (json, "\n]}\n");
+
+  return g_file_set_contents (filename, json->str, json->len, error);
+}
@@ -0,0 +1,38 @@
+/*
+ * /pipevec/pipevec-trace.h
+ *
+ * Timeline tracing of operations and worker threads.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void pipevec_trace_start (void);
+
+void pipevec_trace_stop (void);
+
+gboolean pipevec_trace_get_active (void);
+
+gboolean pipevec_trace_write_json (const char  *filename,
+                                   GError     **error);
+
+G_END_DECLS
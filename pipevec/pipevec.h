@@ -24,4 +24,14 @@
 
 #include <glib.h>
 
+#include <pipevec/pipevec-allocator.h>
+#include <pipevec/pipevec-autotune.h>
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-memory.h>
+#include <pipevec/pipevec-packed-tensor.h>
+#include <pipevec/pipevec-profile.h>
 #include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-einsum.h>
+#include <pipevec/pipevec-tensor-layout.h>
+#include <pipevec/pipevec-tensor-linalg.h>
+#include <pipevec/pipevec-trace.h>
@@ -0,0 +1,295 @@
+/*
+ * /tests/pipevec/pipevec-allocator-test.cpp
+ *
+ * Tests for custom tensor storage allocators.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <cstdlib>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-allocator.h>
+#include <pipevec/pipevec-allocator-private.h>
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-gemm-private.h>
+#include <pipevec/pipevec-tensor.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::Eq;
+using ::testing::FloatNear;
+using ::testing::Ge;
+using ::testing::IsNull;
+using ::testing::Le;
+using ::testing::NotNull;
+using ::testing::Pointwise;
+
+using pipevec::test::make_tensor;
+using pipevec::test::matmul;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
+
+namespace {
+  struct CountingAllocator {
+    size_t n_allocs = 0;
+    size_t n_frees = 0;
+    size_t live_bytes = 0;
+    size_t last_alignment = 0;
+    bool destroyed = false;
+  };
+
+  gpointer
+  counting_alloc (gsize    size,
+                  gsize    alignment,
+                  gpointer user_data)
+  {
+    CountingAllocator *counts = static_cast <CountingAllocator *> (user_data);
+    gpointer memory = NULL;
+
+    if (posix_memalign (&memory, alignment, size) != 0)
+      return NULL;
+
+    counts->n_allocs++;
+    counts->live_bytes += size;
+    counts->last_alignment = alignment;
+
+    return memory;
+  }
+
+  void
+  counting_free (gpointer memory,
+                 gsize    size,
+                 gpointer user_data)
+  {
+    CountingAllocator *counts = static_cast <CountingAllocator *> (user_data);
+
+    counts->n_frees++;
+    counts->live_bytes -= size;
+    free (memory);
+  }
+
+  void
+  mark_destroyed (gpointer user_data)
+  {
+    static_cast <CountingAllocator *> (user_data)->destroyed = true;
+  }
+
+  gpointer
+  failing_alloc (gsize    size,
+                 gsize    alignment,
+                 gpointer user_data)
+  {
+    return NULL;
+  }
+
+  /* Fails the allocation with index fail_at, counting from zero */
+  struct FailingAllocator {
+    size_t n_allocs = 0;
+    size_t fail_at = 0;
+  };
+
+  gpointer
+  fail_nth_alloc (gsize    size,
+                  gsize    alignment,
+                  gpointer user_data)
+  {
+    FailingAllocator *state = static_cast <FailingAllocator *> (user_data);
+    gpointer memory = NULL;
+
+    if (state->n_allocs++ == state->fail_at ||
+        posix_memalign (&memory, alignment, size) != 0)
+      return NULL;
+
+    return memory;
+  }
+
+  void
+  plain_free (gpointer memory,
+              gsize    size G_GNUC_UNUSED,
+              gpointer user_data G_GNUC_UNUSED)
+  {
+    free (memory);
+  }
+
+  PipevecAllocatorFuncs const counting_funcs = { counting_alloc, counting_free };
+
+  class PipevecAllocator : public ::testing::Test
+  {
+    protected:
+      void TearDown () override
+      {
+        pipevec_allocator_set (NULL, NULL, NULL);
+        pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_AUTO, 0);
+      }
+  };
+
+  TEST_F (PipevecAllocator, TensorStorageGoesThroughTheAllocator)
+  {
+    CountingAllocator counts;
+
+    pipevec_allocator_set (&counting_funcs, &counts, NULL);
+
+    {
+      g_autoptr(PipevecTensor) tensor = make_tensor ({ 3, 5 }, sequence (15));
+
+      EXPECT_THAT (counts.n_allocs, Eq (1u));
+      EXPECT_THAT (counts.last_alignment, Eq (8 * sizeof (float)));
+
+      /* Rows are padded to 8 elements */
+      EXPECT_THAT (counts.live_bytes, Eq (3 * 8 * sizeof (float)));
+    }
+
+    EXPECT_THAT (counts.n_frees, Eq (1u));
+    EXPECT_THAT (counts.live_bytes, Eq (0u));
+  }
+
+  TEST_F (PipevecAllocator, StorageIsFreedByTheAllocatorThatMadeIt)
+  {
+    CountingAllocator counts;
+
+    pipevec_allocator_set (&counting_funcs, &counts, mark_destroyed);
+
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 4 }, sequence (4));
+
+    pipevec_allocator_set (NULL, NULL, NULL);
+
+    /* Still holding storage from the counting allocator */
+    EXPECT_FALSE (counts.destroyed);
+
+    g_clear_object (&tensor);
+
+    EXPECT_THAT (counts.n_frees, Eq (1u));
+    EXPECT_TRUE (counts.destroyed);
+  }
+
+  TEST_F (PipevecAllocator, FailedAllocationsReportOutOfMemory)
+  {
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 4 }, sequence (4));
+    g_autoptr(GError) error = NULL;
+    PipevecAllocatorFuncs const failing_funcs = { failing_alloc, counting_free };
+
+    pipevec_allocator_set (&failing_funcs, NULL, NULL);
+
+    g_autoptr(PipevecTensor) copy = pipevec_tensor_copy (tensor, &error);
+
+    EXPECT_THAT (copy, IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_OUT_OF_MEMORY));
+  }
+
+  TEST_F (PipevecAllocator, FailedPackingBuffersReportOutOfMemory)
+  {
+    const size_t m = 40, k = 50, n = 30;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    std::vector <float> expected = matmul (a, b, m, k, n);
+    PipevecAllocatorFuncs const failing_funcs = { fail_nth_alloc, plain_free };
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+
+    pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_BLOCKED, 0);
+
+    /* Fail each allocation the product makes in turn, the storage of
+     * the result and then the packing buffers, until it has made all
+     * of them. Each failure has to be reported. */
+    for (size_t fail_at = 0; ; ++fail_at)
+      {
+        FailingAllocator state;
+        g_autoptr(GError) error = NULL;
+
+        state.fail_at = fail_at;
+        pipevec_allocator_set (&failing_funcs, &state, NULL);
+
+        g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+        pipevec_allocator_set (NULL, NULL, NULL);
+
+        if (product != NULL)
+          {
+            ASSERT_THAT (error, IsNull ());
+            EXPECT_THAT (fail_at, Eq (3u)) << "result and both packing buffers allocated";
+            EXPECT_THAT (tensor_contents (product), Pointwise (FloatNear (1e-4f), expected));
+            break;
+          }
+
+        EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_OUT_OF_MEMORY))
+          << "failing allocation " << fail_at;
+      }
+  }
+
+  TEST_F (PipevecAllocator, ProductsThatCannotFailFallBackWithoutPacking)
+  {
+    const size_t m = 40, k = 50, n = 30;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    std::vector <float> c (m * n);
+    PipevecAllocatorFuncs const failing_funcs = { failing_alloc, counting_free };
+
+    pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_BLOCKED, 0);
+    pipevec_allocator_set (&failing_funcs, NULL, NULL);
+
+    pipevec_gemm (m, n, k, 1.0f, a.data (), k, 1, b.data (), n, 1, 0.0f, c.data (), n);
+
+    EXPECT_THAT (c, Pointwise (FloatNear (1e-4f), matmul (a, b, m, k, n)));
+  }
+
+  TEST_F (PipevecAllocator, ResultsOfTheSameSizeReuseStorage)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 16, 20 }, sequence (320));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 16, 20 }, sequence (320, 3));
+    guint64 n_reused_before, n_allocated_before, n_reused, n_allocated;
+
+    pipevec_allocator_get_cache_counts (&n_reused_before, &n_allocated_before);
+
+    for (size_t i = 0; i < 100; ++i)
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) sum = pipevec_tensor_add_tensor (lhs, rhs, &error);
+
+        ASSERT_THAT (sum, NotNull ());
+      }
+
+    pipevec_allocator_get_cache_counts (&n_reused, &n_allocated);
+
+    /* Only the first result needs new storage */
+    EXPECT_THAT (n_allocated - n_allocated_before, Le (1u));
+    EXPECT_THAT (n_reused - n_reused_before, Ge (99u));
+  }
+
+  TEST_F (PipevecAllocator, InstalledAllocatorSeesEveryAllocation)
+  {
+    CountingAllocator counts;
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 16, 20 }, sequence (320));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 16, 20 }, sequence (320, 3));
+
+    pipevec_allocator_set (&counting_funcs, &counts, NULL);
+
+    for (size_t i = 0; i < 10; ++i)
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) sum = pipevec_tensor_add_tensor (lhs, rhs, &error);
+
+        ASSERT_THAT (sum, NotNull ());
+      }
+
+    EXPECT_THAT (counts.n_allocs, Eq (10u));
+    EXPECT_THAT (counts.n_frees, Eq (10u));
+  }
+}
@@ -0,0 +1,85 @@
+/*
+ * /tests/pipevec/pipevec-autotune-test.cpp
+ *
+ * Tests for tuning of the matrix product engine.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-autotune.h>
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-tensor.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::FloatNear;
+using ::testing::Gt;
+using ::testing::Pointwise;
+
+using pipevec::test::make_tensor;
+using pipevec::test::matmul;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
+
+namespace {
+  TEST (PipevecAutotune, DefaultBlockingIsUsable)
+  {
+    size_t mc, kc, nc;
+
+    pipevec_autotune_get_gemm_blocking (&mc, &kc, &nc);
+
+    EXPECT_THAT (mc, Gt (0u));
+    EXPECT_THAT (kc, Gt (0u));
+    EXPECT_THAT (nc, Gt (0u));
+  }
+
+  TEST (PipevecAutotune, TuningIsSavedAndProductsStayCorrect)
+  {
+    const size_t m = 70, k = 600, n = 90;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    g_autofree char *path = g_build_filename (g_get_user_cache_dir (), "pipevec", "gemm-blocking.ini", NULL);
+    g_autoptr(GError) error = NULL;
+
+    ASSERT_TRUE (pipevec_autotune_gemm (&error));
+    EXPECT_TRUE (g_file_test (path, G_FILE_TEST_EXISTS));
+
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-3f), matmul (a, b, m, k, n)));
+  }
+
+  TEST (PipevecAutotune, DispatchCalibrationIsSavedAndKeepsSmallLoopsSerial)
+  {
+    g_autofree char *path = g_build_filename (g_get_user_cache_dir (), "pipevec", "dispatch-costs.ini", NULL);
+    g_autoptr(GError) error = NULL;
+    PipevecDispatchPlan plan;
+
+    ASSERT_TRUE (pipevec_autotune_dispatch (&error));
+    EXPECT_TRUE (g_file_test (path, G_FILE_TEST_EXISTS));
+
+    pipevec_dispatch_plan_loop (16, 16.0, 64.0, &plan);
+    EXPECT_THAT (plan.n_threads, testing::Eq (1u));
+  }
+}
@@ -0,0 +1,210 @@
+/*
+ * /tests/pipevec/pipevec-dispatch-test.cpp
+ *
+ * Tests for the dispatcher cost model.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-autotune-private.h>
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-tensor.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::DoubleNear;
+using ::testing::Eq;
+using ::testing::FloatNear;
+using ::testing::Gt;
+using ::testing::HasSubstr;
+using ::testing::IsNull;
+using ::testing::Le;
+using ::testing::Pointwise;
+
+using pipevec::test::make_tensor;
+using pipevec::test::matmul;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
+
+namespace {
+  /* Plan against the costs of a known machine rather than whatever
+   * was calibrated into the cache, so that the expected plans do not
+   * depend on how fast the machine running the tests is */
+  class PipevecDispatch : public ::testing::Test
+  {
+    protected:
+      void SetUp () override
+      {
+        PipevecDispatchCosts costs;
+
+        pipevec_autotune_current_dispatch_costs (&calibrated_costs);
+
+        costs.flops_per_ns = 16.0;
+        costs.blocked_flops_per_ns = 32.0;
+        costs.blocked_setup_ns = 2000.0;
+        costs.cache_bytes_per_ns = 32.0;
+        costs.memory_bytes_per_ns = 8.0;
+        costs.memory_bytes_per_ns_all = 20.0;
+        costs.dispatch_ns = 5000.0;
+        costs.dispatch_thread_ns = 1000.0;
+        costs.cache_bytes = 8 << 20;
+
+        pipevec_autotune_set_dispatch_costs (&costs);
+      }
+
+      void TearDown () override
+      {
+        pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_AUTO, 0);
+        pipevec_autotune_set_dispatch_costs (&calibrated_costs);
+      }
+
+      PipevecDispatchCosts calibrated_costs;
+  };
+
+  TEST_F (PipevecDispatch, SmallOperationsStayOnTheCallingThread)
+  {
+    PipevecDispatchPlan plan;
+
+    pipevec_dispatch_plan_loop (64, 16.0, 64.0, &plan);
+    EXPECT_THAT (plan.n_threads, Eq (1u));
+    EXPECT_THAT (plan.dispatch_ns, Eq (0.0));
+
+    /* A vector times a small matrix, as in per-frame UI transforms,
+     * takes about half a microsecond, a tenth of waking a worker */
+    pipevec_dispatch_plan_gemm (1, 64, 64, &plan);
+    EXPECT_THAT (plan.variant, Eq (PIPEVEC_DISPATCH_VARIANT_STREAMING));
+    EXPECT_THAT (plan.n_threads, Eq (1u));
+    EXPECT_THAT (plan.estimated_ns, DoubleNear (512.0, 1.0));
+
+    pipevec_dispatch_plan_gemm (4, 4, 4, &plan);
+    EXPECT_THAT (plan.variant, Eq (PIPEVEC_DISPATCH_VARIANT_DIRECT));
+    EXPECT_THAT (plan.n_threads, Eq (1u));
+  }
+
+  TEST_F (PipevecDispatch, ThreadsAreOnlyUsedWhenTheyPayOff)
+  {
+    PipevecDispatchPlan plan;
+
+    /* Streaming 256 MiB from memory takes milliseconds, so any
+     * second thread pays for itself many times over */
+    pipevec_dispatch_plan_gemm (1 << 13, 1, 1 << 13, &plan);
+
+    EXPECT_THAT (plan.variant, Eq (PIPEVEC_DISPATCH_VARIANT_STREAMING));
+    EXPECT_THAT (plan.n_threads, Le (plan.max_threads));
+    EXPECT_THAT (plan.estimated_ns, Le (plan.serial_ns));
+    EXPECT_FALSE (plan.overridden);
+
+    if (plan.max_threads > 1)
+      {
+        EXPECT_THAT (plan.n_threads, Gt (1u));
+      }
+
+    /* Milliseconds of arithmetic, split by rows of C */
+    pipevec_dispatch_plan_gemm (512, 512, 512, &plan);
+    EXPECT_THAT (plan.variant, Eq (PIPEVEC_DISPATCH_VARIANT_BLOCKED));
+    EXPECT_THAT (plan.estimated_ns, Le (plan.serial_ns));
+
+    if (plan.max_threads > 1)
+      {
+        EXPECT_THAT (plan.n_threads, Gt (1u));
+        EXPECT_THAT (plan.dispatch_ns, Gt (0.0));
+      }
+  }
+
+  TEST_F (PipevecDispatch, OverrideForcesVariantAndThreads)
+  {
+    PipevecDispatchPlan plan;
+    g_autofree char *explanation = NULL;
+
+    pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_AUTO, 2);
+    pipevec_dispatch_plan_loop (64, 16.0, 64.0, &plan);
+
+    EXPECT_THAT (plan.n_threads, Eq (MIN (plan.max_threads, 2u)));
+    EXPECT_TRUE (plan.overridden);
+
+    pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_BLOCKED, 0);
+    pipevec_dispatch_plan_gemm (4, 4, 4, &plan);
+    explanation = pipevec_dispatch_explain (&plan);
+
+    EXPECT_THAT (plan.variant, Eq (PIPEVEC_DISPATCH_VARIANT_BLOCKED));
+    EXPECT_THAT (explanation, HasSubstr ("blocked"));
+    EXPECT_THAT (explanation, HasSubstr ("overridden"));
+  }
+
+  TEST_F (PipevecDispatch, EveryVariantComputesTheSameProduct)
+  {
+    const size_t m = 37, k = 45, n = 29;
+    std::vector <float> a = sequence (m * k, 5);
+    std::vector <float> b = sequence (k * n, 11);
+    const PipevecDispatchVariant variants[] = {
+      PIPEVEC_DISPATCH_VARIANT_DIRECT,
+      PIPEVEC_DISPATCH_VARIANT_BLOCKED
+    };
+
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+
+    for (PipevecDispatchVariant variant : variants)
+      {
+        g_autoptr(GError) error = NULL;
+
+        pipevec_dispatch_set_override (variant, 0);
+
+        g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+        ASSERT_THAT (error, IsNull ());
+        EXPECT_THAT (tensor_contents (product),
+                     Pointwise (FloatNear (1e-3f), matmul (a, b, m, k, n)));
+      }
+  }
+
+  TEST_F (PipevecDispatch, ThreadedBlockedProductMatchesTheSerialOne)
+  {
+    /* Rows that do not split evenly between the threads, and a shared
+     * lhs whose packed blocks are reused across the batch */
+    const size_t m = 37, k = 45, n = 29, batch = 3;
+    std::vector <float> a = sequence (m * k, 5);
+    std::vector <float> b = sequence (batch * k * n, 11);
+    std::vector <float> expected;
+    PipevecDispatchPlan plan;
+
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 1, m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ batch, k, n }, b);
+    g_autoptr(GError) error = NULL;
+
+    for (size_t i = 0; i < batch; ++i)
+      {
+        std::vector <float> b_i (b.begin () + i * k * n, b.begin () + (i + 1) * k * n);
+        std::vector <float> item = matmul (a, b_i, m, k, n);
+
+        expected.insert (expected.end (), item.begin (), item.end ());
+      }
+
+    pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_BLOCKED, 3);
+    pipevec_dispatch_plan_gemm (m, n, k, &plan);
+
+    EXPECT_THAT (plan.n_threads, Eq (MIN (plan.max_threads, 3u)));
+
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, IsNull ());
+    EXPECT_THAT (tensor_contents (product), Pointwise (FloatNear (1e-3f), expected));
+  }
+}
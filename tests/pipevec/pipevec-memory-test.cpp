@@ -0,0 +1,141 @@
+/*
+ * /tests/pipevec/pipevec-memory-test.cpp
+ *
+ * Tests for tensor memory accounting.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-memory.h>
+#include <pipevec/pipevec-tensor.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::Eq;
+using ::testing::Ge;
+using ::testing::HasSubstr;
+using ::testing::IsNull;
+using ::testing::NotNull;
+
+using pipevec::test::make_tensor;
+using pipevec::test::sequence;
+
+namespace {
+  class PipevecMemory : public ::testing::Test
+  {
+    protected:
+      void TearDown () override
+      {
+        pipevec_memory_set_limit (0);
+      }
+
+      static PipevecMemoryStats stats ()
+      {
+        g_autoptr(PipevecMemorySnapshot) snapshot = pipevec_memory_get_snapshot ();
+
+        return *pipevec_memory_snapshot_get_stats (snapshot);
+      }
+
+      /* Live tensors of an unusual shape, so that other tests do not
+       * show up in the count */
+      static guint64 live_with_shape (size_t rows, size_t columns, guint64 *bytes)
+      {
+        g_autoptr(PipevecMemorySnapshot) snapshot = pipevec_memory_get_snapshot ();
+
+        for (size_t i = 0; i < pipevec_memory_snapshot_get_n_shapes (snapshot); ++i)
+          {
+            guint64 n_tensors;
+            GArray *shape = pipevec_memory_snapshot_get_shape (snapshot, i, &n_tensors, bytes);
+
+            if (shape->len == 2 &&
+                g_array_index (shape, size_t, 0) == rows &&
+                g_array_index (shape, size_t, 1) == columns)
+              return n_tensors;
+          }
+
+        *bytes = 0;
+        return 0;
+      }
+  };
+
+  TEST_F (PipevecMemory, CountsLiveTensorsByShape)
+  {
+    guint64 bytes;
+
+    {
+      g_autoptr(PipevecTensor) first = make_tensor ({ 3, 13 }, sequence (39));
+      g_autoptr(PipevecTensor) second = pipevec_tensor_copy (first, NULL);
+
+      ASSERT_THAT (second, NotNull ());
+      EXPECT_THAT (live_with_shape (3, 13, &bytes), Eq (2u));
+
+      /* Rows are padded to 16 elements */
+      EXPECT_THAT (bytes, Eq (2 * 3 * 16 * sizeof (float)));
+    }
+
+    EXPECT_THAT (live_with_shape (3, 13, &bytes), Eq (0u));
+  }
+
+  TEST_F (PipevecMemory, TracksPeakBytes)
+  {
+    pipevec_memory_reset_peak ();
+    PipevecMemoryStats before = stats ();
+
+    {
+      g_autoptr(PipevecTensor) tensor = make_tensor ({ 64, 64 }, sequence (64 * 64));
+    }
+
+    PipevecMemoryStats after = stats ();
+
+    EXPECT_THAT (after.live_bytes, Eq (before.live_bytes));
+    EXPECT_THAT (after.peak_bytes, Ge (before.live_bytes + 64 * 64 * sizeof (float)));
+  }
+
+  TEST_F (PipevecMemory, AllocationsOverTheLimitFail)
+  {
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 16, 16 }, sequence (256));
+    g_autoptr(GError) error = NULL;
+
+    pipevec_memory_set_limit (stats ().live_bytes + 16);
+
+    g_autoptr(PipevecTensor) copy = pipevec_tensor_copy (tensor, &error);
+
+    EXPECT_THAT (copy, IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_OUT_OF_MEMORY));
+
+    pipevec_memory_set_limit (0);
+    g_clear_error (&error);
+
+    g_autoptr(PipevecTensor) retry = pipevec_tensor_copy (tensor, &error);
+
+    EXPECT_THAT (retry, NotNull ());
+    EXPECT_THAT (error, IsNull ());
+  }
+
+  TEST_F (PipevecMemory, SummaryListsShapes)
+  {
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 5, 17 }, sequence (85));
+    g_autoptr(PipevecMemorySnapshot) snapshot = pipevec_memory_get_snapshot ();
+    g_autofree char *summary = pipevec_memory_snapshot_to_string (snapshot);
+
+    EXPECT_THAT (summary, HasSubstr ("[5, 17]"));
+  }
+}
@@ -0,0 +1,212 @@
+/*
+ * /tests/pipevec/pipevec-packed-tensor-test.cpp
+ *
+ * Tests for pre-packed weight tensors.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-packed-tensor.h>
+#include <pipevec/pipevec-tensor.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::FloatNear;
+using ::testing::Pointwise;
+
+using pipevec::test::make_tensor;
+using pipevec::test::matmul;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
+
+namespace {
+  std::string
+  temporary_path (const char *name)
+  {
+    return testing::TempDir () + name;
+  }
+
+  TEST (PipevecPackedTensor, InnerProductMatchesUnpacked)
+  {
+    /* More rows of the weight than fit in one block of k, and
+     * a batch that is folded into a single taller product */
+    const size_t batch = 3, m = 70, k = 300, n = 90;
+    std::vector <float> a = sequence (batch * m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ batch, m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecPackedTensor) packed = pipevec_tensor_pack_for_matmul (rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_packed (lhs, packed, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-3f), matmul (a, b, batch * m, k, n)));
+  }
+
+  TEST (PipevecPackedTensor, InnerProductOfVectorAndPackedMatrix)
+  {
+    const size_t k = 40, n = 37;
+    std::vector <float> x = sequence (k, 3);
+    std::vector <float> b = sequence (k * n, 7);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ k }, x);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(PipevecPackedTensor) packed = pipevec_tensor_pack_for_matmul (rhs, NULL);
+    g_autoptr(PipevecTensor) bias = make_tensor ({ n }, sequence (n, 5));
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_packed_fused (lhs, packed,
+                                                                                 1.0f,
+                                                                                 bias,
+                                                                                 PIPEVEC_ACTIVATION_RELU,
+                                                                                 NULL,
+                                                                                 0.0f,
+                                                                                 &error);
+    std::vector <float> expected = matmul (x, b, 1, k, n);
+    std::vector <float> bias_values = sequence (n, 5);
+
+    for (size_t j = 0; j < n; ++j)
+      expected[j] = std::max (expected[j] + bias_values[j], 0.0f);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product), Pointwise (FloatNear (1e-4f), expected));
+  }
+
+  TEST (PipevecPackedTensor, InnerProductRejectsMismatchedShape)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 4, 2 }, sequence (8));
+    g_autoptr(PipevecPackedTensor) packed = pipevec_tensor_pack_for_matmul (rhs, NULL);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_packed (lhs, packed, &error);
+
+    EXPECT_THAT (product, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_BAD_SHAPE));
+  }
+
+  TEST (PipevecPackedTensor, PackRejectsBatches)
+  {
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 2, 2, 2 }, sequence (8));
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecPackedTensor) packed = pipevec_tensor_pack_for_matmul (rhs, &error);
+
+    EXPECT_THAT (packed, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_BAD_SHAPE));
+  }
+
+  TEST (PipevecPackedTensor, SaveAndLoad)
+  {
+    const size_t m = 20, k = 60, n = 50;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    std::string path = temporary_path ("pipevec-packed-save-and-load");
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(PipevecPackedTensor) packed = pipevec_tensor_pack_for_matmul (rhs, NULL);
+    g_autoptr(GError) error = NULL;
+
+    ASSERT_TRUE (pipevec_packed_tensor_save (packed, path.c_str (), &error));
+
+    g_autoptr(PipevecPackedTensor) loaded = pipevec_packed_tensor_load (path.c_str (), &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_packed (lhs, loaded, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-4f), matmul (a, b, m, k, n)));
+  }
+
+  /* Mirrors the file header written by pipevec_packed_tensor_save() */
+  struct PackedHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint64_t rows;
+    uint64_t columns;
+    uint64_t nr;
+    uint64_t kc;
+    uint64_t nc;
+  };
+
+  TEST (PipevecPackedTensor, LoadRepacksForeignLayout)
+  {
+    /* A file packed for a hypothetical 4 column microkernel with
+     * tiny blocks, which no build of pipevec uses */
+    const size_t m = 3, k = 5, n = 10, nr = 4, kc = 3, nc = 8;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    std::vector <float> panels (k * 12, 0.0f);
+    PackedHeader header = { { 'P', 'V', 'P', 'A', 'C', 'K', 'E', 'D' }, 1, 0x01020304, k, n, nr, kc, nc };
+
+    for (size_t jc = 0; jc < n; jc += nc)
+      for (size_t pc = 0; pc < k; pc += kc)
+        {
+          size_t block_columns = std::min (nc, n - jc);
+          size_t block_rows = std::min (kc, k - pc);
+          size_t offset = jc * k + pc * ((block_columns + nr - 1) / nr * nr);
+
+          for (size_t jr = 0; jr < block_columns; jr += nr)
+            for (size_t p = 0; p < block_rows; ++p)
+              for (size_t j = 0; j < nr && jr + j < block_columns; ++j)
+                panels[offset + (jr / nr) * block_rows * nr + p * nr + j] = b[(pc + p) * n + jc + jr + j];
+        }
+
+    std::string contents (reinterpret_cast <const char *> (&header), sizeof (header));
+    std::string path = temporary_path ("pipevec-packed-foreign-layout");
+
+    contents.append (reinterpret_cast <const char *> (panels.data ()), sizeof (float) * panels.size ());
+    ASSERT_TRUE (g_file_set_contents (path.c_str (), contents.data (), contents.size (), NULL));
+
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecPackedTensor) loaded = pipevec_packed_tensor_load (path.c_str (), &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_packed (lhs, loaded, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-5f), matmul (a, b, m, k, n)));
+  }
+
+  TEST (PipevecPackedTensor, LoadRejectsMalformedFile)
+  {
+    std::string path = temporary_path ("pipevec-packed-malformed");
+    g_autoptr(GError) error = NULL;
+
+    ASSERT_TRUE (g_file_set_contents (path.c_str (), "not a packed tensor at all, just some text", -1, NULL));
+
+    g_autoptr(PipevecPackedTensor) loaded = pipevec_packed_tensor_load (path.c_str (), &error);
+
+    EXPECT_THAT (loaded, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_INVALID_DATA));
+  }
+}
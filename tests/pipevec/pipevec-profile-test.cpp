@@ -0,0 +1,151 @@
+/*
+ * /tests/pipevec/pipevec-profile-test.cpp
+ *
+ * Tests for the per-operation profiling counters.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-profile.h>
+#include <pipevec/pipevec-tensor.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::IsNull;
+using ::testing::Not;
+using ::testing::NotNull;
+
+using pipevec::test::make_tensor;
+using pipevec::test::sequence;
+
+namespace {
+  class PipevecProfile : public ::testing::Test
+  {
+    protected:
+      void SetUp () override
+      {
+        pipevec_profile_set_enabled (TRUE);
+        pipevec_profile_reset ();
+      }
+
+      void TearDown () override
+      {
+        pipevec_profile_set_enabled (FALSE);
+        pipevec_profile_reset ();
+      }
+  };
+
+  TEST_F (PipevecProfile, CountsTheOutermostOperationOnly)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 2, 3 }, sequence (6, 3));
+    g_autoptr(GError) error = NULL;
+
+    pipevec_profile_reset ();
+
+    g_autoptr(PipevecTensor) sum = pipevec_tensor_add_tensor (lhs, rhs, &error);
+    ASSERT_THAT (error, IsNull ());
+
+    g_autoptr(PipevecProfileSnapshot) snapshot = pipevec_profile_get_snapshot ();
+    const PipevecProfileCounters *add = pipevec_profile_snapshot_get_counters (snapshot,
+                                                                               PIPEVEC_PROFILE_OP_ADD_TENSOR);
+    const PipevecProfileCounters *copy = pipevec_profile_snapshot_get_counters (snapshot,
+                                                                                PIPEVEC_PROFILE_OP_COPY);
+
+    EXPECT_THAT (add->calls, Eq (1u));
+    EXPECT_THAT (add->bytes_read, Eq (2 * 6 * sizeof (float)));
+    EXPECT_THAT (add->bytes_written, Eq (6 * sizeof (float)));
+    EXPECT_THAT (add->flops, Eq (6u));
+    EXPECT_THAT (add->allocations, Eq (1u));
+
+    /* The copy made for the result is part of the addition */
+    EXPECT_THAT (copy->calls, Eq (0u));
+  }
+
+  TEST_F (PipevecProfile, CountsInnerProductFlops)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 4, 5 }, sequence (40));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 5, 3 }, sequence (15, 3));
+    g_autoptr(GError) error = NULL;
+
+    pipevec_profile_reset ();
+
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+    ASSERT_THAT (error, IsNull ());
+
+    g_autoptr(PipevecProfileSnapshot) snapshot = pipevec_profile_get_snapshot ();
+    const PipevecProfileCounters *counters = pipevec_profile_snapshot_get_counters (snapshot,
+                                                                                    PIPEVEC_PROFILE_OP_INNER_PRODUCT);
+
+    EXPECT_THAT (counters->calls, Eq (1u));
+    EXPECT_THAT (counters->flops, Eq (2u * 2 * 4 * 5 * 3));
+    EXPECT_THAT (counters->bytes_read, Eq ((40 + 15) * sizeof (float)));
+    EXPECT_THAT (counters->bytes_written, Eq (2 * 4 * 3 * sizeof (float)));
+  }
+
+  TEST_F (PipevecProfile, FailedCallsHaveNoTraffic)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 3, 2 }, sequence (6));
+    g_autoptr(GError) error = NULL;
+
+    pipevec_profile_reset ();
+
+    g_autoptr(PipevecTensor) sum = pipevec_tensor_add_tensor (lhs, rhs, &error);
+    ASSERT_THAT (sum, IsNull ());
+
+    g_autoptr(PipevecProfileSnapshot) snapshot = pipevec_profile_get_snapshot ();
+    const PipevecProfileCounters *add = pipevec_profile_snapshot_get_counters (snapshot,
+                                                                               PIPEVEC_PROFILE_OP_ADD_TENSOR);
+
+    EXPECT_THAT (add->calls, Eq (1u));
+    EXPECT_THAT (add->bytes_read, Eq (0u));
+    EXPECT_THAT (add->flops, Eq (0u));
+  }
+
+  TEST_F (PipevecProfile, NothingIsCountedWhileDisabled)
+  {
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 4 }, sequence (4));
+
+    pipevec_profile_set_enabled (FALSE);
+    pipevec_profile_reset ();
+
+    g_autoptr(PipevecTensor) copy = pipevec_tensor_copy (tensor, NULL);
+    ASSERT_THAT (copy, NotNull ());
+
+    g_autoptr(PipevecProfileSnapshot) snapshot = pipevec_profile_get_snapshot ();
+
+    EXPECT_THAT (pipevec_profile_snapshot_get_counters (snapshot, PIPEVEC_PROFILE_OP_COPY)->calls,
+                 Eq (0u));
+  }
+
+  TEST_F (PipevecProfile, SummaryListsCalledOperations)
+  {
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 4 }, sequence (4));
+    g_autoptr(PipevecTensor) scaled = pipevec_tensor_multiply_scalar (tensor, 2.0f, NULL);
+    g_autoptr(PipevecProfileSnapshot) snapshot = pipevec_profile_get_snapshot ();
+    g_autofree char *summary = pipevec_profile_snapshot_to_string (snapshot);
+
+    EXPECT_THAT (summary, HasSubstr ("multiply_scalar"));
+    EXPECT_THAT (summary, Not (HasSubstr ("divide_scalar")));
+  }
+}
@@ -0,0 +1,295 @@
+/*
+ * /tests/pipevec/pipevec-tensor-einsum-test.cpp
+ *
+ * Tests for Einstein summation over PipevecTensor
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-einsum.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::ElementsAre;
+using ::testing::FloatNear;
+using ::testing::Pointwise;
+
+using pipevec::test::make_tensor;
+using pipevec::test::matmul;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
+
+namespace {
+  std::vector <float>
+  transpose (std::vector <float> const &matrix,
+             size_t                     rows,
+             size_t                     columns)
+  {
+    std::vector <float> transposed (rows * columns);
+
+    for (size_t i = 0; i < rows; ++i)
+      for (size_t j = 0; j < columns; ++j)
+        transposed[j * rows + i] = matrix[i * columns + j];
+
+    return transposed;
+  }
+
+  TEST (PipevecTensorEinsum, BatchedMatrixProduct)
+  {
+    const size_t b = 3, m = 5, k = 20, n = 9;
+    std::vector <float> lhs = sequence (b * m * k, 3);
+    std::vector <float> rhs = sequence (b * k * n, 5);
+    std::vector <float> expected;
+    g_autoptr(PipevecTensor) a = make_tensor ({ b, m, k }, lhs);
+    g_autoptr(PipevecTensor) c = make_tensor ({ b, k, n }, rhs);
+    PipevecTensor *operands[] = { a, c };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) result = pipevec_tensor_einsum ("bij,bjk->bik", operands, 2, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    for (size_t i = 0; i < b; ++i)
+      {
+        std::vector <float> product = matmul (std::vector <float> (lhs.begin () + i * m * k, lhs.begin () + (i + 1) * m * k),
+                                              std::vector <float> (rhs.begin () + i * k * n, rhs.begin () + (i + 1) * k * n),
+                                              m, k, n);
+        expected.insert (expected.end (), product.begin (), product.end ());
+      }
+
+    EXPECT_THAT (tensor_contents (result), Pointwise (FloatNear (1e-4f), expected));
+  }
+
+  TEST (PipevecTensorEinsum, TransposedOperandsAndOutput)
+  {
+    const size_t m = 7, k = 12, n = 10;
+    std::vector <float> lhs = sequence (k * m, 3);
+    std::vector <float> rhs = sequence (n * k, 5);
+    g_autoptr(PipevecTensor) a = make_tensor ({ k, m }, lhs);
+    g_autoptr(PipevecTensor) c = make_tensor ({ n, k }, rhs);
+    PipevecTensor *operands[] = { a, c };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) result = pipevec_tensor_einsum ("ji,kj->ki", operands, 2, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    /* (A^T B^T)^T = B A */
+    EXPECT_THAT (tensor_contents (result),
+                 Pointwise (FloatNear (1e-4f), matmul (rhs, lhs, n, k, m)));
+  }
+
+  TEST (PipevecTensorEinsum, SharedWeightAcrossBatch)
+  {
+    const size_t b = 4, m = 3, k = 6, n = 5;
+    std::vector <float> lhs = sequence (b * m * k, 3);
+    std::vector <float> weight = sequence (k * n, 5);
+    g_autoptr(PipevecTensor) a = make_tensor ({ b, m, k }, lhs);
+    g_autoptr(PipevecTensor) w = make_tensor ({ k, n }, weight);
+    PipevecTensor *operands[] = { a, w };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) result = pipevec_tensor_einsum ("bik,kj->bij", operands, 2, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (result),
+                 Pointwise (FloatNear (1e-4f), matmul (lhs, weight, b * m, k, n)));
+  }
+
+  TEST (PipevecTensorEinsum, ChainOfThreeMatrices)
+  {
+    /* The cheapest order contracts the last two matrices first */
+    const size_t m = 30, k = 20, p = 25, n = 2;
+    std::vector <float> x = sequence (m * k, 3);
+    std::vector <float> y = sequence (k * p, 5);
+    std::vector <float> z = sequence (p * n, 7);
+    g_autoptr(PipevecTensor) a = make_tensor ({ m, k }, x);
+    g_autoptr(PipevecTensor) b = make_tensor ({ k, p }, y);
+    g_autoptr(PipevecTensor) c = make_tensor ({ p, n }, z);
+    PipevecTensor *operands[] = { a, b, c };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) result = pipevec_tensor_einsum ("ij,jk,kl->il", operands, 3, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (result),
+                 Pointwise (FloatNear (1e-3f), matmul (matmul (x, y, m, k, p), z, m, p, n)));
+  }
+
+  TEST (PipevecTensorEinsum, ContractsOverSeveralDimensions)
+  {
+    /* The padded rows of the operands mean that j and k cannot be
+     * treated as a single dimension without a copy */
+    const size_t i = 4, j = 3, k = 5, l = 6;
+    std::vector <float> lhs = sequence (i * j * k, 3);
+    std::vector <float> rhs = sequence (j * k * l, 5);
+    g_autoptr(PipevecTensor) a = make_tensor ({ i, j, k }, lhs);
+    g_autoptr(PipevecTensor) b = make_tensor ({ j, k, l }, rhs);
+    PipevecTensor *operands[] = { a, b };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) result = pipevec_tensor_einsum ("ijk,jkl->li", operands, 2, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (result),
+                 Pointwise (FloatNear (1e-4f), transpose (matmul (lhs, rhs, i, j * k, l), i, l)));
+  }
+
+  TEST (PipevecTensorEinsum, TransposedMatrixVectorProducts)
+  {
+    const size_t m = 37, k = 45;
+    std::vector <float> matrix = sequence (k * m, 3);
+    std::vector <float> x = sequence (k, 5);
+    std::vector <float> y = sequence (m, 7);
+    g_autoptr(PipevecTensor) a = make_tensor ({ k, m }, matrix);
+    g_autoptr(PipevecTensor) u = make_tensor ({ k }, x);
+    g_autoptr(PipevecTensor) v = make_tensor ({ m }, y);
+    g_autoptr(GError) error = NULL;
+
+    /* A^T x, where the rows of A^T are strided */
+    PipevecTensor *transposed_operands[] = { a, u };
+    g_autoptr(PipevecTensor) transposed = pipevec_tensor_einsum ("ji,j->i", transposed_operands, 2, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (transposed),
+                 Pointwise (FloatNear (1e-4f), matmul (x, matrix, 1, k, m)));
+
+    /* A y, where each row of A is contiguous */
+    PipevecTensor *direct_operands[] = { a, v };
+    g_autoptr(PipevecTensor) direct = pipevec_tensor_einsum ("ji,i->j", direct_operands, 2, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (direct),
+                 Pointwise (FloatNear (1e-4f), matmul (matrix, y, k, m, 1)));
+  }
+
+  TEST (PipevecTensorEinsum, SingleOperandPermutesAndReduces)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 3, 3 }, {
+      1.0f, 2.0f, 3.0f,
+      4.0f, 5.0f, 6.0f,
+      7.0f, 8.0f, 9.0f
+    });
+    PipevecTensor *operands[] = { a };
+    g_autoptr(GError) error = NULL;
+
+    g_autoptr(PipevecTensor) transposed = pipevec_tensor_einsum ("ij->ji", operands, 1, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (transposed),
+                 ElementsAre (1.0f, 4.0f, 7.0f, 2.0f, 5.0f, 8.0f, 3.0f, 6.0f, 9.0f));
+
+    g_autoptr(PipevecTensor) diagonal = pipevec_tensor_einsum ("ii->i", operands, 1, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (diagonal), ElementsAre (1.0f, 5.0f, 9.0f));
+
+    g_autoptr(PipevecTensor) trace = pipevec_tensor_einsum ("ii", operands, 1, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (trace), ElementsAre (15.0f));
+
+    g_autoptr(PipevecTensor) column_sums = pipevec_tensor_einsum ("ij->j", operands, 1, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (column_sums), ElementsAre (12.0f, 15.0f, 18.0f));
+  }
+
+  TEST (PipevecTensorEinsum, ImplicitOutputAndOuterProduct)
+  {
+    std::vector <float> lhs = sequence (6 * 4, 3);
+    std::vector <float> rhs = sequence (4 * 3, 5);
+    g_autoptr(PipevecTensor) a = make_tensor ({ 6, 4 }, lhs);
+    g_autoptr(PipevecTensor) b = make_tensor ({ 4, 3 }, rhs);
+    g_autoptr(PipevecTensor) u = make_tensor ({ 2 }, { 1.0f, 2.0f });
+    g_autoptr(PipevecTensor) v = make_tensor ({ 3 }, { 3.0f, 4.0f, 5.0f });
+    g_autoptr(GError) error = NULL;
+
+    PipevecTensor *matrices[] = { b, a };
+    g_autoptr(PipevecTensor) product = pipevec_tensor_einsum ("jk,ij", matrices, 2, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-5f), matmul (lhs, rhs, 6, 4, 3)));
+
+    PipevecTensor *vectors[] = { u, v };
+    g_autoptr(PipevecTensor) outer = pipevec_tensor_einsum ("i,j->ji", vectors, 2, &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (outer),
+                 ElementsAre (3.0f, 6.0f, 4.0f, 8.0f, 5.0f, 10.0f));
+    EXPECT_THAT (transpose (tensor_contents (outer), 3, 2),
+                 ElementsAre (3.0f, 4.0f, 5.0f, 6.0f, 8.0f, 10.0f));
+  }
+
+  TEST (PipevecTensorEinsum, RejectsMismatchedSizes)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(PipevecTensor) b = make_tensor ({ 4, 2 }, sequence (8));
+    PipevecTensor *operands[] = { a, b };
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) result = pipevec_tensor_einsum ("ij,jk->ik", operands, 2, &error);
+
+    EXPECT_THAT (result, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_DIMENSION_MISMATCH));
+  }
+
+  TEST (PipevecTensorEinsum, RejectsMalformedSubscripts)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 2 }, sequence (4));
+    PipevecTensor *operands[] = { a, a };
+
+    for (const char *subscripts : { "ij,jk->iq", "ij->ii", "ij", "i1,jk" })
+      {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) result = pipevec_tensor_einsum (subscripts, operands, 2, &error);
+
+        EXPECT_THAT (result, testing::IsNull ()) << subscripts;
+        EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_INVALID_ARGUMENT)) << subscripts;
+      }
+  }
+
+  TEST (PipevecTensorEinsum, TensordotOverPairedAxes)
+  {
+    /* Contract axes 0 and 2 of a (3, 4, 5) tensor with axes 1
+     * and 0 of a (5, 3, 2) tensor, giving a (4, 2) tensor */
+    std::vector <float> lhs = sequence (3 * 4 * 5, 3);
+    std::vector <float> rhs = sequence (5 * 3 * 2, 5);
+    std::vector <float> expected (4 * 2, 0.0f);
+    g_autoptr(PipevecTensor) a = make_tensor ({ 3, 4, 5 }, lhs);
+    g_autoptr(PipevecTensor) b = make_tensor ({ 5, 3, 2 }, rhs);
+    g_autoptr(GArray) lhs_axes = g_array_new (FALSE, FALSE, sizeof (size_t));
+    g_autoptr(GArray) rhs_axes = g_array_new (FALSE, FALSE, sizeof (size_t));
+    size_t lhs_axes_data[] = { 0, 2 };
+    size_t rhs_axes_data[] = { 1, 0 };
+    g_autoptr(GError) error = NULL;
+
+    g_array_append_vals (lhs_axes, lhs_axes_data, 2);
+    g_array_append_vals (rhs_axes, rhs_axes_data, 2);
+
+    for (size_t i = 0; i < 3; ++i)
+      for (size_t j = 0; j < 4; ++j)
+        for (size_t k = 0; k < 5; ++k)
+          for (size_t l = 0; l < 2; ++l)
+            expected[j * 2 + l] += lhs[(i * 4 + j) * 5 + k] * rhs[(k * 3 + i) * 2 + l];
+
+    g_autoptr(PipevecTensor) result = pipevec_tensor_tensordot (a, b, lhs_axes, rhs_axes, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (result), Pointwise (FloatNear (1e-5f), expected));
+
+    /* Pairing axes of different sizes is an error */
+    g_autoptr(GError) mismatch_error = NULL;
+    g_autoptr(PipevecTensor) mismatch = pipevec_tensor_tensordot (a, b, rhs_axes, rhs_axes, &mismatch_error);
+
+    EXPECT_THAT (mismatch, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (mismatch_error, PIPEVEC_ERROR, PIPEVEC_ERROR_DIMENSION_MISMATCH));
+  }
+}
+
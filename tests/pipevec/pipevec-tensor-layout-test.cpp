@@ -0,0 +1,145 @@
+/*
+ * /tests/pipevec/pipevec-tensor-layout-test.cpp
+ *
+ * Tests for layout conversions of Pipevec Tensors.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-layout.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::Eq;
+
+using pipevec::test::make_tensor;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
+
+namespace {
+  /* Element by element reference for pipevec_tensor_permute */
+  std::vector <float>
+  permute (std::vector <float>  const &values,
+           std::vector <size_t> const &shape,
+           std::vector <size_t> const &axes)
+  {
+    std::vector <float> permuted (values.size ());
+    std::vector <size_t> index (shape.size (), 0);
+
+    for (size_t i = 0; i < values.size (); ++i)
+      {
+        size_t offset = 0;
+
+        for (size_t j = 0; j < axes.size (); ++j)
+          offset = offset * shape[axes[j]] + index[axes[j]];
+
+        permuted[offset] = values[i];
+
+        for (size_t d = shape.size (); d-- > 0;)
+          {
+            if (++index[d] < shape[d])
+              break;
+
+            index[d] = 0;
+          }
+      }
+
+    return permuted;
+  }
+
+  PipevecTensor *
+  permute_tensor (PipevecTensor              *tensor,
+                  std::vector <size_t> const &axes,
+                  GError                    **error)
+  {
+    g_autoptr(GArray) axes_array = g_array_new (FALSE, FALSE, sizeof (size_t));
+
+    g_array_append_vals (axes_array, axes.data (), axes.size ());
+
+    return pipevec_tensor_permute (tensor, axes_array, error);
+  }
+
+  TEST (PipevecTensorLayout, NchwToNhwcAndBack)
+  {
+    /* Neither the channels nor the pixels fill a whole tile */
+    const std::vector <size_t> shape = { 2, 11, 5, 3 };
+    std::vector <float> values = sequence (2 * 11 * 5 * 3);
+    g_autoptr(PipevecTensor) nchw = make_tensor (shape, values);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) nhwc = permute_tensor (nchw, { 0, 2, 3, 1 }, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (nhwc), Eq (permute (values, shape, { 0, 2, 3, 1 })));
+
+    g_autoptr(PipevecTensor) round_trip = permute_tensor (nhwc, { 0, 3, 1, 2 }, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (round_trip), Eq (values));
+  }
+
+  TEST (PipevecTensorLayout, TransposeSpansSeveralBands)
+  {
+    /* More records than one task transposes, with fields that end
+     * part way into a tile */
+    std::vector <float> records = sequence (150 * 13);
+    g_autoptr(PipevecTensor) aos = make_tensor ({ 150, 13 }, records);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) soa = pipevec_tensor_transpose (aos, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (soa), Eq (permute (records, { 150, 13 }, { 1, 0 })));
+
+    std::vector <float> batches = sequence (3 * 9 * 17);
+    g_autoptr(PipevecTensor) batched = make_tensor ({ 3, 9, 17 }, batches);
+    g_autoptr(PipevecTensor) transposed = pipevec_tensor_transpose (batched, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (transposed), Eq (permute (batches, { 3, 9, 17 }, { 0, 2, 1 })));
+  }
+
+  TEST (PipevecTensorLayout, PermuteKeepingLastAxisMovesRows)
+  {
+    const std::vector <size_t> shape = { 3, 4, 5 };
+    std::vector <float> values = sequence (3 * 4 * 5);
+    g_autoptr(PipevecTensor) tensor = make_tensor (shape, values);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) permuted = permute_tensor (tensor, { 1, 0, 2 }, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (permuted), Eq (permute (values, shape, { 1, 0, 2 })));
+  }
+
+  TEST (PipevecTensorLayout, RejectsAxesThatAreNotAPermutation)
+  {
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(PipevecTensor) vector = make_tensor ({ 6 }, sequence (6));
+    g_autoptr(GError) repeated_error = NULL;
+    g_autoptr(GError) transpose_error = NULL;
+    g_autoptr(PipevecTensor) repeated = permute_tensor (tensor, { 1, 1 }, &repeated_error);
+    g_autoptr(PipevecTensor) transposed = pipevec_tensor_transpose (vector, &transpose_error);
+
+    EXPECT_THAT (repeated, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (repeated_error, PIPEVEC_ERROR, PIPEVEC_ERROR_INVALID_ARGUMENT));
+    EXPECT_THAT (transposed, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (transpose_error, PIPEVEC_ERROR, PIPEVEC_ERROR_INVALID_ARGUMENT));
+  }
+}
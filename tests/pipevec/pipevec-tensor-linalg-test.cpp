@@ -0,0 +1,409 @@
+/*
+ * /tests/pipevec/pipevec-tensor-linalg-test.cpp
+ *
+ * Tests for the dense linear algebra on PipevecTensor
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-linalg.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::FloatNear;
+using ::testing::Pointwise;
+
+using pipevec::test::make_tensor;
+using pipevec::test::matmul;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
+
+namespace {
+  /* A symmetric positive definite matrix of size n, built
+   * as M * M^T + n * I from a fixed M */
+  std::vector <float>
+  spd_matrix (size_t n)
+  {
+    std::vector <float> m = sequence (n * n);
+    std::vector <float> spd (n * n);
+
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = 0; j < n; ++j)
+        {
+          float sum = i == j ? static_cast <float> (n) : 0.0f;
+
+          for (size_t p = 0; p < n; ++p)
+            sum += m[i * n + p] * m[j * n + p];
+
+          spd[i * n + j] = sum;
+        }
+
+    return spd;
+  }
+
+  TEST (PipevecTensorLinalg, CholeskyOfTwoByTwo)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 2 }, { 4.0f, 2.0f, 2.0f, 5.0f });
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) l = pipevec_tensor_cholesky (a, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (l),
+                 Pointwise (FloatNear (1e-5f), std::vector <float> ({ 2.0f, 0.0f, 1.0f, 2.0f })));
+  }
+
+  TEST (PipevecTensorLinalg, CholeskyReconstructsBlockedMatrix)
+  {
+    const size_t n = 150;
+    std::vector <float> spd = spd_matrix (n);
+    g_autoptr(PipevecTensor) a = make_tensor ({ n, n }, spd);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) l = pipevec_tensor_cholesky (a, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    std::vector <float> factor = tensor_contents (l);
+    std::vector <float> factor_transpose (n * n);
+
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = 0; j < n; ++j)
+        factor_transpose[j * n + i] = factor[i * n + j];
+
+    EXPECT_THAT (matmul (factor, factor_transpose, n, n, n),
+                 Pointwise (FloatNear (1e-3f), spd));
+  }
+
+  TEST (PipevecTensorLinalg, CholeskyRejectsIndefiniteMatrix)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 2 }, { 1.0f, 2.0f, 2.0f, 1.0f });
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) l = pipevec_tensor_cholesky (a, &error);
+
+    EXPECT_THAT (l, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_NOT_POSITIVE_DEFINITE));
+  }
+
+  TEST (PipevecTensorLinalg, SolveBatchOfSmallSystems)
+  {
+    /* Two 3x3 systems, the second of which needs pivoting */
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 3, 3 }, {
+      2.0f, 1.0f, 0.0f,
+      1.0f, 3.0f, 1.0f,
+      0.0f, 1.0f, 4.0f,
+
+      0.0f, 1.0f, 0.0f,
+      1.0f, 0.0f, 0.0f,
+      0.0f, 0.0f, 2.0f
+    });
+    g_autoptr(PipevecTensor) b = make_tensor ({ 2, 3, 1 }, {
+      3.0f, 5.0f, 5.0f,
+      2.0f, 3.0f, 8.0f
+    });
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) x = pipevec_tensor_solve (a, b, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (x),
+                 Pointwise (FloatNear (1e-5f), std::vector <float> ({
+                   1.0f, 1.0f, 1.0f,
+                   3.0f, 2.0f, 4.0f
+                 })));
+  }
+
+  TEST (PipevecTensorLinalg, SolveLargeSystemThroughLU)
+  {
+    const size_t n = 100;
+    const size_t k = 3;
+    std::vector <float> matrix = spd_matrix (n);
+    std::vector <float> expected (n * k);
+
+    /* Break the symmetry so that pivoting is exercised */
+    for (size_t i = 0; i < n; ++i)
+      matrix[i * n + (n - 1 - i)] += 10.0f;
+
+    for (size_t i = 0; i < n * k; ++i)
+      expected[i] = static_cast <float> (i % 5) - 2.0f;
+
+    g_autoptr(PipevecTensor) a = make_tensor ({ n, n }, matrix);
+    g_autoptr(PipevecTensor) b = make_tensor ({ n, k }, matmul (matrix, expected, n, n, k));
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) x = pipevec_tensor_solve (a, b, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (x), Pointwise (FloatNear (1e-3f), expected));
+  }
+
+  TEST (PipevecTensorLinalg, SolveRejectsSingularMatrix)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 2 }, { 1.0f, 2.0f, 2.0f, 4.0f });
+    g_autoptr(PipevecTensor) b = make_tensor ({ 2, 1 }, { 1.0f, 1.0f });
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) x = pipevec_tensor_solve (a, b, &error);
+
+    EXPECT_THAT (x, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_SINGULAR_MATRIX));
+  }
+
+  TEST (PipevecTensorLinalg, TriangularSolveWithTranspose)
+  {
+    g_autoptr(PipevecTensor) l = make_tensor ({ 2, 2 }, { 2.0f, 0.0f, 1.0f, 2.0f });
+    g_autoptr(PipevecTensor) b = make_tensor ({ 2, 1 }, { 4.0f, 4.0f });
+    g_autoptr(GError) error = NULL;
+
+    g_autoptr(PipevecTensor) forward = pipevec_tensor_triangular_solve (l, b,
+                                                                        PIPEVEC_TRIANGULAR_SOLVE_LOWER,
+                                                                        &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (forward),
+                 Pointwise (FloatNear (1e-5f), std::vector <float> ({ 2.0f, 1.0f })));
+
+    g_autoptr(PipevecTensor) backward = pipevec_tensor_triangular_solve (l, b,
+                                                                         static_cast <PipevecTriangularSolveFlags> (PIPEVEC_TRIANGULAR_SOLVE_LOWER |
+                                                                                                                    PIPEVEC_TRIANGULAR_SOLVE_TRANSPOSE),
+                                                                         &error);
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (backward),
+                 Pointwise (FloatNear (1e-5f), std::vector <float> ({ 1.0f, 2.0f })));
+  }
+
+  TEST (PipevecTensorLinalg, LUReturnsPivots)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 2 }, { 1.0f, 2.0f, 3.0f, 4.0f });
+    g_autoptr(GArray) pivots = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) lu = pipevec_tensor_lu (a, &pivots, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_EQ (g_array_index (pivots, size_t, 0), 1u);
+    EXPECT_EQ (g_array_index (pivots, size_t, 1), 1u);
+    EXPECT_THAT (tensor_contents (lu),
+                 Pointwise (FloatNear (1e-5f), std::vector <float> ({
+                   3.0f, 4.0f,
+                   1.0f / 3.0f, 2.0f - 4.0f / 3.0f
+                 })));
+  }
+
+  /* Check that q * r reconstructs a and that the columns of q are
+   * orthonormal, where a is m x n */
+  void
+  expect_valid_qr (const std::vector <float> &a,
+                   PipevecTensor             *q,
+                   PipevecTensor             *r,
+                   size_t                     m,
+                   size_t                     n,
+                   float                      tolerance)
+  {
+    size_t k = std::min (m, n);
+    std::vector <float> q_contents = tensor_contents (q);
+    std::vector <float> q_transpose (k * m);
+    std::vector <float> identity (k * k, 0.0f);
+
+    for (size_t i = 0; i < m; ++i)
+      for (size_t j = 0; j < k; ++j)
+        q_transpose[j * m + i] = q_contents[i * k + j];
+
+    for (size_t i = 0; i < k; ++i)
+      identity[i * k + i] = 1.0f;
+
+    EXPECT_THAT (matmul (q_contents, tensor_contents (r), m, k, n),
+                 Pointwise (FloatNear (tolerance), a));
+    EXPECT_THAT (matmul (q_transpose, q_contents, k, m, k),
+                 Pointwise (FloatNear (tolerance), identity));
+  }
+
+  TEST (PipevecTensorLinalg, QRReconstructsBlockedMatrix)
+  {
+    const size_t m = 150;
+    const size_t n = 90;
+    std::vector <float> contents = sequence (m * n);
+    g_autoptr(PipevecTensor) a = make_tensor ({ m, n }, contents);
+    g_autoptr(PipevecTensor) q = NULL;
+    g_autoptr(PipevecTensor) r = NULL;
+    g_autoptr(GError) error = NULL;
+
+    ASSERT_TRUE (pipevec_tensor_qr (a, &q, &r, &error));
+
+    std::vector <float> r_contents = tensor_contents (r);
+
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = 0; j < i; ++j)
+        EXPECT_EQ (r_contents[i * n + j], 0.0f);
+
+    expect_valid_qr (contents, q, r, m, n, 1e-3f);
+  }
+
+  TEST (PipevecTensorLinalg, QRTallSkinnyMatrix)
+  {
+    /* Tall enough to be split into row blocks when there
+     * is more than one thread */
+    const size_t m = 5000;
+    const size_t n = 8;
+    std::vector <float> contents = sequence (m * n);
+    g_autoptr(PipevecTensor) a = make_tensor ({ m, n }, contents);
+    g_autoptr(PipevecTensor) q = NULL;
+    g_autoptr(PipevecTensor) r = NULL;
+    g_autoptr(GError) error = NULL;
+
+    ASSERT_TRUE (pipevec_tensor_qr (a, &q, &r, &error));
+    expect_valid_qr (contents, q, r, m, n, 1e-3f);
+  }
+
+  TEST (PipevecTensorLinalg, LeastSquaresOfOverdeterminedSystems)
+  {
+    /* Fit y = 1 + 2x through points lying exactly on the line, and
+     * y = c through points whose mean is 2 */
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 4, 2 }, {
+      1.0f, 0.0f,
+      1.0f, 1.0f,
+      1.0f, 2.0f,
+      1.0f, 3.0f,
+
+      1.0f, 0.0f,
+      1.0f, 0.0f,
+      1.0f, 0.0f,
+      1.0f, 1.0f
+    });
+    g_autoptr(PipevecTensor) b = make_tensor ({ 2, 4, 1 }, {
+      1.0f, 3.0f, 5.0f, 7.0f,
+      1.0f, 3.0f, 2.0f, 4.0f
+    });
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) x = pipevec_tensor_lstsq (a, b, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (x),
+                 Pointwise (FloatNear (1e-4f), std::vector <float> ({
+                   1.0f, 2.0f,
+                   2.0f, 2.0f
+                 })));
+  }
+
+  TEST (PipevecTensorLinalg, LeastSquaresOfTallSkinnySystem)
+  {
+    const size_t m = 5000;
+    const size_t n = 4;
+    std::vector <float> matrix = sequence (m * n);
+    std::vector <float> expected ({ 1.0f, -2.0f, 0.5f, 3.0f });
+    g_autoptr(PipevecTensor) a = make_tensor ({ m, n }, matrix);
+    g_autoptr(PipevecTensor) b = make_tensor ({ m, 1 }, matmul (matrix, expected, m, n, 1));
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) x = pipevec_tensor_lstsq (a, b, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (x), Pointwise (FloatNear (1e-3f), expected));
+  }
+
+  TEST (PipevecTensorLinalg, LeastSquaresRejectsRankDeficientMatrix)
+  {
+    g_autoptr(PipevecTensor) a = make_tensor ({ 3, 2 }, { 1.0f, 2.0f, 2.0f, 4.0f, 3.0f, 6.0f });
+    g_autoptr(PipevecTensor) b = make_tensor ({ 3, 1 }, { 1.0f, 1.0f, 1.0f });
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) x = pipevec_tensor_lstsq (a, b, &error);
+
+    EXPECT_THAT (x, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_SINGULAR_MATRIX));
+  }
+
+  TEST (PipevecTensorLinalg, EighOfTwoByTwo)
+  {
+    /* Only the lower triangle is read, so the upper one is garbage */
+    g_autoptr(PipevecTensor) a = make_tensor ({ 2, 2 }, { 2.0f, 100.0f, 1.0f, 2.0f });
+    g_autoptr(PipevecTensor) w = NULL;
+    g_autoptr(PipevecTensor) v = NULL;
+    g_autoptr(GError) error = NULL;
+
+    ASSERT_TRUE (pipevec_tensor_eigh (a, &w, &v, &error));
+    EXPECT_THAT (tensor_contents (w),
+                 Pointwise (FloatNear (1e-5f), std::vector <float> ({ 1.0f, 3.0f })));
+
+    /* Eigenvectors are only defined up to their sign */
+    std::vector <float> vectors = tensor_contents (v);
+    float half_root = std::sqrt (0.5f);
+
+    EXPECT_NEAR (std::fabs (vectors[0]), half_root, 1e-5f);
+    EXPECT_NEAR (vectors[0] + vectors[2], 0.0f, 1e-5f);
+    EXPECT_NEAR (std::fabs (vectors[1]), half_root, 1e-5f);
+    EXPECT_NEAR (vectors[1] - vectors[3], 0.0f, 1e-5f);
+  }
+
+  TEST (PipevecTensorLinalg, EighDiagonalizesBatchOfCovariances)
+  {
+    const size_t batch = 16;
+    const size_t n = 12;
+    std::vector <float> matrices;
+
+    for (size_t i = 0; i < batch; ++i)
+      {
+        std::vector <float> m = sequence (n * n, 2 + i % 9);
+
+        /* Symmetric but indefinite */
+        for (size_t r = 0; r < n; ++r)
+          for (size_t c = 0; c < r; ++c)
+            m[c * n + r] = m[r * n + c];
+
+        matrices.insert (matrices.end (), m.begin (), m.end ());
+      }
+
+    g_autoptr(PipevecTensor) a = make_tensor ({ batch, n, n }, matrices);
+    g_autoptr(PipevecTensor) w = NULL;
+    g_autoptr(PipevecTensor) v = NULL;
+    g_autoptr(GError) error = NULL;
+
+    ASSERT_TRUE (pipevec_tensor_eigh (a, &w, &v, &error));
+
+    std::vector <float> values = tensor_contents (w);
+    std::vector <float> vectors = tensor_contents (v);
+
+    ASSERT_EQ (values.size (), batch * n);
+
+    for (size_t i = 0; i < batch; ++i)
+      {
+        std::vector <float> matrix (matrices.begin () + i * n * n,
+                                    matrices.begin () + (i + 1) * n * n);
+        std::vector <float> basis (vectors.begin () + i * n * n,
+                                   vectors.begin () + (i + 1) * n * n);
+        std::vector <float> scaled (n * n);
+        std::vector <float> basis_transpose (n * n);
+        std::vector <float> identity (n * n, 0.0f);
+
+        for (size_t r = 0; r < n; ++r)
+          for (size_t c = 0; c < n; ++c)
+            {
+              scaled[r * n + c] = basis[r * n + c] * values[i * n + c];
+              basis_transpose[c * n + r] = basis[r * n + c];
+            }
+
+        for (size_t j = 0; j < n; ++j)
+          identity[j * n + j] = 1.0f;
+
+        for (size_t j = 1; j < n; ++j)
+          EXPECT_LE (values[i * n + j - 1], values[i * n + j]);
+
+        /* A * V = V * diag(w) and V^T * V = I */
+        EXPECT_THAT (matmul (matrix, basis, n, n, n), Pointwise (FloatNear (1e-4f), scaled));
+        EXPECT_THAT (matmul (basis_transpose, basis, n, n, n), Pointwise (FloatNear (1e-5f), identity));
+      }
+  }
+}
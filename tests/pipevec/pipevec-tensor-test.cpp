@@ -1,5 +1,5 @@
 /*
- * /tests/galgorithm/galgorithm-tensor-test.cpp
+ * /tests/pipevec/pipevec-tensor-test.cpp
  *
  * Tests for the pipevec's PipevecTensor class
  *
@@ -20,13 +20,744 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <cmath>
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-errors.h>
+#include <pipevec/pipevec-gemm-private.h>
 #include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-private.h>
+
+#include "pipevec-test-helpers.h"
 
 using ::testing::Eq;
+using ::testing::FloatNear;
 using ::testing::Not;
+using ::testing::Pointwise;
+
+using pipevec::test::make_tensor;
+using pipevec::test::matmul;
+using pipevec::test::sequence;
+using pipevec::test::tensor_contents;
 
 namespace {
+  TEST (PipevecTensor, InnerProductOfBatchedMatrices)
+  {
+    /* Operands with different padded row lengths, so that each
+     * one has a different stride between batches */
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 2, 3 }, {
+      1.0f, 2.0f, 3.0f,
+      4.0f, 5.0f, 6.0f,
+
+      1.0f, 0.0f, 0.0f,
+      0.0f, 1.0f, 0.0f
+    });
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 2, 3, 1 }, {
+      1.0f, 1.0f, 1.0f,
+      7.0f, 8.0f, 9.0f
+    });
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-5f), std::vector <float> ({ 6.0f, 15.0f, 7.0f, 8.0f })));
+  }
+
+  TEST (PipevecTensor, InnerProductOfLargeMatrices)
+  {
+    const size_t m = 70, k = 50, n = 90;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-4f), matmul (a, b, m, k, n)));
+  }
+
+  /* The matrix at batch index i of a batch of matrices of size rows x columns */
+  std::vector <float>
+  batch_item (std::vector <float> const &batch,
+              size_t                     i,
+              size_t                     rows,
+              size_t                     columns)
+  {
+    return std::vector <float> (batch.begin () + i * rows * columns,
+                                batch.begin () + (i + 1) * rows * columns);
+  }
+
+  TEST (PipevecTensor, InnerProductBroadcastsSharedWeight)
+  {
+    const size_t batch = 4, m = 40, k = 50, n = 30;
+    std::vector <float> a = sequence (batch * m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ batch, m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-4f), matmul (a, b, batch * m, k, n)));
+  }
+
+  TEST (PipevecTensor, InnerProductBroadcastsSharedLeftOperand)
+  {
+    const size_t batch = 3, m = 40, k = 50, n = 30;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (batch * k * n, 3);
+    std::vector <float> expected;
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ batch, k, n }, b);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    for (size_t i = 0; i < batch; ++i)
+      {
+        std::vector <float> item = matmul (a, batch_item (b, i, k, n), m, k, n);
+        expected.insert (expected.end (), item.begin (), item.end ());
+      }
+
+    EXPECT_THAT (tensor_contents (product), Pointwise (FloatNear (1e-4f), expected));
+  }
+
+  TEST (PipevecTensor, InnerProductBroadcastsUnitDimensions)
+  {
+    /* (2, 1, M, K) x (3, K, N) -> (2, 3, M, N) */
+    const size_t m = 3, k = 5, n = 4;
+    std::vector <float> a = sequence (2 * m * k, 7);
+    std::vector <float> b = sequence (3 * k * n, 3);
+    std::vector <float> expected;
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 1, m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 3, k, n }, b);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+
+    for (size_t i = 0; i < 2; ++i)
+      for (size_t j = 0; j < 3; ++j)
+        {
+          std::vector <float> item = matmul (batch_item (a, i, m, k), batch_item (b, j, k, n), m, k, n);
+          expected.insert (expected.end (), item.begin (), item.end ());
+        }
+
+    EXPECT_THAT (tensor_contents (product), Pointwise (FloatNear (1e-5f), expected));
+  }
+
+  TEST (PipevecTensor, InnerProductRejectsIncompatibleBatches)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 2, 2 }, sequence (8));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 3, 2, 2 }, sequence (12));
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    EXPECT_THAT (product, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_BAD_SHAPE));
+  }
+
+  TEST (PipevecTensor, InnerProductOfMatrixAndVector)
+  {
+    const size_t m = 3000, k = 301;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> x = sequence (k, 3);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, 1 }, x);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-3f), matmul (a, x, m, k, 1)));
+  }
+
+  TEST (PipevecTensor, InnerProductOfVectorAndMatrix)
+  {
+    const size_t k = 301, n = 3001;
+    std::vector <float> x = sequence (k, 3);
+    std::vector <float> b = sequence (k * n, 7);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 1, k }, x);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-3f), matmul (x, b, 1, k, n)));
+  }
+
+  TEST (PipevecTensor, InnerProductOfColumnAndRowIsOuterProduct)
+  {
+    const size_t m = 500, n = 301;
+    std::vector <float> a = sequence (m, 3);
+    std::vector <float> b = sequence (n, 7);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, 1 }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 1, n }, b);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-6f), matmul (a, b, m, 1, n)));
+  }
+
+  TEST (PipevecTensor, InnerProductOfBatchesOfSmallMatrices)
+  {
+    /* Sizes covering one and two vectors per row, square and not */
+    const size_t sizes[][3] = {
+      { 2, 2, 2 }, { 3, 3, 3 }, { 4, 4, 4 }, { 6, 6, 6 },
+      { 5, 7, 12 }, { 16, 16, 16 }, { 9, 16, 1 }
+    };
+    const size_t batch = 1000;
+
+    for (auto const &size : sizes)
+      {
+        size_t m = size[0], k = size[1], n = size[2];
+        std::vector <float> a = sequence (batch * m * k, 7);
+        std::vector <float> b = sequence (batch * k * n, 3);
+        std::vector <float> expected;
+        g_autoptr(PipevecTensor) lhs = make_tensor ({ batch, m, k }, a);
+        g_autoptr(PipevecTensor) rhs = make_tensor ({ batch, k, n }, b);
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+        ASSERT_THAT (error, testing::IsNull ());
+
+        for (size_t i = 0; i < batch; ++i)
+          {
+            std::vector <float> item = matmul (batch_item (a, i, m, k), batch_item (b, i, k, n), m, k, n);
+            expected.insert (expected.end (), item.begin (), item.end ());
+          }
+
+        EXPECT_THAT (tensor_contents (product), Pointwise (FloatNear (1e-5f), expected))
+          << m << " x " << k << " times " << k << " x " << n;
+      }
+  }
+
+  /* activation (alpha * product + bias) + beta * residual, computed
+   * separately from the fused kernels */
+  std::vector <float>
+  fused_reference (std::vector <float> const &product,
+                   size_t                     n,
+                   float                      alpha,
+                   std::vector <float> const &bias,
+                   float                    (*activation) (float),
+                   std::vector <float> const &residual,
+                   float                      beta)
+  {
+    std::vector <float> result (product.size ());
+
+    for (size_t i = 0; i < product.size (); ++i)
+      {
+        float x = alpha * product[i] + (bias.empty () ? 0.0f : bias[i % n]);
+
+        result[i] = activation (x) + (residual.empty () ? 0.0f : beta * residual[i]);
+      }
+
+    return result;
+  }
+
+  float
+  relu (float x)
+  {
+    return x > 0.0f ? x : 0.0f;
+  }
+
+  float
+  sigmoid (float x)
+  {
+    return 1.0f / (1.0f + std::exp (-x));
+  }
+
+  float
+  tanh_activation (float x)
+  {
+    return std::tanh (x);
+  }
+
+  TEST (PipevecTensor, FusedInnerProductAddsBiasAndAppliesRelu)
+  {
+    const size_t m = 70, k = 50, n = 90;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    std::vector <float> bias = sequence (n, 5);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(PipevecTensor) bias_tensor = make_tensor ({ n }, bias);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor_fused (lhs, rhs,
+                                                                                  1.0f,
+                                                                                  bias_tensor,
+                                                                                  PIPEVEC_ACTIVATION_RELU,
+                                                                                  NULL,
+                                                                                  0.0f,
+                                                                                  &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-4f),
+                            fused_reference (matmul (a, b, m, k, n), n, 1.0f, bias, relu, {}, 0.0f)));
+  }
+
+  TEST (PipevecTensor, FusedProductWithEmptyInnerDimensionAppliesEpilogue)
+  {
+    /* A * B is zero, so C becomes relu (beta * C + bias), on
+     * whichever path the product is forced down */
+    const size_t m = 40, n = 30, c_row_stride = 32;
+    std::vector <float> bias = sequence (n, 5);
+    std::vector <float> initial = sequence (m * c_row_stride, 2);
+    const float beta = 0.5f;
+    const float operand = 0.0f;
+    const PipevecDispatchVariant variants[] = {
+      PIPEVEC_DISPATCH_VARIANT_AUTO,
+      PIPEVEC_DISPATCH_VARIANT_DIRECT,
+      PIPEVEC_DISPATCH_VARIANT_BLOCKED
+    };
+    PipevecGemmEpilogue epilogue = { bias.data (), PIPEVEC_ACTIVATION_RELU, NULL, 0.0f };
+
+    for (PipevecDispatchVariant variant : variants)
+      {
+        std::vector <float> c (initial);
+
+        pipevec_dispatch_set_override (variant, 0);
+        pipevec_gemm_batched_fused (1, m, n, 0,
+                                    1.0f,
+                                    &operand, 0, 0, 1,
+                                    &operand, 0, n, 1,
+                                    beta,
+                                    c.data (), 0, c_row_stride,
+                                    &epilogue,
+                                    NULL);
+        pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_AUTO, 0);
+
+        for (size_t i = 0; i < m; ++i)
+          for (size_t j = 0; j < n; ++j)
+            EXPECT_THAT (c[i * c_row_stride + j],
+                         FloatNear (relu (beta * initial[i * c_row_stride + j] + bias[j]), 1e-5f))
+              << "at " << i << ", " << j << " with variant " << variant;
+      }
+  }
+
+  TEST (PipevecTensor, FusedInnerProductAddsScaledResidualToBatch)
+  {
+    /* A (B, M, K) x (K, N) product is computed as one taller product,
+     * so the residual has to be stacked the same way */
+    const size_t batch = 4, m = 40, k = 50, n = 30;
+    std::vector <float> a = sequence (batch * m * k, 7);
+    std::vector <float> b = sequence (k * n, 3);
+    std::vector <float> bias = sequence (n, 5);
+    std::vector <float> residual = sequence (batch * m * n, 2);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ batch, m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, n }, b);
+    g_autoptr(PipevecTensor) bias_tensor = make_tensor ({ 1, n }, bias);
+    g_autoptr(PipevecTensor) residual_tensor = make_tensor ({ batch, m, n }, residual);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor_fused (lhs, rhs,
+                                                                                  0.5f,
+                                                                                  bias_tensor,
+                                                                                  PIPEVEC_ACTIVATION_TANH,
+                                                                                  residual_tensor,
+                                                                                  2.0f,
+                                                                                  &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-4f),
+                            fused_reference (matmul (a, b, batch * m, k, n),
+                                             n, 0.5f, bias, tanh_activation, residual, 2.0f)));
+  }
+
+  TEST (PipevecTensor, FusedInnerProductOfMatrixAndVector)
+  {
+    const size_t m = 3000, k = 301;
+    std::vector <float> a = sequence (m * k, 7);
+    std::vector <float> x = sequence (k, 3);
+    std::vector <float> residual = sequence (m, 2);
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ m, k }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ k, 1 }, x);
+    g_autoptr(PipevecTensor) residual_tensor = make_tensor ({ m, 1 }, residual);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor_fused (lhs, rhs,
+                                                                                  0.01f,
+                                                                                  NULL,
+                                                                                  PIPEVEC_ACTIVATION_SIGMOID,
+                                                                                  residual_tensor,
+                                                                                  -1.0f,
+                                                                                  &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (product),
+                 Pointwise (FloatNear (1e-4f),
+                            fused_reference (matmul (a, x, m, k, 1), 1, 0.01f, {}, sigmoid, residual, -1.0f)));
+  }
+
+  TEST (PipevecTensor, FusedInnerProductRejectsMismatchedBias)
+  {
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 3, 4 }, sequence (12));
+    g_autoptr(PipevecTensor) bias_tensor = make_tensor ({ 4, 1 }, sequence (4));
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor_fused (lhs, rhs,
+                                                                                  1.0f,
+                                                                                  bias_tensor,
+                                                                                  PIPEVEC_ACTIVATION_NONE,
+                                                                                  NULL,
+                                                                                  0.0f,
+                                                                                  &error);
+
+    EXPECT_THAT (product, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (error, PIPEVEC_ERROR, PIPEVEC_ERROR_BAD_SHAPE));
+  }
+
+  TEST (PipevecTensor, BulkAccessorsRoundTripPaddedRows)
+  {
+    /* Rows of 5 are padded to 8 internally */
+    std::vector <float> values = sequence (3 * 5);
+    const size_t dimensions[] = { 3, 5 };
+    g_autoptr(GArray) shape = g_array_new (FALSE, FALSE, sizeof (size_t));
+    g_autoptr(GBytes) bytes = g_bytes_new (values.data (), sizeof (float) * values.size ());
+    g_autoptr(GError) error = NULL;
+
+    g_array_append_vals (shape, dimensions, G_N_ELEMENTS (dimensions));
+
+    g_autoptr(PipevecTensor) tensor = pipevec_tensor_new_from_bytes (shape, bytes, &error);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (tensor), Eq (values));
+
+    g_autoptr(GBytes) returned = pipevec_tensor_get_bytes (tensor);
+    gsize size = 0;
+    const float *returned_data = static_cast <const float *> (g_bytes_get_data (returned, &size));
+
+    ASSERT_THAT (size, Eq (sizeof (float) * values.size ()));
+    EXPECT_THAT (std::vector <float> (returned_data, returned_data + values.size ()), Eq (values));
+
+    std::vector <float> doubled (values.size ());
+
+    for (size_t i = 0; i < values.size (); ++i)
+      doubled[i] = 2.0f * values[i];
+
+    ASSERT_TRUE (pipevec_tensor_set_data_from_buffer (tensor, doubled.data (), doubled.size (), shape, &error));
+
+    std::vector <float> read_back (values.size ());
+
+    ASSERT_TRUE (pipevec_tensor_read_data (tensor, read_back.data (), read_back.size (), &error));
+    EXPECT_THAT (read_back, Eq (doubled));
+  }
+
+  TEST (PipevecTensor, BulkAccessorsRejectMismatchedSizes)
+  {
+    const size_t dimensions[] = { 2, 3 };
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(GArray) shape = g_array_new (FALSE, FALSE, sizeof (size_t));
+    std::vector <float> buffer (5);
+    g_autoptr(GError) read_error = NULL;
+    g_autoptr(GError) bytes_error = NULL;
+
+    EXPECT_FALSE (pipevec_tensor_read_data (tensor, buffer.data (), buffer.size (), &read_error));
+    EXPECT_TRUE (g_error_matches (read_error, PIPEVEC_ERROR, PIPEVEC_ERROR_BAD_SHAPE));
+
+    /* Not a whole number of floats */
+    g_autoptr(GBytes) bytes = g_bytes_new (buffer.data (), sizeof (float) * buffer.size () - 1);
+
+    g_array_append_vals (shape, dimensions, G_N_ELEMENTS (dimensions));
+
+    g_autoptr(PipevecTensor) from_bytes = pipevec_tensor_new_from_bytes (shape, bytes, &bytes_error);
+
+    EXPECT_THAT (from_bytes, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (bytes_error, PIPEVEC_ERROR, PIPEVEC_ERROR_BAD_SHAPE));
+  }
+
+  TEST (PipevecTensor, SubtractTensorsAndScalars)
+  {
+    std::vector <float> a = sequence (3 * 13, 7);
+    std::vector <float> b = sequence (3 * 13, 3);
+    std::vector <float> difference (a.size ());
+    std::vector <float> shifted (a.size ());
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 3, 13 }, a);
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 3, 13 }, b);
+    g_autoptr(GError) tensor_error = NULL;
+    g_autoptr(GError) scalar_error = NULL;
+    g_autoptr(PipevecTensor) tensor_result = pipevec_tensor_sub_tensor (lhs, rhs, &tensor_error);
+    g_autoptr(PipevecTensor) scalar_result = pipevec_tensor_sub_scalar (lhs, 0.25f, &scalar_error);
+
+    for (size_t i = 0; i < a.size (); ++i)
+      {
+        difference[i] = a[i] - b[i];
+        shifted[i] = a[i] - 0.25f;
+      }
+
+    ASSERT_THAT (tensor_error, testing::IsNull ());
+    ASSERT_THAT (scalar_error, testing::IsNull ());
+    EXPECT_THAT (tensor_contents (tensor_result), Pointwise (FloatNear (1e-6f), difference));
+    EXPECT_THAT (tensor_contents (scalar_result), Pointwise (FloatNear (1e-6f), shifted));
+  }
+
+  /* Encode the indices an element was visited at in its value */
+  float
+  encode_indices (float     element G_GNUC_UNUSED,
+                  GArray   *indices,
+                  gpointer  user_data)
+  {
+    size_t *n_calls = static_cast <size_t *> (user_data);
+    float encoded = 0.0f;
+
+    ++*n_calls;
+
+    for (guint i = 0; i < indices->len; ++i)
+      encoded = 10.0f * encoded + g_array_index (indices, size_t, i);
+
+    return encoded;
+  }
+
+  TEST (PipevecTensor, MapPassesIndicesOfEachElement)
+  {
+    const size_t d0 = 2, d1 = 3, d2 = 4, d3 = 5;
+    std::vector <float> expected;
+    size_t n_calls = 0;
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ d0, d1, d2, d3 }, sequence (d0 * d1 * d2 * d3));
+    g_autoptr(GError) error = NULL;
+    g_autoptr(PipevecTensor) mapped = pipevec_tensor_map (tensor,
+                                                          encode_indices,
+                                                          reinterpret_cast <gpointer *> (&n_calls),
+                                                          &error);
+
+    for (size_t i = 0; i < d0; ++i)
+      for (size_t j = 0; j < d1; ++j)
+        for (size_t k = 0; k < d2; ++k)
+          for (size_t l = 0; l < d3; ++l)
+            expected.push_back (1000.0f * i + 100.0f * j + 10.0f * k + l);
+
+    ASSERT_THAT (error, testing::IsNull ());
+    EXPECT_THAT (n_calls, Eq (expected.size ()));
+    EXPECT_THAT (tensor_contents (mapped), Eq (expected));
+  }
+
+  TEST (PipevecTensor, ResultsReuseShapesOfDroppedTensors)
+  {
+    /* Drop tensors of different ranks so that later ones get
+     * their shape arrays, then check the later shapes */
+    for (size_t rank = 1; rank <= 4; ++rank)
+      {
+        std::vector <size_t> shape (rank, 2);
+        g_autoptr(PipevecTensor) dropped = make_tensor (shape, sequence (1u << rank));
+        g_autoptr(PipevecTensor) sum = pipevec_tensor_add_tensor (dropped, dropped, NULL);
+      }
+
+    std::vector <float> values = sequence (3 * 9);
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 3, 9 }, values);
+    g_autoptr(PipevecTensor) scaled = pipevec_tensor_multiply_scalar (tensor, 2.0f, NULL);
+    std::vector <float> expected (values.size ());
+
+    for (size_t i = 0; i < values.size (); ++i)
+      expected[i] = 2.0f * values[i];
+
+    EXPECT_THAT (tensor_contents (scaled), Pointwise (FloatNear (1e-5f), expected));
+
+    g_autoptr(GBytes) bytes = pipevec_tensor_get_bytes (scaled);
+
+    EXPECT_THAT (g_bytes_get_size (bytes), Eq (sizeof (float) * 3 * 9));
+  }
+
+  TEST (PipevecTensor, SplitThenConcatAlongEachAxisRoundTrips)
+  {
+    /* Rows of ten floats, so that pieces along the last axis start
+     * part way into a vector and have padding of their own */
+    const size_t splits[][2] = { { 1, 1 }, { 1, 2 }, { 3, 7 } };
+    std::vector <float> values = sequence (2 * 3 * 10);
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 2, 3, 10 }, values);
+
+    for (size_t axis = 0; axis < 3; ++axis)
+      {
+        g_autoptr(GArray) sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+        g_autoptr(GError) error = NULL;
+
+        g_array_append_vals (sizes, splits[axis], 2);
+
+        g_autoptr(GPtrArray) pieces = pipevec_tensor_split (tensor, sizes, axis, &error);
+
+        ASSERT_THAT (error, testing::IsNull ());
+        ASSERT_THAT (pieces->len, Eq (2u));
+
+        g_autoptr(PipevecTensor) joined = pipevec_tensor_concat ((PipevecTensor **) pieces->pdata,
+                                                                 pieces->len,
+                                                                 axis,
+                                                                 &error);
+
+        ASSERT_THAT (error, testing::IsNull ());
+        EXPECT_THAT (tensor_contents (joined), Eq (values));
+      }
+
+    /* Each row of the second piece along the last axis is the last
+     * seven elements of a row */
+    g_autoptr(GPtrArray) chunks = pipevec_tensor_chunk (tensor, 3, 2, NULL);
+    std::vector <float> expected;
+
+    ASSERT_THAT (chunks->len, Eq (3u));
+
+    for (size_t row = 0; row < 6; ++row)
+      expected.insert (expected.end (), values.begin () + row * 10 + 8, values.begin () + row * 10 + 10);
+
+    EXPECT_THAT (tensor_contents (PIPEVEC_TENSOR (chunks->pdata[2])), Eq (expected));
+  }
+
+  TEST (PipevecTensor, LeadingAxisPiecesOutliveTheirSource)
+  {
+    const size_t dimensions[] = { 1 };
+    const float replacement[] = { 0.0f };
+    std::vector <float> values = sequence (4 * 3);
+    PipevecTensor *tensor = make_tensor ({ 4, 3 }, values);
+    g_autoptr(GArray) shape = g_array_new (FALSE, FALSE, sizeof (size_t));
+    g_autoptr(GPtrArray) chunks = pipevec_tensor_chunk (tensor, 2, 0, NULL);
+    g_autoptr(GPtrArray) halves = pipevec_tensor_chunk (PIPEVEC_TENSOR (chunks->pdata[1]), 2, 0, NULL);
+
+    /* Replacing the data of the source or of a piece does not
+     * disturb the other pieces */
+    g_array_append_vals (shape, dimensions, G_N_ELEMENTS (dimensions));
+    ASSERT_TRUE (pipevec_tensor_set_data_from_buffer (tensor, replacement, 1, shape, NULL));
+    ASSERT_TRUE (pipevec_tensor_set_data_from_buffer (PIPEVEC_TENSOR (chunks->pdata[1]), replacement, 1, shape, NULL));
+    g_object_unref (tensor);
+
+    EXPECT_THAT (tensor_contents (PIPEVEC_TENSOR (chunks->pdata[0])),
+                 Eq (std::vector <float> (values.begin (), values.begin () + 6)));
+    EXPECT_THAT (tensor_contents (PIPEVEC_TENSOR (halves->pdata[1])),
+                 Eq (std::vector <float> (values.begin () + 9, values.end ())));
+  }
+
+  TEST (PipevecTensor, ConcatAndSplitRejectBadArguments)
+  {
+    const size_t bad_sizes[] = { 2, 0, 1 };
+    g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 3 }, sequence (6));
+    g_autoptr(PipevecTensor) rhs = make_tensor ({ 2, 4 }, sequence (8));
+    PipevecTensor *operands[] = { lhs, rhs };
+    g_autoptr(GArray) sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+    g_autoptr(GError) concat_error = NULL;
+    g_autoptr(GError) split_error = NULL;
+    g_autoptr(GError) chunk_error = NULL;
+
+    /* The operands only differ along the last axis */
+    g_autoptr(PipevecTensor) joined = pipevec_tensor_concat (operands, 2, 0, &concat_error);
+
+    EXPECT_THAT (joined, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (concat_error, PIPEVEC_ERROR, PIPEVEC_ERROR_DIMENSION_MISMATCH));
+
+    g_array_append_vals (sizes, bad_sizes, G_N_ELEMENTS (bad_sizes));
+
+    g_autoptr(GPtrArray) pieces = pipevec_tensor_split (lhs, sizes, 1, &split_error);
+
+    EXPECT_THAT (pieces, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (split_error, PIPEVEC_ERROR, PIPEVEC_ERROR_INVALID_ARGUMENT));
+
+    g_autoptr(GPtrArray) chunks = pipevec_tensor_chunk (lhs, 2, 2, &chunk_error);
+
+    EXPECT_THAT (chunks, testing::IsNull ());
+    EXPECT_TRUE (g_error_matches (chunk_error, PIPEVEC_ERROR, PIPEVEC_ERROR_INVALID_ARGUMENT));
+  }
+
+  TEST (PipevecTensor, EqualAndAllcloseCompareElements)
+  {
+    /* Enough elements for several blocks, with the difference in
+     * the last row */
+    std::vector <float> values = sequence (20 * 5);
+    std::vector <float> nudged (values);
+    std::vector <float> with_nan (values);
+
+    nudged.back () += 1e-3f;
+    with_nan.back () = NAN;
+
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 20, 5 }, values);
+    g_autoptr(PipevecTensor) same = make_tensor ({ 20, 5 }, values);
+    g_autoptr(PipevecTensor) transposed_shape = make_tensor ({ 5, 20 }, values);
+    g_autoptr(PipevecTensor) nudged_tensor = make_tensor ({ 20, 5 }, nudged);
+    g_autoptr(PipevecTensor) nan_tensor = make_tensor ({ 20, 5 }, with_nan);
+
+    EXPECT_TRUE (pipevec_tensor_equal (tensor, same));
+    EXPECT_FALSE (pipevec_tensor_equal (tensor, transposed_shape));
+    EXPECT_FALSE (pipevec_tensor_equal (tensor, nudged_tensor));
+    EXPECT_FALSE (pipevec_tensor_equal (nan_tensor, nan_tensor));
+
+    EXPECT_TRUE (pipevec_tensor_allclose (tensor, nudged_tensor, 0.0f, 1e-2f));
+    EXPECT_FALSE (pipevec_tensor_allclose (tensor, nudged_tensor, 0.0f, 1e-4f));
+    EXPECT_TRUE (pipevec_tensor_allclose (tensor, nudged_tensor, 1e-2f, 0.0f));
+    EXPECT_FALSE (pipevec_tensor_allclose (tensor, nan_tensor, 1.0f, 1.0f));
+    EXPECT_FALSE (pipevec_tensor_allclose (tensor, transposed_shape, 1.0f, 1.0f));
+  }
+
+  TEST (PipevecTensor, HashFollowsShapeAndContents)
+  {
+    std::vector <float> values = sequence (4 * 6);
+    std::vector <float> swapped (values);
+    std::vector <float> negative_zero (values);
+
+    std::swap (swapped[1], swapped[2]);
+    negative_zero[0] = 0.0f;
+
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 4, 6 }, values);
+    g_autoptr(PipevecTensor) stacked = make_tensor ({ 8, 6 }, sequence (8 * 6));
+    g_autoptr(GPtrArray) halves = pipevec_tensor_chunk (stacked, 2, 0, NULL);
+    g_autoptr(PipevecTensor) reshaped = make_tensor ({ 6, 4 }, values);
+    g_autoptr(PipevecTensor) swapped_tensor = make_tensor ({ 4, 6 }, swapped);
+    g_autoptr(PipevecTensor) zero = make_tensor ({ 4, 6 }, negative_zero);
+
+    negative_zero[0] = -0.0f;
+
+    g_autoptr(PipevecTensor) signed_zero = make_tensor ({ 4, 6 }, negative_zero);
+
+    /* A view hashes the same as a tensor made from its contents */
+    EXPECT_THAT (pipevec_tensor_hash (PIPEVEC_TENSOR (halves->pdata[0])), Eq (pipevec_tensor_hash (tensor)));
+    EXPECT_THAT (pipevec_tensor_hash (signed_zero), Eq (pipevec_tensor_hash (zero)));
+    EXPECT_THAT (pipevec_tensor_hash (reshaped), Not (Eq (pipevec_tensor_hash (tensor))));
+    EXPECT_THAT (pipevec_tensor_hash (swapped_tensor), Not (Eq (pipevec_tensor_hash (tensor))));
+  }
+
+  TEST (PipevecTensor, ComparisonsAndHashIgnoreRowPadding)
+  {
+    /* Rows of thirteen floats are padded to sixteen, so the padding
+     * shares the second vector of each row with elements */
+    std::vector <float> values = sequence (3 * 13);
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 3, 13 }, values);
+    g_autoptr(PipevecTensor) dirty = make_tensor ({ 3, 13 }, values);
+    float *storage = pipevec_tensor_get_storage (dirty);
+
+    storage[13] = NAN;
+    storage[16 + 15] = INFINITY;
+    storage[32 + 14] = 1.0f;
+
+    EXPECT_TRUE (pipevec_tensor_equal (dirty, dirty));
+    EXPECT_TRUE (pipevec_tensor_equal (tensor, dirty));
+    EXPECT_TRUE (pipevec_tensor_allclose (tensor, dirty, 0.0f, 0.0f));
+    EXPECT_THAT (pipevec_tensor_hash (dirty), Eq (pipevec_tensor_hash (tensor)));
+  }
+
+  TEST (PipevecTensor, SmallProductsOfNonFiniteValuesKeepPaddingZero)
+  {
+    /* Rows of C of one and of two vectors */
+    const size_t widths[] = { 3, 11 };
+
+    for (size_t width : widths)
+      {
+        g_autoptr(PipevecTensor) lhs = make_tensor ({ 2, 2 }, { INFINITY, 1.0f, NAN, 1.0f });
+        g_autoptr(PipevecTensor) rhs = make_tensor ({ 2, width }, std::vector <float> (2 * width, 1.0f));
+        g_autoptr(GError) error = NULL;
+        g_autoptr(PipevecTensor) product = pipevec_tensor_inner_product_tensor (lhs, rhs, &error);
+
+        ASSERT_THAT (error, testing::IsNull ());
+
+        const float *storage = pipevec_tensor_get_storage (product);
+        size_t row_stride = (width + 7) / 8 * 8;
+
+        for (size_t row = 0; row < 2; ++row)
+          for (size_t j = width; j < row_stride; ++j)
+            EXPECT_THAT (storage[row * row_stride + j], Eq (0.0f));
+      }
+  }
 }
@@ -0,0 +1,85 @@
+/*
+ * /tests/pipevec/pipevec-test-helpers.h
+ *
+ * Helpers shared between the pipevec library tests.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <pipevec/pipevec-tensor.h>
+
+namespace pipevec
+{
+  namespace test
+  {
+    inline PipevecTensor *
+    make_tensor (std::vector <size_t> const &shape,
+                 std::vector <float>  const &contents)
+    {
+      g_autoptr(GArray) shape_array = g_array_new (FALSE, FALSE, sizeof (size_t));
+      g_autoptr(GArray) contents_array = g_array_new (FALSE, FALSE, sizeof (float));
+
+      g_array_append_vals (shape_array, shape.data (), shape.size ());
+      g_array_append_vals (contents_array, contents.data (), contents.size ());
+
+      return pipevec_tensor_new (shape_array, contents_array, NULL);
+    }
+
+    inline std::vector <float>
+    tensor_contents (PipevecTensor *tensor)
+    {
+      g_autoptr(GArray) data = pipevec_tensor_get_data (tensor);
+      float *begin = reinterpret_cast <float *> (data->data);
+
+      return std::vector <float> (begin, begin + data->len);
+    }
+
+    /* Reference row-major matrix product of an m x k and a k x n matrix */
+    inline std::vector <float>
+    matmul (std::vector <float> const &a,
+            std::vector <float> const &b,
+            size_t                     m,
+            size_t                     k,
+            size_t                     n)
+    {
+      std::vector <float> c (m * n, 0.0f);
+
+      for (size_t i = 0; i < m; ++i)
+        for (size_t p = 0; p < k; ++p)
+          for (size_t j = 0; j < n; ++j)
+            c[i * n + j] += a[i * k + p] * b[p * n + j];
+
+      return c;
+    }
+
+    /* Deterministic values in [-0.5, 0.5) */
+    inline std::vector <float>
+    sequence (size_t n, size_t seed = 7)
+    {
+      std::vector <float> values (n);
+
+      for (size_t i = 0; i < n; ++i)
+        values[i] = static_cast <float> ((i * seed) % 11) / 11.0f - 0.5f;
+
+      return values;
+    }
+  }
+}
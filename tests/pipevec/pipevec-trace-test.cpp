@@ -0,0 +1,115 @@
+/*
+ * /tests/pipevec/pipevec-trace-test.cpp
+ *
+ * Tests for timeline tracing.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string>
+
+#include <glib/gstdio.h>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+#include <pipevec/pipevec-dispatch.h>
+#include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-linalg.h>
+#include <pipevec/pipevec-trace.h>
+
+#include "pipevec-test-helpers.h"
+
+using ::testing::EndsWith;
+using ::testing::HasSubstr;
+using ::testing::IsNull;
+using ::testing::Not;
+using ::testing::StartsWith;
+
+using pipevec::test::make_tensor;
+using pipevec::test::sequence;
+
+namespace {
+  std::string
+  write_trace ()
+  {
+    g_autofree char *path = g_build_filename (g_get_tmp_dir (), "pipevec-trace-test.json", NULL);
+    g_autofree char *contents = NULL;
+    g_autoptr(GError) error = NULL;
+
+    EXPECT_TRUE (pipevec_trace_write_json (path, &error));
+    EXPECT_TRUE (g_file_get_contents (path, &contents, NULL, &error));
+    g_unlink (path);
+
+    return contents != NULL ? std::string (contents) : std::string ();
+  }
+
+  TEST (PipevecTrace, RecordsOperationsAndWorkerTasks)
+  {
+    /* A batch of identity matrices, decomposed in parallel. A batch
+     * this small would stay on the calling thread, so force threads. */
+    std::vector <float> identities (4 * 3 * 3, 0.0f);
+    g_autoptr(GError) error = NULL;
+
+    for (size_t b = 0; b < 4; ++b)
+      for (size_t i = 0; i < 3; ++i)
+        identities[b * 9 + i * 3 + i] = 1.0f;
+
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 4, 3, 3 }, identities);
+    g_autoptr(PipevecTensor) eigenvalues = NULL;
+
+    pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_AUTO, 4);
+    pipevec_trace_start ();
+    EXPECT_TRUE (pipevec_trace_get_active ());
+    EXPECT_TRUE (pipevec_tensor_eigh (tensor, &eigenvalues, NULL, &error));
+    pipevec_trace_stop ();
+    pipevec_dispatch_set_override (PIPEVEC_DISPATCH_VARIANT_AUTO, 0);
+
+    ASSERT_THAT (error, IsNull ());
+
+    std::string trace = write_trace ();
+
+    EXPECT_THAT (trace, StartsWith ("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+    EXPECT_THAT (trace, EndsWith ("]}\n"));
+    EXPECT_THAT (trace, HasSubstr ("\"cat\":\"op\",\"name\":\"eigh\",\"ph\":\"X\""));
+    EXPECT_THAT (trace, HasSubstr ("\"name\":\"parallel_for\""));
+    EXPECT_THAT (trace, HasSubstr ("\"name\":\"task\""));
+    EXPECT_THAT (trace, HasSubstr ("\"args\":{\"index\":3}"));
+  }
+
+  TEST (PipevecTrace, StartingAgainDropsEarlierEvents)
+  {
+    g_autoptr(PipevecTensor) tensor = make_tensor ({ 2, 3 }, sequence (6));
+
+    pipevec_trace_start ();
+    g_autoptr(GArray) data = pipevec_tensor_get_data (tensor);
+    pipevec_trace_stop ();
+
+    pipevec_trace_start ();
+    g_autoptr(PipevecTensor) scaled = pipevec_tensor_multiply_scalar (tensor, 2.0f, NULL);
+    pipevec_trace_stop ();
+
+    /* Operations called while stopped are not recorded either */
+    g_autoptr(PipevecTensor) sum = pipevec_tensor_add_scalar (tensor, 2.0f, NULL);
+
+    std::string trace = write_trace ();
+
+    EXPECT_THAT (trace, HasSubstr ("\"name\":\"multiply_scalar\""));
+    EXPECT_THAT (trace, Not (HasSubstr ("\"name\":\"get_data\"")));
+    EXPECT_THAT (trace, Not (HasSubstr ("\"name\":\"add_scalar\"")));
+  }
+}
@@ -0,0 +1,58 @@
+/*
+ * /tools/pipevec-autotune.c
+ *
+ * Tune the matrix product engine for this machine and save the result.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include <pipevec/pipevec-autotune.h>
+
+int
+main (int   argc G_GNUC_UNUSED,
+      char *argv[] G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  size_t mc, kc, nc;
+
+  pipevec_autotune_get_gemm_blocking (&mc, &kc, &nc);
+  g_print ("Current blocking: mc=%zu kc=%zu nc=%zu\n", mc, kc, nc);
+
+  if (!pipevec_autotune_gemm (&error))
+    {
+      g_printerr ("Could not tune: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  pipevec_autotune_get_gemm_blocking (&mc, &kc, &nc);
+  g_print ("Tuned blocking: mc=%zu kc=%zu nc=%zu\n", mc, kc, nc);
+
+  /* The dispatcher times blocked products with the tuned blocking */
+  if (!pipevec_autotune_dispatch (&error))
+    {
+      g_printerr ("Could not calibrate the dispatcher: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  g_print ("Calibrated the dispatcher\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,482 @@
+/*
+ * /tools/pipevec-roofline.c
+ *
+ * Report how close each operation gets to the roofline of this machine.
+ *
+ * Copyright (C) 2019 Sam Spilsbury.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include <pipevec/pipevec-profile.h>
+#include <pipevec/pipevec-tensor.h>
+#include <pipevec/pipevec-tensor-linalg.h>
+
+/* The roofline of a machine is the lesser of its peak arithmetic
+ * throughput and its memory bandwidth multiplied by the arithmetic
+ * intensity (FLOPs per byte) of the code running on it. This tool
+ * measures both peaks, then runs each operation with profiling
+ * enabled and reports what fraction of the roofline it reaches.
+ *
+ * The peak FLOP rate comes from a loop of independent multiply-adds
+ * on the same 8-float vectors the kernels use, built with the same
+ * compiler flags as the library, so it is the peak for this build
+ * rather than for the CPU. The bandwidth comes from a STREAM-style
+ * triad over arrays much larger than the last level cache. Both use
+ * as many threads as pipevec does. Operation FLOP and byte counts
+ * are the ones the profiler keeps, which count logical elements, so
+ * traffic from padding and packing is not included. Operands that
+ * fit in cache are not limited by memory bandwidth, so they can go
+ * over 100% of the memory roof. */
+
+typedef float float8_t __attribute__((vector_size(8 * (sizeof (float)))));
+
+/* Enough independent accumulators to cover the latency of a
+ * multiply-add on every port that can issue one */
+#define N_ACCUMULATORS 12
+#define PEAK_ITERATIONS (1 << 22)
+#define STREAM_ELEMENTS (16 * 1024 * 1024)
+#define N_REPEATS 5
+
+typedef void (*ThreadFunc) (size_t   index,
+                            size_t   n_threads,
+                            gpointer user_data);
+
+typedef struct {
+  ThreadFunc func;
+  gpointer   user_data;
+  size_t     index;
+  size_t     n_threads;
+} ThreadData;
+
+static gpointer
+thread_main (gpointer data)
+{
+  ThreadData *thread = data;
+
+  thread->func (thread->index, thread->n_threads, thread->user_data);
+
+  return NULL;
+}
+
+/* Run @func once on each of @n_threads threads, including this one */
+static void
+run_on_threads (size_t     n_threads,
+                ThreadFunc func,
+                gpointer   user_data)
+{
+  g_autofree ThreadData *threads = g_new0 (ThreadData, n_threads);
+  g_autofree GThread **handles = g_new0 (GThread *, n_threads);
+
+  for (size_t i = 0; i < n_threads; ++i)
+    threads[i] = (ThreadData) { func, user_data, i, n_threads };
+
+  for (size_t i = 1; i < n_threads; ++i)
+    handles[i] = g_thread_new ("roofline", thread_main, &threads[i]);
+
+  thread_main (&threads[0]);
+
+  for (size_t i = 1; i < n_threads; ++i)
+    g_thread_join (handles[i]);
+}
+
+static size_t
+get_n_threads (void)
+{
+  const char *requested = g_getenv ("PIPEVEC_NUM_THREADS");
+  size_t n_threads = requested != NULL ? (size_t) g_ascii_strtoull (requested, NULL, 10) : 0;
+
+  return n_threads > 0 ? n_threads : g_get_num_processors ();
+}
+
+static void
+peak_flops_thread (size_t   index G_GNUC_UNUSED,
+                   size_t   n_threads G_GNUC_UNUSED,
+                   gpointer user_data)
+{
+  float *sink = user_data;
+  float8_t accumulators[N_ACCUMULATORS];
+  float8_t scale, offset;
+
+  for (size_t lane = 0; lane < 8; ++lane)
+    {
+      scale[lane] = 0.999f;
+      offset[lane] = 0.001f;
+    }
+
+  for (size_t i = 0; i < N_ACCUMULATORS; ++i)
+    accumulators[i] = offset * (float) i;
+
+  /* Converges towards 1 rather than overflowing */
+  for (size_t iteration = 0; iteration < PEAK_ITERATIONS; ++iteration)
+    for (size_t i = 0; i < N_ACCUMULATORS; ++i)
+      accumulators[i] = accumulators[i] * scale + offset;
+
+  float8_t sum = accumulators[0];
+
+  for (size_t i = 1; i < N_ACCUMULATORS; ++i)
+    sum += accumulators[i];
+
+  /* Stops the loop from being optimized away */
+  *(volatile float *) sink = sum[0];
+}
+
+static double
+measure_peak_flops (size_t n_threads)
+{
+  double best = 0.0;
+  float sink;
+
+  for (size_t repeat = 0; repeat < N_REPEATS; ++repeat)
+    {
+      gint64 start_us = g_get_monotonic_time ();
+
+      run_on_threads (n_threads, peak_flops_thread, &sink);
+
+      double seconds = (g_get_monotonic_time () - start_us) / 1e6;
+      double flops = 2.0 * 8 * N_ACCUMULATORS * (double) PEAK_ITERATIONS * n_threads;
+
+      best = MAX (best, flops / seconds);
+    }
+
+  return best;
+}
+
+typedef struct {
+  float *a;
+  float *b;
+  float *c;
+  gboolean initialize;
+} StreamArrays;
+
+static void
+stream_triad_thread (size_t   index,
+                     size_t   n_threads,
+                     gpointer user_data)
+{
+  StreamArrays *arrays = user_data;
+  size_t begin = STREAM_ELEMENTS * index / n_threads;
+  size_t end = STREAM_ELEMENTS * (index + 1) / n_threads;
+
+  /* Touching the pages first from the thread that uses them places
+   * them on its NUMA node */
+  if (arrays->initialize)
+    {
+      for (size_t i = begin; i < end; ++i)
+        {
+          arrays->a[i] = 0.0f;
+          arrays->b[i] = 1.0f;
+          arrays->c[i] = 2.0f;
+        }
+
+      return;
+    }
+
+  for (size_t i = begin; i < end; ++i)
+    arrays->a[i] = arrays->b[i] + 3.0f * arrays->c[i];
+}
+
+static double
+measure_peak_bandwidth (size_t n_threads)
+{
+  StreamArrays arrays = {
+    .a = g_new (float, STREAM_ELEMENTS),
+    .b = g_new (float, STREAM_ELEMENTS),
+    .c = g_new (float, STREAM_ELEMENTS),
+    .initialize = TRUE
+  };
+  double best = 0.0;
+
+  run_on_threads (n_threads, stream_triad_thread, &arrays);
+  arrays.initialize = FALSE;
+
+  for (size_t repeat = 0; repeat < N_REPEATS; ++repeat)
+    {
+      gint64 start_us = g_get_monotonic_time ();
+
+      run_on_threads (n_threads, stream_triad_thread, &arrays);
+
+      double seconds = (g_get_monotonic_time () - start_us) / 1e6;
+
+      /* Two arrays read and one written, as STREAM counts it */
+      best = MAX (best, 3.0 * sizeof (float) * STREAM_ELEMENTS / seconds);
+    }
+
+  g_free (arrays.a);
+  g_free (arrays.b);
+  g_free (arrays.c);
+
+  return best;
+}
+
+typedef PipevecTensor * (*RooflineOperation) (PipevecTensor  *lhs,
+                                               PipevecTensor  *rhs,
+                                               GError        **error);
+
+typedef struct {
+  const char        *name;
+  PipevecProfileOp   op;
+  RooflineOperation  operation;
+  size_t             lhs_rows;
+  size_t             lhs_columns;
+  size_t             rhs_rows;
+  size_t             rhs_columns;
+  gboolean           positive_definite;
+} RooflineCase;
+
+static PipevecTensor *
+copy_operation (PipevecTensor  *lhs,
+                PipevecTensor  *rhs G_GNUC_UNUSED,
+                GError        **error)
+{
+  return pipevec_tensor_copy (lhs, error);
+}
+
+static PipevecTensor *
+multiply_scalar_operation (PipevecTensor  *lhs,
+                           PipevecTensor  *rhs G_GNUC_UNUSED,
+                           GError        **error)
+{
+  return pipevec_tensor_multiply_scalar (lhs, 1.5f, error);
+}
+
+static float
+double_element (float   element,
+                GArray *indices G_GNUC_UNUSED,
+                gpointer user_data G_GNUC_UNUSED)
+{
+  return element * 2.0f;
+}
+
+static PipevecTensor *
+map_operation (PipevecTensor  *lhs,
+               PipevecTensor  *rhs G_GNUC_UNUSED,
+               GError        **error)
+{
+  return pipevec_tensor_map (lhs, double_element, NULL, error);
+}
+
+static PipevecTensor *
+cholesky_operation (PipevecTensor  *lhs,
+                    PipevecTensor  *rhs G_GNUC_UNUSED,
+                    GError        **error)
+{
+  return pipevec_tensor_cholesky (lhs, error);
+}
+
+static PipevecTensor *
+qr_operation (PipevecTensor  *lhs,
+              PipevecTensor  *rhs G_GNUC_UNUSED,
+              GError        **error)
+{
+  g_autoptr(PipevecTensor) q = NULL;
+  g_autoptr(PipevecTensor) r = NULL;
+
+  if (!pipevec_tensor_qr (lhs, &q, &r, error))
+    return NULL;
+
+  return g_steal_pointer (&r);
+}
+
+/* One case that fits in cache and one that does not for the
+ * elementwise operations, and products from small to large */
+static const RooflineCase cases[] = {
+  { "copy", PIPEVEC_PROFILE_OP_COPY, copy_operation, 256, 1024, 0, 0, FALSE },
+  { "copy", PIPEVEC_PROFILE_OP_COPY, copy_operation, 4096, 4096, 0, 0, FALSE },
+  { "map", PIPEVEC_PROFILE_OP_MAP, map_operation, 256, 1024, 0, 0, FALSE },
+  { "add_tensor", PIPEVEC_PROFILE_OP_ADD_TENSOR, pipevec_tensor_add_tensor, 256, 1024, 256, 1024, FALSE },
+  { "add_tensor", PIPEVEC_PROFILE_OP_ADD_TENSOR, pipevec_tensor_add_tensor, 4096, 4096, 4096, 4096, FALSE },
+  { "multiply_tensor", PIPEVEC_PROFILE_OP_MULTIPLY_TENSOR, pipevec_tensor_multiply_tensor, 4096, 4096, 4096, 4096, FALSE },
+  { "divide_tensor", PIPEVEC_PROFILE_OP_DIVIDE_TENSOR, pipevec_tensor_divide_tensor, 4096, 4096, 4096, 4096, FALSE },
+  { "multiply_scalar", PIPEVEC_PROFILE_OP_MULTIPLY_SCALAR, multiply_scalar_operation, 4096, 4096, 0, 0, FALSE },
+  { "inner_product", PIPEVEC_PROFILE_OP_INNER_PRODUCT, pipevec_tensor_inner_product_tensor, 64, 64, 64, 64, FALSE },
+  { "inner_product", PIPEVEC_PROFILE_OP_INNER_PRODUCT, pipevec_tensor_inner_product_tensor, 512, 512, 512, 512, FALSE },
+  { "inner_product", PIPEVEC_PROFILE_OP_INNER_PRODUCT, pipevec_tensor_inner_product_tensor, 2048, 2048, 2048, 2048, FALSE },
+  { "inner_product", PIPEVEC_PROFILE_OP_INNER_PRODUCT, pipevec_tensor_inner_product_tensor, 4096, 256, 256, 16, FALSE },
+  { "cholesky", PIPEVEC_PROFILE_OP_CHOLESKY, cholesky_operation, 1024, 1024, 0, 0, TRUE },
+  { "solve", PIPEVEC_PROFILE_OP_SOLVE, pipevec_tensor_solve, 1024, 1024, 1024, 64, TRUE },
+  { "qr", PIPEVEC_PROFILE_OP_QR, qr_operation, 1024, 1024, 0, 0, FALSE }
+};
+
+/* Values in [0.5, 1.5), made symmetric and diagonally dominant if
+ * @positive_definite is set so that factorizations succeed */
+static PipevecTensor *
+make_matrix (size_t    rows,
+             size_t    columns,
+             gboolean  positive_definite,
+             GError  **error)
+{
+  g_autoptr(GArray) shape = g_array_sized_new (FALSE, FALSE, sizeof (size_t), 2);
+  g_autoptr(GArray) contents = g_array_sized_new (FALSE, FALSE, sizeof (float), rows * columns);
+
+  g_array_append_val (shape, rows);
+  g_array_append_val (shape, columns);
+  g_array_set_size (contents, rows * columns);
+
+  for (size_t i = 0; i < rows; ++i)
+    for (size_t j = 0; j < columns; ++j)
+      {
+        size_t seed = positive_definite ? MIN (i, j) * 31 + MAX (i, j) : i * columns + j;
+        float value = (float) ((seed * 7) % 11) / 11.0f + 0.5f;
+
+        if (positive_definite && i == j)
+          value += (float) columns;
+
+        g_array_index (contents, float, i * columns + j) = value;
+      }
+
+  return pipevec_tensor_new (shape, contents, error);
+}
+
+static gboolean
+run_case (const RooflineCase      *roofline_case,
+          double                   min_seconds,
+          PipevecProfileCounters  *counters,
+          GError                 **error)
+{
+  g_autoptr(PipevecTensor) lhs = make_matrix (roofline_case->lhs_rows,
+                                              roofline_case->lhs_columns,
+                                              roofline_case->positive_definite,
+                                              error);
+  g_autoptr(PipevecTensor) rhs = NULL;
+
+  if (lhs == NULL)
+    return FALSE;
+
+  if (roofline_case->rhs_rows > 0)
+    {
+      rhs = make_matrix (roofline_case->rhs_rows, roofline_case->rhs_columns, FALSE, error);
+
+      if (rhs == NULL)
+        return FALSE;
+    }
+
+  /* The first call warms up the caches and the thread pool */
+  g_autoptr(PipevecTensor) warm_up = roofline_case->operation (lhs, rhs, error);
+
+  if (warm_up == NULL)
+    return FALSE;
+
+  pipevec_profile_set_enabled (TRUE);
+  pipevec_profile_reset ();
+
+  gint64 start_us = g_get_monotonic_time ();
+
+  do
+    {
+      g_autoptr(PipevecTensor) result = roofline_case->operation (lhs, rhs, error);
+
+      if (result == NULL)
+        {
+          pipevec_profile_set_enabled (FALSE);
+          return FALSE;
+        }
+    }
+  while ((g_get_monotonic_time () - start_us) / 1e6 < min_seconds);
+
+  pipevec_profile_set_enabled (FALSE);
+
+  g_autoptr(PipevecProfileSnapshot) snapshot = pipevec_profile_get_snapshot ();
+
+  *counters = *pipevec_profile_snapshot_get_counters (snapshot, roofline_case->op);
+
+  return TRUE;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GOptionContext) context = g_option_context_new ("- measure how close operations get to the roofline");
+  double min_seconds = 0.5;
+  GOptionEntry entries[] = {
+    { "min-time", 't', 0, G_OPTION_ARG_DOUBLE, &min_seconds, "Seconds to run each operation for", "SECONDS" },
+    { NULL }
+  };
+
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  size_t n_threads = get_n_threads ();
+  double peak_flops = measure_peak_flops (n_threads);
+  double peak_bandwidth = measure_peak_bandwidth (n_threads);
+
+  g_print ("Threads: %zu\n", n_threads);
+  g_print ("Peak: %.1f GFLOP/s, %.1f GB/s, ridge point %.2f FLOP/byte\n\n",
+           peak_flops / 1e9,
+           peak_bandwidth / 1e9,
+           peak_flops / peak_bandwidth);
+  g_print ("%-16s %-22s %10s %10s %10s %8s %10s\n",
+           "op",
+           "shape",
+           "GFLOP/s",
+           "GB/s",
+           "FLOP/byte",
+           "bound",
+           "% roofline");
+
+  for (size_t i = 0; i < G_N_ELEMENTS (cases); ++i)
+    {
+      const RooflineCase *roofline_case = &cases[i];
+      PipevecProfileCounters counters;
+      g_autofree char *shape = NULL;
+
+      if (roofline_case->rhs_rows > 0)
+        shape = g_strdup_printf ("%zux%zu, %zux%zu",
+                                 roofline_case->lhs_rows,
+                                 roofline_case->lhs_columns,
+                                 roofline_case->rhs_rows,
+                                 roofline_case->rhs_columns);
+      else
+        shape = g_strdup_printf ("%zux%zu", roofline_case->lhs_rows, roofline_case->lhs_columns);
+
+      if (!run_case (roofline_case, min_seconds, &counters, &error))
+        {
+          g_printerr ("%s %s failed: %s\n", roofline_case->name, shape, error->message);
+          return EXIT_FAILURE;
+        }
+
+      double seconds = counters.wall_time_ns / 1e9;
+      double bytes = (double) (counters.bytes_read + counters.bytes_written);
+      double flop_rate = counters.flops / seconds;
+      double byte_rate = bytes / seconds;
+      double intensity = bytes > 0.0 ? counters.flops / bytes : 0.0;
+
+      /* Below the ridge point the memory roof is the lower one */
+      gboolean memory_bound = intensity * peak_bandwidth < peak_flops;
+      double fraction = memory_bound ? byte_rate / peak_bandwidth : flop_rate / peak_flops;
+
+      g_print ("%-16s %-22s %10.2f %10.2f %10.3f %8s %10.1f\n",
+               roofline_case->name,
+               shape,
+               flop_rate / 1e9,
+               byte_rate / 1e9,
+               intensity,
+               memory_bound ? "memory" : "compute",
+               100.0 * fraction);
+    }
+
+  return EXIT_SUCCESS;
+}